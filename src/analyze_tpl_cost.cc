@@ -0,0 +1,352 @@
+// Copyright (c) 2026, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+//
+// A utility for finding the templates that are likely to be expensive
+// to expand, by looking at their parse trees (see
+// Template::AnalyzeCost()) rather than waiting for them to show up in
+// a CPU profile.
+//
+// For example:
+//
+// > <path_to>/analyze_tpl_cost -t /srv/templates -c capture.tplcap .
+//
+// loads every template under /srv/templates and prints a table, most
+// expensive first, with one tab-separated line per template:
+//    rank            1 for the most expensive
+//    est_work        the work of one expansion (see below)
+//    pass_work       the work of expanding every section once
+//    iter_work       the work of one pass through its costliest section
+//    depth           how deeply its sections nest
+//    nodes           in the parse tree, and of those:
+//    vars            variables,
+//    sections        sections,
+//    includes        includes,
+//    iter_includes   and includes inside sections
+//    max_mods        the longest chain of modifiers on one variable
+//    dynamic_pct     the percentage of nodes that aren't static text
+//    text_bytes      how much static text it has
+//    unset           how many variables the sample dictionary leaves empty
+//    template        its name
+//    costliest_section
+// Work is counted in rough units, about what it takes to emit a short
+// run of text.  For est_work, each section is repeated as many times
+// as the sample dictionary repeats it, if there is one, or else -i
+// times, so nested sections multiply.  The sample dictionary for a
+// template is the first expansion of it in the capture file given with
+// -c (see template_capture.h).  With -v, the unset variables are
+// listed too.
+//
+// Arguments that are directories are analyzed recursively.
+//
+// Exit code is the number of templates we were unable to load.
+
+// This is for windows.  Even though we #include config.h, just like
+// the files used to compile the dll, we are actually a *client* of
+// the dll, so we don't get to decl anything.
+#include <config.h>
+#undef CTEMPLATE_DLL_DECL
+#include <errno.h>
+#ifdef HAVE_GETOPT_H
+# include <getopt.h>
+#endif
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#include <algorithm>       // for sort()
+#include <map>
+#include <string>
+#include <vector>
+
+#include <ctemplate/template.h>
+#include <ctemplate/template_cache.h>
+#include <ctemplate/template_capture.h>
+#include <ctemplate/template_pathops.h>
+#include "base/fileutil.h"
+using std::map;
+using std::string;
+using std::vector;
+using ctemplate::CapturedExpand;
+using ctemplate::File;
+using ctemplate::Strip;
+using ctemplate::TemplateCache;
+using ctemplate::TemplateCaptureReader;
+using ctemplate::TemplateCost;
+using ctemplate::TemplateDictionaryInterface;
+using ctemplate::TemplateHandle;
+
+enum {LOG_INFO, LOG_WARNING, LOG_ERROR, LOG_FATAL};
+
+static void LogPrintf(int severity, int should_log_info, const char* pat, ...) {
+  if (severity == LOG_INFO && !should_log_info)
+    return;
+  if (severity == LOG_FATAL)
+    fprintf(stderr, "FATAL ERROR: ");
+  va_list ap;
+  va_start(ap, pat);
+  vfprintf(stderr, pat, ap);
+  va_end(ap);
+  fprintf(stderr, "\n");
+  if (severity == LOG_FATAL)
+    exit(1);
+}
+
+// prints to outfile -- usually stdout or stderr
+static void Usage(const char* argv0, FILE* outfile) {
+  fprintf(outfile, "USAGE: %s [-t<dir>] [-s<strip>] [-c<capture>] [-i<n>]"
+          " [-n<n>] [-v] [-q] <template_filename_or_dir> ...\n", argv0);
+  fprintf(outfile,
+          "       -t<dir> --template_dir=<dir>  Root directory of templates\n"
+          "       -s<strip> --strip=<strip>     STRIP_WHITESPACE [default],\n"
+          "                                     STRIP_BLANK_LINES, DO_NOT_STRIP\n"
+          "       -c<file> --capture=<file>     Capture file to take sample\n"
+          "                                     dictionaries from\n"
+          "       -i<n> --iterations=<n>        Times to assume a section\n"
+          "                                     repeats, without a sample\n"
+          "                                     [default: 3]\n"
+          "       -n<n> --top=<n>               Only show the n most\n"
+          "                                     expensive templates\n"
+          "       -v --verbose                  List the unset variables\n"
+          "       -q --nolog_info               Only log on error\n"
+          "       -h --help                     This help\n"
+          "       -V --version                  Version information\n");
+  fprintf(outfile, "\n"
+          "This program ranks templates by how expensive they are likely\n"
+          "to be to expand, judging from their parse trees.  Directories\n"
+          "are analyzed recursively.\n");
+}
+
+static void Version(FILE* outfile) {
+  fprintf(outfile,
+          "analyze_tpl_cost "
+          " (part of " PACKAGE_STRING ")"
+          "\n\n"
+          "Copyright 2026 Google Inc.\n"
+          "\n"
+          "This is BSD licensed software; see the source for copying conditions\n"
+          "and license information.\n"
+          "There is NO warranty; not even for MERCHANTABILITY or FITNESS FOR A\n"
+          "PARTICULAR PURPOSE.\n"
+          );
+}
+
+// Adds the file named name (relative to template_dir, unless it's
+// absolute) to names -- or, if it's a directory, everything under it.
+// Returns the number of files we couldn't add.
+static int AddTemplates(const string& template_dir, const string& name,
+                        bool log_info, vector<string>* names) {
+  vector<string> errors;
+  File::FindFiles(template_dir, name, names, &errors);
+  for (vector<string>::const_iterator it = errors.begin();
+       it != errors.end(); ++it)
+    LogPrintf(LOG_ERROR, log_info, "%s", it->c_str());
+  return static_cast<int>(errors.size());
+}
+
+// One template we analyzed.
+struct TemplateReport {
+  string name;
+  TemplateCost cost;
+  bool has_sample;
+};
+
+// Most expensive first; ties go by name, so the order is stable.
+static bool MoreExpensive(const TemplateReport& a, const TemplateReport& b) {
+  if (a.cost.estimated_work != b.cost.estimated_work)
+    return a.cost.estimated_work > b.cost.estimated_work;
+  return a.name < b.name;
+}
+
+int main(int argc, char **argv) {
+  string FLAG_template_dir(ctemplate::kCWD);   // "./"
+  string FLAG_strip("");
+  string FLAG_capture("");
+  int FLAG_iterations = 3;
+  int FLAG_top = 0;          // 0 means all of them
+  bool FLAG_verbose = false;
+  bool FLAG_log_info = true;
+
+#if defined(HAVE_GETOPT_LONG)
+  static struct option longopts[] = {
+    {"help", 0, NULL, 'h'},
+    {"version", 0, NULL, 'V'},
+    {"template_dir", 1, NULL, 't'},
+    {"strip", 1, NULL, 's'},
+    {"capture", 1, NULL, 'c'},
+    {"iterations", 1, NULL, 'i'},
+    {"top", 1, NULL, 'n'},
+    {"verbose", 0, NULL, 'v'},
+    {"nolog_info", 0, NULL, 'q'},
+    {0, 0, 0, 0}
+  };
+  int option_index;
+# define GETOPT(argc, argv)  getopt_long(argc, argv, "t:s:c:i:n:vqhV", \
+                                         longopts, &option_index)
+#elif defined(HAVE_GETOPT_H)
+# define GETOPT(argc, argv)  getopt(argc, argv, "t:s:c:i:n:vqhV")
+#else    // TODO(csilvers): implement something reasonable for windows
+# define GETOPT(argc, argv)  -1
+  int optind = 1;    // first non-opt argument
+  const char* optarg = "";   // not used
+#endif
+
+  int r = 0;
+  while (r != -1) {   // getopt()/getopt_long() return -1 upon no-more-input
+    r = GETOPT(argc, argv);
+    switch (r) {
+      case 't': FLAG_template_dir.assign(optarg); break;
+      case 's': FLAG_strip.assign(optarg); break;
+      case 'c': FLAG_capture.assign(optarg); break;
+      case 'i': FLAG_iterations = atoi(optarg); break;
+      case 'n': FLAG_top = atoi(optarg); break;
+      case 'v': FLAG_verbose = true; break;
+      case 'q': FLAG_log_info = false; break;
+      case 'V': Version(stdout); return 0; break;
+      case 'h': Usage(argv[0], stderr); return 0; break;
+      case -1: break;   // means 'no more input'
+      default: Usage(argv[0], stderr); return 1; break;
+    }
+  }
+
+  if (optind >= argc) {
+    LogPrintf(LOG_FATAL, FLAG_log_info,
+              "Must specify at least one template file on the command line.");
+  }
+  if (FLAG_iterations < 0 || FLAG_top < 0) {
+    LogPrintf(LOG_FATAL, FLAG_log_info, "Bad value for -i or -n.");
+  }
+  Strip strip = ctemplate::STRIP_WHITESPACE;
+  if (FLAG_strip == "STRIP_WHITESPACE" || FLAG_strip == "")
+    strip = ctemplate::STRIP_WHITESPACE;
+  else if (FLAG_strip == "STRIP_BLANK_LINES")
+    strip = ctemplate::STRIP_BLANK_LINES;
+  else if (FLAG_strip == "DO_NOT_STRIP")
+    strip = ctemplate::DO_NOT_STRIP;
+  else
+    LogPrintf(LOG_FATAL, FLAG_log_info, "Unrecognized Strip: %s. Must be one "
+              "of: STRIP_WHITESPACE, STRIP_BLANK_LINES or DO_NOT_STRIP",
+              FLAG_strip.c_str());
+
+  // The first captured expansion of each template is its sample.
+  map<string, CapturedExpand*> samples;
+  vector<CapturedExpand*> expands;
+  if (!FLAG_capture.empty()) {
+    TemplateCaptureReader* reader = TemplateCaptureReader::Open(FLAG_capture);
+    if (reader == NULL)
+      return 1;
+    while (true) {
+      expands.push_back(new CapturedExpand);
+      if (!reader->Next(expands.back())) {
+        delete expands.back();
+        expands.pop_back();
+        break;
+      }
+      if (!samples.count(expands.back()->template_name))
+        samples[expands.back()->template_name] = expands.back();
+    }
+    if (!reader->error().empty()) {
+      LogPrintf(LOG_FATAL, FLAG_log_info, "%s", reader->error().c_str());
+    }
+    delete reader;
+    LogPrintf(LOG_INFO, FLAG_log_info,
+              "Read %d expansions, of %d templates, from %s",
+              static_cast<int>(expands.size()),
+              static_cast<int>(samples.size()), FLAG_capture.c_str());
+  }
+
+  vector<string> names;
+  int num_errors = 0;
+  for (int i = optind; i < argc; ++i)
+    num_errors += AddTemplates(FLAG_template_dir, argv[i], FLAG_log_info,
+                               &names);
+
+  TemplateCache cache;
+  cache.SetTemplateRootDirectory(FLAG_template_dir);
+  vector<TemplateReport> reports;
+  for (vector<string>::const_iterator it = names.begin();
+       it != names.end(); ++it) {
+    TemplateHandle tpl = cache.GetTemplateHandle(*it, strip);
+    if (!tpl.valid()) {
+      LogPrintf(LOG_ERROR, FLAG_log_info, "Could not load file: %s",
+                it->c_str());
+      num_errors++;
+      continue;
+    }
+    map<string, CapturedExpand*>::const_iterator sample = samples.find(*it);
+    TemplateReport report;
+    report.name = *it;
+    report.has_sample = (sample != samples.end());
+    tpl.get()->AnalyzeCost(report.has_sample ?
+                           sample->second->dictionary() : NULL,
+                           FLAG_iterations, &report.cost);
+    reports.push_back(report);
+  }
+  std::sort(reports.begin(), reports.end(), MoreExpensive);
+
+  printf("rank\test_work\tpass_work\titer_work\tdepth\tnodes\tvars\t"
+         "sections\tincludes\titer_includes\tmax_mods\tdynamic_pct\t"
+         "text_bytes\tunset\ttemplate\tcostliest_section\n");
+  for (size_t i = 0; i < reports.size(); ++i) {
+    if (FLAG_top > 0 && i >= static_cast<size_t>(FLAG_top))
+      break;
+    const TemplateCost& cost = reports[i].cost;
+    const int num_dynamic = cost.num_nodes - cost.num_text_nodes;
+    printf("%d\t%.0f\t%.0f\t%.0f\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t",
+           static_cast<int>(i + 1), cost.estimated_work, cost.work_per_pass,
+           cost.max_iteration_work, cost.max_section_depth, cost.num_nodes,
+           cost.num_variable_nodes, cost.num_section_nodes,
+           cost.num_include_nodes, cost.num_includes_in_sections,
+           cost.max_modifiers,
+           cost.num_nodes > 0 ? 100 * num_dynamic / cost.num_nodes : 0,
+           static_cast<int>(cost.text_bytes));
+    if (reports[i].has_sample)
+      printf("%d", static_cast<int>(cost.unset_variables.size()));
+    else
+      printf("-");     // we can't tell without a sample
+    printf("\t%s\t%s\n", reports[i].name.c_str(),
+           cost.costliest_section.c_str());
+    if (FLAG_verbose && !cost.unset_variables.empty()) {
+      printf("# %s: unset:", reports[i].name.c_str());
+      for (size_t v = 0; v < cost.unset_variables.size(); ++v)
+        printf(" %s", cost.unset_variables[v].c_str());
+      printf("\n");
+    }
+  }
+
+  for (size_t i = 0; i < expands.size(); ++i)
+    delete expands[i];
+  // Cap at 127 to avoid causing problems with return code
+  return num_errors > 127 ? 127 : num_errors;
+}
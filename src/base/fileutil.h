@@ -30,19 +30,28 @@
 // ---
 // Author: csilvers@google.com (Craig Silverstein)
 //
-// A tiny wrapper around struct stat and FILE*.
+// A tiny wrapper around struct stat and FILE*, plus the few file
+// helpers the command-line tools share.
 
 #ifndef TEMPLATE_OPENSOURCE_FILEUTIL_H_
 #define TEMPLATE_OPENSOURCE_FILEUTIL_H_
 
 #include <config.h>
+#include <errno.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <time.h>
 #ifdef HAVE_UNISTD_H
 # include <unistd.h>
 #endif
+#ifdef HAVE_DIRENT_H
+# include <dirent.h>       // for opendir() etc
+#endif
+#include <algorithm>       // for sort()
 #include <string>
+#include <vector>
+#include <ctemplate/template_pathops.h>
 
 namespace ctemplate {
 
@@ -50,6 +59,9 @@ class FileStat {
  public:
   time_t mtime;
   off_t length;
+  // Together, these tell a file apart from one that replaced it.
+  dev_t device;
+  ino_t inode;
   bool IsDirectory() { return S_ISDIR(internal_statbuf.st_mode); }
 
  private:
@@ -64,6 +76,8 @@ class File {
       return false;
     statbuf->mtime = statbuf->internal_statbuf.st_mtime;
     statbuf->length = statbuf->internal_statbuf.st_size;
+    statbuf->device = statbuf->internal_statbuf.st_dev;
+    statbuf->inode = statbuf->internal_statbuf.st_ino;
     return true;
   }
 
@@ -71,6 +85,69 @@ class File {
     return access(filename, R_OK) == 0;
   }
 
+  // Reads the whole of filename into *contents.  Returns false if it
+  // can't be read.
+  static bool ReadFileToString(const std::string& filename,
+                               std::string* contents) {
+    FILE* fp = fopen(filename.c_str(), "rb");
+    if (!fp)
+      return false;
+    char buf[8192];
+    size_t len;
+    contents->clear();
+    while ((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+      contents->append(buf, len);
+    const bool ok = !ferror(fp);
+    fclose(fp);
+    return ok;
+  }
+
+  // Appends to *names the file named name (relative to dir, unless
+  // it's absolute) or, if it's a directory, every file under it, in
+  // sorted order.  Files under "." are named "a.tpl", not "./a.tpl".
+  // For each file or directory that can't be read, appends the reason
+  // to *errors.
+  static void FindFiles(const std::string& dir, const std::string& name,
+                        std::vector<std::string>* names,
+                        std::vector<std::string>* errors) {
+    const std::string filename = PathJoin(dir, name);
+    struct stat statbuf;
+    if (stat(filename.c_str(), &statbuf) != 0) {
+      errors->push_back("Can't stat " + filename + ": " + strerror(errno));
+      return;
+    }
+    if (!S_ISDIR(statbuf.st_mode)) {
+      names->push_back(name);
+      return;
+    }
+#ifdef HAVE_DIRENT_H
+    DIR* dirp = opendir(filename.c_str());
+    if (dirp == NULL) {
+      errors->push_back("Can't read directory " + filename + ": " +
+                        strerror(errno));
+      return;
+    }
+    std::vector<std::string> children;
+    struct dirent* dir_entry;
+    while ((dir_entry = readdir(dirp)) != NULL) {
+      if (strcmp(dir_entry->d_name, ".") != 0 &&
+          strcmp(dir_entry->d_name, "..") != 0)
+        children.push_back(dir_entry->d_name);
+    }
+    closedir(dirp);
+    std::sort(children.begin(), children.end());
+    for (std::vector<std::string>::const_iterator it = children.begin();
+         it != children.end(); ++it) {
+      FindFiles(dir, (name.empty() || name == "." || name == kCWD
+                      ? *it : PathJoin(name, *it)),
+                names, errors);
+    }
+#else
+    errors->push_back("Can't read directory " + filename +
+                      " on this system");
+#endif
+  }
+
   static File* Open(const char* filename, const char* mode) {
     char binary_mode[3];
     const char* mode_to_use = mode;
@@ -91,9 +168,15 @@ class File {
     return fread(buf, 1, size, fp_);
   }
 
-  void Close() {
-    fclose(fp_);
+  size_t Write(const char* buf, size_t size) {
+    return fwrite(buf, 1, size, fp_);
+  }
+
+  // Returns false if the final flush failed.
+  bool Close() {
+    const bool ok = fclose(fp_) == 0;
     delete this;   // naughty naughty!
+    return ok;
   }
 
  private:
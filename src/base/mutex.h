@@ -55,6 +55,13 @@
 // feel free to #define GMUTEX_TRYLOCK, or to remove the #ifdefs
 // in the code below.
 //
+// If MUTEX_WAIT_STATS is defined, a Mutex can be given a
+// base::MutexWaitStats, which counts how often it was acquired and how
+// long threads waited for it.  That costs a trylock and, when the
+// trylock fails, two clock reads per acquisition, so it's only for
+// contention benchmarks (see template_contention_benchmark.cc).  It
+// needs pthreads.
+//
 // CYGWIN NOTE: Cygwin support for rwlock seems to be buggy:
 //    http://www.cygwin.com/ml/cygwin/2008-12/msg00017.html
 // Because of that, we might as well use windows locks for
@@ -157,10 +164,21 @@
 
 #include <assert.h>
 #include <stdlib.h>      // for abort()
+#ifdef MUTEX_WAIT_STATS
+# if defined(NO_THREADS) || !defined(HAVE_PTHREAD)
+#   error MUTEX_WAIT_STATS needs pthreads
+# endif
+# include <stdint.h>     // for uint64_t
+# include <atomic>
+# include <chrono>
+#endif
 
 namespace ctemplate {
 
 namespace base {
+#ifdef MUTEX_WAIT_STATS
+struct MutexWaitStats;
+#endif
 // This is used for the single-arg constructor
 enum LinkerInitialized { LINKER_INITIALIZED };
 }
@@ -193,6 +211,11 @@ class Mutex {
   inline void WriterLock() { Lock(); }     // Acquire an exclusive lock
   inline void WriterUnlock() { Unlock(); } // Release a lock from WriterLock()
 
+#ifdef MUTEX_WAIT_STATS
+  // From now on, count our acquisitions and waits in stats.
+  void set_wait_stats(base::MutexWaitStats* stats) { wait_stats_ = stats; }
+#endif
+
  private:
   MutexType mutex_;
   // We want to make sure that the compiler sets is_safe_ to true only
@@ -202,7 +225,12 @@ class Mutex {
   // This indicates which constructor was called.
   bool destroy_;
 
+#ifdef MUTEX_WAIT_STATS
+  base::MutexWaitStats* wait_stats_;
+  inline void SetIsSafe() { is_safe_ = true; wait_stats_ = NULL; }
+#else
   inline void SetIsSafe() { is_safe_ = true; }
+#endif
 
   // Catch the error of writing Mutex when intending MutexLock.
   Mutex(Mutex* /*ignored*/) {}
@@ -211,6 +239,67 @@ class Mutex {
   void operator=(const Mutex&);
 };
 
+#ifdef MUTEX_WAIT_STATS
+namespace base {
+
+// Counts for one Mutex, or for a family of them (all TemplateCaches'
+// mutex_es, say).  Every MutexWaitStats ever constructed is on a list,
+// for the benchmark to print; construct them only as globals, since
+// adding to the list isn't thread-safe.
+struct MutexWaitStats {
+  MutexWaitStats(const char* a_name, Mutex* mu) : name(a_name) {
+    Reset();
+    next = *list();
+    *list() = this;
+    if (mu)
+      mu->set_wait_stats(this);
+  }
+
+  void Reset() {
+    acquisitions = 0;
+    contended = 0;
+    wait_ns = 0;
+  }
+
+  static MutexWaitStats** list() {
+    static MutexWaitStats* head = NULL;
+    return &head;
+  }
+
+  // Acquires mu with lock, counting how long that takes if trylock
+  // says we'd block.
+  template <typename MutexType>
+  void Lock(MutexType* mu, int (*trylock)(MutexType*),
+            int (*lock)(MutexType*)) {
+    ++acquisitions;
+    if (trylock(mu) == 0)
+      return;
+    const std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    if (lock(mu) != 0) abort();
+    ++contended;
+    wait_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+  }
+
+  const char* const name;
+  std::atomic<uint64_t> acquisitions;
+  std::atomic<uint64_t> contended;    // acquisitions that had to wait
+  std::atomic<uint64_t> wait_ns;      // total time spent waiting
+  MutexWaitStats* next;
+};
+
+}
+
+// Like SAFE_PTHREAD(lock), but counting waits if we've been asked to.
+#define SAFE_PTHREAD_LOCK(trylock, lock)  do {                             \
+  if (wait_stats_ == NULL) SAFE_PTHREAD(lock);                             \
+  else if (is_safe_) wait_stats_->Lock(&mutex_, trylock, lock);            \
+} while (0)
+#else
+#define SAFE_PTHREAD_LOCK(trylock, lock)  SAFE_PTHREAD(lock)
+#endif
+
 // We will also define GoogleOnceType, GOOGLE_ONCE_INIT, and
 // GoogleOnceInit, which are portable versions of pthread_once_t,
 // PTHREAD_ONCE_INIT, and pthread_once.
@@ -309,13 +398,17 @@ Mutex::Mutex(base::LinkerInitialized) : destroy_(false) {
   if (is_safe_ && pthread_rwlock_init(&mutex_, NULL) != 0) abort();
 }
 Mutex::~Mutex()       { if (destroy_) SAFE_PTHREAD(pthread_rwlock_destroy); }
-void Mutex::Lock()    { SAFE_PTHREAD(pthread_rwlock_wrlock); }
+void Mutex::Lock()    {
+  SAFE_PTHREAD_LOCK(pthread_rwlock_trywrlock, pthread_rwlock_wrlock);
+}
 void Mutex::Unlock()  { SAFE_PTHREAD(pthread_rwlock_unlock); }
 #ifdef GMUTEX_TRYLOCK
 bool Mutex::TryLock()      { return is_safe_ ?
                                pthread_rwlock_trywrlock(&mutex_) == 0 : true; }
 #endif
-void Mutex::ReaderLock()   { SAFE_PTHREAD(pthread_rwlock_rdlock); }
+void Mutex::ReaderLock()   {
+  SAFE_PTHREAD_LOCK(pthread_rwlock_tryrdlock, pthread_rwlock_rdlock);
+}
 void Mutex::ReaderUnlock() { SAFE_PTHREAD(pthread_rwlock_unlock); }
 #undef SAFE_PTHREAD
 
@@ -341,7 +434,9 @@ Mutex::Mutex(base::LinkerInitialized) : destroy_(false) {
   if (is_safe_ && pthread_mutex_init(&mutex_, NULL) != 0) abort();
 }
 Mutex::~Mutex()       { if (destroy_) SAFE_PTHREAD(pthread_mutex_destroy); }
-void Mutex::Lock()    { SAFE_PTHREAD(pthread_mutex_lock); }
+void Mutex::Lock()    {
+  SAFE_PTHREAD_LOCK(pthread_mutex_trylock, pthread_mutex_lock);
+}
 void Mutex::Unlock()  { SAFE_PTHREAD(pthread_mutex_unlock); }
 #ifdef GMUTEX_TRYLOCK
 bool Mutex::TryLock() { return is_safe_ ?
@@ -359,6 +454,7 @@ inline int GoogleOnceInit(GoogleOnceType* once_control,
 }
 
 #endif
+#undef SAFE_PTHREAD_LOCK
 
 // --------------------------------------------------------------------------
 // Some helper classes
@@ -0,0 +1,343 @@
+// Copyright (c) 2026, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// PersistentMap is a hash map whose copies share their structure.
+// Copying one takes constant time however big it is; after that,
+// changing either copy copies only the nodes on the path to the
+// entry that changed, and the two maps go on sharing everything else.
+//
+// It's a hash-array-mapped trie.  Each level of the trie looks at
+// the next kBitsPerLevel bits of the key's hash, and each node keeps
+// the entries and the subtries for its 32 slots in two arrays,
+// indexed by bitmaps (so an empty slot takes no space).  Once all the
+// hash bits are used up, a node just keeps its entries in a list.
+// Nodes are refcounted, and we change a node in place only when no
+// other map can see it.
+//
+// Like small_map, this only implements the parts of the STL
+// associative container interface that we need.  Differences:
+//    * find() returns a pointer to the value, or NULL.  find() never
+//      copies anything; find_mutable() and operator[] copy the path
+//      to the entry if another map shares it.
+//    * Iterators are const, and any change to the map invalidates
+//      them, as well as every pointer find() has returned.
+//
+// Two maps that share nodes may be used from different threads.  As
+// with the STL, one map must not be read and changed at the same time.
+
+#ifndef BASE_PERSISTENT_MAP_H_
+#define BASE_PERSISTENT_MAP_H_
+
+#include <config.h>
+#include <assert.h>
+#include <stddef.h>     // for size_t
+#include <stdint.h>     // for uint32_t
+#include <atomic>       // for atomic<>
+#include <utility>      // for pair<>
+#include <vector>
+
+namespace ctemplate {
+
+template <typename Key, typename Value, typename Hash>
+class PersistentMap {
+ public:
+  typedef std::pair<Key, Value> value_type;
+
+ private:
+  static const int kBitsPerLevel = 5;
+  static const int kHashBits = sizeof(size_t) * 8;
+
+  struct Node {
+    Node() : entry_bitmap(0), child_bitmap(0), refcount(1) { }
+    // The copy starts out with no other owners; it shares the
+    // children with the original.
+    Node(const Node& other)
+        : entry_bitmap(other.entry_bitmap),
+          child_bitmap(other.child_bitmap),
+          entries(other.entries),
+          children(other.children),
+          refcount(1) {
+      for (size_t i = 0; i < children.size(); ++i)
+        IncRef(children[i]);
+    }
+
+    uint32_t entry_bitmap;    // the slots that hold an entry
+    uint32_t child_bitmap;    // the slots that hold a subtrie
+    std::vector<value_type> entries;   // in slot order
+    std::vector<Node*> children;       // in slot order
+    // Atomic, since maps that share this node may be on other threads.
+    mutable std::atomic<int> refcount;
+
+   private:
+    void operator=(const Node&);
+  };
+
+ public:
+  class const_iterator {
+   public:
+    const_iterator() : current_(NULL) { }
+    const value_type& operator*() const { return *current_; }
+    const value_type* operator->() const { return current_; }
+    const_iterator& operator++() {
+      Advance();
+      return *this;
+    }
+    bool operator==(const const_iterator& x) const {
+      return current_ == x.current_;
+    }
+    bool operator!=(const const_iterator& x) const {
+      return current_ != x.current_;
+    }
+
+   private:
+    friend class PersistentMap;
+    explicit const_iterator(const Node* root) : current_(NULL) {
+      if (root) {
+        stack_.push_back(std::make_pair(root, size_t(0)));
+        Advance();
+      }
+    }
+    // A depth-first walk: each node's entries, then its children.
+    void Advance() {
+      while (!stack_.empty()) {
+        const Node* node = stack_.back().first;
+        const size_t i = stack_.back().second++;
+        if (i < node->entries.size()) {
+          current_ = &node->entries[i];
+          return;
+        }
+        if (i - node->entries.size() < node->children.size()) {
+          stack_.push_back(std::make_pair(
+              node->children[i - node->entries.size()], size_t(0)));
+        } else {
+          stack_.pop_back();
+        }
+      }
+      current_ = NULL;
+    }
+
+    std::vector<std::pair<const Node*, size_t> > stack_;
+    const value_type* current_;
+  };
+
+  PersistentMap() : root_(NULL), size_(0) { }
+  PersistentMap(const PersistentMap& x) : root_(x.root_), size_(x.size_) {
+    if (root_)
+      IncRef(root_);
+  }
+  PersistentMap& operator=(const PersistentMap& x) {
+    PersistentMap tmp(x);
+    swap(tmp);
+    return *this;
+  }
+  ~PersistentMap() {
+    if (root_)
+      DecRef(root_);
+  }
+
+  void swap(PersistentMap& x) {
+    std::swap(root_, x.root_);
+    std::swap(size_, x.size_);
+  }
+  void clear() {
+    PersistentMap().swap(*this);
+  }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  const_iterator begin() const { return const_iterator(root_); }
+  const_iterator end() const { return const_iterator(); }
+
+  const Value* find(const Key& key) const {
+    const size_t hash = Hash()(key);
+    const Node* node = root_;
+    for (int shift = 0; node; shift += kBitsPerLevel) {
+      if (shift >= kHashBits) {
+        for (size_t i = 0; i < node->entries.size(); ++i) {
+          if (node->entries[i].first == key)
+            return &node->entries[i].second;
+        }
+        return NULL;
+      }
+      const uint32_t bit = Bit(hash, shift);
+      if (node->entry_bitmap & bit) {
+        const value_type& entry = node->entries[Index(node->entry_bitmap, bit)];
+        return entry.first == key ? &entry.second : NULL;
+      }
+      if (!(node->child_bitmap & bit))
+        return NULL;
+      node = node->children[Index(node->child_bitmap, bit)];
+    }
+    return NULL;
+  }
+
+  Value* find_mutable(const Key& key) {
+    // Don't copy a path just to find nothing at the end of it.
+    return find(key) ? &(*this)[key] : NULL;
+  }
+
+  Value& operator[](const Key& key) {
+    const size_t hash = Hash()(key);
+    if (!root_)
+      root_ = new Node;
+    Node** slot = &root_;
+    for (int shift = 0; ; shift += kBitsPerLevel) {
+      Node* node = Own(slot);
+      if (shift >= kHashBits) {
+        for (size_t i = 0; i < node->entries.size(); ++i) {
+          if (node->entries[i].first == key)
+            return node->entries[i].second;
+        }
+        ++size_;
+        node->entries.push_back(value_type(key, Value()));
+        return node->entries.back().second;
+      }
+      const uint32_t bit = Bit(hash, shift);
+      if (node->entry_bitmap & bit) {
+        const size_t i = Index(node->entry_bitmap, bit);
+        if (node->entries[i].first == key)
+          return node->entries[i].second;
+        // Another key is using this slot: move it down a level, and
+        // then look for room for ours there.
+        Node* child = new Node;
+        if (shift + kBitsPerLevel < kHashBits)
+          child->entry_bitmap = Bit(Hash()(node->entries[i].first),
+                                    shift + kBitsPerLevel);
+        child->entries.push_back(node->entries[i]);
+        node->entries.erase(node->entries.begin() + i);
+        node->entry_bitmap &= ~bit;
+        node->child_bitmap |= bit;
+        node->children.insert(
+            node->children.begin() + Index(node->child_bitmap, bit), child);
+      }
+      if (node->child_bitmap & bit) {
+        slot = &node->children[Index(node->child_bitmap, bit)];
+        continue;
+      }
+      ++size_;
+      node->entry_bitmap |= bit;
+      return node->entries.insert(
+          node->entries.begin() + Index(node->entry_bitmap, bit),
+          value_type(key, Value()))->second;
+    }
+  }
+
+  // Returns true if key was in the map.
+  bool erase(const Key& key) {
+    if (!find(key))
+      return false;
+    const size_t hash = Hash()(key);
+    std::vector<Node**> path;
+    Node** slot = &root_;
+    for (int shift = 0; ; shift += kBitsPerLevel) {
+      Node* node = Own(slot);
+      path.push_back(slot);
+      if (shift >= kHashBits) {
+        for (size_t i = 0; i < node->entries.size(); ++i) {
+          if (node->entries[i].first == key) {
+            node->entries.erase(node->entries.begin() + i);
+            break;
+          }
+        }
+        break;
+      }
+      const uint32_t bit = Bit(hash, shift);
+      if (node->entry_bitmap & bit) {   // find() says this is our key
+        node->entries.erase(
+            node->entries.begin() + Index(node->entry_bitmap, bit));
+        node->entry_bitmap &= ~bit;
+        break;
+      }
+      slot = &node->children[Index(node->child_bitmap, bit)];
+    }
+    --size_;
+    // Take out the nodes this left empty, from the bottom up.  (We
+    // don't bother pulling a lone entry back up into its parent;
+    // lookups for it will just go a level deeper than they need to.)
+    for (size_t depth = path.size() - 1; depth > 0; --depth) {
+      Node* node = *path[depth];
+      if (!node->entries.empty() || !node->children.empty())
+        break;
+      Node* parent = *path[depth - 1];
+      const uint32_t bit = Bit(hash, (depth - 1) * kBitsPerLevel);
+      DecRef(node);
+      parent->children.erase(
+          parent->children.begin() + Index(parent->child_bitmap, bit));
+      parent->child_bitmap &= ~bit;
+    }
+    if (root_->entries.empty() && root_->children.empty()) {
+      DecRef(root_);
+      root_ = NULL;
+    }
+    return true;
+  }
+
+ private:
+  static uint32_t Bit(size_t hash, int shift) {
+    return uint32_t(1) << ((hash >> shift) & ((1 << kBitsPerLevel) - 1));
+  }
+  // Where the slot for bit goes in an array indexed by bitmap.
+  static size_t Index(uint32_t bitmap, uint32_t bit) {
+    uint32_t x = bitmap & (bit - 1);   // count the bits below bit
+    x = x - ((x >> 1) & 0x55555555);
+    x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+    return (((x + (x >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+  }
+
+  static void IncRef(const Node* node) {
+    node->refcount.fetch_add(1, std::memory_order_relaxed);
+  }
+  static void DecRef(const Node* node) {
+    // acq_rel, so whoever deletes the node sees every other owner's
+    // last use of it.
+    if (node->refcount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      for (size_t i = 0; i < node->children.size(); ++i)
+        DecRef(node->children[i]);
+      delete node;
+    }
+  }
+
+  // Makes sure no other map can see *slot, by copying it if need be,
+  // so that we may change it.
+  static Node* Own(Node** slot) {
+    if ((*slot)->refcount.load(std::memory_order_acquire) > 1) {
+      Node* copy = new Node(**slot);
+      DecRef(*slot);
+      *slot = copy;
+    }
+    return *slot;
+  }
+
+  Node* root_;
+  size_t size_;
+};
+
+}
+
+#endif  // BASE_PERSISTENT_MAP_H_
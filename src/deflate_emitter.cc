@@ -0,0 +1,272 @@
+// Copyright (c) 2026, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+//
+// DeflateEmitter writes a gzip stream.  We drive zlib in raw-deflate
+// mode and write the gzip header and trailer ourselves, since the
+// trailer's CRC and length have to cover precompressed text that
+// never passes through our z_stream.
+//
+// Splicing works because deflate blocks needn't be byte-aligned or
+// come from a single compressor: after a Z_FULL_FLUSH, our stream
+// ends on a byte boundary and later blocks make no reference to
+// earlier data.  A precompressed segment was compressed from an
+// empty history and ends with a Z_SYNC_FLUSH, so it can be appended
+// at that point, and compression picks up again after it.
+
+#include <config.h>
+#include <ctemplate/template_emitter.h>
+
+#ifdef HAVE_ZLIB
+
+#include <assert.h>
+#include <string.h>
+#include <zlib.h>
+#include <iostream>
+#include <string>
+
+#define LOG(level)   std::cerr << #level ": "
+
+namespace ctemplate {
+
+using std::string;
+
+// How much text we collect before handing it to zlib.
+static const size_t kPendingSize = 16384;
+// How much output space we give zlib at a time.
+static const size_t kOutputChunkSize = 16384;
+// zlib lengths are uInts; we feed it at most this much at a time.
+static const size_t kMaxInputChunkSize = 1 << 30;
+
+// A precompressed segment is the CRC-32 of the text, as 4
+// little-endian bytes, followed by the raw deflate data.
+static const size_t kPrecompressedHeaderLen = 4;
+
+static void AppendLittleEndian32(unsigned long value, string* out) {
+  for (int i = 0; i < 4; ++i)
+    out->push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+}
+
+static unsigned long ReadLittleEndian32(const char* p) {
+  unsigned long value = 0;
+  for (int i = 3; i >= 0; --i)
+    value = (value << 8) | static_cast<unsigned char>(p[i]);
+  return value;
+}
+
+// Like zlib's crc32(), but for any length.
+static unsigned long Crc32(unsigned long crc, const char* s, size_t slen) {
+  for (size_t pos = 0; pos < slen; pos += kMaxInputChunkSize) {
+    const size_t len = slen - pos < kMaxInputChunkSize ?
+                       slen - pos : kMaxInputChunkSize;
+    crc = crc32(crc, reinterpret_cast<const Bytef*>(s + pos),
+                static_cast<uInt>(len));
+  }
+  return crc;
+}
+
+// Runs s through zstream, appending whatever it produces to out.
+// flush is as for deflate().  Returns false on a zlib error.
+static bool Deflate(z_stream* zstream, const char* s, size_t slen,
+                    int flush, string* out) {
+  do {
+    const size_t chunk = slen < kMaxInputChunkSize ? slen : kMaxInputChunkSize;
+    zstream->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(s));
+    zstream->avail_in = static_cast<uInt>(chunk);
+    s += chunk;
+    slen -= chunk;
+    const int chunk_flush = slen == 0 ? flush : Z_NO_FLUSH;
+    do {
+      const size_t old_size = out->size();
+      out->resize(old_size + kOutputChunkSize);
+      zstream->next_out = reinterpret_cast<Bytef*>(&(*out)[old_size]);
+      zstream->avail_out = static_cast<uInt>(kOutputChunkSize);
+      const int err = deflate(zstream, chunk_flush);
+      out->resize(old_size + kOutputChunkSize - zstream->avail_out);
+      if (err == Z_STREAM_ERROR) {
+        LOG(ERROR) << "deflate failed: "
+                   << (zstream->msg ? zstream->msg : "unknown error") << "\n";
+        return false;
+      }
+    } while (zstream->avail_out == 0);
+  } while (slen > 0);
+  return true;
+}
+
+static bool InitRawDeflate(z_stream* zstream, int level) {
+  memset(zstream, 0, sizeof(*zstream));
+  // Negative windowBits asks for raw deflate, with no zlib wrapper.
+  if (deflateInit2(zstream, level, Z_DEFLATED, -MAX_WBITS, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    LOG(ERROR) << "deflateInit2 failed at level " << level << "\n";
+    return false;
+  }
+  return true;
+}
+
+// ----------------------------------------------------------------------
+// DeflateEmitter::Stream
+//    The compressor state.  Input is collected in pending_ and handed
+//    to zlib kPendingSize bytes at a time, since most emits are short.
+//    crc_ and size_ track all the text we've been given, compressed
+//    by us or not, for the gzip trailer.
+// ----------------------------------------------------------------------
+
+class DeflateEmitter::Stream {
+ public:
+  Stream(string* outbuf, int level)
+      : outbuf_(outbuf), ok_(InitRawDeflate(&zstream_, level)),
+        finished_(false), flushed_(true),
+        crc_(crc32(0L, Z_NULL, 0)), size_(0) {
+    // A minimal gzip header: no name, no mtime, unknown OS.
+    static const char kGzipHeader[] = "\x1f\x8b\x08\0\0\0\0\0\0\xff";
+    outbuf_->append(kGzipHeader, sizeof(kGzipHeader) - 1);
+  }
+  ~Stream() {
+    if (ok_)
+      deflateEnd(&zstream_);
+  }
+
+  void Append(const char* s, size_t slen) {
+    assert(!finished_);
+    pending_.append(s, slen);
+    flushed_ = flushed_ && slen == 0;
+    if (pending_.size() >= kPendingSize)
+      Flush(Z_NO_FLUSH);
+  }
+
+  void Splice(const char* s, size_t slen, const string& precompressed) {
+    assert(!finished_);
+    if (precompressed.size() <= kPrecompressedHeaderLen) {
+      Append(s, slen);
+      return;
+    }
+    if (!flushed_)
+      Flush(Z_FULL_FLUSH);
+    if (!ok_)
+      return;   // splicing onto a broken stream would only corrupt it more
+    const unsigned long crc = ReadLittleEndian32(precompressed.data());
+    crc_ = crc32_combine(crc_, crc, static_cast<z_off_t>(slen));
+    size_ += slen;
+    outbuf_->append(precompressed, kPrecompressedHeaderLen, string::npos);
+  }
+
+  void Finish() {
+    if (finished_)
+      return;
+    Flush(Z_FINISH);
+    finished_ = true;
+    if (!ok_)
+      return;
+    AppendLittleEndian32(crc_, outbuf_);
+    AppendLittleEndian32(size_ & 0xffffffffUL, outbuf_);
+  }
+
+ private:
+  // Compresses pending_, and then clears it.
+  void Flush(int flush) {
+    if (ok_) {
+      crc_ = Crc32(crc_, pending_.data(), pending_.size());
+      size_ += pending_.size();
+      ok_ = Deflate(&zstream_, pending_.data(), pending_.size(), flush,
+                    outbuf_);
+    }
+    pending_.clear();
+    flushed_ = (flush != Z_NO_FLUSH);
+  }
+
+  string* const outbuf_;
+  z_stream zstream_;
+  bool ok_;             // false if zlib failed us; we then emit nothing more
+  bool finished_;       // set by Finish()
+  bool flushed_;        // true if all our input has been flushed through zlib
+  unsigned long crc_;
+  unsigned long size_;
+  string pending_;
+};
+
+// ----------------------------------------------------------------------
+// DeflateEmitter
+// ----------------------------------------------------------------------
+
+DeflateEmitter::DeflateEmitter(string* outbuf, int level)
+    : stream_(new Stream(outbuf, level)) {
+}
+
+DeflateEmitter::~DeflateEmitter() {
+  delete stream_;
+}
+
+void DeflateEmitter::Emit(char c) {
+  stream_->Append(&c, 1);
+}
+
+void DeflateEmitter::Emit(const string& s) {
+  stream_->Append(s.data(), s.size());
+}
+
+void DeflateEmitter::Emit(const char* s) {
+  stream_->Append(s, strlen(s));
+}
+
+void DeflateEmitter::Emit(const char* s, size_t slen) {
+  stream_->Append(s, slen);
+}
+
+void DeflateEmitter::EmitStaticText(const StaticTextSegment& text) {
+  stream_->Splice(text.text, text.textlen, text.precompressed);
+}
+
+void DeflateEmitter::Finish() {
+  stream_->Finish();
+}
+
+bool DeflateEmitter::Precompress(const char* s, size_t slen, string* out) {
+  z_stream zstream;
+  // This is done once, at load time, so we might as well do it well.
+  if (!InitRawDeflate(&zstream, Z_BEST_COMPRESSION))
+    return false;
+  string precompressed;
+  AppendLittleEndian32(crc32(0L, Z_NULL, 0), &precompressed);
+  const bool ok = Deflate(&zstream, s, slen, Z_SYNC_FLUSH, &precompressed);
+  deflateEnd(&zstream);
+  if (!ok || precompressed.size() - kPrecompressedHeaderLen >= slen)
+    return false;
+  // Now that we know it's worth it, fill in the CRC.
+  string crc_bytes;
+  AppendLittleEndian32(Crc32(crc32(0L, Z_NULL, 0), s, slen), &crc_bytes);
+  precompressed.replace(0, kPrecompressedHeaderLen, crc_bytes);
+  out->swap(precompressed);
+  return true;
+}
+
+}
+
+#endif  // HAVE_ZLIB
@@ -53,6 +53,24 @@
 //         For correct operation of Auto-Escape, ensure this matches
 //         the Strip mode you normally use on these templates.
 //
+//   . With --batch, the tool diffs many pairs of templates: either
+//     every pair listed in a file (one pair per line, the two names
+//     separated by whitespace; "-" reads the list from stdin), or,
+//     given two directories, every file under the first against the
+//     file with the same relative name under the second.  The pairs
+//     are diffed by --threads threads (default: one per core), each
+//     with its own TemplateCache, so a template in several pairs is
+//     only parsed once per thread.  The differences go to stderr, and
+//     a summary goes to stdout, one tab-separated line per pair:
+//        <same|differ|error> <vars> <diffs> <vars-without-mods> <a> <b>
+//     followed by a "# total=..." line with the counts.
+//
+//   . With --cache=<file>, batch mode remembers, by the hash of both
+//     templates' contents and the Strip mode, which pairs had no
+//     differences, and doesn't parse them again on the next run.
+//     Only pairs without differences are remembered, since the others
+//     need to be parsed again to show their differences anyway.
+//
 //
 // Exit code is zero if there were no differences. It is non-zero
 // if we failed to load the templates or we found one or more
@@ -67,27 +85,42 @@
 #include <config.h>
 #undef CTEMPLATE_DLL_DECL
 
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <sys/types.h>
 #ifdef HAVE_UNISTD_H
 # include <unistd.h>
 #endif
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
 #include <stdarg.h>
 #ifdef HAVE_GETOPT_H
 # include <getopt.h>
 #endif
 #include <string.h>
+#include <map>
 #include <string>
+#include <vector>
 #include <ctemplate/template.h>
+#include <ctemplate/template_cache.h>
+#include <ctemplate/template_emitter.h>
 #include <ctemplate/template_pathops.h>
+#include "base/fileutil.h"
+using std::map;
 using std::string;
 using std::vector;
 using ctemplate::Template;
+using ctemplate::TemplateCache;
+using ctemplate::TemplateHandle;
 using ctemplate::TemplateContext;
 using ctemplate::Strip;
 using ctemplate::STRIP_WHITESPACE;
 using ctemplate::STRIP_BLANK_LINES;
 using ctemplate::DO_NOT_STRIP;
+using ctemplate::File;
+using ctemplate::HashingEmitter;
 
 enum {LOG_VERBOSE, LOG_INFO, LOG_WARNING, LOG_ERROR, LOG_FATAL};
 
@@ -105,6 +138,9 @@ typedef vector<VariableAndMod> VariableAndMods;
 static string FLAG_template_dir(ctemplate::kCWD);   // "./"
 static string FLAG_strip = "";      // cmd-line arg -s
 static bool FLAG_verbose = false;   // cmd-line arg -v
+static bool FLAG_batch = false;     // cmd-line arg -b
+static int FLAG_threads = 0;        // cmd-line arg -j; 0 means one per core
+static string FLAG_cache = "";      // cmd-line arg -c
 
 static void LogPrintf(int severity, const char* pat, ...) {
   if (severity == LOG_VERBOSE && !FLAG_verbose)
@@ -124,13 +160,22 @@ static void LogPrintf(int severity, const char* pat, ...) {
 
 // Prints to outfile -- usually stdout or stderr -- and then exits
 static int Usage(const char* argv0, FILE* outfile) {
-  fprintf(outfile, "USAGE: %s [-t<dir>] [-v] [-b] [-s<n>] <file1> <file2>\n",
-          argv0);
+  fprintf(outfile, "USAGE: %s [-t<dir>] [-v] [-s<n>] <file1> <file2>\n"
+          "       %s -b [-t<dir>] [-s<n>] [-j<n>] [-c<file>]"
+          " <list-file> | <dir1> <dir2>\n",
+          argv0, argv0);
 
   fprintf(outfile,
           "       -t --template_dir=<dir>  Root directory of templates\n"
           "       -s --strip=<strip>       STRIP_WHITESPACE [default],\n"
           "                                STRIP_BLANK_LINES, DO_NOT_STRIP\n"
+          "       -b --batch               Diff the pairs of templates\n"
+          "                                listed in a file, or in two\n"
+          "                                directories\n"
+          "       -j --threads=<n>         Threads to diff them in\n"
+          "                                [default: one per core]\n"
+          "       -c --cache=<file>        Where to remember the pairs\n"
+          "                                without differences\n"
           "       -h --help                This help\n"
           "       -v --verbose             For a bit more output\n"
           "       -V --version             Version information\n");
@@ -172,18 +217,19 @@ static int Version(FILE* outfile) {
 // variable name and modifiers when present.
 // Because DumpToString also outputs text nodes, it is possible
 // to trip this function. Probably ok since this is just a helper tool.
-bool LoadVariables(const char* filename, Strip strip,
-                   VariableAndMods& vars_and_mods) {
+// Returns false, with the reason in error, if the template can't be
+// loaded.
+bool LoadVariables(TemplateCache* cache, const char* filename, Strip strip,
+                   VariableAndMods& vars_and_mods, string* error) {
   const string kVariablePreambleText = "Variable Node: ";
-  Template *tpl;
-  tpl = Template::GetTemplate(filename, strip);
-  if (tpl == NULL) {
-    LogPrintf(LOG_FATAL, "Could not load file: %s\n", filename);
+  TemplateHandle tpl = cache->GetTemplateHandle(filename, strip);
+  if (!tpl.valid()) {
+    *error = string("Could not load file: ") + filename + "\n";
     return false;
   }
 
   string output;
-  tpl->DumpToString(filename, &output);
+  tpl.get()->DumpToString(filename, &output);
 
   string::size_type index = 0;
   string::size_type delim, end;
@@ -219,55 +265,316 @@ bool SuppressLameDiff(string modifiers_a, string modifiers_b) {
   return false;
 }
 
+// What DiffTemplates() found for one pair of templates.
+struct DiffResult {
+  DiffResult()
+      : failed(false), num_vars(0), num_diffs(0), num_no_modifiers(0) { }
+  bool failed;            // true iff we couldn't compare the templates
+  int num_vars;
+  int num_diffs;          // how many variables have different modifiers
+  int num_no_modifiers;   // how many lack modifiers in one of the two
+  string diffs;           // a "Difference for variable" line for each
+  string error;           // why we failed, if we did
+};
+
 // Main function to analyze differences in escaping modifiers between
-// two template files. These files are assumed to be identical in
-// content [strictly speaking: same number of variables in the same order].
-// If that is not the case, we fail.
-// We return true if there were no differences, false if we failed
-// or we found one or more differences.
-bool DiffTemplates(const char* filename_a, const char* filename_b,
-                   Strip strip) {
+// two template files, loaded into cache. These files are assumed to be
+// identical in content [strictly speaking: same number of variables in
+// the same order]. If that is not the case, we fail.
+// We fill in result, and return true if there were no differences,
+// false if we failed or we found one or more differences.
+bool DiffTemplates(TemplateCache* cache, const char* filename_a,
+                   const char* filename_b, Strip strip, DiffResult* result) {
   vector<VariableAndMod> vars_and_mods_a, vars_and_mods_b;
 
-  if (!LoadVariables(filename_a, strip, vars_and_mods_a) ||
-      !LoadVariables(filename_b, strip, vars_and_mods_b))
+  if (!LoadVariables(cache, filename_a, strip, vars_and_mods_a,
+                     &result->error) ||
+      !LoadVariables(cache, filename_b, strip, vars_and_mods_b,
+                     &result->error)) {
+    result->failed = true;
     return false;
+  }
 
-  if (vars_and_mods_a.size() != vars_and_mods_b.size())
-    LogPrintf(LOG_FATAL, "Templates differ: %s [%d vars] vs. %s [%d vars].\n",
-              filename_a, vars_and_mods_a.size(),
-              filename_b, vars_and_mods_b.size());
+  char buf[1024];
+  if (vars_and_mods_a.size() != vars_and_mods_b.size()) {
+    snprintf(buf, sizeof(buf),
+             "Templates differ: %s [%d vars] vs. %s [%d vars].\n",
+             filename_a, static_cast<int>(vars_and_mods_a.size()),
+             filename_b, static_cast<int>(vars_and_mods_b.size()));
+    result->error = buf;
+    result->failed = true;
+    return false;
+  }
 
-  int mismatch_count = 0;      // How many differences there were.
-  int no_modifiers_count = 0;  // How many variables without modifiers.
   VariableAndMods::const_iterator iter_a, iter_b;
   for (iter_a = vars_and_mods_a.begin(), iter_b = vars_and_mods_b.begin();
        iter_a != vars_and_mods_a.end() && iter_b != vars_and_mods_b.end();
        ++iter_a, ++iter_b) {
     // The templates have different variables, we fail!
-    if (iter_a->variable_name != iter_b->variable_name)
-      LogPrintf(LOG_FATAL, "Variable name mismatch: %s vs. %s\n",
-                iter_a->variable_name.c_str(),
-                iter_b->variable_name.c_str());
+    if (iter_a->variable_name != iter_b->variable_name) {
+      result->error = "Variable name mismatch: " + iter_a->variable_name +
+                      " vs. " + iter_b->variable_name + "\n";
+      result->failed = true;
+      return false;
+    }
     // Variables without modifiers are ignored from the diff. They simply
     // get counted and the count is shown in verbose logging/
     if (iter_a->modifiers == "" || iter_b->modifiers == "") {
-      no_modifiers_count++;
+      result->num_no_modifiers++;
     } else {
       if (iter_a->modifiers != iter_b->modifiers &&
           !SuppressLameDiff(iter_a->modifiers, iter_b->modifiers)) {
-        mismatch_count++;
-        LogPrintf(LOG_INFO, "Difference for variable %s -- %s vs. %s\n",
-                  iter_a->variable_name.c_str(),
-                  iter_a->modifiers.c_str(), iter_b->modifiers.c_str());
+        result->num_diffs++;
+        result->diffs.append("Difference for variable " +
+                             iter_a->variable_name + " -- " +
+                             iter_a->modifiers + " vs. " +
+                             iter_b->modifiers + "\n");
       }
     }
   }
+  result->num_vars = static_cast<int>(vars_and_mods_a.size());
 
-  LogPrintf(LOG_VERBOSE, "Variables Found: Total=%d; Diffs=%d; NoMods=%d\n",
-            vars_and_mods_a.size(), mismatch_count, no_modifiers_count);
+  return (result->num_diffs == 0);
+}
+
+// ---- BATCH MODE ----
+
+// One pair of templates to diff in batch mode, and what we found.
+struct BatchPair {
+  BatchPair(const string& a, const string& b)
+      : filename_a(a), filename_b(b), cached(false) { }
+  string filename_a;
+  string filename_b;
+  string cache_key;   // empty if either file can't be read
+  bool cached;        // true iff the cache said there are no differences
+  DiffResult result;
+};
+
+// Adds a pair for every line of the list file ("-" for stdin).
+// Returns false if it can't be read, or a line doesn't hold two names.
+static bool ReadPairList(const string& list_file, vector<BatchPair>* pairs) {
+  string contents;
+  if (list_file == "-") {
+    char buf[8192];
+    size_t len;
+    while ((len = fread(buf, 1, sizeof(buf), stdin)) > 0)
+      contents.append(buf, len);
+  } else if (!File::ReadFileToString(list_file, &contents)) {
+    LogPrintf(LOG_ERROR, "Can't read %s: %s\n", list_file.c_str(),
+              strerror(errno));
+    return false;
+  }
+  const char* const kWhitespace = " \t\r";
+  string::size_type pos = 0;
+  while (pos < contents.size()) {
+    string::size_type eol = contents.find('\n', pos);
+    if (eol == string::npos)
+      eol = contents.size();
+    const string line = contents.substr(pos, eol - pos);
+    pos = eol + 1;
+    const string::size_type a = line.find_first_not_of(kWhitespace);
+    if (a == string::npos || line[a] == '#')   // blank lines and comments
+      continue;
+    const string::size_type a_end = line.find_first_of(kWhitespace, a);
+    const string::size_type b = (a_end == string::npos ? string::npos :
+                                 line.find_first_not_of(kWhitespace, a_end));
+    if (b == string::npos) {
+      LogPrintf(LOG_ERROR, "%s: not a pair of templates: %s\n",
+                list_file.c_str(), line.c_str());
+      return false;
+    }
+    const string::size_type b_end = line.find_first_of(kWhitespace, b);
+    pairs->push_back(BatchPair(line.substr(a, a_end - a),
+                               line.substr(b, b_end == string::npos ?
+                                           string::npos : b_end - b)));
+  }
+  return true;
+}
+
+// Adds a pair for every file under dir_a (relative to the
+// template_dir, unless it's absolute), with the file of the same name
+// under dir_b.  Returns false if a directory can't be read.
+static bool ReadPairDirs(const string& dir_a, const string& dir_b,
+                         vector<BatchPair>* pairs) {
+  vector<string> names, errors;
+  File::FindFiles(ctemplate::PathJoin(FLAG_template_dir, dir_a), "",
+                  &names, &errors);
+  for (vector<string>::const_iterator it = errors.begin();
+       it != errors.end(); ++it)
+    LogPrintf(LOG_ERROR, "%s\n", it->c_str());
+  if (!errors.empty())
+    return false;
+  for (vector<string>::const_iterator it = names.begin();
+       it != names.end(); ++it)
+    pairs->push_back(BatchPair(ctemplate::PathJoin(dir_a, *it),
+                               ctemplate::PathJoin(dir_b, *it)));
+  return true;
+}
+
+// Reads the cache file's entries, one per pair that had no
+// differences: "<key> <vars> <vars-without-mods>".  The first line of
+// a cache file is a header, which we check so we don't take some other
+// file for one.
+static const char kCacheHeader[] = "# diff_tpl_auto_escape cache";
+static map<string, DiffResult> ReadCache(const string& cache_file) {
+  map<string, DiffResult> entries;
+  string contents;
+  if (!File::ReadFileToString(cache_file, &contents))
+    return entries;   // no cache yet
+  string::size_type pos = contents.find('\n');
+  if (pos == string::npos || contents.substr(0, pos) != kCacheHeader)
+    return entries;
+  while (++pos < contents.size()) {
+    string::size_type eol = contents.find('\n', pos);
+    if (eol == string::npos)
+      eol = contents.size();
+    char key[64];
+    DiffResult result;
+    if (sscanf(contents.substr(pos, eol - pos).c_str(), "%63s %d %d", key,
+               &result.num_vars, &result.num_no_modifiers) == 3)
+      entries[key] = result;
+    pos = eol;
+  }
+  return entries;
+}
+
+// The pairs one thread diffs: every stride'th one, from first.
+struct BatchWork {
+  vector<BatchPair>* pairs;
+  const map<string, DiffResult>* cached;
+  size_t first;
+  size_t stride;
+  Strip strip;
+};
+
+// Returns the HashingEmitter::Digest() of contents, in hex.
+static string DigestHex(const string& contents) {
+  char buf[17];
+  snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(
+      HashingEmitter::Digest(contents.data(), contents.size())));
+  return buf;
+}
 
-  return (mismatch_count == 0);
+static void* DiffBatch(void* arg) {
+  BatchWork* work = static_cast<BatchWork*>(arg);
+  TemplateCache cache;
+  cache.SetTemplateRootDirectory(FLAG_template_dir);
+  for (size_t i = work->first; i < work->pairs->size(); i += work->stride) {
+    BatchPair* pair = &(*work->pairs)[i];
+    if (!FLAG_cache.empty()) {
+      string contents_a, contents_b;
+      if (File::ReadFileToString(cache.FindTemplateFilename(pair->filename_a),
+                                 &contents_a) &&
+          File::ReadFileToString(cache.FindTemplateFilename(pair->filename_b),
+                                 &contents_b)) {
+        char strip_buf[16];
+        snprintf(strip_buf, sizeof(strip_buf), "%d",
+                 static_cast<int>(work->strip));
+        pair->cache_key = DigestHex(contents_a) + DigestHex(contents_b) +
+                          "-" + strip_buf;
+        map<string, DiffResult>::const_iterator it =
+            work->cached->find(pair->cache_key);
+        if (it != work->cached->end()) {
+          pair->result = it->second;
+          pair->cached = true;
+          continue;
+        }
+      }
+    }
+    DiffTemplates(&cache, pair->filename_a.c_str(), pair->filename_b.c_str(),
+                  work->strip, &pair->result);
+  }
+  return NULL;
+}
+
+// Diffs every pair, printing the differences to stderr and the summary
+// to stdout.  Returns true iff no pair had differences or failed.
+static bool RunBatch(vector<BatchPair>* pairs, Strip strip) {
+  map<string, DiffResult> cached;
+  if (!FLAG_cache.empty())
+    cached = ReadCache(FLAG_cache);
+
+  int num_threads = FLAG_threads;
+#if defined(HAVE_PTHREAD) && defined(_SC_NPROCESSORS_ONLN)
+  if (num_threads == 0)
+    num_threads = static_cast<int>(sysconf(_SC_NPROCESSORS_ONLN));
+#endif
+  if (num_threads < 1)
+    num_threads = 1;
+#ifndef HAVE_PTHREAD
+  if (num_threads > 1) {
+    LogPrintf(LOG_WARNING, "Built without threads; diffing with just one.\n");
+    num_threads = 1;
+  }
+#endif
+
+  vector<BatchWork> work(num_threads);
+  for (int t = 0; t < num_threads; ++t) {
+    work[t].pairs = pairs;
+    work[t].cached = &cached;
+    work[t].first = t;
+    work[t].stride = num_threads;
+    work[t].strip = strip;
+  }
+#ifdef HAVE_PTHREAD
+  vector<pthread_t> threads(num_threads);
+  for (int t = 1; t < num_threads; ++t)
+    pthread_create(&threads[t], NULL, DiffBatch, &work[t]);
+  DiffBatch(&work[0]);
+  for (int t = 1; t < num_threads; ++t)
+    pthread_join(threads[t], NULL);
+#else
+  DiffBatch(&work[0]);
+#endif
+
+  int num_same = 0, num_differ = 0, num_failed = 0, num_cached = 0;
+  string new_cache = string(kCacheHeader) + "\n";
+  for (vector<BatchPair>::const_iterator it = pairs->begin();
+       it != pairs->end(); ++it) {
+    const DiffResult& result = it->result;
+    const char* status;
+    if (result.failed) {
+      status = "error";
+      num_failed++;
+      fprintf(stderr, "%s vs. %s: %s", it->filename_a.c_str(),
+              it->filename_b.c_str(), result.error.c_str());
+    } else if (result.num_diffs > 0) {
+      status = "differ";
+      num_differ++;
+      fprintf(stderr, "------ Diff of [%s, %s] ------\n%s",
+              it->filename_a.c_str(), it->filename_b.c_str(),
+              result.diffs.c_str());
+    } else {
+      status = "same";
+      num_same++;
+      if (it->cached)
+        num_cached++;
+      if (!it->cache_key.empty()) {
+        char counts[32];
+        snprintf(counts, sizeof(counts), " %d %d\n", result.num_vars,
+                 result.num_no_modifiers);
+        new_cache.append(it->cache_key + counts);
+      }
+    }
+    fprintf(stdout, "%s\t%d\t%d\t%d\t%s\t%s\n", status, result.num_vars,
+            result.num_diffs, result.num_no_modifiers,
+            it->filename_a.c_str(), it->filename_b.c_str());
+  }
+  fprintf(stdout, "# total=%d same=%d differ=%d error=%d cached=%d\n",
+          static_cast<int>(pairs->size()), num_same, num_differ, num_failed,
+          num_cached);
+
+  if (!FLAG_cache.empty()) {
+    FILE* fp = fopen(FLAG_cache.c_str(), "wb");
+    if (fp == NULL ||
+        fwrite(new_cache.data(), 1, new_cache.size(), fp) != new_cache.size()) {
+      LogPrintf(LOG_ERROR, "Can't write %s: %s\n", FLAG_cache.c_str(),
+                strerror(errno));
+    }
+    if (fp != NULL)
+      fclose(fp);
+  }
+  return num_differ == 0 && num_failed == 0;
 }
 
 int main(int argc, char **argv) {
@@ -278,13 +585,16 @@ int main(int argc, char **argv) {
     {"template_dir", 1, NULL, 't'},
     {"verbose", 0, NULL, 'v'},
     {"version", 0, NULL, 'V'},
+    {"batch", 0, NULL, 'b'},
+    {"threads", 1, NULL, 'j'},
+    {"cache", 1, NULL, 'c'},
     {0, 0, 0, 0}
   };
   int option_index;
-# define GETOPT(argc, argv)  getopt_long(argc, argv, "t:s:hvV", \
+# define GETOPT(argc, argv)  getopt_long(argc, argv, "t:s:j:c:bhvV", \
                                          longopts, &option_index)
 #elif defined(HAVE_GETOPT_H)
-# define GETOPT(argc, argv)  getopt(argc, argv, "t:s:hvV")
+# define GETOPT(argc, argv)  getopt(argc, argv, "t:s:j:c:bhvV")
 #else
   // TODO(csilvers): implement something reasonable for windows/etc
 # define GETOPT(argc, argv)  -1
@@ -299,6 +609,9 @@ int main(int argc, char **argv) {
       case 's': FLAG_strip.assign(optarg); break;
       case 't': FLAG_template_dir.assign(optarg); break;
       case 'v': FLAG_verbose = true; break;
+      case 'b': FLAG_batch = true; break;
+      case 'j': FLAG_threads = atoi(optarg); break;
+      case 'c': FLAG_cache.assign(optarg); break;
       case 'V': Version(stdout); break;
       case -1: break;   // means 'no more input'
       default: Usage(argv[0], stderr);
@@ -308,9 +621,14 @@ int main(int argc, char **argv) {
   Template::SetTemplateRootDirectory(FLAG_template_dir);
 
 
-  if (argc != (optind + 2))
+  if (FLAG_batch) {
+    if (argc != optind + 1 && argc != optind + 2)
+      LogPrintf(LOG_FATAL, "Must specify a list file, or two directories, "
+                "on the command line.\n");
+  } else if (argc != (optind + 2)) {
     LogPrintf(LOG_FATAL,
               "Must specify exactly two template files on the command line.\n");
+  }
 
   // Validate the Strip value. Default is STRIP_WHITESPACE.
   Strip strip = STRIP_WHITESPACE;   // To avoid compiler warnings.
@@ -325,13 +643,28 @@ int main(int argc, char **argv) {
               "STRIP_WHITESPACE, STRIP_BLANK_LINES or DO_NOT_STRIP\n",
               FLAG_strip.c_str());
 
+  if (FLAG_batch) {
+    vector<BatchPair> pairs;
+    const bool ok = (argc == optind + 1 ?
+                     ReadPairList(argv[optind], &pairs) :
+                     ReadPairDirs(argv[optind], argv[optind + 1], &pairs));
+    if (!ok)
+      return 1;
+    return RunBatch(&pairs, strip) ? 0 : 1;
+  }
+
   const char* filename_a = argv[optind];
   const char* filename_b = argv[optind + 1];
   LogPrintf(LOG_VERBOSE, "------ Diff of [%s, %s] ------\n",
             filename_a, filename_b);
 
-  if (DiffTemplates(filename_a, filename_b, strip))
-    return 0;
-  else
-    return 1;
+  DiffResult result;
+  const bool same = DiffTemplates(ctemplate::mutable_default_template_cache(),
+                                  filename_a, filename_b, strip, &result);
+  if (result.failed)
+    LogPrintf(LOG_FATAL, "%s", result.error.c_str());
+  LogPrintf(LOG_INFO, "%s", result.diffs.c_str());
+  LogPrintf(LOG_VERBOSE, "Variables Found: Total=%d; Diffs=%d; NoMods=%d\n",
+            result.num_vars, result.num_diffs, result.num_no_modifiers);
+  return same ? 0 : 1;
 }
@@ -0,0 +1,208 @@
+// Copyright (c) 2026, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+//
+// HashingEmitter's digest is a CRC, rather than a faster hash like
+// MurmurHash, because a CRC can be extended by a string it hasn't
+// seen: given crc(A) and crc(B), crc(AB) is crc(A) times x^(8*|B|),
+// modulo the CRC polynomial, plus crc(B).  That is what lets static
+// template text be hashed once, at load time.  The carry-less
+// arithmetic below follows zlib's crc32_combine(); the CRC itself
+// is computed eight bytes at a time ("slicing-by-8").
+
+#include <config.h>
+#include <ctemplate/template_emitter.h>
+#include <string.h>
+#include <string>
+
+namespace ctemplate {
+
+using std::string;
+
+// The ECMA-182 polynomial, bit-reversed.
+static const uint64_t kPoly = 0xc96c5795d7870f42ULL;
+
+// In our bit-reversed representation, the polynomial 1 (that is,
+// x^0) is the high bit.
+static const uint64_t kOne = 1ULL << 63;
+
+// Returns a times b, modulo kPoly.  a must not be zero.
+static uint64_t MultModPoly(uint64_t a, uint64_t b) {
+  uint64_t m = kOne;
+  uint64_t p = 0;
+  for (;;) {
+    if (a & m) {
+      p ^= b;
+      if ((a & (m - 1)) == 0)
+        break;
+    }
+    m >>= 1;
+    b = (b & 1) ? (b >> 1) ^ kPoly : b >> 1;
+  }
+  return p;
+}
+
+// Tables for computing the CRC, and for computing x^n mod kPoly.
+struct Crc64Tables {
+  Crc64Tables() {
+    for (int i = 0; i < 256; ++i) {
+      uint64_t crc = i;
+      for (int bit = 0; bit < 8; ++bit)
+        crc = (crc & 1) ? (crc >> 1) ^ kPoly : crc >> 1;
+      bytes[0][i] = crc;
+    }
+    for (int i = 0; i < 256; ++i) {
+      for (int k = 1; k < 8; ++k) {
+        const uint64_t prev = bytes[k-1][i];
+        bytes[k][i] = (prev >> 8) ^ bytes[0][prev & 0xff];
+      }
+    }
+    x_to_2_to_the[0] = kOne >> 1;   // x^1
+    for (int k = 1; k < kNumPowers; ++k)
+      x_to_2_to_the[k] = MultModPoly(x_to_2_to_the[k-1], x_to_2_to_the[k-1]);
+  }
+
+  // bytes[k][i] is the CRC of byte i followed by k zero bytes.
+  uint64_t bytes[8][256];
+  // x_to_2_to_the[k] is x^(2^k) mod kPoly.  We need one for each bit
+  // of a size_t, plus three, since we count lengths in bytes.
+  static const int kNumPowers = 8 * sizeof(size_t) + 3;
+  uint64_t x_to_2_to_the[kNumPowers];
+};
+
+static const Crc64Tables& Tables() {
+  static const Crc64Tables tables;
+  return tables;
+}
+
+// Returns the digest of s appended to a string whose digest is crc.
+static uint64_t UpdateDigest(uint64_t crc, const char* s, size_t slen) {
+  const Crc64Tables& tables = Tables();
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(s);
+  crc = ~crc;
+  for (; slen >= 8; p += 8, slen -= 8) {
+    // Assembling the word byte by byte keeps this endian-neutral.
+    uint64_t word = 0;
+    for (int i = 7; i >= 0; --i)
+      word = (word << 8) | p[i];
+    word ^= crc;
+    crc = (tables.bytes[7][word & 0xff] ^
+           tables.bytes[6][(word >> 8) & 0xff] ^
+           tables.bytes[5][(word >> 16) & 0xff] ^
+           tables.bytes[4][(word >> 24) & 0xff] ^
+           tables.bytes[3][(word >> 32) & 0xff] ^
+           tables.bytes[2][(word >> 40) & 0xff] ^
+           tables.bytes[1][(word >> 48) & 0xff] ^
+           tables.bytes[0][word >> 56]);
+  }
+  for (; slen > 0; ++p, --slen)
+    crc = (crc >> 8) ^ tables.bytes[0][(crc ^ *p) & 0xff];
+  return ~crc;
+}
+
+// ----------------------------------------------------------------------
+// HashingEmitter::Digest()
+// HashingEmitter::DigestShift()
+// HashingEmitter::Combine()
+// HashingEmitter::CombineWithShift()
+//    DigestShift(len) is x^(8*len) mod kPoly: what the digest of a
+//    string is multiplied by when len more bytes are appended to it.
+// ----------------------------------------------------------------------
+
+uint64_t HashingEmitter::Digest(const char* s, size_t slen) {
+  return UpdateDigest(0, s, slen);
+}
+
+uint64_t HashingEmitter::DigestShift(size_t len) {
+  const Crc64Tables& tables = Tables();
+  uint64_t shift = kOne;
+  for (int k = 3; len != 0; len >>= 1, ++k) {
+    if (len & 1)
+      shift = MultModPoly(tables.x_to_2_to_the[k], shift);
+  }
+  return shift;
+}
+
+uint64_t HashingEmitter::Combine(uint64_t digest1, uint64_t digest2,
+                                 size_t len2) {
+  return CombineWithShift(digest1, digest2, DigestShift(len2));
+}
+
+uint64_t HashingEmitter::CombineWithShift(uint64_t digest1, uint64_t digest2,
+                                          uint64_t shift2) {
+  if (shift2 == 0)     // not a valid shift; MultModPoly() would never end
+    return digest2;
+  return MultModPoly(shift2, digest1) ^ digest2;
+}
+
+// ----------------------------------------------------------------------
+// HashingEmitter::Emit()
+// HashingEmitter::EmitStaticText()
+// ----------------------------------------------------------------------
+
+void HashingEmitter::Emit(char c) {
+  Emit(&c, 1);
+}
+
+void HashingEmitter::Emit(const string& s) {
+  Emit(s.data(), s.size());
+}
+
+void HashingEmitter::Emit(const char* s) {
+  Emit(s, strlen(s));
+}
+
+void HashingEmitter::Emit(const char* s, size_t slen) {
+  digest_ = UpdateDigest(digest_, s, slen);
+  size_ += slen;
+  if (output_)
+    output_->Emit(s, slen);
+}
+
+void HashingEmitter::EmitStaticText(const StaticTextSegment& text) {
+  uint64_t shift = text.digest_shift.load(std::memory_order_acquire);
+  uint64_t digest;
+  if (shift != 0) {
+    digest = text.digest.load(std::memory_order_relaxed);
+  } else {
+    // We're the first to hash this text, so we save its digest for
+    // next time.  Racing emitters just store the same values twice.
+    digest = Digest(text.text, text.textlen);
+    shift = DigestShift(text.textlen);
+    text.digest.store(digest, std::memory_order_relaxed);
+    text.digest_shift.store(shift, std::memory_order_release);
+  }
+  digest_ = CombineWithShift(digest_, digest, shift);
+  size_ += text.textlen;
+  if (output_)
+    output_->EmitStaticText(text);
+}
+
+}
@@ -222,7 +222,7 @@ class FSMGenerateC(FSMGenerateAbstract):
 
     # Special case for the character class [:default:]
     if expression == '[:default:]':
-      out = [chr(c) for c in range(0, 255)]
+      out = [chr(c) for c in range(0, 256)]
       return ''.join(out)
 
     chars = [c for c in expression]  # list o characters in the expression.
@@ -244,27 +244,19 @@ class FSMGenerateC(FSMGenerateAbstract):
 
     return ''.join(out)
 
-  def _CreateTransitionTable(self):
-    """Print the state transition list.
+  def _CharRepr(self, c):
+    """Return a printable representation of the character with code c."""
 
-    Returns a set of C structures that define the transition table for the state
-    machine. This structure is a list of lists of ints (int **). The outer list
-    indexes the source state and the inner list contains the destination state
-    for each of the possible input characters:
+    return str(repr(chr(c)).encode("ASCII", "backslashreplace"), "ASCII")
 
-    const int * const* transitions[source][input] == destination.
-
-    The conditions are mapped from the conditions variable.
+  def _BuildStateTable(self):
+    """Return a dict mapping each state to its list of 256 destinations."""
 
-    Returns:
-      String containing the generated transition table in a C struct.
-    """
-    out = []          # output list
     default_state = 'STATEMACHINE_ERROR'
     state_table = {}
 
     for state in self._config.states:
-      state_table[state] = [default_state for col in range(255)]
+      state_table[state] = [default_state for col in range(256)]
 
     # We process the transition in reverse order while updating the table.
     for i_transition in range(len(self._config.transitions) - 1, -1, -1):
@@ -278,11 +270,31 @@ class FSMGenerateC(FSMGenerateAbstract):
       for c in char_list:
         state_table[src][ord(c)] = self._StateInternalC(dst)
 
+    return state_table
+
+  def _CreateTransitionTable(self):
+    """Print the state transition list.
+
+    Returns a set of C structures that define the transition table for the state
+    machine. This structure is a list of lists of ints (int **). The outer list
+    indexes the source state and the inner list contains the destination state
+    for each of the possible input characters:
+
+    const int * const* transitions[source][input] == destination.
+
+    The conditions are mapped from the conditions variable.
+
+    Returns:
+      String containing the generated transition table in a C struct.
+    """
+    out = []          # output list
+    state_table = self._BuildStateTable()
+
     # Create the inner lists which map input characters to destination states.
     for state in self._config.states:
       transition_row = []
-      for c in range(0, 255):
-        ch_repr = str(repr(chr(c)).encode("ASCII", "backslashreplace"), "ASCII")
+      for c in range(0, 256):
+        ch_repr = self._CharRepr(c)
         transition_row.append('    /* %06s */ %s' % (ch_repr,
                                                      state_table[state][c]))
 
@@ -294,7 +306,7 @@ class FSMGenerateC(FSMGenerateAbstract):
       out.append('\n')
 
     # Create the outer list, which map source states to input characters.
-    out.append('static const %s %s[] = {\n' % ('int *', self._Prefix() +
+    out.append('static const %s %s[] = {\n' % ('int * const', self._Prefix() +
                                                'state_transitions'))
 
     row_list = ['  %stransition_row_%s' %
@@ -304,6 +316,74 @@ class FSMGenerateC(FSMGenerateAbstract):
 
     return ''.join(out)
 
+  def _CreateCompactTransitionTable(self):
+    """Print the compact state transition table.
+
+    Input characters that lead to the same destination from every state are
+    merged into a single equivalence class. The result is a 256 entry map from
+    input character to class and a flat table of unsigned chars indexed by
+    source state and class:
+
+    transitions[source * num_classes + char_classes[input]] == destination.
+
+    Both tables are wrapped in a statemachine_compact_table structure that can
+    be passed to statemachine_definition_populate_compact().
+
+    Returns:
+      String containing the generated compact tables.
+    """
+    # Destination states are stored as unsigned chars, and STATEMACHINE_ERROR
+    # must not collide with a real state.
+    if len(self._config.states) >= 127:
+      raise ValueError('Too many states for a compact table: %d' %
+                       len(self._config.states))
+
+    out = []          # output list
+    state_table = self._BuildStateTable()
+    states = list(self._config.states)
+
+    # Characters with identical columns share a class. Classes are numbered
+    # in order of first appearance so the output is stable.
+    class_ids = {}
+    class_columns = []
+    char_classes = []
+    for c in range(0, 256):
+      column = tuple(state_table[state][c] for state in states)
+      if column not in class_ids:
+        class_ids[column] = len(class_columns)
+        class_columns.append(column)
+      char_classes.append(class_ids[column])
+
+    out.append('#define %s_NUM_CLASSES %d\n\n' % (self._config.name.upper(),
+                                                  len(class_columns)))
+
+    class_list = ['    /* %06s */ %d' % (self._CharRepr(c), char_classes[c])
+                  for c in range(0, 256)]
+    out.append(self._CreateStructList(self._Prefix() + 'char_classes',
+                                      'unsigned char',
+                                      class_list))
+    out.append('\n')
+
+    # One block per source state, each with one entry per class.
+    rows = []
+    for i_state in range(len(states)):
+      row = ['    %s' % column[i_state] for column in class_columns]
+      rows.append('  /* %s */\n%s' % (states[i_state], ',\n'.join(row)))
+    out.append('static const unsigned char %s[] = {\n%s\n};\n\n' % (
+        self._Prefix() + 'compact_transitions',
+        ',\n'.join(rows)))
+
+    out.append('static const statemachine_compact_table %s = {\n' %
+               (self._Prefix() + 'compact_table'))
+    out.append(self._ListToIndentedString([
+        str(len(states)),
+        '%s_NUM_CLASSES' % self._config.name.upper(),
+        self._Prefix() + 'char_classes',
+        self._Prefix() + 'compact_transitions']))
+    out.append('\n};\n')
+
+    return ''.join(out)
+
   def Generate(self):
     """Returns the generated the C include statements for the statemachine."""
 
@@ -312,7 +392,8 @@ class FSMGenerateC(FSMGenerateAbstract):
                      self._CreateStatesEnum(),
                      self._CreateStatesExternal(),
                      self._CreateStatesInternalNames(),
-                     self._CreateTransitionTable())))
+                     self._CreateTransitionTable(),
+                     self._CreateCompactTransitionTable())))
 
 
 def main():
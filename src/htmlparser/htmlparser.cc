@@ -707,8 +707,8 @@ static statemachine_definition *create_statemachine_definition()
   if (def == NULL)
     return NULL;
 
-  statemachine_definition_populate(def, htmlparser_state_transitions,
-                                   htmlparser_states_internal_names);
+  statemachine_definition_populate_compact(def, &htmlparser_compact_table,
+                                           htmlparser_states_internal_names);
 
   statemachine_enter_state(def, HTMLPARSER_STATE_INT_TAG_NAME,
                            enter_tag_name);
@@ -548,8 +548,8 @@ static statemachine_definition *create_statemachine_definition()
     return NULL;
 
   /* TODO(falmeida): Check return value. */
-  statemachine_definition_populate(def, jsparser_state_transitions,
-                                   jsparser_states_internal_names);
+  statemachine_definition_populate_compact(def, &jsparser_compact_table,
+                                           jsparser_states_internal_names);
 
   statemachine_in_state(def, JSPARSER_STATE_INT_JS_TEXT,
                         in_state_js_text);
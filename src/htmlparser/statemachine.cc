@@ -63,6 +63,50 @@ void statemachine_definition_populate(statemachine_definition *def,
   assert(transition_table != NULL);
 
   def->transition_table = transition_table;
+  def->compact_table = NULL;
+
+  def->state_names = state_names;
+}
+
+/* Populates the statemachine definition from a compact transition table.
+ *
+ * Besides storing the table, it finds the states that can only be left
+ * through a single input character so statemachine_parse() can look for that
+ * character with memchr().
+ */
+void statemachine_definition_populate_compact(
+    statemachine_definition *def,
+    const statemachine_compact_table *compact_table,
+    const char* const* state_names)
+{
+  int st;
+  int chr;
+
+  assert(def != NULL);
+  assert(compact_table != NULL);
+  assert(compact_table->num_states <= def->num_states);
+
+  def->transition_table = NULL;
+  def->compact_table = compact_table;
+
+  for (st = 0; st < def->num_states; st++) {
+    const unsigned char *row;
+    int exits = 0;
+
+    def->single_exit_char[st] = -1;
+    if (st >= compact_table->num_states)
+      continue;
+
+    row = compact_table->transitions + st * compact_table->num_classes;
+    for (chr = 0; chr < MAX_CHAR_8BIT && exits < 2; chr++) {
+      if (row[compact_table->char_classes[chr]] != st) {
+        def->single_exit_char[st] = chr;
+        exits++;
+      }
+    }
+    if (exits != 1)
+      def->single_exit_char[st] = -1;
+  }
 
   def->state_names = state_names;
 }
@@ -144,7 +188,13 @@ statemachine_definition *statemachine_definition_new(int states)
     if (def->exit_state_events == NULL)
       return NULL;
 
+    def->single_exit_char = CAST(int *, calloc(states, sizeof(int)));
+    if (def->single_exit_char == NULL)
+      return NULL;
+
     def->num_states = states;
+    def->transition_table = NULL;
+    def->compact_table = NULL;
     def->state_names = NULL;
     return def;
 }
@@ -157,6 +207,7 @@ void statemachine_definition_delete(statemachine_definition *def)
     free(def->in_state_events);
     free(def->enter_state_events);
     free(def->exit_state_events);
+    free(def->single_exit_char);
     free(def);
 }
 
@@ -374,6 +425,70 @@ static void statemachine_set_transition_error_message(statemachine_ctx *ctx)
 
 }
 
+/* Consumes the longest prefix of str that keeps the statemachine in its
+ * current state, and returns its length.
+ *
+ * Must only be called for states without an in_state event and with a
+ * compact transition table. No event would fire for any of the skipped
+ * characters, so only the recording buffer and the line and column numbers
+ * need to be updated.
+ */
+static int statemachine_skip_run(statemachine_ctx *ctx, const char *str,
+                                 int size)
+{
+    const statemachine_definition *def = ctx->definition;
+    const statemachine_compact_table *table = def->compact_table;
+    const int state = ctx->current_state;
+    const char *end;
+    const char *line_start;
+    const char *newline;
+    int run;
+
+    if (def->single_exit_char[state] >= 0) {
+        end = CAST(const char *, memchr(str, def->single_exit_char[state],
+                                        size));
+        run = end ? CAST(int, end - str) : size;
+    } else {
+        const unsigned char *row = table->transitions +
+                                   state * table->num_classes;
+        run = 0;
+        while (run < size &&
+               row[table->char_classes[CAST(unsigned char, str[run])]] ==
+               state)
+            run++;
+    }
+
+    if (run == 0)
+        return 0;
+
+    if (ctx->recording &&
+        STATEMACHINE_RECORD_BUFFER_SIZE - 1 > ctx->record_pos) {
+        size_t len = STATEMACHINE_RECORD_BUFFER_SIZE - 1 - ctx->record_pos;
+        if (len > CAST(size_t, run))
+            len = run;
+        memcpy(ctx->record_buffer + ctx->record_pos, str, len);
+        ctx->record_pos += len;
+        ctx->record_buffer[ctx->record_pos] = '\0';
+    }
+
+    line_start = NULL;
+    end = str + run;
+    newline = str;
+    while ((newline = CAST(const char *,
+                           memchr(newline, '\n', end - newline))) != NULL) {
+        ctx->line_number++;
+        line_start = ++newline;
+    }
+    if (line_start)
+        ctx->column_number = CAST(int, end - line_start) + 1;
+    else
+        ctx->column_number += run;
+
+    ctx->current_char = str[run - 1];
+    ctx->next_state = state;
+    return run;
+}
+
 /* Parses the input html stream and returns the finishing state.
  *
  * Returns STATEMACHINE_ERROR if unable to parse the input. If
@@ -384,12 +499,14 @@ static void statemachine_set_transition_error_message(statemachine_ctx *ctx)
 int statemachine_parse(statemachine_ctx *ctx, const char *str, int size)
 {
     int i;
-    const int* const* state_table = ctx->definition->transition_table;
+    const int* const* state_table;
+    const statemachine_compact_table *compact_table;
     statemachine_definition *def;
 
     assert(ctx !=NULL &&
            ctx->definition != NULL &&
-           ctx->definition->transition_table != NULL);
+           (ctx->definition->transition_table != NULL ||
+            ctx->definition->compact_table != NULL));
 
     if (size < 0) {
         snprintf(ctx->error_msg, STATEMACHINE_MAX_STR_ERROR, "%s",
@@ -398,11 +515,28 @@ int statemachine_parse(statemachine_ctx *ctx, const char *str, int size)
     }
 
     def = ctx->definition;
+    state_table = def->transition_table;
+    compact_table = def->compact_table;
 
     for (i = 0; i < size; i++) {
+        if (compact_table != NULL &&
+            def->in_state_events[ctx->current_state] == NULL) {
+            int run = statemachine_skip_run(ctx, str, size - i);
+            i += run;
+            str += run;
+            if (i == size)
+                break;
+        }
+
         ctx->current_char = *str;
-        ctx->next_state =
-            state_table[ctx->current_state][CAST(unsigned char, *str)];
+        if (compact_table != NULL) {
+            ctx->next_state = compact_table->transitions[
+                ctx->current_state * compact_table->num_classes +
+                compact_table->char_classes[CAST(unsigned char, *str)]];
+        } else {
+            ctx->next_state =
+                state_table[ctx->current_state][CAST(unsigned char, *str)];
+        }
         if (ctx->next_state == STATEMACHINE_ERROR) {
             statemachine_set_transition_error_message(ctx);
             return STATEMACHINE_ERROR;
@@ -52,6 +52,20 @@ enum {
 
 struct statemachine_ctx_s;
 
+/* Compact transition table, as generated by generate_fsm.py.
+ *
+ * Input characters are first mapped to an equivalence class, and the
+ * destination state is looked up by source state and class:
+ *
+ * transitions[source * num_classes + char_classes[input]] == destination.
+ */
+typedef struct statemachine_compact_table_s {
+    int num_states;
+    int num_classes;
+    const unsigned char *char_classes;
+    const unsigned char *transitions;
+} statemachine_compact_table;
+
 typedef void(*state_event_function)(struct statemachine_ctx_s *, int, char,
                                     int);
 
@@ -59,6 +73,16 @@ typedef struct statemachine_definition_s {
     int num_states;
     const int* const* transition_table;
 
+    /* Set instead of transition_table by
+     * statemachine_definition_populate_compact().
+     */
+    const statemachine_compact_table *compact_table;
+
+    /* For every state, the only input character that leaves it, or -1 if there
+     * are several. Only valid when compact_table is set.
+     */
+    int *single_exit_char;
+
     /* Array containing the name of the states as a C string.
      * This field is optional and if not in use it should be set to NULL.
      */
@@ -113,6 +137,18 @@ void statemachine_definition_populate(statemachine_definition *def,
                                      const int* const* transition_table,
                                      const char* const* state_names);
 
+/* Populates the statemachine definition from a compact transition table.
+ *
+ * Behaves like statemachine_definition_populate() but uses the much smaller
+ * tables from statemachine_compact_table. It also lets statemachine_parse()
+ * skip over runs of input that stay in a state without an in_state event,
+ * which is where most of the time goes for typical html text.
+ */
+void statemachine_definition_populate_compact(
+    statemachine_definition *def,
+    const statemachine_compact_table *compact_table,
+    const char* const* state_names);
+
 void statemachine_in_state(statemachine_definition *def, int st,
                            state_event_function func);
 void statemachine_enter_state(statemachine_definition *def, int st,
@@ -0,0 +1,221 @@
+// Copyright (c) 2026, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+//
+// A utility for packing templates into a TemplateArchive, which a
+// TemplateCache can then load them from (see template_source.h).
+//
+// For example:
+//
+// > <path_to>/make_tpl_archive -t /srv/templates -o templates.tplar .
+//
+// packs every file under /srv/templates into templates.tplar.  Names
+// in the archive are relative to the -t directory, so to use it:
+//    cache->SetTemplateRootDirectory("/srv/templates");
+//    archive = TemplateArchive::Open("templates.tplar", "/srv/templates");
+//    cache->SetTemplateSource(archive);
+// Arguments that are directories are packed recursively.  Each
+// template keeps the mtime of the file it came from, and the archive
+// records when it was packed, as its version.
+//
+// Exit code is the number of files we were unable to pack.  Nothing
+// is written if that's not 0.
+
+// This is for windows.  Even though we #include config.h, just like
+// the files used to compile the dll, we are actually a *client* of
+// the dll, so we don't get to decl anything.
+#include <config.h>
+#undef CTEMPLATE_DLL_DECL
+#include <errno.h>
+#ifdef HAVE_GETOPT_H
+# include <getopt.h>
+#endif
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#include <string>
+#include <vector>
+
+#include <ctemplate/template_pathops.h>
+#include <ctemplate/template_source.h>
+#include "base/fileutil.h"
+using std::string;
+using std::vector;
+using ctemplate::File;
+using ctemplate::FileStat;
+using ctemplate::TemplateArchive;
+
+enum {LOG_INFO, LOG_WARNING, LOG_ERROR, LOG_FATAL};
+
+static void LogPrintf(int severity, int should_log_info, const char* pat, ...) {
+  if (severity == LOG_INFO && !should_log_info)
+    return;
+  if (severity == LOG_FATAL)
+    fprintf(stderr, "FATAL ERROR: ");
+  va_list ap;
+  va_start(ap, pat);
+  vfprintf(stderr, pat, ap);
+  va_end(ap);
+  fprintf(stderr, "\n");
+  if (severity == LOG_FATAL)
+    exit(1);
+}
+
+// prints to outfile -- usually stdout or stderr
+static void Usage(const char* argv0, FILE* outfile) {
+  fprintf(outfile, "USAGE: %s [-t<dir>] -o<archive> [-q]"
+          " <template_filename_or_dir> ...\n", argv0);
+  fprintf(outfile,
+          "       -t<dir> --template_dir=<dir>  Root directory of templates\n"
+          "       -o<archive> --outputfile=<archive>\n"
+          "                                     The archive to write\n"
+          "       -q --nolog_info               Only log on error\n"
+          "       -h --help                     This help\n"
+          "       -V --version                  Version information\n");
+  fprintf(outfile, "\n"
+          "This program packs templates into one archive file, which a\n"
+          "TemplateCache can load them from faster than from the\n"
+          "filesystem.  Directories are packed recursively.\n");
+}
+
+static void Version(FILE* outfile) {
+  fprintf(outfile,
+          "make_tpl_archive "
+          " (part of " PACKAGE_STRING ")"
+          "\n\n"
+          "Copyright 2026 Google Inc.\n"
+          "\n"
+          "This is BSD licensed software; see the source for copying conditions\n"
+          "and license information.\n"
+          "There is NO warranty; not even for MERCHANTABILITY or FITNESS FOR A\n"
+          "PARTICULAR PURPOSE.\n"
+          );
+}
+
+// Adds the file named name (relative to template_dir, unless it's
+// absolute) to entries -- or, if it's a directory, everything under
+// it.  Returns the number of files we couldn't add.
+static int AddToArchive(const string& template_dir, const string& name,
+                        bool log_info, vector<TemplateArchive::Entry>* entries) {
+  vector<string> names, errors;
+  File::FindFiles(template_dir, name, &names, &errors);
+  for (vector<string>::const_iterator it = errors.begin();
+       it != errors.end(); ++it)
+    LogPrintf(LOG_ERROR, log_info, "%s", it->c_str());
+  int num_errors = static_cast<int>(errors.size());
+  for (vector<string>::const_iterator it = names.begin();
+       it != names.end(); ++it) {
+    const string filename = ctemplate::PathJoin(template_dir, *it);
+    TemplateArchive::Entry entry;
+    entry.name = *it;
+    FileStat statbuf;
+    if (!File::Stat(filename, &statbuf) ||
+        !File::ReadFileToString(filename, &entry.contents)) {
+      LogPrintf(LOG_ERROR, log_info, "Can't read %s: %s",
+                filename.c_str(), strerror(errno));
+      ++num_errors;
+      continue;
+    }
+    entry.mtime = statbuf.mtime;
+    LogPrintf(LOG_INFO, log_info, "Adding %s", it->c_str());
+    entries->push_back(entry);
+  }
+  return num_errors;
+}
+
+int main(int argc, char **argv) {
+  string FLAG_template_dir(ctemplate::kCWD);   // "./"
+  string FLAG_outputfile("");
+  bool FLAG_log_info = true;
+
+#if defined(HAVE_GETOPT_LONG)
+  static struct option longopts[] = {
+    {"help", 0, NULL, 'h'},
+    {"version", 0, NULL, 'V'},
+    {"template_dir", 1, NULL, 't'},
+    {"outputfile", 1, NULL, 'o'},
+    {"nolog_info", 0, NULL, 'q'},
+    {0, 0, 0, 0}
+  };
+  int option_index;
+# define GETOPT(argc, argv)  getopt_long(argc, argv, "t:o:qhV", \
+                                         longopts, &option_index)
+#elif defined(HAVE_GETOPT_H)
+# define GETOPT(argc, argv)  getopt(argc, argv, "t:o:qhV")
+#else    // TODO(csilvers): implement something reasonable for windows
+# define GETOPT(argc, argv)  -1
+  int optind = 1;    // first non-opt argument
+  const char* optarg = "";   // not used
+#endif
+
+  int r = 0;
+  while (r != -1) {   // getopt()/getopt_long() return -1 upon no-more-input
+    r = GETOPT(argc, argv);
+    switch (r) {
+      case 't': FLAG_template_dir.assign(optarg); break;
+      case 'o': FLAG_outputfile.assign(optarg); break;
+      case 'q': FLAG_log_info = false; break;
+      case 'V': Version(stdout); return 0; break;
+      case 'h': Usage(argv[0], stderr); return 0; break;
+      case -1: break;   // means 'no more input'
+      default: Usage(argv[0], stderr); return 1; break;
+    }
+  }
+
+  if (FLAG_outputfile.empty()) {
+    LogPrintf(LOG_FATAL, FLAG_log_info, "Must specify an archive with -o.");
+  }
+  if (optind >= argc) {
+    LogPrintf(LOG_FATAL, FLAG_log_info,
+              "Must specify at least one template file on the command line.");
+  }
+
+  vector<TemplateArchive::Entry> entries;
+  int num_errors = 0;
+  for (int i = optind; i < argc; ++i)
+    num_errors += AddToArchive(FLAG_template_dir, argv[i], FLAG_log_info,
+                               &entries);
+  if (num_errors > 0) {
+    LogPrintf(LOG_ERROR, FLAG_log_info, "Not writing %s",
+              FLAG_outputfile.c_str());
+    return num_errors;
+  }
+  if (!TemplateArchive::Write(FLAG_outputfile, entries, time(NULL)))
+    return 1;
+  LogPrintf(LOG_INFO, FLAG_log_info, "Wrote %d templates to %s",
+            static_cast<int>(entries.size()), FLAG_outputfile.c_str());
+  return 0;
+}
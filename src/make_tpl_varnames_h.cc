@@ -43,6 +43,17 @@
 //
 // Exit code is the number of templates we were unable to parse.
 //
+// With -j<n>, the templates are loaded and parsed by n threads.
+//
+// With -m<manifest>, runs are incremental: the manifest records a hash
+// of each template that was processed successfully, and a later run
+// with the same options skips any template whose hash still matches
+// (as long as its output file is still there).  With --outputfile, all
+// the templates are processed again if any one of them changed.  In
+// this mode an output file is only rewritten when its contents change,
+// so its mtime doesn't trigger recompiles of everything that includes
+// it.
+//
 // Headers can be all written to one output file (via --outputfile)
 // or written to one output file per template processed (via --header_dir).
 // As such, we have a first stage where we load each template and generate
@@ -61,6 +72,9 @@
 #ifdef HAVE_GETOPT_H
 # include <getopt.h>
 #endif
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -68,15 +82,21 @@
 #ifdef HAVE_UNISTD_H
 # include <unistd.h>
 #endif
+#include <map>
 #include <string>
 #include <set>
 #include <vector>
 
 #include <ctemplate/template_pathops.h>
 #include <ctemplate/template.h>
+#include <ctemplate/template_emitter.h>
+#include "base/fileutil.h"
+using std::map;
 using std::set;
 using std::string;
 using std::vector;
+using ctemplate::File;
+using ctemplate::HashingEmitter;
 using ctemplate::Template;
 
 enum {LOG_INFO, LOG_WARNING, LOG_ERROR, LOG_FATAL};
@@ -85,10 +105,14 @@ enum {LOG_INFO, LOG_WARNING, LOG_ERROR, LOG_FATAL};
 struct TemplateRecord {
   const string name;       // filename given on cmd-line (may be relative
   bool error;              // true iff an error occurred during template loading
+  bool unchanged;          // true iff the manifest says we can skip it
+  string hash;             // of the template's contents, for the manifest
   string header_entries;   // output of tpl->WriteHeaderEntries()
+  string log;              // messages from loading it, printed in order
+  string dump;             // output of tpl->DumpToString(), for -d
 
   explicit TemplateRecord(const string& aname)
-      : name(aname), error(false) {
+      : name(aname), error(false), unchanged(false) {
   }
 };
 
@@ -106,10 +130,26 @@ static void LogPrintf(int severity, int should_log_info, const char* pat, ...) {
     exit(1);
 }
 
+// Like LogPrintf, but appends the message to a template's log instead,
+// since templates may be loaded by several threads at once.
+static void RecordPrintf(TemplateRecord* rec, int severity, int should_log_info,
+                         const char* pat, ...) {
+  if (severity == LOG_INFO && !should_log_info)
+    return;
+  char buf[1024];
+  va_list ap;
+  va_start(ap, pat);
+  vsnprintf(buf, sizeof(buf), pat, ap);
+  va_end(ap);
+  rec->log.append(buf);
+  rec->log.append("\n");
+}
+
 // prints to outfile -- usually stdout or stderr
 static void Usage(const char* argv0, FILE* outfile) {
   fprintf(outfile, "USAGE: %s [-t<dir>] [-o<dir>] [-s<suffix>] [-f<filename>]"
-          " [-n] [-d] [-q] <template_filename> ...\n", argv0);
+          " [-j<n>] [-m<manifest>] [-n] [-d] [-q] <template_filename> ...\n",
+          argv0);
   fprintf(outfile,
           "       -t<dir> --template_dir=<dir>  Root directory of templates\n"
           "       -o<dir> --header_dir=<dir>    Where to place output files\n"
@@ -118,6 +158,12 @@ static void Usage(const char* argv0, FILE* outfile) {
           "       -f<filename> --outputfile=<filename>\n"
           "                                     outname = filename (when given, \n"
           "                                     --header_dir is ignored)\n"
+          "       -j<n> --threads=<n>           Load templates in n threads\n"
+          "       -m<filename> --manifest=<filename>\n"
+          "                                     Skip templates that haven't\n"
+          "                                     changed since the manifest was\n"
+          "                                     written, and leave unchanged\n"
+          "                                     output files alone\n"
           "       -n --noheader                 Just check syntax, no output\n"
           "       -d --dump_templates           Cause templates dump contents\n"
           "       -q --nolog_info               Only log on error\n"
@@ -280,10 +326,117 @@ static string TextWithDuplicateLinesRemoved(const string& header_entries) {
   return output;
 }
 
-// Writes the given text to the filename header_file.
+// Returns true iff output_file already exists.
+// Returns the HashingEmitter::Digest() of contents, in hex.
+static string DigestHex(const string& contents) {
+  char buf[17];
+  snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(
+      HashingEmitter::Digest(contents.data(), contents.size())));
+  return buf;
+}
+
+static bool FileExists(const string& output_file) {
+  FILE* f = fopen(output_file.c_str(), "rb");
+  if (!f)
+    return false;
+  fclose(f);
+  return true;
+}
+
+// Reads the template hashes in the manifest into hashes.  The first
+// line of a manifest describes the options that produced it; if they
+// differ from options, or the manifest doesn't exist yet, hashes is
+// left empty, so every template is processed.  The other lines are
+// "<hash> <template name>".
+static void ReadManifest(const string& manifest, const string& options,
+                         map<string, string>* hashes) {
+  string contents;
+  if (!File::ReadFileToString(manifest, &contents))
+    return;
+  const vector<string> lines = SplitIntoLines(contents);
+  if (lines.empty() || lines[0] != options)
+    return;
+  for (vector<string>::size_type i = 1; i < lines.size(); ++i) {
+    const string::size_type space = lines[i].find(' ');
+    if (space != string::npos)
+      (*hashes)[lines[i].substr(space + 1)] = lines[i].substr(0, space);
+  }
+}
+
+// Loads and parses one template, and (unless -n is given) writes its
+// header entries into the record.
+static void LoadTemplate(TemplateRecord* rec, bool header, bool dump_templates,
+                         bool log_info) {
+  const char* tplname = rec->name.c_str();
+  RecordPrintf(rec, LOG_INFO, log_info, "\n------ Checking %s ------", tplname);
+
+  // The last two arguments in the following call do not matter
+  // since they control how the template gets expanded and we never
+  // expand the template after loading it here
+  Template * tpl = Template::GetTemplate(tplname, ctemplate::DO_NOT_STRIP);
+
+  // The call to GetTemplate (above) loads the template from disk
+  // and attempts to parse it. If it cannot find the file or if it
+  // detects any template syntax errors, the parsing routines
+  // report the error and GetTemplate returns NULL. Syntax errors
+  // include such things as mismatched double-curly-bracket pairs,
+  // e.g. '{{VAR}', Invalid characters in template variables or
+  // section names, e.g.  '{{BAD_VAR?}}' [the question mark is
+  // illegal], improperly nested section/end section markers,
+  // e.g. a section close marker with no section start marker or a
+  // section start of a different name.
+  // If that happens, since the parsing errors have already been reported
+  // we just continue on to the next one.
+  if (!tpl) {
+    RecordPrintf(rec, LOG_ERROR, log_info, "Could not load file: %s", tplname);
+    rec->error = true;
+    return;
+  }
+  RecordPrintf(rec, LOG_INFO, log_info, "No syntax errors detected in %s",
+               tplname);
+  if (dump_templates)
+    tpl->DumpToString(tpl->template_file(), &rec->dump);
+
+  // The rest creates the header file
+  if (!header)
+    return;            // They don't want header files
+
+  tpl->WriteHeaderEntries(&rec->header_entries);
+}
+
+// The templates one thread loads: every stride'th one, from first.
+struct LoadWork {
+  vector<TemplateRecord*>* records;
+  size_t first;
+  size_t stride;
+  bool header;
+  bool dump_templates;
+  bool log_info;
+};
+
+static void* LoadTemplates(void* arg) {
+  LoadWork* work = static_cast<LoadWork*>(arg);
+  for (size_t i = work->first; i < work->records->size(); i += work->stride) {
+    TemplateRecord* rec = (*work->records)[i];
+    if (!rec->unchanged)
+      LoadTemplate(rec, work->header, work->dump_templates, work->log_info);
+  }
+  return NULL;
+}
+
+// Writes the given text to the filename header_file, unless
+// keep_unchanged is true and the file already holds exactly that text.
 // Returns true if it succeeded, false otherwise.
 static bool WriteToDisk(bool log_info, const string& output_file,
-                        const string& text) {
+                        const string& text, bool keep_unchanged) {
+  if (keep_unchanged) {
+    string old_text;
+    if (File::ReadFileToString(output_file, &old_text) && old_text == text) {
+      LogPrintf(LOG_INFO, log_info, "Leaving %s unchanged",
+                output_file.c_str());
+      return true;
+    }
+  }
   FILE* outfile = fopen(output_file.c_str(), "wb");
   if (!outfile) {
     LogPrintf(LOG_ERROR, log_info, "Can't open %s", output_file.c_str());
@@ -307,6 +460,8 @@ int main(int argc, char **argv) {
   bool FLAG_header = true;
   bool FLAG_dump_templates = false;
   bool FLAG_log_info = true;
+  int FLAG_threads = 1;
+  string FLAG_manifest("");
 
 #if defined(HAVE_GETOPT_LONG)
   static struct option longopts[] = {
@@ -316,6 +471,8 @@ int main(int argc, char **argv) {
     {"header_dir", 1, NULL, 'o'},
     {"outputfile_suffix", 1, NULL, 's'},
     {"outputfile", 1, NULL, 'f'},
+    {"threads", 1, NULL, 'j'},
+    {"manifest", 1, NULL, 'm'},
     {"noheader", 0, NULL, 'n'},
     {"dump_templates", 0, NULL, 'd'},
     {"nolog_info", 0, NULL, 'q'},
@@ -323,10 +480,10 @@ int main(int argc, char **argv) {
     {0, 0, 0, 0}
   };
   int option_index;
-# define GETOPT(argc, argv)  getopt_long(argc, argv, "t:o:s:f:ndqhV", \
+# define GETOPT(argc, argv)  getopt_long(argc, argv, "t:o:s:f:j:m:ndqhV", \
                                          longopts, &option_index)
 #elif defined(HAVE_GETOPT_H)
-# define GETOPT(argc, argv)  getopt(argc, argv, "t:o:s:f:ndqhV")
+# define GETOPT(argc, argv)  getopt(argc, argv, "t:o:s:f:j:m:ndqhV")
 #else    // TODO(csilvers): implement something reasonable for windows
 # define GETOPT(argc, argv)  -1
   int optind = 1;    // first non-opt argument
@@ -341,6 +498,8 @@ int main(int argc, char **argv) {
       case 'o': FLAG_header_dir.assign(optarg); break;
       case 's': FLAG_outputfile_suffix.assign(optarg); break;
       case 'f': FLAG_outputfile.assign(optarg); break;
+      case 'j': FLAG_threads = atoi(optarg); break;
+      case 'm': FLAG_manifest.assign(optarg); break;
       case 'n': FLAG_header = false; break;
       case 'd': FLAG_dump_templates = true; break;
       case 'q': FLAG_log_info = false; break;
@@ -355,6 +514,16 @@ int main(int argc, char **argv) {
     LogPrintf(LOG_FATAL, FLAG_log_info,
               "Must specify at least one template file on the command line.");
   }
+  if (FLAG_threads < 1) {
+    LogPrintf(LOG_FATAL, FLAG_log_info, "Bad value for -j.");
+  }
+#ifndef HAVE_PTHREAD
+  if (FLAG_threads > 1) {
+    LogPrintf(LOG_WARNING, FLAG_log_info,
+              "Built without threads; loading templates with just one.");
+    FLAG_threads = 1;
+  }
+#endif
 
   Template::SetTemplateRootDirectory(FLAG_template_dir);
 
@@ -367,48 +536,89 @@ int main(int argc, char **argv) {
     template_records.push_back(template_rec);
   }
 
-  // Iterate through each template and (unless -n is given), write
-  // its header entries into the headers array.
-  int num_errors = 0;
-  for (vector<TemplateRecord*>::iterator it = template_records.begin();
-       it != template_records.end(); ++it) {
-    const char* tplname = (*it)->name.c_str();
-    LogPrintf(LOG_INFO, FLAG_log_info, "\n------ Checking %s ------", tplname);
-
-    // The last two arguments in the following call do not matter
-    // since they control how the template gets expanded and we never
-    // expand the template after loading it here
-    Template * tpl = Template::GetTemplate(tplname, ctemplate::DO_NOT_STRIP);
-
-    // The call to GetTemplate (above) loads the template from disk
-    // and attempts to parse it. If it cannot find the file or if it
-    // detects any template syntax errors, the parsing routines
-    // report the error and GetTemplate returns NULL. Syntax errors
-    // include such things as mismatched double-curly-bracket pairs,
-    // e.g. '{{VAR}', Invalid characters in template variables or
-    // section names, e.g.  '{{BAD_VAR?}}' [the question mark is
-    // illegal], improperly nested section/end section markers,
-    // e.g. a section close marker with no section start marker or a
-    // section start of a different name.
-    // If that happens, since the parsing errors have already been reported
-    // we just continue on to the next one.
-    if (!tpl) {
-      LogPrintf(LOG_ERROR, FLAG_log_info, "Could not load file: %s", tplname);
-      num_errors++;
-      (*it)->error = true;
-      continue;
-    } else {
-      LogPrintf(LOG_INFO, FLAG_log_info, "No syntax errors detected in %s",
-                tplname);
-      if (FLAG_dump_templates)
-        tpl->Dump(tpl->template_file());
+  // With a manifest, find the templates that haven't changed since it
+  // was written.  Its first line holds everything besides a template's
+  // contents that goes into its output, so a manifest written with
+  // different options doesn't match.
+  const string progname = argv[0];
+  const bool incremental = !FLAG_manifest.empty();
+  const string manifest_options =
+      "# make_tpl_varnames_h manifest: " + progname +
+      " -t" + FLAG_template_dir + " -o" + FLAG_header_dir +
+      " -s" + FLAG_outputfile_suffix + " -f" + FLAG_outputfile +
+      (FLAG_header ? "" : " -n");
+  if (incremental) {
+    map<string, string> old_hashes;
+    ReadManifest(FLAG_manifest, manifest_options, &old_hashes);
+    bool all_unchanged = true;
+    for (vector<TemplateRecord*>::iterator it = template_records.begin();
+         it != template_records.end(); ++it) {
+      string contents;
+      if (!File::ReadFileToString(Template::FindTemplateFilename((*it)->name),
+                                  &contents)) {
+        all_unchanged = false;     // let LoadTemplate() report it
+        continue;
+      }
+      (*it)->hash = DigestHex(contents);
+      map<string, string>::const_iterator old = old_hashes.find((*it)->name);
+      (*it)->unchanged = (!FLAG_dump_templates && old != old_hashes.end() &&
+                          old->second == (*it)->hash);
+      if (FLAG_header && FLAG_outputfile.empty() && (*it)->unchanged) {
+        const string output_file = ctemplate::PathJoin(
+            FLAG_header_dir, ctemplate::Basename((*it)->name) +
+            FLAG_outputfile_suffix);
+        (*it)->unchanged = FileExists(output_file);
+      }
+      all_unchanged = all_unchanged && (*it)->unchanged;
+    }
+    // One output file for all the templates needs all their entries.
+    if (FLAG_header && !FLAG_outputfile.empty() &&
+        !(all_unchanged && FileExists(FLAG_outputfile))) {
+      for (vector<TemplateRecord*>::iterator it = template_records.begin();
+           it != template_records.end(); ++it) {
+        (*it)->unchanged = false;
+      }
     }
+  }
 
-    // The rest of the loop creates the header file
-    if (!FLAG_header)
-      continue;            // They don't want header files
+  // Load each template and (unless -n is given), write its header
+  // entries into its record.
+  vector<LoadWork> work(FLAG_threads);
+  for (int t = 0; t < FLAG_threads; ++t) {
+    work[t].records = &template_records;
+    work[t].first = t;
+    work[t].stride = FLAG_threads;
+    work[t].header = FLAG_header;
+    work[t].dump_templates = FLAG_dump_templates;
+    work[t].log_info = FLAG_log_info;
+  }
+#ifdef HAVE_PTHREAD
+  vector<pthread_t> threads(FLAG_threads);
+  for (int t = 1; t < FLAG_threads; ++t)
+    pthread_create(&threads[t], NULL, LoadTemplates, &work[t]);
+  LoadTemplates(&work[0]);
+  for (int t = 1; t < FLAG_threads; ++t)
+    pthread_join(threads[t], NULL);
+#else
+  LoadTemplates(&work[0]);
+#endif
 
-    tpl->WriteHeaderEntries(&((*it)->header_entries));
+  int num_errors = 0;
+  int num_unchanged = 0;
+  for (vector<TemplateRecord*>::const_iterator it = template_records.begin();
+       it != template_records.end(); ++it) {
+    fputs((*it)->log.c_str(), stderr);
+    fwrite((*it)->dump.data(), 1, (*it)->dump.length(), stdout);
+    if ((*it)->error)
+      num_errors++;
+    if ((*it)->unchanged)
+      num_unchanged++;
+  }
+  fflush(stdout);
+  if (incremental) {
+    LogPrintf(LOG_INFO, FLAG_log_info,
+              "Skipped %d unchanged templates out of %d", num_unchanged,
+              static_cast<int>(template_records.size()));
   }
 
   // We have headers to emit:
@@ -418,8 +628,6 @@ int main(int argc, char **argv) {
   // . Otherwise, we write one output file per template we processed.
   // . In both cases, we add proper boilerplate first.
   if (FLAG_header) {
-    string progname = argv[0];
-
     if (!FLAG_outputfile.empty()) {  // All header entries written to one file.
       // If any template had an error, we do not produce an output file.
       if (num_errors == 0) {
@@ -434,14 +642,23 @@ int main(int argc, char **argv) {
         const string cleantext =
             TextWithDuplicateLinesRemoved(all_header_entries);
         output.append(WrapWithGuard(FLAG_outputfile, cleantext));
-        if (!WriteToDisk(FLAG_log_info, FLAG_outputfile, output))
+        if (num_unchanged == static_cast<int>(template_records.size())) {
+          // Nothing changed, so there is nothing to write.
+        } else if (!WriteToDisk(FLAG_log_info, FLAG_outputfile, output,
+                                incremental)) {
+          for (vector<TemplateRecord*>::const_iterator
+               it = template_records.begin(); it != template_records.end();
+               ++it) {
+            (*it)->error = true;     // so the manifest doesn't skip them
+          }
           num_errors++;
+        }
       }
     } else {
       // Each template will have its own output file. Skip any that had errors.
       for (vector<TemplateRecord*>::const_iterator
            it = template_records.begin(); it != template_records.end(); ++it) {
-        if ((*it)->error)
+        if ((*it)->error || (*it)->unchanged)
           continue;
         string basename = ctemplate::Basename((*it)->name);
         string output_file =
@@ -451,12 +668,27 @@ int main(int argc, char **argv) {
         template_filenames.push_back((*it)->name);
         string output = Boilerplate(progname, template_filenames);
         output.append(WrapWithGuard(output_file, (*it)->header_entries));
-        if (!WriteToDisk(FLAG_log_info, output_file, output))
+        if (!WriteToDisk(FLAG_log_info, output_file, output, incremental)) {
+          (*it)->error = true;     // so the manifest doesn't skip it
           num_errors++;
+        }
       }
     }
   }
 
+  // Record the templates that were processed successfully, so the next
+  // run can skip them if they don't change.
+  if (incremental) {
+    string manifest = manifest_options + "\n";
+    for (vector<TemplateRecord*>::const_iterator it = template_records.begin();
+         it != template_records.end(); ++it) {
+      if (!(*it)->error && !(*it)->hash.empty())
+        manifest.append((*it)->hash + " " + (*it)->name + "\n");
+    }
+    if (!WriteToDisk(FLAG_log_info, FLAG_manifest, manifest, true))
+      num_errors++;
+  }
+
   // Free dynamic memory
   for (vector<TemplateRecord*>::iterator it = template_records.begin();
        it != template_records.end(); ++it) {
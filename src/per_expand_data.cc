@@ -73,4 +73,23 @@ const void* PerExpandData::LookupForModifiers(const char* key) const {
   return map_ ? find_ptr2(*map_, key) : NULL;
 }
 
+const size_t PerExpandData::kDeadlineCheckInterval;
+
+// We check the clock on the first iteration, so an expand that
+// starts after its deadline does no work at all, and then every
+// kDeadlineCheckInterval iterations after that.
+bool PerExpandData::CountLimitedIteration() {
+  ++num_iterations_;
+  if (max_iterations_ != 0 && num_iterations_ > max_iterations_) {
+    Abort(EXPAND_ITERATION_LIMIT_EXCEEDED);
+    return false;
+  }
+  if (has_deadline_ && num_iterations_ % kDeadlineCheckInterval == 1 &&
+      std::chrono::steady_clock::now() >= deadline_) {
+    Abort(EXPAND_DEADLINE_EXCEEDED);
+    return false;
+  }
+  return true;
+}
+
 }
@@ -0,0 +1,336 @@
+// Copyright (c) 2026, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+//
+// A utility for replaying expansions recorded by a TemplateCapture
+// (see template_capture.h), to benchmark or regression-test the
+// template system on real-world dictionaries.
+//
+// For example:
+//
+// > <path_to>/replay_tpl_capture -t /srv/templates -j 4 -n 10 capture.tplcap
+//
+// loads the templates the capture uses from /srv/templates, expands
+// each captured request once and checks that its output is the same
+// size and has the same digest as when it was captured, then expands
+// the whole capture 10 more times, spread over 4 threads, and reports
+// the throughput and the distribution of expansion latencies.
+// Captures of expansions that used a template-expansion modifier are
+// replayed, but not checked, since the modifier can't be captured.
+//
+// Exit code is 1 if any output didn't match (or on error), else 0.
+
+// This is for windows.  Even though we #include config.h, just like
+// the files used to compile the dll, we are actually a *client* of
+// the dll, so we don't get to decl anything.
+#include <config.h>
+#undef CTEMPLATE_DLL_DECL
+#ifdef HAVE_GETOPT_H
+# include <getopt.h>
+#endif
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>     // for sort()
+#include <chrono>        // for steady_clock
+#include <string>
+#include <vector>
+
+#include <ctemplate/per_expand_data.h>
+#include <ctemplate/template_cache.h>
+#include <ctemplate/template_capture.h>
+#include <ctemplate/template_dictionary.h>
+#include <ctemplate/template_emitter.h>
+#include <ctemplate/template_pathops.h>
+using std::string;
+using std::vector;
+using ctemplate::CapturedExpand;
+using ctemplate::HashingEmitter;
+using ctemplate::PerExpandData;
+using ctemplate::StringEmitter;
+using ctemplate::TemplateCache;
+using ctemplate::TemplateCaptureReader;
+using ctemplate::TemplateDictionary;
+
+enum {LOG_INFO, LOG_WARNING, LOG_ERROR, LOG_FATAL};
+
+static void LogPrintf(int severity, int should_log_info, const char* pat, ...) {
+  if (severity == LOG_INFO && !should_log_info)
+    return;
+  if (severity == LOG_FATAL)
+    fprintf(stderr, "FATAL ERROR: ");
+  va_list ap;
+  va_start(ap, pat);
+  vfprintf(stderr, pat, ap);
+  va_end(ap);
+  fprintf(stderr, "\n");
+  if (severity == LOG_FATAL)
+    exit(1);
+}
+
+// prints to outfile -- usually stdout or stderr
+static void Usage(const char* argv0, FILE* outfile) {
+  fprintf(outfile, "USAGE: %s [-t<dir>] [-j<threads>] [-n<repeat>] [-q]"
+          " <capture_file>\n", argv0);
+  fprintf(outfile,
+          "       -t<dir> --template_dir=<dir>  Root directory of templates\n"
+          "       -j<n> --threads=<n>           Threads to replay with\n"
+          "                                     (default 1)\n"
+          "       -n<n> --repeat=<n>            Times to replay the capture\n"
+          "                                     for timing (default 1)\n"
+          "       -q --nolog_info               Only log on error\n"
+          "       -h --help                     This help\n"
+          "       -V --version                  Version information\n");
+  fprintf(outfile, "\n"
+          "This program expands the requests in a template capture file\n"
+          "again, checks their output against what was captured, and\n"
+          "reports throughput and latency.\n");
+}
+
+static void Version(FILE* outfile) {
+  fprintf(outfile,
+          "replay_tpl_capture "
+          " (part of " PACKAGE_STRING ")"
+          "\n\n"
+          "Copyright 2026 Google Inc.\n"
+          "\n"
+          "This is BSD licensed software; see the source for copying conditions\n"
+          "and license information.\n"
+          "There is NO warranty; not even for MERCHANTABILITY or FITNESS FOR A\n"
+          "PARTICULAR PURPOSE.\n"
+          );
+}
+
+static bool Expand(TemplateCache* cache, const CapturedExpand& expand,
+                   ctemplate::ExpandEmitter* output) {
+  PerExpandData per_expand_data;
+  expand.SetUpPerExpandData(&per_expand_data);
+  return cache->ExpandWithData(expand.template_name, expand.strip,
+                               expand.dictionary(), &per_expand_data, output);
+}
+
+// One replay thread's share of the work: expands[first],
+// expands[first + stride], ..., repeat times over.
+struct ReplayWork {
+  TemplateCache* cache;
+  const vector<CapturedExpand*>* expands;
+  size_t first;
+  size_t stride;
+  int repeat;
+  vector<double> latencies_usec;   // filled in by Replay()
+  size_t output_bytes;             // ditto
+};
+
+static void* Replay(void* arg) {
+  ReplayWork* work = static_cast<ReplayWork*>(arg);
+  string output;
+  work->output_bytes = 0;
+  for (int r = 0; r < work->repeat; ++r) {
+    for (size_t i = work->first; i < work->expands->size(); i += work->stride) {
+      output.clear();
+      StringEmitter emitter(&output);
+      const std::chrono::steady_clock::time_point start =
+          std::chrono::steady_clock::now();
+      Expand(work->cache, *(*work->expands)[i], &emitter);
+      work->latencies_usec.push_back(
+          std::chrono::duration<double, std::micro>(
+              std::chrono::steady_clock::now() - start).count());
+      work->output_bytes += output.size();
+    }
+  }
+  return NULL;
+}
+
+static double Percentile(const vector<double>& sorted, double fraction) {
+  if (sorted.empty())
+    return 0;
+  return sorted[static_cast<size_t>(fraction * (sorted.size() - 1))];
+}
+
+int main(int argc, char **argv) {
+  string FLAG_template_dir(ctemplate::kCWD);   // "./"
+  int FLAG_threads = 1;
+  int FLAG_repeat = 1;
+  bool FLAG_log_info = true;
+
+#if defined(HAVE_GETOPT_LONG)
+  static struct option longopts[] = {
+    {"help", 0, NULL, 'h'},
+    {"version", 0, NULL, 'V'},
+    {"template_dir", 1, NULL, 't'},
+    {"threads", 1, NULL, 'j'},
+    {"repeat", 1, NULL, 'n'},
+    {"nolog_info", 0, NULL, 'q'},
+    {0, 0, 0, 0}
+  };
+  int option_index;
+# define GETOPT(argc, argv)  getopt_long(argc, argv, "t:j:n:qhV", \
+                                         longopts, &option_index)
+#elif defined(HAVE_GETOPT_H)
+# define GETOPT(argc, argv)  getopt(argc, argv, "t:j:n:qhV")
+#else    // TODO(csilvers): implement something reasonable for windows
+# define GETOPT(argc, argv)  -1
+  int optind = 1;    // first non-opt argument
+  const char* optarg = "";   // not used
+#endif
+
+  int r = 0;
+  while (r != -1) {   // getopt()/getopt_long() return -1 upon no-more-input
+    r = GETOPT(argc, argv);
+    switch (r) {
+      case 't': FLAG_template_dir.assign(optarg); break;
+      case 'j': FLAG_threads = atoi(optarg); break;
+      case 'n': FLAG_repeat = atoi(optarg); break;
+      case 'q': FLAG_log_info = false; break;
+      case 'V': Version(stdout); return 0; break;
+      case 'h': Usage(argv[0], stderr); return 0; break;
+      case -1: break;   // means 'no more input'
+      default: Usage(argv[0], stderr); return 1; break;
+    }
+  }
+
+  if (optind + 1 != argc) {
+    LogPrintf(LOG_FATAL, FLAG_log_info,
+              "Must specify exactly one capture file on the command line.");
+  }
+  if (FLAG_threads < 1 || FLAG_repeat < 0) {
+    LogPrintf(LOG_FATAL, FLAG_log_info, "Bad value for -j or -n.");
+  }
+#ifndef HAVE_PTHREAD
+  if (FLAG_threads > 1) {
+    LogPrintf(LOG_WARNING, FLAG_log_info,
+              "Built without threads; replaying with just one.");
+    FLAG_threads = 1;
+  }
+#endif
+
+  TemplateCaptureReader* reader = TemplateCaptureReader::Open(argv[optind]);
+  if (reader == NULL)
+    return 1;
+  vector<CapturedExpand*> expands;
+  while (true) {
+    expands.push_back(new CapturedExpand);
+    if (!reader->Next(expands.back())) {
+      delete expands.back();
+      expands.pop_back();
+      break;
+    }
+  }
+  if (!reader->error().empty()) {
+    LogPrintf(LOG_FATAL, FLAG_log_info, "%s", reader->error().c_str());
+  }
+  for (size_t i = 0; i < reader->global_values().size(); ++i) {
+    TemplateDictionary::SetGlobalValue(reader->global_values()[i].first,
+                                       reader->global_values()[i].second);
+  }
+  delete reader;
+  LogPrintf(LOG_INFO, FLAG_log_info, "Read %d expansions from %s",
+            static_cast<int>(expands.size()), argv[optind]);
+
+  TemplateCache cache;
+  cache.SetTemplateRootDirectory(FLAG_template_dir);
+
+  // The first pass loads the templates, and checks the output.
+  int num_mismatches = 0, num_unchecked = 0;
+  for (size_t i = 0; i < expands.size(); ++i) {
+    const CapturedExpand& expand = *expands[i];
+    HashingEmitter emitter(NULL);
+    const bool succeeded = Expand(&cache, expand, &emitter);
+    if (expand.had_expansion_modifier) {
+      ++num_unchecked;
+    } else if (succeeded != expand.expand_succeeded ||
+               emitter.size() != expand.output_size ||
+               emitter.digest() != expand.output_digest) {
+      ++num_mismatches;
+      LogPrintf(LOG_WARNING, FLAG_log_info,
+                "Mismatch: expansion #%d, of %s: %s, %d bytes "
+                "(captured: %s, %d bytes)%s",
+                static_cast<int>(i), expand.template_name.c_str(),
+                succeeded ? "succeeded" : "failed",
+                static_cast<int>(emitter.size()),
+                expand.expand_succeeded ? "succeeded" : "failed",
+                static_cast<int>(expand.output_size),
+                emitter.size() == expand.output_size ?
+                    ", but with different contents" : "");
+    }
+  }
+
+  vector<ReplayWork> work(FLAG_threads);
+  for (int t = 0; t < FLAG_threads; ++t) {
+    work[t].cache = &cache;
+    work[t].expands = &expands;
+    work[t].first = t;
+    work[t].stride = FLAG_threads;
+    work[t].repeat = FLAG_repeat;
+  }
+  const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+#ifdef HAVE_PTHREAD
+  vector<pthread_t> threads(FLAG_threads);
+  for (int t = 1; t < FLAG_threads; ++t)
+    pthread_create(&threads[t], NULL, Replay, &work[t]);
+  Replay(&work[0]);
+  for (int t = 1; t < FLAG_threads; ++t)
+    pthread_join(threads[t], NULL);
+#else
+  Replay(&work[0]);
+#endif
+  const double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+
+  vector<double> latencies;
+  double output_bytes = 0;
+  for (int t = 0; t < FLAG_threads; ++t) {
+    latencies.insert(latencies.end(), work[t].latencies_usec.begin(),
+                     work[t].latencies_usec.end());
+    output_bytes += work[t].output_bytes;
+  }
+  std::sort(latencies.begin(), latencies.end());
+
+  printf("expansions:        %d (x%d, on %d threads)\n",
+         static_cast<int>(expands.size()), FLAG_repeat, FLAG_threads);
+  printf("mismatches:        %d (%d not checked)\n",
+         num_mismatches, num_unchecked);
+  if (!latencies.empty() && seconds > 0) {
+    printf("throughput:        %.0f expansions/sec, %.1f MB/sec\n",
+           latencies.size() / seconds, output_bytes / seconds / 1e6);
+    printf("latency (usec):    p50 %.1f, p90 %.1f, p99 %.1f, max %.1f\n",
+           Percentile(latencies, 0.5), Percentile(latencies, 0.9),
+           Percentile(latencies, 0.99), latencies.back());
+  }
+
+  for (size_t i = 0; i < expands.size(); ++i)
+    delete expands[i];
+  return num_mismatches > 0 ? 1 : 0;
+}
@@ -44,10 +44,12 @@
 # include <unistd.h>
 #endif         // for stat() and open() and getcwd()
 #include <algorithm>        // for binary_search()
+#include <atomic>           // for atomic<>
 #include <functional>       // for binary_function()
 #include HASH_MAP_H
 #include <iterator>
 #include <list>
+#include <set>
 #include <string>
 #include <utility>          // for pair
 #include <vector>
@@ -61,9 +63,9 @@
 #include <ctemplate/template_dictionary_interface.h>   // also gets kIndent
 #include <ctemplate/template_modifiers.h>
 #include "template_modifiers_internal.h"
+#include "text_store.h"
 #include <ctemplate/template_pathops.h>
 #include <ctemplate/template_string.h>
-#include "base/fileutil.h"
 #include <ctype.h>
 #include <iostream>
 #include <sstream>          // for ostringstream
@@ -103,20 +105,27 @@ static bool ascii_isspace(char c) {
 using std::endl;
 using std::string;
 using std::list;
+using std::set;
 using std::vector;
 using std::pair;
 using std::binary_search;
+using std::make_pair;
+using std::sort;
+using std::upper_bound;
 using HASH_NAMESPACE::unordered_map;
 
 namespace ctemplate {
 
 using ctemplate_htmlparser::HtmlParser;
 
+uint64_t MurmurHash64(const char* ptr, size_t len);  // in template_string.cc
+
 TemplateId GlobalIdForSTS_INIT(const TemplateString& s) {
   return s.GetGlobalId();   // normally this method is private
 }
 
-int Template::num_deletes_ = 0;
+std::atomic<int> Template::num_deletes_(0);
+int Template::num_resumed_builds_ = 0;
 
 namespace {
 // Mutex for protecting Expand calls against ReloadIfChanged, which
@@ -130,11 +139,23 @@ namespace {
 // ReloadIfChanged is deprecated, in most applications all the mutex
 // uses will be as read-locks, so this shouldn't cause much contention.
 static Mutex g_template_mutex(base::LINKER_INITIALIZED);
+#ifdef MUTEX_WAIT_STATS
+static base::MutexWaitStats g_template_mutex_stats("g_template_mutex",
+                                                   &g_template_mutex);
+#endif
 
-// Mutex for protecting vars_seen in WriteOneHeaderEntry, below.
-// g_template_mutex and g_header_mutex are never held at the same time.
-// TODO(csilvers): assert this in the codebase.
-static Mutex g_header_mutex(base::LINKER_INITIALIZED);
+// Guards every template's autoescape_checkpoints_, which the template
+// that replaces it on reload takes over.  A template can be in more
+// than one TemplateCache, so one cache may be rebuilding a template
+// (under g_template_mutex) while another is replacing it.  BuildTree()
+// only holds it to take the checkpoints and to put them back, so
+// templates are still parsed in parallel.  Acquire after
+// g_template_mutex.
+static Mutex g_checkpoint_mutex(base::LINKER_INITIALIZED);
+
+// The next SectionTemplateNode::tree_id_ to hand out.  0 is never
+// used, so an empty ExpansionRecord matches no tree.
+static std::atomic<uint64_t> g_next_tree_id(1);
 
 // It's not great to have a global variable with a constructor, but
 // it's safe in this case: the constructor is trivial and does not
@@ -604,24 +625,16 @@ static size_t FindLongestMatch(
 //    section names used in a template, so we can define constants
 //    to refer to them instead of having to type them in by hand.
 //    Output is *appended* to outstring.
+//
+//    The state is kept in a HeaderEntryState, one per call to
+//    Template::WriteHeaderEntries(), rather than in statics, so
+//    make_tpl_varnames_h can write the entries for several templates
+//    at once, and writing the same template twice in a row gives the
+//    same entries both times.
 // ----------------------------------------------------------------------
 
-static void WriteOneHeaderEntry(
-    string *outstring, const string& variable, const string& full_pathname)
-    LOCKS_EXCLUDED(g_header_mutex) {
-  MutexLock ml(&g_header_mutex);
-
-  // we use hash_map instead of hash_set just to keep the stl size down
-  static unordered_map<string, bool, StringHash> vars_seen
-      GUARDED_BY(g_header_mutex);
-  static string current_file GUARDED_BY(g_header_mutex);
-  static string prefix GUARDED_BY(g_header_mutex);
-
-  if (full_pathname != current_file) {
-    // changed files so re-initialize the static variables
-    vars_seen.clear();
-    current_file = full_pathname;
-
+struct HeaderEntryState {
+  explicit HeaderEntryState(const string& full_pathname) {
     // remove the path before the filename
     string filename(Basename(full_pathname));
 
@@ -648,6 +661,16 @@ static void WriteOneHeaderEntry(
     prefix = prefix + "_";
   }
 
+  string prefix;     // what the constants' names start with
+  // we use hash_map instead of hash_set just to keep the stl size down
+  unordered_map<string, bool, StringHash> vars_seen;
+};
+
+static void WriteOneHeaderEntry(
+    string *outstring, const string& variable, HeaderEntryState* state) {
+  const string& prefix = state->prefix;
+  unordered_map<string, bool, StringHash>& vars_seen = state->vars_seen;
+
   // print out the variable, but only if we haven't seen it before.
   if (!vars_seen.count(variable)) {
     if (variable == kMainSectionName || variable.find("BI_") == 0) {
@@ -882,6 +905,466 @@ static void AppendTokenWithIndent(int level, string *out, const string& before,
   out->append(before + token_string + after);
 }
 
+// Only the built-in modifiers are known to depend on nothing but
+// their input; extension modifiers ("x-...") may look at PerExpandData.
+static bool HasOnlyBuiltinModifiers(const vector<ModifierAndValue>& modifiers) {
+  for (vector<ModifierAndValue>::const_iterator it = modifiers.begin();
+       it != modifiers.end();  ++it) {
+    if (it->modifier_info->long_name.compare(0, 2, "x-") == 0)
+      return false;
+  }
+  return true;
+}
+
+// The encodings used by TemplateCache::ExpandSkeleton(), ExpandHoles()
+// and SpliceSkeleton().  A skeleton and a hole list both start with a
+// header line holding the skeleton's fingerprint as 16 hex digits.
+// That's followed by records of the form "<length in decimal>:<bytes>".
+// A skeleton has one more record than the hole lists that go with it.
+static const size_t kSkeletonHeaderLen = 17;
+
+static void EmitSkeletonHeader(uint64_t fingerprint, ExpandEmitter* out) {
+  char header[kSkeletonHeaderLen + 1];
+  snprintf(header, sizeof(header), "%016llx\n",
+           static_cast<unsigned long long>(fingerprint));
+  out->Emit(header, kSkeletonHeaderLen);
+}
+
+static void EmitSkeletonRecord(const char* data, size_t len,
+                               ExpandEmitter* out) {
+  char prefix[32];
+  const int prefixlen = snprintf(prefix, sizeof(prefix), "%lu:",
+                                 static_cast<unsigned long>(len));
+  out->Emit(prefix, prefixlen);
+  out->Emit(data, len);
+}
+
+// Reads the record starting at s[*pos], and advances *pos past it.
+// Returns false if there's no well-formed record there.
+static bool ReadSkeletonRecord(const string& s, size_t* pos,
+                               const char** data, size_t* len) {
+  size_t i = *pos;
+  size_t n = 0;
+  if (i >= s.size() || s[i] < '0' || s[i] > '9')
+    return false;
+  for (; i < s.size() && s[i] >= '0' && s[i] <= '9'; ++i) {
+    n = n * 10 + (s[i] - '0');
+    if (n > s.size())
+      return false;
+  }
+  if (i >= s.size() || s[i] != ':' || n > s.size() - i - 1)
+    return false;
+  *data = s.data() + i + 1;
+  *len = n;
+  *pos = i + 1 + n;
+  return true;
+}
+
+// What one node of the parse tree emitted the last time
+// TemplateCache::ExpandIncrementally() expanded it.  A section has a
+// child for each row it expanded; a row, and the main section, has a
+// child for each node in the section, plus one for the separator
+// section's extra expansion, right after the separator itself.
+struct ExpansionRecordNode {
+  ExpansionRecordNode() : expanded(false), size(0) { }
+  ~ExpansionRecordNode() { Clear(); }
+
+  void Clear() {
+    for (vector<ExpansionRecordNode*>::iterator it = children.begin();
+         it != children.end(); ++it) {
+      delete *it;
+    }
+    children.clear();
+    expanded = false;
+    size = 0;
+    input.clear();
+  }
+
+  // Returns children[i], adding it if it's the first time through.
+  ExpansionRecordNode* Child(size_t i) {
+    if (i == children.size())
+      children.push_back(new ExpansionRecordNode);
+    return children[i];
+  }
+
+  void SumChildSizes() {
+    size = 0;
+    for (vector<ExpansionRecordNode*>::const_iterator it = children.begin();
+         it != children.end(); ++it) {
+      size += (*it)->size;
+    }
+  }
+
+  bool expanded;   // false if the node hasn't been expanded yet
+  size_t size;     // of the node's output
+  // A variable's value, before modifiers, or, for a node we can't see
+  // into (such as an include), its whole output.
+  string input;
+  vector<ExpansionRecordNode*> children;
+
+ private:
+  ExpansionRecordNode(const ExpansionRecordNode&);   // disallow copying
+  void operator=(const ExpansionRecordNode&);
+};
+
+ExpansionRecord::~ExpansionRecord() {
+  delete root_;
+}
+
+// Records that the delete_len bytes at offset, in the old output, are
+// now insert.
+static void AddEdit(size_t offset, size_t delete_len, const string& insert,
+                    vector<ExpandEdit>* edits) {
+  if (delete_len == 0 && insert.empty())
+    return;
+  // Edits come in order, so merging with the last edit is enough to
+  // make adjacent changes (such as several new rows) a single edit.
+  if (!edits->empty() &&
+      edits->back().offset + edits->back().delete_len == offset) {
+    edits->back().delete_len += delete_len;
+    edits->back().insert.append(insert);
+    return;
+  }
+  edits->push_back(ExpandEdit());
+  edits->back().offset = offset;
+  edits->back().delete_len = delete_len;
+  edits->back().insert = insert;
+}
+
+// Applies edits, which are in order and whose offsets are in terms of
+// *text as it is now, to *text.  If no edit changes the size, the
+// rest of the text stays where it is; otherwise we copy it once.
+static void ApplyEdits(const vector<ExpandEdit>& edits, string* text) {
+  vector<ExpandEdit>::const_iterator it;
+  for (it = edits.begin(); it != edits.end(); ++it) {
+    if (it->insert.size() != it->delete_len)
+      break;
+  }
+  if (it == edits.end()) {
+    for (it = edits.begin(); it != edits.end(); ++it)
+      text->replace(it->offset, it->delete_len, it->insert);
+    return;
+  }
+  string result;
+  size_t pos = 0;
+  for (it = edits.begin(); it != edits.end(); ++it) {
+    result.append(*text, pos, it->offset - pos);
+    result.append(it->insert);
+    pos = it->offset + it->delete_len;
+  }
+  result.append(*text, pos, string::npos);
+  text->swap(result);
+}
+
+// Records one global-dictionary lookup made while specializing a
+// parse tree, so we can tell later whether the tree is out of date.
+struct GlobalLookup {
+  GlobalLookup(const TemplateString& n, bool f, const TemplateString& v)
+      : name(n), found(f), value(v.data(), v.size()) {
+  }
+  TemplateString name;   // points into template_text_
+  bool found;
+  string value;
+};
+typedef vector<GlobalLookup> GlobalLookups;
+
+// ----------------------------------------------------------------------
+// Template::Specialization
+//    A copy of a template's parse tree with global values folded in;
+//    see Template::SpecializeOnGlobalValues().
+// ----------------------------------------------------------------------
+
+struct Template::Specialization {
+  Specialization() : tree(NULL), generation(0) { }
+  ~Specialization();   // defined after SectionTemplateNode
+
+  SectionTemplateNode* tree;  // NULL if no globals were folded into it
+  int generation;             // GlobalValuesGeneration() it's valid for
+  GlobalLookups lookups;      // the lookups tree depends on
+};
+
+// ----------------------------------------------------------------------
+// Template::AutoEscapeCheckpoints
+//    Every kCheckpointInterval bytes or so, BuildTree() saves a copy of
+//    htmlparser_ as it was before parsing a text token, along with a
+//    hash of the input up to there.  It also records the modifiers
+//    Auto-Escape picked for every variable.  When an edited file is
+//    reloaded, the input up to the last checkpoint whose hash still
+//    matches is unchanged, so BuildTree() replays the recorded
+//    modifiers for it instead of running the parser over it, and
+//    restores the parser from the checkpoint.  The tree itself is
+//    always rebuilt, since its nodes point into the new input.
+// ----------------------------------------------------------------------
+
+static const size_t kCheckpointInterval = 16 * 1024;
+
+// Extends the hash of a prefix of the input by the next len bytes.
+static uint64_t ExtendPrefixHash(uint64_t hash, const char* data,
+                                 size_t len) {
+  return (hash ^ MurmurHash64(data, len)) * 0x9ddfea08eb382d69ULL;
+}
+
+struct Template::AutoEscapeCheckpoints {
+  struct Checkpoint {
+    size_t offset;           // start of a text token in the stripped input
+    size_t hashed_len;       // how much input must match to resume here
+    uint64_t prefix_hash;    // hash of the first hashed_len bytes of input
+    size_t num_modifiers;    // how many modifiers were recorded before offset
+    HtmlParser parser;       // htmlparser_ before parsing the text at offset
+  };
+
+  AutoEscapeCheckpoints()
+      : input(NULL), resume(NULL), next_modifier(0), replay_failed(false),
+        last_offset(0), hashed_len(0), prefix_hash(0) {
+  }
+  ~AutoEscapeCheckpoints() {
+    for (size_t i = 0; i < checkpoints.size(); ++i)
+      delete checkpoints[i];
+  }
+
+  // Called at the start of BuildTree().  Drops the checkpoints that
+  // the new input invalidates, and sets up to resume from the last one
+  // that's left.
+  void StartBuild(const char* begin, const char* end) {
+    input = begin;
+    resume = NULL;
+    next_modifier = 0;
+    replay_failed = false;
+    uint64_t hash = 0;
+    size_t hashed = 0;
+    size_t keep = 0;
+    for (; keep < checkpoints.size(); ++keep) {
+      const Checkpoint* cp = checkpoints[keep];
+      if (cp->hashed_len > static_cast<size_t>(end - begin))
+        break;
+      hash = ExtendPrefixHash(hash, begin + hashed, cp->hashed_len - hashed);
+      hashed = cp->hashed_len;
+      if (hash != cp->prefix_hash)
+        break;
+    }
+    for (size_t i = keep; i < checkpoints.size(); ++i)
+      delete checkpoints[i];
+    checkpoints.resize(keep);
+    if (keep > 0) {
+      resume = checkpoints.back();
+      modifiers.resize(resume->num_modifiers);
+      last_offset = resume->offset;
+      hashed_len = resume->hashed_len;
+      prefix_hash = resume->prefix_hash;
+    } else {
+      modifiers.clear();
+      last_offset = hashed_len = 0;
+      prefix_hash = 0;
+    }
+  }
+
+  // Returns true if the text or variable at pos comes before the
+  // checkpoint we're resuming from, so the parser should leave it
+  // alone.  When pos reaches that checkpoint, restores parser from it.
+  bool Replaying(const char* pos, HtmlParser* parser) {
+    if (resume == NULL || replay_failed)
+      return replay_failed;
+    const size_t offset = pos - input;
+    if (offset < resume->offset)
+      return true;
+    // Only a text token can start at a checkpoint, and the identical
+    // input before it should have produced the same variables.
+    if (offset != resume->offset || next_modifier != resume->num_modifiers) {
+      replay_failed = true;
+      return true;
+    }
+    parser->CopyFrom(&resume->parser);
+    resume = NULL;
+    return false;
+  }
+
+  // Returns the modifiers recorded for the next variable before the
+  // checkpoint we're resuming from, or NULL if we've run out.
+  const vector<const ModifierAndValue*>* ReplayModifiers() {
+    if (replay_failed || next_modifier >= modifiers.size()) {
+      replay_failed = true;
+      return NULL;
+    }
+    return &modifiers[next_modifier++];
+  }
+
+  void RecordModifiers(const vector<const ModifierAndValue*>& modvals) {
+    modifiers.push_back(modvals);
+  }
+
+  // Called before the text at pos is parsed.  lookahead is how many
+  // bytes from pos on decide where the token starting at pos ends up.
+  void MaybeAddCheckpoint(const char* pos, const char* end,
+                          const HtmlParser& parser, size_t lookahead) {
+    const size_t offset = pos - input;
+    if (offset < last_offset + kCheckpointInterval)
+      return;
+    size_t len = offset + lookahead;
+    if (len > static_cast<size_t>(end - input))
+      len = end - input;
+    prefix_hash = ExtendPrefixHash(prefix_hash, input + hashed_len,
+                                   len - hashed_len);
+    hashed_len = len;
+    last_offset = offset;
+
+    Checkpoint* cp = new Checkpoint;
+    cp->offset = offset;
+    cp->hashed_len = hashed_len;
+    cp->prefix_hash = prefix_hash;
+    cp->num_modifiers = modifiers.size();
+    cp->parser.CopyFrom(&parser);
+    checkpoints.push_back(cp);
+  }
+
+  // Called at the end of BuildTree().  Returns false if the build
+  // couldn't resume where it meant to; then its tree is wrong.
+  bool FinishBuild() const {
+    return !replay_failed && resume == NULL;
+  }
+
+  // Doesn't count what the parsers allocate, like MemoryUsageLocked()
+  // doesn't for htmlparser_.
+  size_t MemoryUsage() const {
+    size_t usage = (sizeof(*this) +
+                    checkpoints.capacity() * sizeof(Checkpoint*) +
+                    checkpoints.size() * sizeof(Checkpoint) +
+                    modifiers.capacity() * sizeof(modifiers[0]));
+    for (size_t i = 0; i < modifiers.size(); ++i)
+      usage += modifiers[i].capacity() * sizeof(const ModifierAndValue*);
+    return usage;
+  }
+
+  vector<Checkpoint*> checkpoints;
+  // The modifiers for each auto-escaped variable, in input order.
+  vector<vector<const ModifierAndValue*> > modifiers;
+
+  // The rest is state for the BuildTree() in progress.
+  const char* input;             // the input BuildTree() is parsing
+  const Checkpoint* resume;      // where we'll restore the parser, or NULL
+  size_t next_modifier;          // next entry of modifiers to replay
+  bool replay_failed;
+  size_t last_offset;            // of the last checkpoint
+  size_t hashed_len;             // how much of input prefix_hash covers
+  uint64_t prefix_hash;
+};
+
+// ----------------------------------------------------------------------
+// StringMemoryUsage()
+// TokenMemoryUsage()
+//    Helpers for TemplateNode::MemoryUsage(): how much heap a string
+//    or token has allocated, not counting the object itself.
+// ----------------------------------------------------------------------
+
+static size_t StringMemoryUsage(const string& s) {
+  // Short strings are kept inside the string object.
+  const char* object = reinterpret_cast<const char*>(&s);
+  if (s.data() >= object && s.data() < object + sizeof(s))
+    return 0;
+  return s.capacity() + 1;
+}
+
+static size_t TokenMemoryUsage(const TemplateToken& token) {
+  return token.modvals.capacity() * sizeof(ModifierAndValue);
+}
+
+// ----------------------------------------------------------------------
+// TemplateCost
+//    The rough work, in the units TemplateCost counts, of expanding
+//    each kind of node.  Template::AnalyzeCost() adds them up.
+// ----------------------------------------------------------------------
+
+TemplateCost::TemplateCost()
+    : num_nodes(0), num_text_nodes(0), num_variable_nodes(0),
+      num_section_nodes(0), num_include_nodes(0), max_section_depth(0),
+      num_includes_in_sections(0), max_modifiers(0), num_modifiers(0),
+      text_bytes(0), work_per_pass(0), max_iteration_work(0),
+      estimated_work(0) {
+}
+
+static const double kVariableWork = 2;   // the dictionary lookup
+static const double kModifierWork = 2;   // each modifier applied
+static const double kSectionWork = 2;    // per iteration
+static const double kIncludeWork = 8;    // finding the template, etc
+
+// Emitting text costs a unit, plus one per 64 bytes.
+static double TextWork(size_t textlen) {
+  return 1 + textlen / 64.0;
+}
+
+static double ModifierWork(const TemplateToken& token) {
+  return kModifierWork * token.modvals.size();
+}
+
+static void AddModifiersToCost(const TemplateToken& token,
+                               TemplateCost* cost) {
+  const int num_modifiers = static_cast<int>(token.modvals.size());
+  cost->num_modifiers += num_modifiers;
+  cost->max_modifiers = std::max(cost->max_modifiers, num_modifiers);
+}
+
+// ----------------------------------------------------------------------
+// TextRelocation
+// RelocateToken()
+//    ShareTextRuns() cuts the runs of text it moves into the
+//    TextStore out of the template's text buffer, leaving a smaller
+//    buffer.  A TextRelocation maps pointers into the old buffer to
+//    the same bytes in the new one, and leaves other pointers alone.
+// ----------------------------------------------------------------------
+
+// The runs cut out of a buffer: where each one starts, and its length.
+typedef vector<pair<const char*, size_t> > TextCuts;
+
+// Runs of text shorter than this aren't worth a TextChunk of their own.
+static const size_t kMinSharedTextLength = 32;
+
+class TextRelocation {
+ public:
+  // cuts must be sorted, and must not overlap.
+  TextRelocation(const char* old_begin, const char* old_end,
+                 const char* new_begin, const TextCuts& cuts)
+      : old_begin_(old_begin), old_end_(old_end), new_begin_(new_begin) {
+    size_t cut_len = 0;
+    for (TextCuts::const_iterator it = cuts.begin(); it != cuts.end(); ++it) {
+      cut_len += it->second;
+      cut_ends_.push_back(make_pair(it->first + it->second - old_begin,
+                                    cut_len));
+    }
+  }
+
+  const char* Map(const char* p) const {
+    if (p < old_begin_ || p > old_end_)
+      return p;
+    const size_t offset = p - old_begin_;
+    // Everything cut before offset comes out.
+    vector<pair<size_t, size_t> >::const_iterator it =
+        upper_bound(cut_ends_.begin(), cut_ends_.end(), offset,
+                    &TextRelocation::IsBeforeCutEnd);
+    const size_t cut_len = (it == cut_ends_.begin() ? 0 : (it - 1)->second);
+    return new_begin_ + offset - cut_len;
+  }
+
+ private:
+  static bool IsBeforeCutEnd(size_t offset, const pair<size_t, size_t>& cut) {
+    return offset < cut.first;
+  }
+
+  const char* const old_begin_;
+  const char* const old_end_;
+  const char* const new_begin_;
+  // For each cut, where it ended in the old buffer, and how many
+  // bytes had been cut by then.
+  vector<pair<size_t, size_t> > cut_ends_;
+};
+
+static void RelocateToken(const TextRelocation& relocation,
+                          TemplateToken* token) {
+  token->text = relocation.Map(token->text);
+  for (vector<ModifierAndValue>::iterator it = token->modvals.begin();
+       it != token->modvals.end(); ++it) {
+    it->value = relocation.Map(it->value);
+  }
+}
+
 // ----------------------------------------------------------------------
 // TemplateNode
 //    When we read a template, we decompose it into its components:
@@ -907,12 +1390,77 @@ class TemplateNode {
   // Writes entries to a header file to provide syntax checking at
   // compile time.
   virtual void WriteHeaderEntries(string *outstring,
-                                  const string& filename) const = 0;
+                                  HeaderEntryState* state) const = 0;
 
   // Appends a representation of the node and its subnodes to a string
   // as a debugging aid.
   virtual void DumpToString(int level, string *out) const = 0;
 
+  // Adds the node and its subnodes to cost's counts and work_per_pass
+  // (see Template::AnalyzeCost()).  section_depth is how many sections
+  // the node is in.
+  virtual void AddToCost(int section_depth, TemplateCost* cost) const = 0;
+
+  // Returns the work (see TemplateCost) of expanding the node with
+  // dictionary, or, if dictionary is NULL, with each section repeated
+  // assumed_iterations times.  Adds the variables dictionary leaves
+  // empty to unset.
+  virtual double EstimateWork(const TemplateDictionaryInterface* dictionary,
+                              int assumed_iterations,
+                              set<string>* unset) const = 0;
+
+  // Returns a new copy of this node in which variables with a value in
+  // the global dictionary have been replaced by text, or NULL if the
+  // node never emits anything.  Every such lookup is appended to
+  // lookups.  Used by Template::SpecializeOnGlobalValuesLocked().
+  virtual TemplateNode* Specialize(GlobalLookups* lookups) const = 0;
+
+  // Returns the token holding this node's text if the node always
+  // emits exactly that text, or NULL otherwise.
+  virtual const TemplateToken* StaticText() const { return NULL; }
+
+  // Returns true if the node never emits anything, and so can be
+  // dropped from the tree once parsing is done.
+  virtual bool EmitsNothing() const { return false; }
+
+  // Simplifies the node's subtree after parsing (see
+  // SectionTemplateNode::CoalesceText()).  Returns the number of
+  // nodes eliminated.
+  virtual int CoalesceText() { return 0; }
+
+  // Compresses each run of static text in the node's subtree that is
+  // at least min_length bytes long, so a DeflateEmitter can splice
+  // it into its output as is.  Returns the number of runs compressed.
+  virtual int PrecompressText(size_t min_length) { return 0; }
+
+  // Returns roughly how many bytes the node and its subtree use,
+  // including what they have allocated, but not the template text
+  // their tokens point into.  Used by Template::MemoryUsageLocked().
+  virtual size_t MemoryUsage() const = 0;
+
+  // Moves each run of static text in the node's subtree that is at
+  // least kMinSharedTextLength bytes long into store, where templates
+  // with the same run share it.  Runs that were in the template's
+  // text buffer are appended to cuts.  Used by ShareTextRuns().
+  virtual void ShareText(TextStore* store, TextCuts* cuts) { }
+
+  // Points the node's subtree at the template's new text buffer,
+  // after ShareTextRuns() has cut the shared runs out of it.
+  virtual void RelocateText(const TextRelocation& relocation) = 0;
+
+  // Brings record, which says what the node emitted last time,
+  // starting at offset in the old output, up to date for dictionary,
+  // and adds an edit for any output that changed (see
+  // TemplateCache::ExpandIncrementally()).  A node whose inputs are
+  // as they were last time isn't expanded again.  By default, we
+  // expand the node and compare its output with last time's.
+  virtual bool ExpandChanges(const TemplateDictionaryInterface *dictionary,
+                             PerExpandData *per_expand_data,
+                             const TemplateCache *cache,
+                             size_t offset,
+                             ExpansionRecordNode* record,
+                             vector<ExpandEdit>* edits) const;
+
  protected:
   typedef list<TemplateNode *> NodeList;
 
@@ -921,23 +1469,64 @@ class TemplateNode {
   void operator=(const TemplateNode&);
 };
 
+bool TemplateNode::ExpandChanges(const TemplateDictionaryInterface *dictionary,
+                                 PerExpandData *per_expand_data,
+                                 const TemplateCache *cache,
+                                 size_t offset,
+                                 ExpansionRecordNode* record,
+                                 vector<ExpandEdit>* edits) const {
+  string output;
+  StringEmitter output_emitter(&output);
+  const bool error_free = Expand(&output_emitter, dictionary,
+                                 per_expand_data, cache);
+  if (!record->expanded || output != record->input) {
+    AddEdit(offset, record->size, output, edits);
+    record->expanded = true;
+    record->size = output.size();
+    record->input.swap(output);
+  }
+  return error_free;
+}
+
 // ----------------------------------------------------------------------
 // TextTemplateNode
 //    The simplest template-node: it holds runs of raw template text,
 //    that should be emitted verbatim.  The text points into
-//    template_text_.
+//    template_text_, unless the node was built by Specialize(), in
+//    which case it owns its text, or the text has been moved into a
+//    TextStore by ShareText().  The text is emitted as a
+//    StaticTextSegment, which also carries its digest, once a
+//    HashingEmitter has computed it, and, if it has been
+//    precompressed, its compressed form.
 // ----------------------------------------------------------------------
 
 class TextTemplateNode : public TemplateNode {
  public:
   explicit TextTemplateNode(const TemplateToken& token)
-      : token_(token) {
+      : token_(token), chunk_(NULL) {
     VLOG(2) << "Constructing TextTemplateNode: "
             << string(token_.text, token_.textlen) << endl;
+    InitSegment();
+  }
+  explicit TextTemplateNode(const string& text)
+      : text_(text),
+        token_(TOKENTYPE_TEXT, text_.data(), text_.length(), NULL),
+        chunk_(NULL) {
+    VLOG(2) << "Constructing TextTemplateNode: " << text_ << endl;
+    InitSegment();
+  }
+  // Shares chunk with whoever else holds it.
+  explicit TextTemplateNode(const TextChunk* chunk)
+      : token_(TOKENTYPE_TEXT, chunk->data(), chunk->size(), NULL),
+        chunk_(chunk) {
+    chunk_->IncRef();
+    InitSegment();
   }
   virtual ~TextTemplateNode() {
     VLOG(2) << "Deleting TextTemplateNode: "
             << string(token_.text, token_.textlen) << endl;
+    if (chunk_ != NULL)
+      chunk_->Release();
   }
 
   // Expands the text node by simply outputting the text string. This
@@ -947,24 +1536,104 @@ class TextTemplateNode : public TemplateNode {
                       const TemplateDictionaryInterface *,
                       PerExpandData *,
                       const TemplateCache *) const {
-    output_buffer->Emit(token_.text, token_.textlen);
+    output_buffer->EmitStaticText(segment_);
     return true;
   }
 
   // A noop for text nodes
   virtual void WriteHeaderEntries(string *outstring,
-                                  const string& filename) const {
+                                  HeaderEntryState* state) const {
     return;
   }
 
+  virtual void AddToCost(int section_depth, TemplateCost* cost) const {
+    cost->num_nodes++;
+    cost->num_text_nodes++;
+    cost->text_bytes += token_.textlen;
+    cost->work_per_pass += TextWork(token_.textlen);
+  }
+
+  virtual double EstimateWork(const TemplateDictionaryInterface*, int,
+                              set<string>*) const {
+    return TextWork(token_.textlen);
+  }
+
   // Appends a representation of the text node to a string.
   virtual void DumpToString(int level, string *out) const {
     assert(out);
     AppendTokenWithIndent(level, out, "Text Node: -->|", token_, "|<--\n");
   }
 
+  virtual TemplateNode* Specialize(GlobalLookups*) const {
+    if (chunk_ != NULL)
+      return new TextTemplateNode(chunk_);
+    if (text_.empty())
+      return new TextTemplateNode(token_);
+    return new TextTemplateNode(text_);
+  }
+
+  virtual const TemplateToken* StaticText() const { return &token_; }
+
+  // The text never changes, so it's only emitted the first time.
+  virtual bool ExpandChanges(const TemplateDictionaryInterface*,
+                             PerExpandData*, const TemplateCache*,
+                             size_t offset, ExpansionRecordNode* record,
+                             vector<ExpandEdit>* edits) const {
+    if (!record->expanded) {
+      AddEdit(offset, record->size, string(token_.text, token_.textlen),
+              edits);
+      record->expanded = true;
+      record->size = token_.textlen;
+    }
+    return true;
+  }
+
+  virtual int PrecompressText(size_t min_length) {
+#ifdef HAVE_ZLIB
+    if (token_.textlen >= min_length &&
+        DeflateEmitter::Precompress(token_.text, token_.textlen,
+                                    &segment_.precompressed)) {
+      return 1;
+    }
+#endif
+    return 0;
+  }
+
+  // We count our share of a shared chunk.
+  virtual size_t MemoryUsage() const {
+    return (sizeof(*this) + StringMemoryUsage(text_) +
+            TokenMemoryUsage(token_) +
+            StringMemoryUsage(segment_.precompressed) +
+            (chunk_ != NULL ? chunk_->size() / chunk_->refcount() : 0));
+  }
+
+  virtual void ShareText(TextStore* store, TextCuts* cuts) {
+    if (chunk_ != NULL || token_.textlen < kMinSharedTextLength)
+      return;
+    chunk_ = store->Intern(token_.text, token_.textlen);
+    if (text_.empty())
+      cuts->push_back(make_pair(token_.text, token_.textlen));
+    string().swap(text_);
+    token_.text = chunk_->data();
+    segment_.text = token_.text;
+  }
+
+  virtual void RelocateText(const TextRelocation& relocation) {
+    RelocateToken(relocation, &token_);
+    segment_.text = token_.text;
+  }
+
  private:
+  // The digest is left for the first HashingEmitter to compute.
+  void InitSegment() {
+    segment_.text = token_.text;
+    segment_.textlen = token_.textlen;
+  }
+
+  string text_;          // Only used if we own our text.
   TemplateToken token_;  // The text held by this node.
+  StaticTextSegment segment_;   // token_'s text, and what we know about it
+  const TextChunk* chunk_;      // Holds the text, if it's been shared.
 };
 
 // ----------------------------------------------------------------------
@@ -997,9 +1666,24 @@ class VariableTemplateNode : public TemplateNode {
                       const TemplateCache *cache) const;
 
   virtual void WriteHeaderEntries(string *outstring,
-                                  const string& filename) const {
+                                  HeaderEntryState* state) const {
     WriteOneHeaderEntry(outstring, string(token_.text, token_.textlen),
-                        filename);
+                        state);
+  }
+
+  virtual void AddToCost(int section_depth, TemplateCost* cost) const {
+    cost->num_nodes++;
+    cost->num_variable_nodes++;
+    AddModifiersToCost(token_, cost);
+    cost->work_per_pass += kVariableWork + ModifierWork(token_);
+  }
+
+  virtual double EstimateWork(const TemplateDictionaryInterface* dictionary,
+                              int, set<string>* unset) const {
+    if (dictionary != NULL && dictionary->GetValue(variable_).empty() &&
+        strncmp(token_.text, "BI_", 3) != 0)
+      unset->insert(string(token_.text, token_.textlen));
+    return kVariableWork + ModifierWork(token_);
   }
 
   // Appends a representation of the variable node to a string. We
@@ -1011,9 +1695,27 @@ class VariableTemplateNode : public TemplateNode {
                           PrettyPrintTokenModifiers(token_.modvals) + "\n");
   }
 
+  virtual TemplateNode* Specialize(GlobalLookups* lookups) const;
+
+  virtual bool ExpandChanges(const TemplateDictionaryInterface *dictionary,
+                             PerExpandData *per_expand_data,
+                             const TemplateCache *cache,
+                             size_t offset,
+                             ExpansionRecordNode* record,
+                             vector<ExpandEdit>* edits) const;
+
+  virtual size_t MemoryUsage() const {
+    return sizeof(*this) + TokenMemoryUsage(token_);
+  }
+
+  virtual void RelocateText(const TextRelocation& relocation) {
+    RelocateToken(relocation, &token_);
+    variable_ = HashedTemplateString(token_.text, token_.textlen);
+  }
+
  private:
-  const TemplateToken token_;
-  const HashedTemplateString variable_;
+  TemplateToken token_;
+  HashedTemplateString variable_;
 };
 
 bool VariableTemplateNode::Expand(ExpandEmitter *output_buffer,
@@ -1042,6 +1744,64 @@ bool VariableTemplateNode::Expand(ExpandEmitter *output_buffer,
   return true;
 }
 
+// The built-in modifiers depend only on the value, so if the value is
+// what it was last time, so is the output.  Extension modifiers might
+// depend on anything, so for them we expand and compare.
+bool VariableTemplateNode::ExpandChanges(
+    const TemplateDictionaryInterface *dictionary,
+    PerExpandData *per_expand_data,
+    const TemplateCache *cache,
+    size_t offset,
+    ExpansionRecordNode* record,
+    vector<ExpandEdit>* edits) const {
+  if (!HasOnlyBuiltinModifiers(token_.modvals)) {
+    return TemplateNode::ExpandChanges(dictionary, per_expand_data, cache,
+                                       offset, record, edits);
+  }
+  const TemplateString value = dictionary->GetValue(variable_);
+  if (record->expanded &&
+      record->input.compare(0, string::npos, value.data(), value.size()) == 0) {
+    return true;
+  }
+  string output;
+  if (AnyMightModify(token_.modvals, per_expand_data)) {
+    StringEmitter output_emitter(&output);
+    EmitModifiedString(token_.modvals, value.data(), value.size(),
+                       per_expand_data, &output_emitter);
+  } else {
+    output.assign(value.data(), value.size());
+  }
+  AddEdit(offset, record->size, output, edits);
+  record->expanded = true;
+  record->size = output.size();
+  record->input.assign(value.data(), value.size());
+  return true;
+}
+
+// If the variable is in the global dict, we apply the modifiers to
+// its value once, now, exactly as Expand() would, and become text.
+TemplateNode* VariableTemplateNode::Specialize(GlobalLookups* lookups) const {
+  if (!HasOnlyBuiltinModifiers(token_.modvals))
+    return new VariableTemplateNode(token_);
+
+  TemplateString value("");
+  const bool found = TemplateDictionary::GetGlobalValue(variable_, &value);
+  lookups->push_back(GlobalLookup(variable_, found, value));
+  if (!found)
+    return new VariableTemplateNode(token_);
+
+  PerExpandData no_per_expand_data;
+  string text;
+  if (AnyMightModify(token_.modvals, &no_per_expand_data)) {
+    StringEmitter text_emitter(&text);
+    EmitModifiedString(token_.modvals, value.data(), value.size(),
+                       &no_per_expand_data, &text_emitter);
+  } else {
+    text.assign(value.data(), value.size());
+  }
+  return new TextTemplateNode(text);
+}
+
 // ----------------------------------------------------------------------
 // PragmaTemplateNode
 //   It simply stores the text given inside the pragma marker
@@ -1070,7 +1830,14 @@ class PragmaTemplateNode : public TemplateNode {
 
   // A no-op for pragma nodes.
   virtual void WriteHeaderEntries(string *outstring,
-                                  const string& filename) const { }
+                                  HeaderEntryState* state) const { }
+
+  // Pragmas cost nothing to expand.
+  virtual void AddToCost(int section_depth, TemplateCost* cost) const { }
+  virtual double EstimateWork(const TemplateDictionaryInterface*, int,
+                              set<string>*) const {
+    return 0;
+  }
 
   // Appends a representation of the pragma node to a string. We output
   // the full text given in {{%...}} verbatim.
@@ -1079,6 +1846,18 @@ class PragmaTemplateNode : public TemplateNode {
     AppendTokenWithIndent(level, out, "Pragma Node: -->|", token_, "|<--\n");
   }
 
+  // Pragmas have done their job once the template is parsed.
+  virtual TemplateNode* Specialize(GlobalLookups*) const { return NULL; }
+  virtual bool EmitsNothing() const { return true; }
+
+  virtual size_t MemoryUsage() const {
+    return sizeof(*this) + TokenMemoryUsage(token_);
+  }
+
+  virtual void RelocateText(const TextRelocation& relocation) {
+    RelocateToken(relocation, &token_);
+  }
+
  private:
   TemplateToken token_;  // The text of the pragma held by this node.
 };
@@ -1137,9 +1916,37 @@ class TemplateTemplateNode : public TemplateNode {
                       const TemplateCache *cache) const;
 
   virtual void WriteHeaderEntries(string *outstring,
-                                  const string& filename) const {
+                                  HeaderEntryState* state) const {
     WriteOneHeaderEntry(outstring, string(token_.text, token_.textlen),
-                        filename);
+                        state);
+  }
+
+  virtual void AddToCost(int section_depth, TemplateCost* cost) const {
+    cost->num_nodes++;
+    cost->num_include_nodes++;
+    if (section_depth > 0)
+      cost->num_includes_in_sections++;
+    AddModifiersToCost(token_, cost);
+    cost->work_per_pass += kIncludeWork + ModifierWork(token_);
+  }
+
+  // The included template is expanded once per dictionary the sample
+  // gives it, but its own work isn't counted.
+  virtual double EstimateWork(const TemplateDictionaryInterface* dictionary,
+                              int, set<string>*) const {
+    int times = 1;
+    if (dictionary != NULL) {
+      if (dictionary->IsHiddenTemplate(variable_))
+        return 0;
+      TemplateDictionaryInterface::Iterator* di =
+          dictionary->CreateTemplateIterator(variable_);
+      for (times = 0; di->HasNext(); ++times)
+        di->Next();
+      delete di;
+      if (times == 0)
+        times = 1;
+    }
+    return times * (kIncludeWork + ModifierWork(token_));
   }
 
   virtual void DumpToString(int level, string *out) const {
@@ -1147,9 +1954,28 @@ class TemplateTemplateNode : public TemplateNode {
     AppendTokenWithIndent(level, out, "Template Node: ", token_, "\n");
   }
 
+  // The copy needs its own indentation_, so we take off the
+  // prefix-line modifier our constructor added and let it add one.
+  virtual TemplateNode* Specialize(GlobalLookups*) const {
+    TemplateToken token(token_);
+    if (!indentation_.empty())
+      token.modvals.pop_back();
+    return new TemplateTemplateNode(token, strip_, indentation_);
+  }
+
+  virtual size_t MemoryUsage() const {
+    return (sizeof(*this) + TokenMemoryUsage(token_) +
+            StringMemoryUsage(indentation_));
+  }
+
+  virtual void RelocateText(const TextRelocation& relocation) {
+    RelocateToken(relocation, &token_);
+    variable_ = HashedTemplateString(token_.text, token_.textlen);
+  }
+
  private:
   TemplateToken token_;   // text is the name of a template file.
-  const HashedTemplateString variable_;
+  HashedTemplateString variable_;
   Strip strip_;       // Flag to pass from parent template to included template.
   const string indentation_;   // Used by ModifierAndValue for g_prefix_line.
 
@@ -1192,6 +2018,10 @@ bool TemplateTemplateNode::Expand(ExpandEmitter *output_buffer,
 
   bool error_free = true;
   for (int dict_num = 0; di->HasNext(); ++dict_num) {
+    if (per_expand_data->expand_aborted() != EXPAND_NOT_ABORTED) {
+      error_free = false;
+      break;
+    }
     const TemplateDictionaryInterface& child = di->Next();
     // We do this in the loop, because maybe one day we'll support
     // each expansion having its own template dictionary.  That's also
@@ -1227,6 +2057,8 @@ bool TemplateTemplateNode::ExpandOnce(
     const char* const filename,
     PerExpandData *per_expand_data,
     const TemplateCache *cache) const {
+  if (!per_expand_data->CountIteration())
+    return false;
   bool error_free = true;
   // NOTE: Although we do this const_cast here, if the cache is frozen
   // the expansion doesn't mutate the cache, and is effectively 'const'.
@@ -1253,7 +2085,8 @@ bool TemplateTemplateNode::ExpandOnce(
                                  &subtemplate_buffer,
                                  &dictionary,
                                  per_expand_data)) {
-      EmitMissingInclude(filename, output_buffer, per_expand_data);
+      if (per_expand_data->expand_aborted() == EXPAND_NOT_ABORTED)
+        EmitMissingInclude(filename, output_buffer, per_expand_data);
       error_free = false;
     } else {
       EmitModifiedString(token_.modvals,
@@ -1266,7 +2099,8 @@ bool TemplateTemplateNode::ExpandOnce(
                                  output_buffer,
                                  &dictionary,
                                  per_expand_data)) {
-      EmitMissingInclude(filename, output_buffer, per_expand_data);
+      if (per_expand_data->expand_aborted() == EXPAND_NOT_ABORTED)
+        EmitMissingInclude(filename, output_buffer, per_expand_data);
       error_free = false;
     }
   }
@@ -1321,13 +2155,61 @@ class SectionTemplateNode : public TemplateNode {
   // Writes a header entry for the section name and calls the same
   // method on all the nodes in the section
   virtual void WriteHeaderEntries(string *outstring,
-                                  const string& filename) const;
+                                  HeaderEntryState* state) const;
 
   virtual void DumpToString(int level, string *out) const;
 
+  virtual void AddToCost(int section_depth, TemplateCost* cost) const;
+  virtual double EstimateWork(const TemplateDictionaryInterface* dictionary,
+                              int assumed_iterations,
+                              set<string>* unset) const;
+
+  virtual TemplateNode* Specialize(GlobalLookups* lookups) const {
+    return SpecializeSection(lookups);
+  }
+
+  // Like Specialize(), but never returns NULL.  Runs of adjacent text
+  // in the copy are merged into a single TextTemplateNode.
+  SectionTemplateNode* SpecializeSection(GlobalLookups* lookups) const;
+
+  // The post-parse pass, run by BuildTree(): merges each run of
+  // adjacent text nodes -- left behind by comments, pragmas and
+  // set-delimiter markers -- into one node, drops the pragma nodes,
+  // and recurses into subsections.  A section left holding nothing
+  // but text is marked static, and ExpandOnce() emits its bytes
+  // directly.  Returns the number of nodes eliminated.
+  virtual int CoalesceText();
+
+  virtual int PrecompressText(size_t min_length);
+
+  virtual size_t MemoryUsage() const;
+  virtual void ShareText(TextStore* store, TextCuts* cuts);
+  virtual void RelocateText(const TextRelocation& relocation);
+  virtual bool ExpandChanges(const TemplateDictionaryInterface *dictionary,
+                             PerExpandData *per_expand_data,
+                             const TemplateCache *cache,
+                             size_t offset,
+                             ExpansionRecordNode* record,
+                             vector<ExpandEdit>* edits) const;
+
+  // Used on the main section by Template::ExpandSkeleton() and
+  // ExpandHoles(): the text nodes in node_list_ make up the skeleton,
+  // and every other node is a hole.
+  void EmitSkeleton(ExpandEmitter* skeleton) const;
+  bool ExpandHoles(ExpandEmitter* holes,
+                   const TemplateDictionaryInterface *dictionary,
+                   PerExpandData* per_expand_data,
+                   const TemplateCache *cache) const;
+  // Used on the main section by Template::ExpandIncrementally().
+  bool ExpandIncrementally(const TemplateDictionaryInterface *dictionary,
+                           PerExpandData* per_expand_data,
+                           const TemplateCache *cache,
+                           ExpansionRecord* record,
+                           vector<ExpandEdit>* edits) const;
+
  private:
-  const TemplateToken token_;   // text is the name of the section
-  const HashedTemplateString variable_;
+  TemplateToken token_;   // text is the name of the section
+  HashedTemplateString variable_;
   NodeList node_list_;  // The list of subnodes in the section
   // A sub-section named "OURNAME_separator" is special.  If we see it
   // when parsing our section, store a pointer to it for ease of use.
@@ -1345,6 +2227,22 @@ class SectionTemplateNode : public TemplateNode {
   // This bool is currently always set to true.
   bool hidden_by_default_;
 
+  // Set by CoalesceText() if node_list_ holds at most one node, a
+  // text node.  static_text_ is that node, or NULL if there is no
+  // node.
+  bool is_static_;
+  const TemplateNode* static_text_;
+
+  // For the main section, a hash of the records EmitSkeleton() writes,
+  // or 0 until SkeletonFingerprint() first computes it.  Few users ask
+  // for skeletons, so parsing doesn't compute it.  Racing expands just
+  // compute the same value twice.
+  mutable std::atomic<uint64_t> skeleton_fingerprint_;
+
+  // For the main section, a number no other parse tree has, so an
+  // ExpansionRecord can tell whether it was made from this tree.
+  uint64_t tree_id_;
+
   // A protected method used in parsing the template file
   // Finds the next token in the file and return it. Anything not inside
   // a template marker is just text. Each template marker type, delimited
@@ -1376,6 +2274,14 @@ class SectionTemplateNode : public TemplateNode {
       bool is_last_child_dict,
       const TemplateCache *cache) const;
 
+  // Helper routine used by ExpandOnce: expands each node in node_list_.
+  bool ExpandNodes(
+      ExpandEmitter *output_buffer,
+      const TemplateDictionaryInterface *dictionary,
+      PerExpandData* per_expand_data,
+      bool is_last_child_dict,
+      const TemplateCache *cache) const;
+
   // The specific methods called used by AddSubnode to add the
   // different types of nodes to this section node.
   // Currently only reasons to fail (return false) are if the
@@ -1389,6 +2295,30 @@ class SectionTemplateNode : public TemplateNode {
   bool AddSectionNode(const TemplateToken* token, Template* my_template,
                       bool hidden_by_default);
   bool AddSectionNode(const TemplateToken* token, Template* my_template);
+
+  // Used by SpecializeSection and CoalesceText: adds the text nodes in
+  // run to node_list_, merged into one node if there are several, and
+  // empties run.  Returns how many fewer nodes there are as a result.
+  int AddTextRun(NodeList* run);
+
+  // Writes a record for each run of text between holes.
+  void EmitSkeletonRecords(ExpandEmitter* skeleton) const;
+
+  // Returns skeleton_fingerprint_, computing it if need be.
+  uint64_t SkeletonFingerprint() const;
+
+  // The ExpandChanges() of one row of the section, expanded with
+  // dictionary (see ExpandOnce()).
+  bool ExpandRowChanges(const TemplateDictionaryInterface *dictionary,
+                        PerExpandData *per_expand_data,
+                        bool is_last_child_dict,
+                        const TemplateCache *cache,
+                        size_t offset,
+                        ExpansionRecordNode* record,
+                        vector<ExpandEdit>* edits) const;
+
+  // Sets is_static_ and static_text_ once node_list_ is final.
+  void FinishNodeList();
 };
 
 // --- constructor and destructor, Expand, Dump, and WriteHeaderEntries
@@ -1399,7 +2329,9 @@ SectionTemplateNode::SectionTemplateNode(const TemplateToken& token,
     : token_(token),
       variable_(token_.text, token_.textlen),
       separator_section_(NULL), indentation_("\n"),
-      hidden_by_default_(hidden_by_default) {
+      hidden_by_default_(hidden_by_default),
+      is_static_(false), static_text_(NULL), skeleton_fingerprint_(0),
+      tree_id_(0) {
   VLOG(2) << "Constructing SectionTemplateNode: "
           << string(token_.text, token_.textlen) << endl;
 }
@@ -1425,6 +2357,8 @@ bool SectionTemplateNode::ExpandOnce(
     PerExpandData *per_expand_data,
     bool is_last_child_dict,
     const TemplateCache* cache) const {
+  if (!per_expand_data->CountIteration())
+    return false;
   bool error_free = true;
 
   if (per_expand_data->annotate()) {
@@ -1434,20 +2368,12 @@ bool SectionTemplateNode::ExpandOnce(
 
   // Expand using the section-specific dictionary.
   // We force children to annotate the output if we have to.
-  NodeList::const_iterator iter = node_list_.begin();
-  for (; iter != node_list_.end(); ++iter) {
-    error_free &=
-        (*iter)->Expand(output_buffer, dictionary, per_expand_data, cache);
-    // If this sub-node is a "separator section" -- a subsection
-    // with the name "OURNAME_separator" -- expand it every time
-    // through but the last.
-    if (*iter == separator_section_ && !is_last_child_dict) {
-      // We call ExpandOnce to make sure we always expand,
-      // even if *iter would normally be hidden.
-      error_free &= separator_section_->ExpandOnce(output_buffer, dictionary,
-                                                   per_expand_data, true,
-                                                   cache);
-    }
+  if (is_static_) {
+    if (static_text_)
+      static_text_->Expand(output_buffer, dictionary, per_expand_data, cache);
+  } else {
+    error_free &= ExpandNodes(output_buffer, dictionary, per_expand_data,
+                              is_last_child_dict, cache);
   }
 
   if (per_expand_data->annotate()) {
@@ -1457,6 +2383,33 @@ bool SectionTemplateNode::ExpandOnce(
   return error_free;
 }
 
+bool SectionTemplateNode::ExpandNodes(
+    ExpandEmitter *output_buffer,
+    const TemplateDictionaryInterface *dictionary,
+    PerExpandData *per_expand_data,
+    bool is_last_child_dict,
+    const TemplateCache* cache) const {
+  bool error_free = true;
+  NodeList::const_iterator iter = node_list_.begin();
+  for (; iter != node_list_.end(); ++iter) {
+    error_free &=
+        (*iter)->Expand(output_buffer, dictionary, per_expand_data, cache);
+    if (per_expand_data->expand_aborted() != EXPAND_NOT_ABORTED)
+      return false;
+    // If this sub-node is a "separator section" -- a subsection
+    // with the name "OURNAME_separator" -- expand it every time
+    // through but the last.
+    if (*iter == separator_section_ && !is_last_child_dict) {
+      // We call ExpandOnce to make sure we always expand,
+      // even if *iter would normally be hidden.
+      error_free &= separator_section_->ExpandOnce(output_buffer, dictionary,
+                                                   per_expand_data, true,
+                                                   cache);
+    }
+  }
+  return error_free;
+}
+
 bool SectionTemplateNode::Expand(
     ExpandEmitter *output_buffer,
     const TemplateDictionaryInterface *dictionary,
@@ -1493,24 +2446,93 @@ bool SectionTemplateNode::Expand(
   bool error_free = true;
   while (di->HasNext()) {
     const TemplateDictionaryInterface& child = di->Next();
-    error_free &= ExpandOnce(output_buffer, &child, per_expand_data,
-                             !di->HasNext(), cache);
+    if (!ExpandOnce(output_buffer, &child, per_expand_data,
+                    !di->HasNext(), cache)) {
+      error_free = false;
+      if (per_expand_data->expand_aborted() != EXPAND_NOT_ABORTED)
+        break;
+    }
   }
   delete di;
   return error_free;
 }
 
 void SectionTemplateNode::WriteHeaderEntries(string *outstring,
-                                             const string& filename) const {
-  WriteOneHeaderEntry(outstring, string(token_.text, token_.textlen),
-                      filename);
+                                             HeaderEntryState* state) const {
+  WriteOneHeaderEntry(outstring, string(token_.text, token_.textlen), state);
 
   NodeList::const_iterator iter = node_list_.begin();
   for (; iter != node_list_.end(); ++iter) {
-    (*iter)->WriteHeaderEntries(outstring, filename);
+    (*iter)->WriteHeaderEntries(outstring, state);
+  }
+}
+
+// The top-level section is expanded once, and isn't counted as a
+// section.  Others cost kSectionWork per iteration, plus their nodes.
+void SectionTemplateNode::AddToCost(int section_depth,
+                                    TemplateCost* cost) const {
+  const bool is_main = (token_.text == kMainSectionName);
+  if (!is_main) {
+    cost->num_nodes++;
+    cost->num_section_nodes++;
+    section_depth++;
+    cost->max_section_depth = std::max(cost->max_section_depth,
+                                       section_depth);
+    cost->work_per_pass += kSectionWork;
+  }
+  const double work_before = cost->work_per_pass;
+  NodeList::const_iterator iter = node_list_.begin();
+  for (; iter != node_list_.end(); ++iter) {
+    (*iter)->AddToCost(section_depth, cost);
+  }
+  const double work = cost->work_per_pass - work_before;
+  if (!is_main && work > cost->max_iteration_work) {
+    cost->max_iteration_work = work;
+    cost->costliest_section.assign(token_.text, token_.textlen);
   }
 }
 
+// Mirrors Expand(): a section the dictionary hides costs nothing, and
+// one it shows is expanded once per section dictionary (or once with
+// the enclosing dictionary, if there are none).
+double SectionTemplateNode::EstimateWork(
+    const TemplateDictionaryInterface* dictionary, int assumed_iterations,
+    set<string>* unset) const {
+  const bool is_main = (token_.text == kMainSectionName);
+  if (dictionary == NULL) {
+    double work = kSectionWork;
+    NodeList::const_iterator iter = node_list_.begin();
+    for (; iter != node_list_.end(); ++iter)
+      work += (*iter)->EstimateWork(NULL, assumed_iterations, unset);
+    return is_main ? work - kSectionWork : work * assumed_iterations;
+  }
+
+  if (!is_main &&
+      (hidden_by_default_ ? !dictionary->IsUnhiddenSection(variable_) :
+       dictionary->IsHiddenSection(variable_)))
+    return 0;
+  vector<const TemplateDictionaryInterface*> dictionaries;
+  TemplateDictionaryInterface::Iterator* di = NULL;
+  if (!is_main) {
+    di = dictionary->CreateSectionIterator(variable_);
+    while (di->HasNext())
+      dictionaries.push_back(&di->Next());
+  }
+  if (dictionaries.empty())
+    dictionaries.push_back(dictionary);
+  double work = 0;
+  for (size_t i = 0; i < dictionaries.size(); ++i) {
+    if (!is_main)
+      work += kSectionWork;
+    NodeList::const_iterator iter = node_list_.begin();
+    for (; iter != node_list_.end(); ++iter)
+      work += (*iter)->EstimateWork(dictionaries[i], assumed_iterations,
+                                    unset);
+  }
+  delete di;
+  return work;
+}
+
 void SectionTemplateNode::DumpToString(int level, string *out) const {
   assert(out);
   AppendTokenWithIndent(level, out, "Section Start: ", token_, "\n");
@@ -1521,6 +2543,327 @@ void SectionTemplateNode::DumpToString(int level, string *out) const {
   AppendTokenWithIndent(level, out, "Section End: ", token_, "\n");
 }
 
+// --- SpecializeSection, CoalesceText, PrecompressText and AddTextRun
+
+SectionTemplateNode* SectionTemplateNode::SpecializeSection(
+    GlobalLookups* lookups) const {
+  SectionTemplateNode* copy = new SectionTemplateNode(token_,
+                                                      hidden_by_default_);
+  NodeList text_run;
+  NodeList::const_iterator iter = node_list_.begin();
+  for (; iter != node_list_.end(); ++iter) {
+    TemplateNode* node;
+    if (*iter == separator_section_) {
+      copy->separator_section_ = separator_section_->SpecializeSection(lookups);
+      node = copy->separator_section_;
+    } else {
+      node = (*iter)->Specialize(lookups);
+    }
+    if (node == NULL)
+      continue;
+    if (node->StaticText() != NULL) {
+      text_run.push_back(node);
+    } else {
+      copy->AddTextRun(&text_run);
+      copy->node_list_.push_back(node);
+    }
+  }
+  copy->AddTextRun(&text_run);
+  copy->FinishNodeList();
+  return copy;
+}
+
+int SectionTemplateNode::CoalesceText() {
+  int num_eliminated = 0;
+  NodeList old_node_list;
+  old_node_list.swap(node_list_);
+  NodeList text_run;
+  for (NodeList::iterator iter = old_node_list.begin();
+       iter != old_node_list.end(); ++iter) {
+    TemplateNode* node = *iter;
+    if (node->EmitsNothing()) {
+      delete node;
+      ++num_eliminated;
+    } else if (node->StaticText() != NULL) {
+      text_run.push_back(node);
+    } else {
+      num_eliminated += AddTextRun(&text_run);
+      num_eliminated += node->CoalesceText();
+      node_list_.push_back(node);
+    }
+  }
+  num_eliminated += AddTextRun(&text_run);
+  FinishNodeList();
+  return num_eliminated;
+}
+
+int SectionTemplateNode::PrecompressText(size_t min_length) {
+  int num_precompressed = 0;
+  for (NodeList::iterator iter = node_list_.begin();
+       iter != node_list_.end(); ++iter) {
+    num_precompressed += (*iter)->PrecompressText(min_length);
+  }
+  return num_precompressed;
+}
+
+size_t SectionTemplateNode::MemoryUsage() const {
+  // A list node holds two links as well as the element.
+  const size_t kListNodeSize = sizeof(TemplateNode*) + 2 * sizeof(void*);
+  size_t usage = (sizeof(*this) + TokenMemoryUsage(token_) +
+                  StringMemoryUsage(indentation_));
+  for (NodeList::const_iterator iter = node_list_.begin();
+       iter != node_list_.end(); ++iter) {
+    usage += kListNodeSize + (*iter)->MemoryUsage();
+  }
+  return usage;
+}
+
+void SectionTemplateNode::ShareText(TextStore* store, TextCuts* cuts) {
+  for (NodeList::iterator iter = node_list_.begin();
+       iter != node_list_.end(); ++iter) {
+    (*iter)->ShareText(store, cuts);
+  }
+}
+
+void SectionTemplateNode::RelocateText(const TextRelocation& relocation) {
+  RelocateToken(relocation, &token_);
+  variable_ = HashedTemplateString(token_.text, token_.textlen);
+  for (NodeList::iterator iter = node_list_.begin();
+       iter != node_list_.end(); ++iter) {
+    (*iter)->RelocateText(relocation);
+  }
+}
+
+void SectionTemplateNode::FinishNodeList() {
+  if (node_list_.empty()) {
+    is_static_ = true;
+  } else if (node_list_.size() == 1 && node_list_.front()->StaticText()) {
+    is_static_ = true;
+    static_text_ = node_list_.front();
+  }
+  skeleton_fingerprint_.store(0, std::memory_order_relaxed);
+  if (token_.text == kMainSectionName)
+    tree_id_ = g_next_tree_id.fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t SectionTemplateNode::SkeletonFingerprint() const {
+  uint64_t fingerprint = skeleton_fingerprint_.load(std::memory_order_relaxed);
+  if (fingerprint == 0) {
+    string skeleton;
+    StringEmitter skeleton_emitter(&skeleton);
+    EmitSkeletonRecords(&skeleton_emitter);
+    fingerprint = MurmurHash64(skeleton.data(), skeleton.size());
+    if (fingerprint == 0)
+      fingerprint = 1;   // 0 means "not computed yet"
+    skeleton_fingerprint_.store(fingerprint, std::memory_order_relaxed);
+  }
+  return fingerprint;
+}
+
+// --- EmitSkeleton, ExpandHoles and ExpandIncrementally
+
+void SectionTemplateNode::EmitSkeleton(ExpandEmitter* skeleton) const {
+  EmitSkeletonHeader(SkeletonFingerprint(), skeleton);
+  EmitSkeletonRecords(skeleton);
+}
+
+void SectionTemplateNode::EmitSkeletonRecords(ExpandEmitter* skeleton) const {
+  string text;
+  for (NodeList::const_iterator iter = node_list_.begin();
+       iter != node_list_.end(); ++iter) {
+    if (const TemplateToken* token = (*iter)->StaticText()) {
+      text.append(token->text, token->textlen);
+    } else {
+      EmitSkeletonRecord(text.data(), text.size(), skeleton);
+      text.clear();
+    }
+  }
+  EmitSkeletonRecord(text.data(), text.size(), skeleton);
+}
+
+bool SectionTemplateNode::ExpandHoles(
+    ExpandEmitter* holes,
+    const TemplateDictionaryInterface *dictionary,
+    PerExpandData* per_expand_data,
+    const TemplateCache *cache) const {
+  bool error_free = true;
+  EmitSkeletonHeader(SkeletonFingerprint(), holes);
+  string hole;
+  for (NodeList::const_iterator iter = node_list_.begin();
+       iter != node_list_.end(); ++iter) {
+    if ((*iter)->StaticText() == NULL) {
+      hole.clear();
+      StringEmitter hole_emitter(&hole);
+      error_free &= (*iter)->Expand(&hole_emitter, dictionary,
+                                    per_expand_data, cache);
+      EmitSkeletonRecord(hole.data(), hole.size(), holes);
+    }
+  }
+  return error_free;
+}
+
+bool SectionTemplateNode::ExpandIncrementally(
+    const TemplateDictionaryInterface *dictionary,
+    PerExpandData* per_expand_data,
+    const TemplateCache *cache,
+    ExpansionRecord* record,
+    vector<ExpandEdit>* edits) const {
+  edits->clear();
+  const bool start_over = (record->root_ == NULL ||
+                           record->tree_id_ != tree_id_);
+  if (start_over) {
+    // The record is for some other tree, so its map of the output is
+    // no use to us.  We build a new one, starting from nothing.
+    delete record->root_;
+    record->root_ = new ExpansionRecordNode;
+    record->tree_id_ = tree_id_;
+  }
+  vector<ExpandEdit> node_edits;
+  const bool error_free = ExpandRowChanges(dictionary, per_expand_data, true,
+                                           cache, 0, record->root_,
+                                           &node_edits);
+  if (per_expand_data->expand_aborted() != EXPAND_NOT_ABORTED) {
+    // The map is only partly up to date, so the next call starts over.
+    delete record->root_;
+    record->root_ = NULL;
+    record->tree_id_ = 0;
+    return false;
+  }
+  if (start_over) {
+    // The node edits are all in terms of an empty output.
+    ExpandEdit edit;
+    edit.offset = 0;
+    edit.delete_len = record->output_.size();
+    ApplyEdits(node_edits, &edit.insert);
+    record->output_ = edit.insert;
+    edits->push_back(edit);
+  } else {
+    ApplyEdits(node_edits, &record->output_);
+    edits->swap(node_edits);
+  }
+  return error_free;
+}
+
+// Mirrors Expand(): each row the section had last time is compared
+// with the corresponding row now, rows that are new are expanded from
+// scratch, and rows that are gone are deleted.
+bool SectionTemplateNode::ExpandChanges(
+    const TemplateDictionaryInterface *dictionary,
+    PerExpandData *per_expand_data,
+    const TemplateCache *cache,
+    size_t offset,
+    ExpansionRecordNode* record,
+    vector<ExpandEdit>* edits) const {
+  record->expanded = true;
+  bool error_free = true;
+  size_t row = 0;
+  if (!(hidden_by_default_ ? !dictionary->IsUnhiddenSection(variable_) :
+        dictionary->IsHiddenSection(variable_))) {
+    TemplateDictionaryInterface::Iterator* di =
+        dictionary->CreateSectionIterator(variable_);
+    if (!di->HasNext()) {
+      ExpansionRecordNode* row_record = record->Child(row++);
+      const size_t old_size = row_record->size;
+      error_free = ExpandRowChanges(dictionary, per_expand_data, true, cache,
+                                    offset, row_record, edits);
+      offset += old_size;
+    }
+    while (di->HasNext()) {
+      const TemplateDictionaryInterface& child = di->Next();
+      ExpansionRecordNode* row_record = record->Child(row++);
+      const size_t old_size = row_record->size;
+      if (!ExpandRowChanges(&child, per_expand_data, !di->HasNext(), cache,
+                            offset, row_record, edits)) {
+        error_free = false;
+        if (per_expand_data->expand_aborted() != EXPAND_NOT_ABORTED)
+          break;
+      }
+      offset += old_size;
+    }
+    delete di;
+  }
+  if (per_expand_data->expand_aborted() != EXPAND_NOT_ABORTED)
+    return false;
+
+  size_t gone_size = 0;
+  for (size_t i = row; i < record->children.size(); ++i) {
+    gone_size += record->children[i]->size;
+    delete record->children[i];
+  }
+  record->children.resize(row);
+  AddEdit(offset, gone_size, string(), edits);
+  record->SumChildSizes();
+  return error_free;
+}
+
+bool SectionTemplateNode::ExpandRowChanges(
+    const TemplateDictionaryInterface *dictionary,
+    PerExpandData *per_expand_data,
+    bool is_last_child_dict,
+    const TemplateCache *cache,
+    size_t offset,
+    ExpansionRecordNode* record,
+    vector<ExpandEdit>* edits) const {
+  if (!per_expand_data->CountIteration())
+    return false;
+  record->expanded = true;
+  bool error_free = true;
+  size_t child = 0;
+  for (NodeList::const_iterator iter = node_list_.begin();
+       iter != node_list_.end(); ++iter) {
+    ExpansionRecordNode* node_record = record->Child(child++);
+    size_t old_size = node_record->size;
+    error_free &= (*iter)->ExpandChanges(dictionary, per_expand_data, cache,
+                                         offset, node_record, edits);
+    if (per_expand_data->expand_aborted() != EXPAND_NOT_ABORTED)
+      return false;
+    offset += old_size;
+    if (*iter == separator_section_) {
+      // As in ExpandNodes(), the separator is expanded once more in
+      // every row but the last.
+      node_record = record->Child(child++);
+      old_size = node_record->size;
+      if (is_last_child_dict) {
+        AddEdit(offset, old_size, string(), edits);
+        node_record->Clear();
+      } else {
+        error_free &= separator_section_->ExpandRowChanges(
+            dictionary, per_expand_data, true, cache, offset, node_record,
+            edits);
+        if (per_expand_data->expand_aborted() != EXPAND_NOT_ABORTED)
+          return false;
+      }
+      offset += old_size;
+    }
+  }
+  record->SumChildSizes();
+  return error_free;
+}
+
+int SectionTemplateNode::AddTextRun(NodeList* run) {
+  string text;
+  for (NodeList::const_iterator iter = run->begin(); iter != run->end();
+       ++iter) {
+    const TemplateToken* token = (*iter)->StaticText();
+    text.append(token->text, token->textlen);
+  }
+  int num_eliminated;
+  if (run->size() == 1 && !text.empty()) {
+    node_list_.push_back(run->front());   // nothing to merge it with
+    num_eliminated = 0;
+  } else {
+    for (NodeList::iterator iter = run->begin(); iter != run->end(); ++iter)
+      delete *iter;
+    num_eliminated = static_cast<int>(run->size());
+    if (!text.empty()) {
+      node_list_.push_back(new TextTemplateNode(text));
+      --num_eliminated;
+    }
+  }
+  run->clear();
+  return num_eliminated;
+}
+
 // --- AddSubnode and its sub-routines
 
 // Under auto-escape (and parsing-enabled modes) advance the parser state.
@@ -1538,6 +2881,22 @@ bool SectionTemplateNode::AddTextNode(const TemplateToken* token,
     node_list_.push_back(new TextTemplateNode(*token));
     if (AUTO_ESCAPE_PARSING_CONTEXT(my_template->initial_context_)) {
       assert(htmlparser);
+      Template::AutoEscapeCheckpoints* checkpoints =
+          my_template->parse_state_.checkpoints;
+      if (checkpoints != NULL) {
+        if (checkpoints->Replaying(token->text, htmlparser))
+          return true;   // unchanged since the last build, and parsed then
+        if (htmlparser->state() != HtmlParser::STATE_ERROR) {
+          // Where this token starts depends on up to two bytes past
+          // it (see MaybeEatNewline()); that it's text depends on the
+          // start-marker's worth.
+          const size_t marker_len =
+              my_template->parse_state_.current_delimiters.start_marker_len;
+          checkpoints->MaybeAddCheckpoint(
+              token->text, my_template->parse_state_.bufend, *htmlparser,
+              marker_len > 2 ? marker_len : 2);
+        }
+      }
       if (htmlparser->state() == HtmlParser::STATE_ERROR ||
           htmlparser->Parse(token->text, static_cast<int>(token->textlen)) ==
           HtmlParser::STATE_ERROR) {
@@ -1587,8 +2946,12 @@ bool SectionTemplateNode::AddVariableNode(TemplateToken* token,
     // So it's ok to hard-code in that these are " " and "\n",
     // respectively, even though in theory the user could change them
     // (to say, BI_NEWLINE == "\r\n").
+    Template::AutoEscapeCheckpoints* checkpoints =
+        htmlparser ? my_template->parse_state_.checkpoints : NULL;
+    const bool replaying =
+        checkpoints != NULL && checkpoints->Replaying(token->text, htmlparser);
     if (variable_name == "BI_SPACE" || variable_name == "BI_NEWLINE") {
-      if (AUTO_ESCAPE_PARSING_CONTEXT(initial_context)) {
+      if (AUTO_ESCAPE_PARSING_CONTEXT(initial_context) && !replaying) {
         assert(htmlparser);
         if (htmlparser->state() == HtmlParser::STATE_ERROR ||
             htmlparser->Parse(variable_name == "BI_SPACE" ? " " : "\n") ==
@@ -1602,9 +2965,18 @@ bool SectionTemplateNode::AddVariableNode(TemplateToken* token,
                              // Luckily, StringHash(a, b) is defined as "a < b"
                              StringHash())) {
       // Do not escape the variable, it is whitelisted.
+    } else if (replaying) {
+      // The parser hasn't seen this part of the input; use what it said
+      // last time.  If that fails, BuildTree() throws this tree away.
+      const vector<const ModifierAndValue*>* modvals =
+          checkpoints->ReplayModifiers();
+      if (modvals != NULL && !modvals->empty())
+        token->UpdateModifier(*modvals);
     } else {
       vector<const ModifierAndValue*> modvals =
           GetModifierForContext(initial_context, htmlparser, my_template);
+      if (checkpoints != NULL)
+        checkpoints->RecordModifiers(modvals);
       // There should always be at least one modifier in any Auto-Escape mode.
       if (modvals.empty())
         success = false;
@@ -2127,10 +3499,19 @@ TemplateCache* mutable_default_template_cache() {
 
 Template* Template::StringToTemplate(const TemplateString& content,
                                      Strip strip) {
+  return StringToTemplate(content, strip, NULL);
+}
+
+Template* Template::StringToTemplate(const TemplateString& content,
+                                     Strip strip, TextStore* text_store) {
   // An empty original_filename_ keeps ReloadIfChangedLocked from performing
   // file operations.
 
   Template *tpl = new Template("", strip, NULL);
+  if (text_store != NULL) {
+    text_store->IncRef();
+    tpl->text_store_ = text_store;
+  }
 
   // But we have to do the "loading" and parsing ourselves:
 
@@ -2163,16 +3544,21 @@ Template* Template::StringToTemplate(const TemplateString& content,
 // ----------------------------------------------------------------------
 
 Template::Template(const TemplateString& filename, Strip strip,
-                   TemplateCache* owner)
+                   TemplateCache* owner, const Template* previous)
     // TODO(csilvers): replace ToString() with an is_immutable() check
     : original_filename_(filename.data(), filename.size()), resolved_filename_(),
       filename_mtime_(0), strip_(strip), state_(TS_EMPTY),
       template_cache_(owner), template_text_(NULL), template_text_len_(0),
       tree_(NULL), parse_state_(),
-      initial_context_(TC_MANUAL), htmlparser_(NULL) {
+      initial_context_(TC_MANUAL), htmlparser_(NULL),
+      autoescape_checkpoints_(NULL), specialization_(NULL),
+      precompress_threshold_(0),
+      text_store_(owner ? owner->text_store_ : NULL) {
   VLOG(2) << "Constructing Template for " << template_file()
           << "; with context " << initial_context_
           << "; and strip " << strip_ << endl;
+  if (text_store_ != NULL)
+    text_store_->IncRef();
 
   // Preserve whitespace in Javascript files because carriage returns
   // can convey meaning for comment termination and closures
@@ -2180,6 +3566,13 @@ Template::Template(const TemplateString& filename, Strip strip,
       strip_ == STRIP_WHITESPACE) {
     strip_ = STRIP_BLANK_LINES;
   }
+  // Nothing else looks at previous's checkpoints once it's been
+  // constructed, so we can just take them.
+  if (previous != NULL) {
+    MutexLock ml(&g_checkpoint_mutex);
+    autoescape_checkpoints_ = previous->autoescape_checkpoints_;
+    previous->autoescape_checkpoints_ = NULL;
+  }
   ReloadIfChangedLocked();
 }
 
@@ -2187,12 +3580,16 @@ Template::~Template() {
   VLOG(2) << endl << "Deleting Template for " << template_file()
           << "; with context " << initial_context_
           << "; and strip " << strip_ << endl;
-  // Since this is only used by tests, we don't bother with locking
   num_deletes_++;
+  delete specialization_;   // has pointers into template_text_
   delete tree_;
   // Delete this last, since tree has pointers into template_text_
   delete[] template_text_;
   delete htmlparser_;
+  delete autoescape_checkpoints_;
+  // The tree's shared text is gone, so the store can go too.
+  if (text_store_ != NULL)
+    text_store_->DecRef();
 }
 
 // In TemplateContexts where the HTML parser is needed, we initialize it in
@@ -2233,6 +3630,41 @@ void Template::MaybeInitHtmlParser(bool in_tag) {
 //    Dump() for when Dump() is called by the caller.
 // ----------------------------------------------------------------------
 
+// ----------------------------------------------------------------------
+// ShareTextRuns()
+//    Moves the long runs of text in tree into store (see
+//    TemplateNode::ShareText()), and replaces *buffer, which tree
+//    points into, by a copy without them.
+// ----------------------------------------------------------------------
+
+static void ShareTextRuns(TextStore* store, SectionTemplateNode* tree,
+                          const char** buffer, const char** buffer_end) {
+  TextCuts cuts;
+  tree->ShareText(store, &cuts);
+  if (cuts.empty())
+    return;
+  sort(cuts.begin(), cuts.end());
+
+  size_t cut_len = 0;
+  for (TextCuts::const_iterator it = cuts.begin(); it != cuts.end(); ++it)
+    cut_len += it->second;
+  char* new_buffer = new char[(*buffer_end - *buffer) - cut_len];
+  char* out = new_buffer;
+  const char* in = *buffer;
+  for (TextCuts::const_iterator it = cuts.begin(); it != cuts.end(); ++it) {
+    memcpy(out, in, it->first - in);
+    out += it->first - in;
+    in = it->first + it->second;
+  }
+  memcpy(out, in, *buffer_end - in);
+  out += *buffer_end - in;
+
+  tree->RelocateText(TextRelocation(*buffer, *buffer_end, new_buffer, cuts));
+  delete[] *buffer;
+  *buffer = new_buffer;
+  *buffer_end = out;
+}
+
 // NOTE: BuildTree takes over ownership of input_buffer, and will delete it.
 //       It should have been created via new[].
 // You should hold a write-lock on g_template_mutex before calling this
@@ -2242,21 +3674,91 @@ void Template::MaybeInitHtmlParser(bool in_tag) {
 // will have the proper modifiers set.
 bool Template::BuildTree(const char* input_buffer,
                          const char* input_buffer_end) {
-  set_state(TS_EMPTY);
-  parse_state_.bufstart = input_buffer;
-  parse_state_.bufend = input_buffer_end;
-  parse_state_.phase = ParseState::GETTING_TEXT;
-  parse_state_.current_delimiters = Template::MarkerDelimiters();
-  // Assign an arbitrary name to the top-level node
-  SectionTemplateNode *top_node = new SectionTemplateNode(
-      TemplateToken(TOKENTYPE_SECTION_START,
-                    kMainSectionName, strlen(kMainSectionName), NULL),
-      false);
-  while (top_node->AddSubnode(this)) {
-    // Add the rest of the template in.
+  // If this is a reload and the input hasn't changed up to one of the
+  // auto-escape checkpoints, resume parsing from there.  If resuming
+  // goes wrong, which it shouldn't, we start over from scratch.
+  // While we build, the checkpoints are ours alone: AddSubnode() gets
+  // at them through parse_state_, so nothing needs a lock until we put
+  // them back.
+  AutoEscapeCheckpoints* checkpoints = NULL;
+  if (!original_filename_.empty()) {   // string templates never reload
+    MutexLock ml(&g_checkpoint_mutex);
+    checkpoints = autoescape_checkpoints_;
+    autoescape_checkpoints_ = NULL;
+  }
+  SectionTemplateNode *top_node = NULL;
+  for (int attempt = 0; top_node == NULL; ++attempt) {
+    bool resuming = false;
+    size_t resume_offset = 0;
+    if (!original_filename_.empty()) {
+      if (checkpoints == NULL || attempt > 0) {
+        delete checkpoints;
+        checkpoints = new AutoEscapeCheckpoints;
+      }
+      checkpoints->StartBuild(input_buffer, input_buffer_end);
+      resuming = checkpoints->resume != NULL;
+      if (resuming)
+        resume_offset = checkpoints->resume->offset;
+    }
+
+    set_state(TS_EMPTY);
+    parse_state_.bufstart = input_buffer;
+    parse_state_.bufend = input_buffer_end;
+    parse_state_.phase = ParseState::GETTING_TEXT;
+    parse_state_.current_delimiters = Template::MarkerDelimiters();
+    parse_state_.checkpoints = checkpoints;
+    // Assign an arbitrary name to the top-level node
+    top_node = new SectionTemplateNode(
+        TemplateToken(TOKENTYPE_SECTION_START,
+                      kMainSectionName, strlen(kMainSectionName), NULL),
+        false);
+    while (top_node->AddSubnode(this)) {
+      // Add the rest of the template in.
+    }
+
+    if (resuming) {
+      if (checkpoints->FinishBuild()) {
+        VLOG(1) << "Resumed auto-escape parsing of " << template_file()
+                << " at offset " << resume_offset << endl;
+        ++num_resumed_builds_;
+      } else {
+        LOG(WARNING) << "Could not resume auto-escape parsing of "
+                     << template_file() << "; parsing it from the top"
+                     << endl;
+        delete top_node;
+        top_node = NULL;
+        initial_context_ = TC_MANUAL;
+        delete htmlparser_;
+        htmlparser_ = NULL;
+      }
+    }
+  }
+  parse_state_.checkpoints = NULL;
+  // Checkpoints are only worth their memory if there are some, and a
+  // failed build has nothing to resume.
+  if (checkpoints != NULL &&
+      (state() == TS_ERROR || checkpoints->checkpoints.empty())) {
+    delete checkpoints;
+    checkpoints = NULL;
+  }
+  if (checkpoints != NULL) {
+    MutexLock ml(&g_checkpoint_mutex);
+    // Only a build takes them, and builds of one template don't overlap.
+    assert(autoescape_checkpoints_ == NULL);
+    autoescape_checkpoints_ = checkpoints;
   }
 
+  const int num_eliminated = top_node->CoalesceText();
+  VLOG(1) << "Coalescing text in " << template_file() << " eliminated "
+          << num_eliminated << " nodes" << endl;
+  if (text_store_ != NULL && state() != TS_ERROR)
+    ShareTextRuns(text_store_, top_node, &input_buffer, &input_buffer_end);
+  if (precompress_threshold_ > 0)
+    top_node->PrecompressText(precompress_threshold_);
+
   // get rid of the old tree, whenever we try to build a new one.
+  delete specialization_;
+  specialization_ = NULL;
   delete tree_;
   delete[] template_text_;
   tree_ = top_node;
@@ -2281,10 +3783,25 @@ bool Template::BuildTree(const char* input_buffer,
 void Template::WriteHeaderEntries(string *outstring) const {
   if (state() == TS_READY) {   // only write header entries for 'good' tpls
     outstring->append("#include <ctemplate/template_string.h>\n");
-    tree_->WriteHeaderEntries(outstring, template_file());
+    HeaderEntryState state(template_file());
+    tree_->WriteHeaderEntries(outstring, &state);
   }
 }
 
+bool Template::AnalyzeCost(const TemplateDictionaryInterface* sample,
+                           int assumed_iterations, TemplateCost* cost) const {
+  ReaderMutexLock ml(&g_template_mutex);
+  if (state() != TS_READY)
+    return false;
+  *cost = TemplateCost();
+  tree_->AddToCost(0, cost);
+  set<string> unset;
+  cost->estimated_work = tree_->EstimateWork(sample, assumed_iterations,
+                                             &unset);
+  cost->unset_variables.assign(unset.begin(), unset.end());
+  return true;
+}
+
 // Dumps the parsed structure of the template for debugging assistance.
 // It goes to stdout instead of LOG to avoid possible truncation due to size.
 void Template::Dump(const char *filename) const {
@@ -2307,6 +3824,124 @@ void Template::DumpToString(const char *filename, string *out) const {
   out->append("------------End Template Dump----------------\n");
 }
 
+// ----------------------------------------------------------------------
+// Template::SpecializeOnGlobalValues()
+// Template::SpecializeOnGlobalValuesLocked()
+//    Builds specialization_: a copy of tree_ in which every variable
+//    that has a value in the global dictionary (and no extension
+//    modifiers) is replaced by its modified value, merged with the
+//    text around it.  Pragma nodes, which emit nothing, are dropped.
+//    We remember every global we looked up, so when the globals
+//    change we only rebuild if one of *those* changed.
+// ----------------------------------------------------------------------
+
+Template::Specialization::~Specialization() {
+  delete tree;
+}
+
+void Template::SpecializeOnGlobalValues() const
+    LOCKS_EXCLUDED(g_template_mutex) {
+  WriterMutexLock ml(&g_template_mutex);
+  SpecializeOnGlobalValuesLocked();
+}
+
+void Template::SpecializeOnGlobalValuesLocked() const
+    EXCLUSIVE_LOCKS_REQUIRED(g_template_mutex) {
+  if (state() != TS_READY)
+    return;
+  // Read this first: if a global changes while we work, we'll look stale.
+  const int generation = TemplateDictionary::GlobalValuesGeneration();
+  if (specialization_ != NULL) {
+    if (specialization_->generation == generation)
+      return;
+    bool changed = false;
+    GlobalLookups::const_iterator it = specialization_->lookups.begin();
+    for (; !changed && it != specialization_->lookups.end(); ++it) {
+      TemplateString value("");
+      const bool found = TemplateDictionary::GetGlobalValue(it->name, &value);
+      changed = (found != it->found ||
+                 it->value != string(value.data(), value.size()));
+    }
+    if (!changed) {
+      specialization_->generation = generation;
+      return;
+    }
+  }
+
+  Specialization* specialization = new Specialization;
+  specialization->generation = generation;
+  SectionTemplateNode* tree = tree_->SpecializeSection(
+      &specialization->lookups);
+  int num_folded = 0;
+  for (GlobalLookups::const_iterator it = specialization->lookups.begin();
+       it != specialization->lookups.end(); ++it) {
+    num_folded += it->found;
+  }
+  if (num_folded > 0) {
+    specialization->tree = tree;
+    if (precompress_threshold_ > 0)
+      tree->PrecompressText(precompress_threshold_);
+  } else {
+    delete tree;       // no better than tree_, so don't bother keeping it
+  }
+  VLOG(1) << "Specialized " << template_file() << ": folded " << num_folded
+          << " global values" << endl;
+  delete specialization_;
+  specialization_ = specialization;
+}
+
+// ----------------------------------------------------------------------
+// Template::PrecompressTextLocked()
+//    Compresses the long runs of static text in tree_ (and in the
+//    specialized tree, if there is one), and remembers min_length so
+//    that trees built later, by BuildTree() or a re-specialization,
+//    get the same treatment.
+// ----------------------------------------------------------------------
+
+void Template::PrecompressTextLocked(size_t min_length) const
+    EXCLUSIVE_LOCKS_REQUIRED(g_template_mutex) {
+  precompress_threshold_ = min_length;
+  if (min_length == 0 || state() != TS_READY)
+    return;
+  int num_precompressed = tree_->PrecompressText(min_length);
+  if (specialization_ != NULL && specialization_->tree != NULL)
+    num_precompressed += specialization_->tree->PrecompressText(min_length);
+  VLOG(1) << "Precompressed " << num_precompressed << " text runs in "
+          << template_file() << endl;
+}
+
+// ----------------------------------------------------------------------
+// Template::MemoryUsage()
+// Template::MemoryUsageLocked()
+//    Adds up the template text, the parse trees and the rest of what
+//    the template holds on to.  TemplateCache charges this against
+//    its memory budget.
+// ----------------------------------------------------------------------
+
+size_t Template::MemoryUsage() const LOCKS_EXCLUDED(g_template_mutex) {
+  ReaderMutexLock ml(&g_template_mutex);
+  return MemoryUsageLocked();
+}
+
+size_t Template::MemoryUsageLocked() const
+    SHARED_LOCKS_REQUIRED(g_template_mutex) {
+  size_t usage = (sizeof(*this) + template_text_len_ +
+                  StringMemoryUsage(original_filename_) +
+                  StringMemoryUsage(resolved_filename_));
+  if (tree_ != NULL)
+    usage += tree_->MemoryUsage();
+  if (specialization_ != NULL) {
+    usage += (sizeof(*specialization_) +
+              specialization_->lookups.capacity() * sizeof(GlobalLookup));
+    if (specialization_->tree != NULL)
+      usage += specialization_->tree->MemoryUsage();
+  }
+  MutexLock ml(&g_checkpoint_mutex);
+  if (autoescape_checkpoints_ != NULL)
+    usage += autoescape_checkpoints_->MemoryUsage();
+  return usage;
+}
+
 // -------------------------------------------------------------------------
 // Template::state()
 // Template::set_state()
@@ -2607,7 +4242,8 @@ bool Template::ReloadIfChangedLocked()
     return false;
   }
 
-  FileStat statbuf;
+  const TemplateSource* source = template_cache_->template_source();
+  TemplateSource::FileInfo statbuf;
   if (resolved_filename_.empty()) {
     if (!template_cache_->ResolveTemplateFilename(original_filename_,
                                                   &resolved_filename_,
@@ -2617,7 +4253,7 @@ bool Template::ReloadIfChangedLocked()
       return false;
     }
   } else {
-    if (!File::Stat(resolved_filename_, &statbuf)) {
+    if (!source->Stat(resolved_filename_, &statbuf)) {
       LOG(WARNING) << "Unable to stat file " << resolved_filename_ << endl;
       // We keep the old tree if there is one, otherwise we're in error
       set_state(TS_ERROR);
@@ -2625,7 +4261,7 @@ bool Template::ReloadIfChangedLocked()
     }
   }
 
-  if (statbuf.IsDirectory()) {
+  if (statbuf.is_directory) {
     LOG(WARNING) << resolved_filename_
                  << "is a directory and thus not readable" << endl;
     // We keep the old tree if there is one, otherwise we're in error
@@ -2640,26 +4276,24 @@ bool Template::ReloadIfChangedLocked()
     return false;   // file's timestamp hasn't changed, so no need to reload
   }
 
-  File* fp = File::Open(resolved_filename_.c_str(), "r");
-  if (fp == NULL) {
-    LOG(ERROR) << "Can't find file " << resolved_filename_
-               << "; skipping" << endl;
-    // We keep the old tree if there is one, otherwise we're in error
-    set_state(TS_ERROR);
-    return false;
-  }
   size_t buflen = statbuf.length;
   char* file_buffer = new char[buflen];
-  if (fp->Read(file_buffer, buflen) != buflen) {
-    LOG(ERROR) << "Error reading file " << resolved_filename_
-               << ": " << strerror(errno) << endl;
-    fp->Close();
-    delete[] file_buffer;
-    // We could just keep the old tree, but probably safer to say 'error'
-    set_state(TS_ERROR);
-    return false;
+  // If another template just read this file (with another Strip
+  // mode, say), we can use what it read.
+  if (text_store_ == NULL ||
+      !text_store_->GetRecentFile(resolved_filename_, statbuf.mtime,
+                                  buflen, file_buffer)) {
+    if (!source->Read(resolved_filename_, file_buffer, buflen)) {
+      LOG(ERROR) << "Error reading file " << resolved_filename_ << endl;
+      delete[] file_buffer;
+      // We could just keep the old tree, but probably safer to say 'error'
+      set_state(TS_ERROR);
+      return false;
+    }
+    if (text_store_ != NULL)
+      text_store_->AddRecentFile(resolved_filename_, statbuf.mtime,
+                                 file_buffer, buflen);
   }
-  fp->Close();
 
   // Now that we know we've read the file ok, mark the new mtime
   filename_mtime_ = statbuf.mtime;
@@ -2678,6 +4312,10 @@ bool Template::ReloadIfChangedLocked()
   // of input_buffer in every case, and will eventually delete it.
   if ( BuildTree(file_buffer, file_buffer + buflen) ) {
     assert(state() == TS_READY);
+    // BuildTree() threw away the specialization; if the cache's global
+    // values are final, nothing else would rebuild it until one changed.
+    if (template_cache_->global_values_final())
+      SpecializeOnGlobalValuesLocked();
     return true;
   } else {
     assert(state() != TS_READY);
@@ -2685,6 +4323,56 @@ bool Template::ReloadIfChangedLocked()
   }
 }
 
+// ----------------------------------------------------------------------
+// OutputLimitEmitter
+//    Passes output on to another emitter until
+//    PerExpandData::max_output_bytes() bytes have gone by.  Then it
+//    aborts the expand, and drops the rest of the output -- as it does
+//    once the expand has been aborted for any other reason.
+// ----------------------------------------------------------------------
+
+class OutputLimitEmitter : public ExpandEmitter {
+ public:
+  OutputLimitEmitter(ExpandEmitter* output, PerExpandData* per_expand_data)
+      : output_(output), per_expand_data_(per_expand_data),
+        remaining_(per_expand_data->max_output_bytes()) {
+  }
+  virtual void Emit(char c) { Emit(&c, 1); }
+  virtual void Emit(const string& s) { Emit(s.data(), s.size()); }
+  virtual void Emit(const char* s) { Emit(s, strlen(s)); }
+  virtual void Emit(const char* s, size_t slen) {
+    slen = Allow(slen);
+    if (slen > 0)
+      output_->Emit(s, slen);
+  }
+  virtual void EmitStaticText(const StaticTextSegment& text) {
+    if (per_expand_data_->expand_aborted() == EXPAND_NOT_ABORTED &&
+        text.textlen <= remaining_) {
+      remaining_ -= text.textlen;
+      output_->EmitStaticText(text);
+    } else {
+      Emit(text.text, text.textlen);
+    }
+  }
+
+ private:
+  // Returns how many of the next slen bytes we can pass on.
+  size_t Allow(size_t slen) {
+    if (per_expand_data_->expand_aborted() != EXPAND_NOT_ABORTED)
+      return 0;
+    if (slen > remaining_) {
+      per_expand_data_->Abort(EXPAND_OUTPUT_LIMIT_EXCEEDED);
+      slen = remaining_;
+    }
+    remaining_ -= slen;
+    return slen;
+  }
+
+  ExpandEmitter* const output_;
+  PerExpandData* const per_expand_data_;
+  size_t remaining_;
+};
+
 // ----------------------------------------------------------------------
 // Template::ExpandLocked()
 // Template::ExpandWithDataAndCache()
@@ -2692,7 +4380,9 @@ bool Template::ReloadIfChangedLocked()
 //    by expanding its parse tree (which starts with a top-level
 //    section node).  For each variable/section/include-template it
 //    sees, it replaces the name stored in the parse-tree with the
-//    appropriate value from the passed-in dictionary.
+//    appropriate value from the passed-in dictionary.  The expansion
+//    limits in per_expand_data apply from here, the outermost expand,
+//    on down.
 // ----------------------------------------------------------------------
 
 bool Template::ExpandLocked(ExpandEmitter *expand_emitter,
@@ -2713,6 +4403,9 @@ bool Template::ExpandLocked(ExpandEmitter *expand_emitter,
     return false;
   }
 
+  const SectionTemplateNode* tree = TreeToExpandLocked(per_expand_data,
+                                                       cache);
+
   if (per_expand_data->annotate()) {
     // Remove the machine dependent prefix from the template file name.
     const char* file = template_file();
@@ -2737,12 +4430,12 @@ bool Template::ExpandLocked(ExpandEmitter *expand_emitter,
     // pass the template name in as the string arg in this case.
     string value;
     StringEmitter tmp_emitter(&value);
-    error_free &= tree_->Expand(&tmp_emitter, dict, per_expand_data, cache);
+    error_free &= tree->Expand(&tmp_emitter, dict, per_expand_data, cache);
     modifier->Modify(value.data(), value.size(), per_expand_data,
                      expand_emitter, template_file());
   } else {
     // No need to modify this template.
-    error_free &= tree_->Expand(expand_emitter, dict, per_expand_data, cache);
+    error_free &= tree->Expand(expand_emitter, dict, per_expand_data, cache);
   }
 
   if (per_expand_data->annotate()) {
@@ -2752,6 +4445,23 @@ bool Template::ExpandLocked(ExpandEmitter *expand_emitter,
   return error_free;
 }
 
+// Use the tree with global values folded in if the cache asked for
+// one and it's up to date.  Annotations need the variable nodes the
+// specialized tree lacks, though.
+const SectionTemplateNode* Template::TreeToExpandLocked(
+    const PerExpandData* per_expand_data,
+    const TemplateCache* cache) const
+    SHARED_LOCKS_REQUIRED(g_template_mutex) {
+  if (specialization_ && specialization_->tree &&
+      !per_expand_data->annotate() &&
+      cache && cache->global_values_final() &&
+      specialization_->generation ==
+      TemplateDictionary::GlobalValuesGeneration()) {
+    return specialization_->tree;
+  }
+  return tree_;
+}
+
 bool Template::ExpandWithDataAndCache(
     ExpandEmitter *expand_emitter,
     const TemplateDictionaryInterface *dict,
@@ -2765,7 +4475,149 @@ bool Template::ExpandWithDataAndCache(
   // TODO(csilvers): We can remove this once we delete ReloadIfChanged.
   //                 When we do that, ExpandLocked() can go away as well.
   ReaderMutexLock ml(&g_template_mutex);
-  return ExpandLocked(expand_emitter, dict, per_expand_data, cache);
+  if (per_expand_data == NULL)
+    return ExpandLocked(expand_emitter, dict, per_expand_data, cache);
+  per_expand_data->StartExpand();
+  bool error_free;
+  if (per_expand_data->max_output_bytes() == 0) {
+    error_free = ExpandLocked(expand_emitter, dict, per_expand_data, cache);
+  } else {
+    OutputLimitEmitter limited_emitter(expand_emitter, per_expand_data);
+    error_free = ExpandLocked(&limited_emitter, dict, per_expand_data, cache);
+  }
+  // We may have run out of output in the very last node.
+  return (error_free &&
+          per_expand_data->expand_aborted() == EXPAND_NOT_ABORTED);
+}
+
+// ----------------------------------------------------------------------
+// Template::ExpandSkeleton()
+// Template::ExpandHoles()
+// Template::SpliceSkeleton()
+// Template::ExpandIncrementally()
+//    These implement the TemplateCache methods of the same name.
+//    The skeleton is the main section's text, with a hole for each
+//    of its other nodes; see SectionTemplateNode::EmitSkeleton().
+//    ExpandIncrementally() walks the whole tree instead; see
+//    SectionTemplateNode::ExpandChanges().
+// ----------------------------------------------------------------------
+
+bool Template::ExpandSkeleton(ExpandEmitter* skeleton,
+                              const TemplateCache* cache) const
+    LOCKS_EXCLUDED(g_template_mutex) {
+  ReaderMutexLock ml(&g_template_mutex);
+  if (state() != TS_READY)
+    return false;
+  PerExpandData empty_per_expand_data;
+  TreeToExpandLocked(&empty_per_expand_data, cache)->EmitSkeleton(skeleton);
+  return true;
+}
+
+bool Template::ExpandHoles(ExpandEmitter* holes,
+                           const TemplateDictionaryInterface *dict,
+                           PerExpandData* per_expand_data,
+                           const TemplateCache* cache) const
+    LOCKS_EXCLUDED(g_template_mutex) {
+  PerExpandData empty_per_expand_data;
+  if (per_expand_data == NULL)
+    per_expand_data = &empty_per_expand_data;
+  // These both apply to the whole of the output, not just the holes.
+  if (per_expand_data->annotate() ||
+      per_expand_data->template_expansion_modifier()) {
+    return false;
+  }
+
+  ReaderMutexLock ml(&g_template_mutex);
+  if (state() != TS_READY)
+    return false;
+  per_expand_data->StartExpand();
+  return TreeToExpandLocked(per_expand_data, cache)->ExpandHoles(
+      holes, dict, per_expand_data, cache);
+}
+
+bool Template::ExpandIncrementally(const TemplateDictionaryInterface *dict,
+                                   PerExpandData* per_expand_data,
+                                   const TemplateCache* cache,
+                                   ExpansionRecord* record,
+                                   vector<ExpandEdit>* edits) const
+    LOCKS_EXCLUDED(g_template_mutex) {
+  PerExpandData empty_per_expand_data;
+  if (per_expand_data == NULL)
+    per_expand_data = &empty_per_expand_data;
+  if (per_expand_data->annotate() ||
+      per_expand_data->template_expansion_modifier()) {
+    return false;
+  }
+
+  ReaderMutexLock ml(&g_template_mutex);
+  if (state() != TS_READY)
+    return false;
+  per_expand_data->StartExpand();
+  return TreeToExpandLocked(per_expand_data, cache)->ExpandIncrementally(
+      dict, per_expand_data, cache, record, edits);
+}
+
+/*static*/ bool Template::SpliceSkeleton(const string& skeleton,
+                                         const string& holes,
+                                         ExpandEmitter* output) {
+  if (skeleton.size() < kSkeletonHeaderLen ||
+      holes.compare(0, kSkeletonHeaderLen,
+                    skeleton, 0, kSkeletonHeaderLen) != 0) {
+    return false;   // not the holes for this skeleton
+  }
+  // We check everything fits together before emitting anything.
+  vector<pair<const char*, size_t> > pieces;
+  size_t skeleton_pos = kSkeletonHeaderLen;
+  size_t holes_pos = kSkeletonHeaderLen;
+  while (true) {
+    const char* data;
+    size_t len;
+    if (!ReadSkeletonRecord(skeleton, &skeleton_pos, &data, &len))
+      return false;
+    pieces.push_back(pair<const char*, size_t>(data, len));
+    if (skeleton_pos == skeleton.size())
+      break;
+    if (!ReadSkeletonRecord(holes, &holes_pos, &data, &len))
+      return false;
+    pieces.push_back(pair<const char*, size_t>(data, len));
+  }
+  if (holes_pos != holes.size())
+    return false;
+
+  for (vector<pair<const char*, size_t> >::const_iterator it = pieces.begin();
+       it != pieces.end(); ++it) {
+    output->Emit(it->first, it->second);
+  }
+  return true;
+}
+
+// ----------------------------------------------------------------------
+// Template::ExpandBatch()
+//    The expansions share a lock and a PerExpandData, and each output
+//    string starts out with room for as much as the one before it
+//    needed, which, for a batch of similar dictionaries, is usually
+//    about right.
+// ----------------------------------------------------------------------
+
+bool Template::ExpandBatch(
+    const vector<const TemplateDictionaryInterface*>& dictionaries,
+    size_t begin, size_t end,
+    vector<string>* outputs,
+    const TemplateCache* cache) const LOCKS_EXCLUDED(g_template_mutex) {
+  ReaderMutexLock ml(&g_template_mutex);
+  PerExpandData per_expand_data;
+  bool error_free = true;
+  size_t size_hint = 0;
+  for (size_t i = begin; i < end; ++i) {
+    string* output = &(*outputs)[i];
+    output->clear();
+    output->reserve(size_hint);
+    StringEmitter emitter(output);
+    error_free &= ExpandLocked(&emitter, dictionaries[i], &per_expand_data,
+                               cache);
+    size_hint = output->size();
+  }
+  return error_free;
 }
 
 }
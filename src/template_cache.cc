@@ -37,19 +37,32 @@
 #include <stddef.h>      // for size_t
 #include <stdlib.h>      // for strerror()
 #include <sys/stat.h>
+#include <time.h>        // for time()
 #ifdef HAVE_UNISTD_H
 # include <unistd.h>
 #endif      // for getcwd()
+#if defined(HAVE_PTHREAD) && !defined(NO_THREADS)
+# include <pthread.h>
+#endif      // for pthread_create(), pthread_join(), pthread_cond_wait()
+#ifdef HAVE_ZLIB
+# include <zlib.h>
+#endif      // for compress2(), uncompress()
 #include HASH_MAP_H      // for hash_map<>::iterator, hash_map<>, etc
+#include <algorithm>     // for find(), min(), sort()
+#include <atomic>        // for atomic<>
+#include <set>           // for set<>
 #include <utility>       // for pair<>, make_pair()
 #include <vector>        // for vector<>::size_type, vector<>, etc
 #include "base/thread_annotations.h"  // for GUARDED_BY
 #include <ctemplate/find_ptr.h>
 #include <ctemplate/template.h>  // for Template, TemplateState
+#include <ctemplate/template_capture.h>
+#include <ctemplate/template_dictionary.h>  // for GlobalValuesGeneration()
 #include <ctemplate/template_enums.h>  // for Strip, DO_NOT_STRIP
 #include <ctemplate/template_pathops.h>  // for PathJoin(), IsAbspath(), etc
 #include <ctemplate/template_string.h>  // for StringHash
-#include "base/fileutil.h"
+#include "base/persistent_map.h"
+#include "text_store.h"
 #include <iostream>      // for cerr
 
 #ifndef PATH_MAX
@@ -65,6 +78,7 @@ using std::string;
 using std::vector;
 using std::pair;
 using std::make_pair;
+using std::set;
 using HASH_NAMESPACE::unordered_map;
 
 static int kVerbosity = 0;   // you can change this by hand to get vlogs
@@ -78,48 +92,53 @@ namespace ctemplate {
 // TemplateCache::RefcountedTemplate
 //    A simple refcounting class to keep track of templates, which
 //    might be shared between caches.  It also owns the pointer to
-//    the template itself.
+//    the template itself, and remembers when a cache last looked it
+//    up (for SetMemoryBudget()).  That's kept here, rather than in
+//    the cache-map, so that a lookup doesn't change the map, which
+//    may be shared with Clone()s of the cache.
 // ----------------------------------------------------------------------
 
 class TemplateCache::RefcountedTemplate {
  public:
-  explicit RefcountedTemplate(const Template* ptr) : ptr_(ptr), refcount_(1) { }
+  explicit RefcountedTemplate(const Template* ptr)
+      : ptr_(ptr), refcount_(1), last_use_(0) { }
+  // The refcount is atomic, so that a TemplateHandle can let go of
+  // its template without taking any lock.
   void IncRef() {
-    MutexLock ml(&mutex_);
-    assert(refcount_ > 0);
-    ++refcount_;
+    const int old_refcount = refcount_.fetch_add(1);
+    assert(old_refcount > 0);
+    (void)old_refcount;
   }
   void DecRefN(int n) {
-    bool refcount_is_zero;
-    {
-      MutexLock ml(&mutex_);
-      assert(refcount_ >= n);
-      refcount_ -= n;
-      refcount_is_zero = (refcount_ == 0);
-    }
-    // We can't delete this within the MutexLock, because when the
-    // MutexLock tries to unlock Mutex at function-exit, the mutex
-    // will have been deleted!  This is just as safe as doing the
-    // delete within the lock -- in either case, if anyone tried to do
-    // anything to this class after the refcount got to 0, bad things
-    // would happen.
-    if (refcount_is_zero)
+    const int old_refcount = refcount_.fetch_sub(n);
+    assert(old_refcount >= n);
+    // If anyone tried to do anything to this class after the
+    // refcount got to 0, bad things would happen.
+    if (old_refcount == n)
       delete this;
   }
   void DecRef() {
     DecRefN(1);
   }
   int refcount() const {
-    MutexLock ml(&mutex_);   // could be ReaderMutexLock, but whatever
-    return refcount_;
+    return refcount_.load();
   }
   const Template* tpl() const { return ptr_; }
+  // Most uses find the stamp already up to date, and since they only
+  // read it, they don't fight over its cache line.
+  void set_last_use(uint64_t tick) {
+    if (last_use_.load(std::memory_order_relaxed) != tick)
+      last_use_.store(tick, std::memory_order_relaxed);
+  }
+  uint64_t last_use() const {
+    return last_use_.load(std::memory_order_relaxed);
+  }
 
  private:
   ~RefcountedTemplate() { delete ptr_; }
   const Template* const ptr_;
-  int refcount_  GUARDED_BY(mutex_);
-  mutable Mutex mutex_;
+  std::atomic<int> refcount_;
+  std::atomic<uint64_t> last_use_;   // a use_clock_ tick
 };
 
 // ----------------------------------------------------------------------
@@ -130,6 +149,8 @@ class TemplateCache::RefcountedTemplate {
 //    actually stored in the map: the Template* and some information
 //    about it (whether we need to reload it, etc.).  Refcount is
 //    a simple refcounting class, used to keep track of templates.
+//    Each CachedTemplate holds a reference to its template, so the
+//    map takes care of the refcounts as it copies entries around.
 // ----------------------------------------------------------------------
 
 // This is needed just because many STLs (eg FreeBSD's) are unable to
@@ -152,9 +173,19 @@ class TemplateCache::RefTplPtrHash {
 class TemplateCache::TemplateCacheHash {
  public:
   size_t operator()(const TemplateCacheKey& p) const {
-    // Using + here is silly, but should work ok in practice.
-    return p.first + p.second;
-}
+    // The id is a hash already, but adding the strip to it would put
+    // the strip variants of one id next to each other, and a
+    // TemplateMap looks at the low bits first.  So we mix the two
+    // together, with the 64-bit finalizer from MurmurHash3.
+    uint64_t h = p.first ^ (static_cast<uint64_t>(p.second) *
+                            0x9e3779b97f4a7c15ULL);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return static_cast<size_t>(h);
+  }
   // Less operator for MSVC's hash containers.
   bool operator()(const TemplateCacheKey& a,
                   const TemplateCacheKey& b) const {
@@ -172,12 +203,38 @@ struct TemplateCache::CachedTemplate {
   CachedTemplate()
       : refcounted_tpl(NULL),
         should_reload(false),
-        template_type(UNUSED) {
+        template_type(UNUSED),
+        memory_usage(0) {
   }
+  // No one else may be able to see tpl_ptr yet.
   CachedTemplate(const Template* tpl_ptr, TemplateType type)
       : refcounted_tpl(new TemplateCache::RefcountedTemplate(tpl_ptr)),
         should_reload(false),
-        template_type(type) {
+        template_type(type),
+        memory_usage(tpl_ptr->MemoryUsageLocked()) {
+  }
+  CachedTemplate(const CachedTemplate& other)
+      : refcounted_tpl(other.refcounted_tpl),
+        should_reload(other.should_reload),
+        template_type(other.template_type),
+        memory_usage(other.memory_usage) {
+    if (refcounted_tpl)
+      refcounted_tpl->IncRef();
+  }
+  CachedTemplate& operator=(const CachedTemplate& other) {
+    if (other.refcounted_tpl)
+      other.refcounted_tpl->IncRef();
+    if (refcounted_tpl)
+      refcounted_tpl->DecRef();
+    refcounted_tpl = other.refcounted_tpl;
+    should_reload = other.should_reload;
+    template_type = other.template_type;
+    memory_usage = other.memory_usage;
+    return *this;
+  }
+  ~CachedTemplate() {
+    if (refcounted_tpl)
+      refcounted_tpl->DecRef();
   }
 
   // we won't remove the template from the cache until refcount drops to 0
@@ -186,29 +243,352 @@ struct TemplateCache::CachedTemplate {
   bool should_reload;
   // indicates if the template is string-based or file-based
   TemplateType template_type;
+  // what the template counts against the memory budget
+  size_t memory_usage;
+};
+
+// ----------------------------------------------------------------------
+// TemplateCache::StringSource
+//    The text passed to StringToTemplateCache(), kept when
+//    SetMemoryBudget() asks for it so the template can be evicted
+//    and parsed again later.  With zlib, the text is kept compressed
+//    (unless that doesn't make it smaller).
+// ----------------------------------------------------------------------
+
+struct TemplateCache::StringSource {
+  StringSource() : length(0), compressed(false) { }
+  StringSource(const char* text, size_t textlen)
+      : length(textlen), compressed(false) {
+#ifdef HAVE_ZLIB
+    uLongf destlen = compressBound(textlen);
+    data.resize(destlen);
+    if (compress2(reinterpret_cast<Bytef*>(&data[0]), &destlen,
+                  reinterpret_cast<const Bytef*>(text), textlen,
+                  Z_DEFAULT_COMPRESSION) == Z_OK &&
+        destlen < textlen) {
+      data.resize(destlen);
+      compressed = true;
+      return;
+    }
+#endif
+    data.assign(text, textlen);
+  }
+
+  // Puts the original text in *text.  Returns false on a zlib error.
+  bool GetText(string* text) const {
+    if (!compressed) {
+      *text = data;
+      return true;
+    }
+#ifdef HAVE_ZLIB
+    text->resize(length);
+    uLongf destlen = length;
+    return (uncompress(reinterpret_cast<Bytef*>(&(*text)[0]), &destlen,
+                       reinterpret_cast<const Bytef*>(data.data()),
+                       data.size()) == Z_OK &&
+            destlen == length);
+#else
+    return false;
+#endif
+  }
+
+  size_t memory_usage() const { return sizeof(*this) + data.capacity(); }
+
+  size_t length;     // of the original text
+  string data;
+  bool compressed;
+};
+
+
+// ----------------------------------------------------------------------
+// TemplateCache::Resolution
+//    What ResolveTemplateFilename() found out about a filename, for
+//    the resolution cache.
+// ----------------------------------------------------------------------
+
+struct TemplateCache::Resolution {
+  Resolution() : num_stats(0), expires(0) { }
+  string resolved;     // empty if the filename wasn't found
+  size_t num_stats;    // how many Stat()s it took to find out
+  time_t expires;
+};
+
+// ----------------------------------------------------------------------
+// TemplateCache::Replica
+// TemplateCache::ThreadReplicas
+//    A Replica is one thread's copy of a frozen cache's index (see
+//    SetThreadLocalReplicas()), holding a reference to each template.
+//    Each thread keeps its Replicas in a ThreadReplicas, under the
+//    replica_id_ they were made with.  g_live_replica_ids holds the
+//    ids that haven't been retired yet; we only look at it when we
+//    make a new Replica, so it's fine for it to need a lock.
+// ----------------------------------------------------------------------
+
+static Mutex g_replica_mutex(base::LINKER_INITIALIZED);
+static set<uint64_t>* g_live_replica_ids GUARDED_BY(g_replica_mutex) = NULL;
+static std::atomic<uint64_t> g_next_replica_id(1);
+
+struct TemplateCache::Replica {
+  Replica() : global_values_final(false), global_values_generation(-1) { }
+  ~Replica() {
+    for (unordered_map<TemplateCacheKey, RefcountedTemplate*,
+                       TemplateCacheHash>::iterator it = templates.begin();
+         it != templates.end(); ++it) {
+      it->second->DecRef();
+    }
+  }
+
+  unordered_map<TemplateCacheKey, RefcountedTemplate*,
+                TemplateCacheHash> templates;
+  bool global_values_final;
+  // Like TemplateCache::global_values_generation_, but for this
+  // thread: when it's out of date, we call RespecializeTemplates().
+  int global_values_generation;
+};
+
+struct TemplateCache::ThreadReplicas {
+  ~ThreadReplicas() {
+    for (unordered_map<uint64_t, Replica*>::iterator it = replicas.begin();
+         it != replicas.end(); ++it) {
+      delete it->second;
+    }
+  }
+
+  // Deletes the Replicas whose ids have been retired.
+  void DeleteRetired() {
+    vector<Replica*> retired;
+    {
+      MutexLock ml(&g_replica_mutex);
+      for (unordered_map<uint64_t, Replica*>::iterator it = replicas.begin();
+           it != replicas.end(); ) {
+        if (!g_live_replica_ids || !g_live_replica_ids->count(it->first)) {
+          retired.push_back(it->second);
+          replicas.erase(it++);
+        } else {
+          ++it;
+        }
+      }
+    }
+    for (vector<Replica*>::iterator it = retired.begin();
+         it != retired.end(); ++it) {
+      delete *it;
+    }
+  }
+
+  unordered_map<uint64_t, Replica*> replicas;
 };
 
+// ----------------------------------------------------------------------
+// TemplateCache::AbortCounts
+//    The counts behind NumAbortedExpands().  Expands from many threads
+//    at once would fight over a single set of counters, so each thread
+//    counts in one of kNumAbortCountShards shards, which don't share
+//    cache lines, and reading a count sums the shards.
+// ----------------------------------------------------------------------
+
+static const int kNumAbortCountShards = 16;
+static std::atomic<int> g_next_abort_count_shard(0);
+
+struct TemplateCache::AbortCounts {
+  AbortCounts() {
+    for (int i = 0; i < kNumAbortCountShards; ++i) {
+      for (int j = 0; j < NUM_EXPAND_ABORT_REASONS; ++j)
+        shards[i].counts[j].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  // Counts the expand that used per_expand_data, if it was aborted.
+  void Count(const PerExpandData* per_expand_data) {
+    if (per_expand_data == NULL)
+      return;
+    const ExpandAbortReason reason = per_expand_data->expand_aborted();
+    if (reason == EXPAND_NOT_ABORTED)
+      return;
+    // Threads take shards in turn, the first time they count.
+    static thread_local const int shard =
+        g_next_abort_count_shard.fetch_add(1) % kNumAbortCountShards;
+    shards[shard].counts[reason].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  int Sum(ExpandAbortReason reason) const {
+    int sum = 0;
+    for (int i = 0; i < kNumAbortCountShards; ++i)
+      sum += shards[i].counts[reason].load(std::memory_order_relaxed);
+    return sum;
+  }
+
+  struct Shard {
+    std::atomic<int> counts[NUM_EXPAND_ABORT_REASONS];
+    char padding[64];     // keeps the shards' counts a cache line apart
+  };
+  Shard shards[kNumAbortCountShards];
+};
+
+// ----------------------------------------------------------------------
+// TemplateCache::ExpandBatchPool
+//    The threads that help ExpandBatch() callers.  They're started
+//    the first time a batch asks for them, and then wait for the next
+//    batch, so small batches don't pay for creating threads.  The
+//    destructor stops and joins them.  The pool helps one batch at a
+//    time; a batch that comes along while it's busy is expanded by
+//    its caller alone.  Without threads, Run() always returns false.
+// ----------------------------------------------------------------------
+
+class TemplateCache::ExpandBatchPool {
+ public:
+#if defined(HAVE_PTHREAD) && !defined(NO_THREADS)
+  ExpandBatchPool() : work_(NULL), helpers_wanted_(0), helpers_working_(0),
+                      busy_(false), stopping_(false) {
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_cond_init(&work_ready_, NULL);
+    pthread_cond_init(&work_done_, NULL);
+  }
+
+  ~ExpandBatchPool() {
+    pthread_mutex_lock(&mutex_);
+    stopping_ = true;
+    pthread_cond_broadcast(&work_ready_);
+    pthread_mutex_unlock(&mutex_);
+    for (vector<pthread_t>::const_iterator it = threads_.begin();
+         it != threads_.end(); ++it) {
+      pthread_join(*it, NULL);
+    }
+    pthread_cond_destroy(&work_done_);
+    pthread_cond_destroy(&work_ready_);
+    pthread_mutex_destroy(&mutex_);
+  }
+
+  // Has up to num_helpers pool threads do work alongside the calling
+  // thread, starting more threads if need be, and returns once work
+  // is all done.  Returns false, having done nothing, if the pool is
+  // busy with another batch.
+  bool Run(ExpandBatchWork* work, int num_helpers) {
+    pthread_mutex_lock(&mutex_);
+    if (busy_) {
+      pthread_mutex_unlock(&mutex_);
+      return false;
+    }
+    while (threads_.size() < static_cast<size_t>(num_helpers)) {
+      pthread_t thread;
+      if (pthread_create(&thread, NULL, ThreadMain, this) != 0) {
+        PLOG(WARNING) << "ExpandBatch: can't start thread "
+                      << threads_.size() + 1 << "; continuing with fewer"
+                      << endl;
+        break;
+      }
+      threads_.push_back(thread);
+    }
+    busy_ = true;
+    work_ = work;
+    helpers_wanted_ = num_helpers;
+    pthread_cond_broadcast(&work_ready_);
+    pthread_mutex_unlock(&mutex_);
+
+    ExpandBatchWorker(work);
+
+    // All the chunks have been handed out, so a helper that hasn't
+    // joined in yet needn't; but we must wait for those that have.
+    pthread_mutex_lock(&mutex_);
+    work_ = NULL;
+    helpers_wanted_ = 0;
+    while (helpers_working_ > 0)
+      pthread_cond_wait(&work_done_, &mutex_);
+    busy_ = false;
+    pthread_mutex_unlock(&mutex_);
+    return true;
+  }
+
+ private:
+  static void* ThreadMain(void* arg) {
+    ExpandBatchPool* pool = static_cast<ExpandBatchPool*>(arg);
+    pthread_mutex_lock(&pool->mutex_);
+    for (;;) {
+      while (!pool->stopping_ && pool->helpers_wanted_ == 0)
+        pthread_cond_wait(&pool->work_ready_, &pool->mutex_);
+      if (pool->stopping_)
+        break;
+      ExpandBatchWork* work = pool->work_;
+      --pool->helpers_wanted_;
+      ++pool->helpers_working_;
+      pthread_mutex_unlock(&pool->mutex_);
+      ExpandBatchWorker(work);
+      pthread_mutex_lock(&pool->mutex_);
+      if (--pool->helpers_working_ == 0)
+        pthread_cond_signal(&pool->work_done_);
+    }
+    pthread_mutex_unlock(&pool->mutex_);
+    return NULL;
+  }
+
+  pthread_mutex_t mutex_;
+  pthread_cond_t work_ready_;   // signaled when helpers_wanted_ goes up
+  pthread_cond_t work_done_;    // signaled when helpers_working_ hits 0
+  vector<pthread_t> threads_;
+  ExpandBatchWork* work_;       // the batch being expanded, or NULL
+  int helpers_wanted_;          // how many more threads should join in
+  int helpers_working_;         // how many threads are working on work_
+  bool busy_;                   // true while Run() is going
+  bool stopping_;               // set by the destructor
+#else
+  bool Run(ExpandBatchWork*, int) {
+    return false;
+  }
+#endif
+};
 
 // ----------------------------------------------------------------------
 // TemplateCache::TemplateCache()
 // TemplateCache::~TemplateCache()
 // ----------------------------------------------------------------------
 
+#ifdef MUTEX_WAIT_STATS
+// Every cache's mutex_ counts its waits here.
+static base::MutexWaitStats g_cache_mutex_stats("TemplateCache::mutex_",
+                                                NULL);
+#endif
+
 TemplateCache::TemplateCache()
     : parsed_template_cache_(new TemplateMap),
+      string_sources_(new StringSourceMap),
       is_frozen_(false),
+      global_values_final_(false),
+      global_values_generation_(-1),
+      precompress_threshold_(0),
+      num_aborted_expands_(new AbortCounts),
+      memory_budget_(0),
+      keep_string_sources_(false),
+      memory_usage_(0),
+      use_clock_(0),
       search_path_(),
       get_template_calls_(new TemplateCallMap),
       mutex_(new Mutex),
-      search_path_mutex_(new Mutex) {
+      search_path_mutex_(new Mutex),
+      source_(TemplateSource::Filesystem()),
+      capture_(NULL),
+      thread_local_replicas_(false),
+      replica_id_(0),
+      resolutions_(new ResolutionMap),
+      resolution_ttl_(0),
+      resolution_mutex_(new Mutex),
+      text_store_(new TextStore),
+      expand_batch_pool_(NULL) {
+#ifdef MUTEX_WAIT_STATS
+  mutex_->set_wait_stats(&g_cache_mutex_stats);
+#endif
 }
 
 TemplateCache::~TemplateCache() {
   ClearCache();
   delete parsed_template_cache_;
+  delete string_sources_;
   delete get_template_calls_;
   delete mutex_;
   delete search_path_mutex_;
+  delete resolutions_;
+  delete resolution_mutex_;
+  text_store_->DecRef();
+  delete num_aborted_expands_;
+  delete expand_batch_pool_;
 }
 
 
@@ -218,10 +598,11 @@ TemplateCache::~TemplateCache() {
 //    backing file's last modtime.
 // ----------------------------------------------------------------------
 
-bool HasTemplateChangedOnDisk(const char* resolved_filename,
+bool HasTemplateChangedOnDisk(const TemplateSource* source,
+                              const char* resolved_filename,
                               time_t mtime,
-                              FileStat* statbuf) {
-  if (!File::Stat(resolved_filename, statbuf)) {
+                              TemplateSource::FileInfo* statbuf) {
+  if (!source->Stat(resolved_filename, statbuf)) {
     LOG(WARNING) << "Unable to stat file " << resolved_filename << endl;
     // If we can't Stat the file then the file may have been deleted,
     // so reload the template.
@@ -237,6 +618,7 @@ bool HasTemplateChangedOnDisk(const char* resolved_filename,
 
 // ----------------------------------------------------------------------
 // TemplateCache::LoadTemplate()
+// TemplateCache::GetTemplateHandle()
 // TemplateCache::GetTemplate()
 // TemplateCache::GetTemplateLocked()
 // TemplateCache::StringToTemplateCache()
@@ -244,7 +626,9 @@ bool HasTemplateChangedOnDisk(const char* resolved_filename,
 //    loads the template into the cache and returns true if the
 //    template was successfully loaded or if it already exists in the
 //    cache.  GetTemplate loads the template into the cache from disk
-//    and returns the parsed template.  StringToTemplateCache parses
+//    and returns the parsed template; GetTemplateHandle does the same,
+//    but wraps it in a handle that holds the template's reference
+//    itself.  StringToTemplateCache parses
 //    and loads the template from the given string into the parsed
 //    cache, or returns false if an older version already exists in
 //    the cache.
@@ -252,93 +636,187 @@ bool HasTemplateChangedOnDisk(const char* resolved_filename,
 
 bool TemplateCache::LoadTemplate(const TemplateString& filename, Strip strip) {
   TemplateCacheKey cache_key = TemplateCacheKey(filename.GetGlobalId(), strip);
-  WriterMutexLock ml(mutex_);
-  return GetTemplateLocked(filename, strip, cache_key) != NULL;
+  bool respecialize;
+  RefcountedTemplate* refcounted_tpl =
+      AcquireTemplate(filename, strip, cache_key, &respecialize);
+  if (!refcounted_tpl)
+    return false;
+  refcounted_tpl->DecRef();
+  return true;
+}
+
+TemplateHandle TemplateCache::GetTemplateHandle(const TemplateString& filename,
+                                               Strip strip) {
+  TemplateCacheKey cache_key = TemplateCacheKey(filename.GetGlobalId(), strip);
+  bool respecialize;
+  // AcquireTemplate()'s reference is released in TemplateHandle::reset().
+  RefcountedTemplate* refcounted_tpl =
+      AcquireTemplate(filename, strip, cache_key, &respecialize);
+  if (!refcounted_tpl)
+    return TemplateHandle();
+  return TemplateHandle(refcounted_tpl, this);
 }
 
 const Template *TemplateCache::GetTemplate(const TemplateString& filename,
                                            Strip strip) {
   // No need to have the cache-mutex acquired for this step
   TemplateCacheKey cache_key = TemplateCacheKey(filename.GetGlobalId(), strip);
-  CachedTemplate retval;
-  WriterMutexLock ml(mutex_);
+  bool respecialize;
+  // AcquireTemplate()'s reference is released in DoneWithGetTemplatePtrs().
   RefcountedTemplate* refcounted_tpl =
-      GetTemplateLocked(filename, strip, cache_key);
+      AcquireTemplate(filename, strip, cache_key, &respecialize);
   if (!refcounted_tpl)
     return NULL;
 
-  refcounted_tpl->IncRef();   // DecRef() is in DoneWithGetTemplatePtrs()
+  WriterMutexLock ml(mutex_);
   (*get_template_calls_)[refcounted_tpl]++;   // set up for DoneWith...()
   return refcounted_tpl->tpl();
 }
 
+TemplateCache::RefcountedTemplate* TemplateCache::AcquireTemplate(
+    const TemplateString& filename,
+    Strip strip,
+    const TemplateCacheKey& template_cache_key,
+    bool* respecialize) {
+  {
+    // The common case: the template is loaded, and up to date.
+    ReaderMutexLock ml(mutex_);
+    const CachedTemplate* it =
+        parsed_template_cache_->find(template_cache_key);
+    if (it && !it->should_reload &&
+        it->refcounted_tpl->tpl()->state() == TS_READY) {
+      it->refcounted_tpl->set_last_use(use_clock_);
+      it->refcounted_tpl->IncRef();
+      *respecialize = GlobalValuesAreStaleLocked();
+      return it->refcounted_tpl;
+    }
+  }
+  RefcountedTemplate* refcounted_tpl;
+  {
+    WriterMutexLock ml(mutex_);
+    refcounted_tpl = GetTemplateLocked(filename, strip, template_cache_key);
+    if (!refcounted_tpl)
+      return NULL;
+    refcounted_tpl->IncRef();
+    *respecialize = GlobalValuesAreStaleLocked();
+  }
+  EvictIfOverBudget(&template_cache_key);
+  return refcounted_tpl;
+}
 TemplateCache::RefcountedTemplate* TemplateCache::GetTemplateLocked(
     const TemplateString& filename,
     Strip strip,
     const TemplateCacheKey& template_cache_key) {
   // NOTE: A write-lock must be held on mutex_ when this method is called.
-  CachedTemplate* it = find_ptr(*parsed_template_cache_, template_cache_key);
+  // We only change the map when we have to, since it may be shared
+  // with our Clone()s.
+  const CachedTemplate* it = parsed_template_cache_->find(template_cache_key);
   if (!it) {
     // If the cache is frozen and the template doesn't already exist in cache,
     // do not load the template, return NULL.
     if (is_frozen_) {
       return NULL;
     }
-    // TODO(panicker): Validate the filename here, and if the file can't be
-    // resolved then insert a NULL in the cache.
-    // If validation succeeds then pass in resolved filename, mtime &
-    // file length (from statbuf) to the constructor.
-    const Template* tpl = new Template(filename, strip, this);
-    it = &(*parsed_template_cache_)[template_cache_key];
-    *it = CachedTemplate(tpl, CachedTemplate::FILE_BASED);
+    // If this is a string-based template that was evicted, we parse
+    // its text again.
+    const StringSource* source = string_sources_->find(template_cache_key);
+    const Template* tpl;
+    if (source) {
+      string content;
+      if (!source->GetText(&content)) {
+        LOG(ERROR) << "Unable to restore the text of evicted template "
+                   << string(filename.data(), filename.size()) << endl;
+        return NULL;
+      }
+      tpl = Template::StringToTemplate(content, strip, text_store_);
+      if (tpl == NULL)
+        return NULL;
+    } else {
+      // TODO(panicker): Validate the filename here, and if the file can't be
+      // resolved then insert a NULL in the cache.
+      // If validation succeeds then pass in resolved filename, mtime &
+      // file length (from statbuf) to the constructor.
+      tpl = new Template(filename, strip, this);
+    }
+    // No one else can see tpl yet, so we needn't lock it.
+    tpl->PrecompressTextLocked(precompress_threshold_);
+    if (global_values_final_)
+      tpl->SpecializeOnGlobalValuesLocked();
+    const CachedTemplate cached_tpl(tpl, source ? CachedTemplate::STRING_BASED
+                                                : CachedTemplate::FILE_BASED);
+    (*parsed_template_cache_)[template_cache_key] = cached_tpl;
+    memory_usage_ += cached_tpl.memory_usage;
+    it = parsed_template_cache_->find(template_cache_key);
     assert(it);
   }
+  it->refcounted_tpl->set_last_use(++use_clock_);
   if (it->should_reload) {
+    CachedTemplate* mutable_it =
+        parsed_template_cache_->find_mutable(template_cache_key);
+    it = mutable_it;
     // check if the template has changed on disk or if a new template with the
     // same name has been added earlier in the search path:
     const string resolved = FindTemplateFilename(
         it->refcounted_tpl->tpl()->original_filename());
-    FileStat statbuf;
+    TemplateSource::FileInfo statbuf;
     if (it->template_type == CachedTemplate::FILE_BASED &&
         (resolved != it->refcounted_tpl->tpl()->template_file() ||
          HasTemplateChangedOnDisk(
+             template_source(),
              it->refcounted_tpl->tpl()->template_file(),
              it->refcounted_tpl->tpl()->mtime(),
              &statbuf))) {
-      // Create a new template, insert it into the cache under
-      // template_cache_key, and DecRef() the old one to indicate
-      // the cache no longer has a reference to it.
-      const Template* tpl = new Template(filename, strip, this);
-      // DecRef after creating the new template since DecRef may free up
-      // the storage for filename,
-      it->refcounted_tpl->DecRef();
-      *it = CachedTemplate(tpl, CachedTemplate::FILE_BASED);
+      // Create a new template, and insert it into the cache under
+      // template_cache_key in place of the old one (which DecRefs the
+      // old one to indicate the cache no longer has a reference to it).
+      // The constructor specializes it, if global values are final.
+      const Template* tpl = new Template(filename, strip, this,
+                                         it->refcounted_tpl->tpl());
+      tpl->PrecompressTextLocked(precompress_threshold_);
+      // Replace after creating the new template since the DecRef may
+      // free up the storage for filename,
+      memory_usage_ -= mutable_it->memory_usage;
+      *mutable_it = CachedTemplate(tpl, CachedTemplate::FILE_BASED);
+      memory_usage_ += mutable_it->memory_usage;
+      mutable_it->refcounted_tpl->set_last_use(use_clock_);
     }
-    it->should_reload = false;
+    mutable_it->should_reload = false;
   }
 
   // If the state is TS_ERROR, we leave the state as is, but return
   // NULL.  We won't try to load the template file again until the
   // reload status is set to true by another call to ReloadAllIfChanged.
-  return it->refcounted_tpl->tpl()->state() == TS_READY ? it->refcounted_tpl : NULL;
+  return (it->refcounted_tpl->tpl()->state() == TS_READY ?
+          it->refcounted_tpl : NULL);
 }
 
 bool TemplateCache::StringToTemplateCache(const TemplateString& key,
                                           const TemplateString& content,
                                           Strip strip) {
-  TemplateCacheKey template_cache_key = TemplateCacheKey(key.GetGlobalId(), strip);
+  TemplateCacheKey template_cache_key =
+      TemplateCacheKey(key.GetGlobalId(), strip);
+  bool specialize;
+  size_t precompress_threshold;
+  bool keep_source;
   {
     ReaderMutexLock ml(mutex_);
     if (is_frozen_) {
       return false;
     }
-    // If the key is already in the parsed-cache, we just return false.
-    CachedTemplate* it = find_ptr(*parsed_template_cache_, template_cache_key);
+    specialize = global_values_final_;
+    precompress_threshold = precompress_threshold_;
+    keep_source = keep_string_sources_;
+    // If the key is already in the parsed-cache (or was, before being
+    // evicted), we just return false.
+    const CachedTemplate* it = parsed_template_cache_->find(template_cache_key);
     if (it && it->refcounted_tpl->tpl()->state() != TS_ERROR) {
       return false;
     }
+    if (!it && string_sources_->find(template_cache_key)) {
+      return false;
+    }
   }
-  Template* tpl = Template::StringToTemplate(content, strip);
+  Template* tpl = Template::StringToTemplate(content, strip, text_store_);
   if (tpl == NULL) {
     return false;
   }
@@ -346,36 +824,262 @@ bool TemplateCache::StringToTemplateCache(const TemplateString& key,
     delete tpl;
     return false;
   }
+  // No one else can see tpl yet, so we needn't lock it.
+  tpl->PrecompressTextLocked(precompress_threshold);
+  if (specialize)
+    tpl->SpecializeOnGlobalValuesLocked();
+  StringSource source;
+  if (keep_source)
+    source = StringSource(content.data(), content.size());
 
-  WriterMutexLock ml(mutex_);
-  // Double-check it wasn't just inserted.
-  CachedTemplate* it = find_ptr(*parsed_template_cache_, template_cache_key);
-  if (it) {
-    if (it->refcounted_tpl->tpl()->state() == TS_ERROR) {
-      // replace the old entry with the new one
-      it->refcounted_tpl->DecRef();
-    } else {
+  {
+    WriterMutexLock ml(mutex_);
+    // Double-check it wasn't just inserted.
+    const CachedTemplate* it = parsed_template_cache_->find(template_cache_key);
+    if (it) {
+      if (it->refcounted_tpl->tpl()->state() == TS_ERROR) {
+        // we replace the old entry with the new one below
+        memory_usage_ -= it->memory_usage;
+      } else {
+        delete tpl;
+        return false;
+      }
+    } else if (string_sources_->find(template_cache_key)) {
       delete tpl;
       return false;
     }
+    // Insert into cache.
+    const CachedTemplate cached_tpl(tpl, CachedTemplate::STRING_BASED);
+    cached_tpl.refcounted_tpl->set_last_use(++use_clock_);
+    (*parsed_template_cache_)[template_cache_key] = cached_tpl;
+    memory_usage_ += cached_tpl.memory_usage;
+    if (keep_source) {
+      StringSource* kept = &(*string_sources_)[template_cache_key];
+      kept->length = source.length;
+      kept->data.swap(source.data);
+      kept->compressed = source.compressed;
+      memory_usage_ += kept->memory_usage();
+    }
   }
-  // Insert into cache.
-  (*parsed_template_cache_)[template_cache_key] =
-      CachedTemplate(tpl, CachedTemplate::STRING_BASED);
+  EvictIfOverBudget(&template_cache_key);
   return true;
 }
 
+// ----------------------------------------------------------------------
+// TemplateHandle
+//    All a handle does is hold a reference to its template.  Since
+//    that refcount is atomic, no lock is needed to let go of it.
+// ----------------------------------------------------------------------
+
+TemplateHandle::TemplateHandle(TemplateHandle&& other)
+    : refcounted_tpl_(other.refcounted_tpl_), cache_(other.cache_) {
+  other.refcounted_tpl_ = NULL;
+  other.cache_ = NULL;
+}
+
+TemplateHandle& TemplateHandle::operator=(TemplateHandle&& other) {
+  if (this != &other) {
+    reset();
+    refcounted_tpl_ = other.refcounted_tpl_;
+    cache_ = other.cache_;
+    other.refcounted_tpl_ = NULL;
+    other.cache_ = NULL;
+  }
+  return *this;
+}
+
+const Template* TemplateHandle::get() const {
+  return refcounted_tpl_ ? refcounted_tpl_->tpl() : NULL;
+}
+
+void TemplateHandle::reset() {
+  if (refcounted_tpl_)
+    refcounted_tpl_->DecRef();
+  refcounted_tpl_ = NULL;
+  cache_ = NULL;
+}
+
+bool TemplateHandle::Expand(ExpandEmitter* output,
+                            const TemplateDictionaryInterface* dictionary,
+                            PerExpandData* per_expand_data) const {
+  if (!refcounted_tpl_)
+    return false;
+  return refcounted_tpl_->tpl()->ExpandWithDataAndCache(
+      output, dictionary, per_expand_data, cache_);
+}
+
+// ----------------------------------------------------------------------
+// TemplateCache::SetMemoryBudget()
+// TemplateCache::memory_usage()
+// TemplateCache::EvictIfOverBudget()
+//    Each CachedTemplate knows how much memory its template uses, and
+//    memory_usage_ is the total, plus what the kept StringSources use.
+//    use_clock_ ticks whenever a template is loaded, and every lookup
+//    stamps the template it finds with the current tick.  Lookups
+//    only hold a read-lock on mutex_, and the stamp is atomic; since
+//    a template used over and over already has the current tick, its
+//    stamp is mostly just read.  (A template shared with a Clone()
+//    has one stamp, which lookups in either cache update.)  When the
+//    total goes over the budget, we sort the templates we could bring
+//    back by their stamps, and evict the oldest.  The sort works on a
+//    snapshot of the maps, which copying a PersistentMap makes cheap,
+//    so it's done without holding mutex_.  We evict down to 7/8 of
+//    the budget, so that the templates loaded after that don't each
+//    trigger another sort.
+// ----------------------------------------------------------------------
+
+void TemplateCache::SetMemoryBudget(size_t max_bytes,
+                                    bool keep_string_sources) {
+  {
+    WriterMutexLock ml(mutex_);
+    memory_budget_ = max_bytes;
+    keep_string_sources_ = keep_string_sources;
+  }
+  EvictIfOverBudget(NULL);
+}
+
+size_t TemplateCache::memory_usage() const {
+  ReaderMutexLock ml(mutex_);
+  return memory_usage_;
+}
+
+// ----------------------------------------------------------------------
+// TemplateCache::SetCapture()
+//    ExpandWithData() asks the capture whether to record each
+//    expansion; if so, the expansion uses the capture's recording
+//    dictionary and emitter, which pass everything through to the
+//    real ones.
+// ----------------------------------------------------------------------
+
+void TemplateCache::SetCapture(TemplateCapture* capture) {
+  capture_.store(capture, std::memory_order_release);
+}
+
+void TemplateCache::EvictIfOverBudget(const TemplateCacheKey* keep) const {
+  TemplateMap templates;
+  StringSourceMap sources;
+  {
+    ReaderMutexLock ml(mutex_);
+    if (memory_budget_ == 0 || memory_usage_ <= memory_budget_ || is_frozen_)
+      return;
+    templates = *parsed_template_cache_;
+    sources = *string_sources_;
+  }
+  // Each candidate is (stamp, (key, template)).  We only evict a
+  // template if the cache still holds it, with the same stamp.
+  typedef pair<uint64_t, pair<TemplateCacheKey, const RefcountedTemplate*> >
+      Candidate;
+  vector<Candidate> candidates;
+  for (TemplateMap::const_iterator it = templates.begin();
+       it != templates.end(); ++it) {
+    if (keep && it->first == *keep)
+      continue;
+    // We can only bring back a string-based template if we kept its text.
+    if (it->second.template_type == CachedTemplate::STRING_BASED &&
+        !sources.find(it->first))
+      continue;
+    const RefcountedTemplate* refcounted_tpl = it->second.refcounted_tpl;
+    candidates.push_back(Candidate(refcounted_tpl->last_use(),
+                                   make_pair(it->first, refcounted_tpl)));
+  }
+  std::sort(candidates.begin(), candidates.end());
+
+  WriterMutexLock ml(mutex_);
+  if (memory_budget_ == 0 || is_frozen_)
+    return;
+  const size_t target = memory_budget_ - memory_budget_ / 8;
+  size_t num_evicted = 0;
+  for (vector<Candidate>::const_iterator it = candidates.begin();
+       it != candidates.end() && memory_usage_ > target; ++it) {
+    const TemplateCacheKey& key = it->second.first;
+    const CachedTemplate* cached = parsed_template_cache_->find(key);
+    if (!cached || cached->refcounted_tpl != it->second.second ||
+        cached->refcounted_tpl->last_use() != it->first)
+      continue;     // changed or used since we looked
+    memory_usage_ -= cached->memory_usage;
+    // Anyone still expanding the template holds their own reference.
+    parsed_template_cache_->erase(key);
+    ++num_evicted;
+  }
+  VLOG(1) << "Evicted " << num_evicted << " templates; the cache now uses "
+          << memory_usage_ << " bytes" << endl;
+}
+
+// ----------------------------------------------------------------------
+// TemplateCache::ExpandBatchWork
+//    What the ExpandBatch() threads share.  Rather than splitting the
+//    dictionaries up front, each thread takes the next
+//    kExpandBatchChunkSize of them whenever it runs out of work, so
+//    threads that get cheap dictionaries go on to help with the rest.
+// ----------------------------------------------------------------------
+
+static const size_t kExpandBatchChunkSize = 16;
+
+struct TemplateCache::ExpandBatchWork {
+  ExpandBatchWork(const Template* t, const TemplateCache* c,
+                  const vector<const TemplateDictionaryInterface*>& d,
+                  vector<string>* o)
+      : tpl(t), cache(c), dictionaries(d), outputs(o),
+        next(0), error_free(true) {
+  }
+
+  // Sets [*begin, *end) to the next chunk of work.  Returns false if
+  // there's none left.
+  bool NextChunk(size_t* begin, size_t* end) {
+    MutexLock ml(&mutex);
+    if (next >= dictionaries.size())
+      return false;
+    *begin = next;
+    next = std::min(next + kExpandBatchChunkSize, dictionaries.size());
+    *end = next;
+    return true;
+  }
+
+  void RecordError() {
+    MutexLock ml(&mutex);
+    error_free = false;
+  }
+
+  const Template* const tpl;
+  const TemplateCache* const cache;
+  const vector<const TemplateDictionaryInterface*>& dictionaries;
+  vector<string>* const outputs;
+  Mutex mutex;
+  size_t next GUARDED_BY(mutex);
+  bool error_free GUARDED_BY(mutex);
+};
+
+void* TemplateCache::ExpandBatchWorker(void* arg) {
+  ExpandBatchWork* work = static_cast<ExpandBatchWork*>(arg);
+  size_t begin, end;
+  while (work->NextChunk(&begin, &end)) {
+    if (!work->tpl->ExpandBatch(work->dictionaries, begin, end,
+                                work->outputs, work->cache)) {
+      work->RecordError();
+    }
+  }
+  return NULL;
+}
+
 // ----------------------------------------------------------------------
 // TemplateCache::ExpandWithData()
 // TemplateCache::ExpandFrozen()
+// TemplateCache::ExpandSkeleton()
+// TemplateCache::ExpandHoles()
+// TemplateCache::SpliceSkeleton()
+// TemplateCache::ExpandIncrementally()
+// TemplateCache::ExpandBatch()
 // TemplateCache::ExpandLocked()
 //    ExpandWithData gets the template from the parsed-cache, possibly
-//    loading the template on-demand, and then expands the template.
+//    loading the template on-demand, and then expands the template,
+//    recording it if a TemplateCapture asks to (see SetCapture()).
 //    ExpandFrozen is for frozen caches only -- if the filename isn't
 //    in the cache, the routine fails (returns false) rather than trying
-//    to fetch the template.  ExpandLocked is used for recursive
-//    sub-template includes, and just tells template.cc it doesn't
-//    need to recursively acquire any locks.
+//    to fetch the template.  ExpandSkeleton, ExpandHoles,
+//    ExpandIncrementally and ExpandBatch fetch the template like
+//    ExpandWithData, and let template.cc do the rest.  ExpandLocked
+//    is used for recursive sub-template includes, and just tells
+//    template.cc it doesn't need to recursively acquire any locks.
 // ----------------------------------------------------------------------
 
 bool TemplateCache::ExpandWithData(const TemplateString& filename,
@@ -383,25 +1087,46 @@ bool TemplateCache::ExpandWithData(const TemplateString& filename,
                                    const TemplateDictionaryInterface *dict,
                                    PerExpandData *per_expand_data,
                                    ExpandEmitter *expand_emitter) {
+  if (TemplateCapture* capture = capture_.load(std::memory_order_acquire)) {
+    if (TemplateCapture::Recording* recording = capture->MaybeStartRecording(
+            filename, strip, dict, per_expand_data, expand_emitter)) {
+      const bool result = ExpandWithDataUncaptured(
+          filename, strip, TemplateCapture::dictionary(recording),
+          per_expand_data, TemplateCapture::emitter(recording));
+      capture->FinishRecording(recording, result);
+      return result;
+    }
+  }
+  return ExpandWithDataUncaptured(filename, strip, dict, per_expand_data,
+                                  expand_emitter);
+}
+
+bool TemplateCache::ExpandWithDataUncaptured(
+    const TemplateString& filename,
+    Strip strip,
+    const TemplateDictionaryInterface *dict,
+    PerExpandData *per_expand_data,
+    ExpandEmitter *expand_emitter) {
   TemplateCacheKey template_cache_key(filename.GetGlobalId(), strip);
+  if (Replica* replica = ThreadReplica()) {
+    return ExpandFromReplica(replica, template_cache_key, dict,
+                             per_expand_data, expand_emitter);
+  }
   // We make a local copy of this struct so we don't have to worry about
   // what happens to our cache while we don't hold the lock (during Expand).
-  RefcountedTemplate* refcounted_tpl = NULL;
-  {
-    WriterMutexLock ml(mutex_);
-    // Optionally load the template (depending on whether the cache is frozen,
-    // the reload bit is set etc.)
-    refcounted_tpl = GetTemplateLocked(filename, strip, template_cache_key);
-    if (!refcounted_tpl)
-      return false;
-    refcounted_tpl->IncRef();
-  }
+  bool respecialize;
+  // Optionally load the template (depending on whether the cache is frozen,
+  // the reload bit is set etc.)
+  RefcountedTemplate* refcounted_tpl =
+      AcquireTemplate(filename, strip, template_cache_key, &respecialize);
+  if (!refcounted_tpl)
+    return false;
+  if (respecialize)
+    RespecializeTemplates();
   const bool result = refcounted_tpl->tpl()->ExpandWithDataAndCache(
       expand_emitter, dict, per_expand_data, this);
-  {
-    WriterMutexLock ml(mutex_);
-    refcounted_tpl->DecRef();
-  }
+  refcounted_tpl->DecRef();
+  num_aborted_expands_->Count(per_expand_data);
   return result;
 }
 
@@ -412,27 +1137,136 @@ bool TemplateCache::ExpandNoLoad(
     PerExpandData *per_expand_data,
     ExpandEmitter *expand_emitter) const {
   TemplateCacheKey template_cache_key(filename.GetGlobalId(), strip);
-  CachedTemplate cached_tpl;
+  if (Replica* replica = ThreadReplica()) {
+    return ExpandFromReplica(replica, template_cache_key, dict,
+                             per_expand_data, expand_emitter);
+  }
+  RefcountedTemplate* refcounted_tpl = NULL;
+  bool respecialize;
   {
     ReaderMutexLock ml(mutex_);
     if (!is_frozen_) {
       LOG(DFATAL) << ": ExpandNoLoad() only works on frozen caches.";
       return false;
     }
-    CachedTemplate* it = find_ptr(*parsed_template_cache_, template_cache_key);
+    const CachedTemplate* it =
+        parsed_template_cache_->find(template_cache_key);
     if (!it) {
       return false;
     }
-    cached_tpl = *it;
-    cached_tpl.refcounted_tpl->IncRef();
+    refcounted_tpl = it->refcounted_tpl;
+    refcounted_tpl->IncRef();
+    respecialize = GlobalValuesAreStaleLocked();
   }
-  const bool result = cached_tpl.refcounted_tpl->tpl()->ExpandWithDataAndCache(
+  if (respecialize)
+    RespecializeTemplates();
+  const bool result = refcounted_tpl->tpl()->ExpandWithDataAndCache(
       expand_emitter, dict, per_expand_data, this);
-  {
+  refcounted_tpl->DecRef();
+  num_aborted_expands_->Count(per_expand_data);
+  return result;
+}
+
+bool TemplateCache::ExpandSkeleton(const TemplateString& filename,
+                                   Strip strip,
+                                   ExpandEmitter *skeleton) {
+  TemplateCacheKey template_cache_key(filename.GetGlobalId(), strip);
+  bool respecialize;
+  RefcountedTemplate* refcounted_tpl =
+      AcquireTemplate(filename, strip, template_cache_key, &respecialize);
+  if (!refcounted_tpl)
+    return false;
+  if (respecialize)
+    RespecializeTemplates();
+  const bool result = refcounted_tpl->tpl()->ExpandSkeleton(skeleton, this);
+  refcounted_tpl->DecRef();
+  return result;
+}
+
+bool TemplateCache::ExpandHoles(const TemplateString& filename,
+                                Strip strip,
+                                const TemplateDictionaryInterface *dict,
+                                PerExpandData *per_expand_data,
+                                ExpandEmitter *holes) {
+  TemplateCacheKey template_cache_key(filename.GetGlobalId(), strip);
+  bool respecialize;
+  RefcountedTemplate* refcounted_tpl =
+      AcquireTemplate(filename, strip, template_cache_key, &respecialize);
+  if (!refcounted_tpl)
+    return false;
+  if (respecialize)
+    RespecializeTemplates();
+  const bool result = refcounted_tpl->tpl()->ExpandHoles(
+      holes, dict, per_expand_data, this);
+  refcounted_tpl->DecRef();
+  num_aborted_expands_->Count(per_expand_data);
+  return result;
+}
+
+/*static*/ bool TemplateCache::SpliceSkeleton(const string& skeleton,
+                                              const string& holes,
+                                              ExpandEmitter *output) {
+  return Template::SpliceSkeleton(skeleton, holes, output);
+}
+
+bool TemplateCache::ExpandIncrementally(const TemplateString& filename,
+                                        Strip strip,
+                                        const TemplateDictionaryInterface *dict,
+                                        PerExpandData *per_expand_data,
+                                        ExpansionRecord* record,
+                                        vector<ExpandEdit>* edits) {
+  TemplateCacheKey template_cache_key(filename.GetGlobalId(), strip);
+  bool respecialize;
+  RefcountedTemplate* refcounted_tpl =
+      AcquireTemplate(filename, strip, template_cache_key, &respecialize);
+  if (!refcounted_tpl)
+    return false;
+  if (respecialize)
+    RespecializeTemplates();
+  const bool result = refcounted_tpl->tpl()->ExpandIncrementally(
+      dict, per_expand_data, this, record, edits);
+  refcounted_tpl->DecRef();
+  num_aborted_expands_->Count(per_expand_data);
+  return result;
+}
+
+bool TemplateCache::ExpandBatch(
+    const TemplateString& filename,
+    Strip strip,
+    const vector<const TemplateDictionaryInterface*>& dictionaries,
+    vector<string>* outputs,
+    int num_threads) {
+  outputs->resize(dictionaries.size());
+  TemplateCacheKey template_cache_key(filename.GetGlobalId(), strip);
+  bool respecialize;
+  RefcountedTemplate* refcounted_tpl =
+      AcquireTemplate(filename, strip, template_cache_key, &respecialize);
+  if (!refcounted_tpl)
+    return false;
+  ExpandBatchPool* pool = NULL;
+  if (num_threads > 1) {
     WriterMutexLock ml(mutex_);
-    cached_tpl.refcounted_tpl->DecRef();
+    if (expand_batch_pool_ == NULL)
+      expand_batch_pool_ = new ExpandBatchPool;
+    pool = expand_batch_pool_;
   }
-  return result;
+  if (respecialize)
+    RespecializeTemplates();
+
+  ExpandBatchWork work(refcounted_tpl->tpl(), this, dictionaries, outputs);
+  // There's no point in more helpers than chunks of work for them.
+  const size_t num_chunks = ((dictionaries.size() + kExpandBatchChunkSize - 1)
+                             / kExpandBatchChunkSize);
+  const int num_helpers = (num_chunks > 1 && num_threads > 1 ?
+                           static_cast<int>(std::min<size_t>(num_threads - 1,
+                                                             num_chunks - 1)) :
+                           0);
+  if (num_helpers == 0 || !pool->Run(&work, num_helpers))
+    ExpandBatchWorker(&work);
+
+  refcounted_tpl->DecRef();
+  MutexLock ml(&work.mutex);
+  return work.error_free;
 }
 
 // Note: "Locked" in this name refers to the template object, not to
@@ -443,20 +1277,14 @@ bool TemplateCache::ExpandLocked(const TemplateString& filename,
                                  const TemplateDictionaryInterface *dict,
                                  PerExpandData *per_expand_data) {
   TemplateCacheKey template_cache_key(filename.GetGlobalId(), strip);
-  RefcountedTemplate* refcounted_tpl = NULL;
-  {
-    WriterMutexLock ml(mutex_);
-    refcounted_tpl = GetTemplateLocked(filename, strip, template_cache_key);
-    if (!refcounted_tpl)
-      return false;
-    refcounted_tpl->IncRef();
-  }
+  bool respecialize;
+  RefcountedTemplate* refcounted_tpl =
+      AcquireTemplate(filename, strip, template_cache_key, &respecialize);
+  if (!refcounted_tpl)
+    return false;
   const bool result = refcounted_tpl->tpl()->ExpandLocked(
       expand_emitter, dict, per_expand_data, this);
-  {
-    WriterMutexLock ml(mutex_);
-    refcounted_tpl->DecRef();
-  }
+  refcounted_tpl->DecRef();
   return result;
 }
 
@@ -472,20 +1300,13 @@ bool TemplateCache::ExpandLocked(const TemplateString& filename,
 //    as alternates.
 // ----------------------------------------------------------------------
 
-bool TemplateCache::AddAlternateTemplateRootDirectoryHelper(
-    const string& directory,
-    bool clear_template_search_path) {
-  {
-    ReaderMutexLock ml(mutex_);
-    if (is_frozen_) {  // Cannot set root-directory on a frozen cache.
-      return false;
-    }
-  }
+// Returns directory as the search path holds it: ending with '/', and
+// absolute, so that a later chdir doesn't change what it means.
+static string SearchPathDirectory(const string& directory) {
   string normalized = directory;
   // make sure it ends with '/'
   NormalizeDirectory(&normalized);
-  // Make the directory absolute if it isn't already.  This makes code
-  // safer if client later does a chdir.
+  // Make the directory absolute if it isn't already.
   if (!IsAbspath(normalized)) {
     char* cwdbuf = new char[PATH_MAX];   // new to avoid stack overflow
     const char* cwd = getcwd(cwdbuf, PATH_MAX);
@@ -497,6 +1318,19 @@ bool TemplateCache::AddAlternateTemplateRootDirectoryHelper(
     }
     delete[] cwdbuf;
   }
+  return normalized;
+}
+
+bool TemplateCache::AddAlternateTemplateRootDirectoryHelper(
+    const string& directory,
+    bool clear_template_search_path) {
+  {
+    ReaderMutexLock ml(mutex_);
+    if (is_frozen_) {  // Cannot set root-directory on a frozen cache.
+      return false;
+    }
+  }
+  const string normalized = SearchPathDirectory(directory);
 
   VLOG(2) << "Setting Template directory to " << normalized << endl;
   {
@@ -505,6 +1339,8 @@ bool TemplateCache::AddAlternateTemplateRootDirectoryHelper(
       search_path_.clear();
     }
     search_path_.push_back(normalized);
+    MutexLock rl(resolution_mutex_);
+    resolutions_->clear();
   }
 
   // NOTE(williasr): The template root is not part of the template
@@ -532,49 +1368,181 @@ string TemplateCache::template_root_directory() const {
 
 // Given an unresolved filename, look through the template search path
 // to see if the template can be found. If so, resolved contains the
-// resolved filename, statbuf contains the stat structure for the file
-// (to avoid double-statting the file), and the function returns
-// true. Otherwise, the function returns false.
-bool TemplateCache::ResolveTemplateFilename(const string& unresolved,
-                                            string* resolved,
-                                            FileStat* statbuf) const {
+// resolved filename, statbuf (if not NULL) contains the stat structure
+// for the file (to avoid double-statting the file), and the function
+// returns true. Otherwise, the function returns false.
+//    With the resolution cache on, we first check what we found last
+// time.  A caller that wants statbuf still gets a fresh one, but
+// that's one stat rather than one per directory we had to try.
+bool TemplateCache::ResolveTemplateFilename(
+    const string& unresolved,
+    string* resolved,
+    TemplateSource::FileInfo* statbuf) const {
   ReaderMutexLock ml(search_path_mutex_);
+  const time_t now = time(NULL);
+  int ttl;
+  Resolution cached;
+  {
+    MutexLock rl(resolution_mutex_);
+    ttl = resolution_ttl_;
+    const Resolution* it = find_ptr(*resolutions_, unresolved);
+    if (ttl > 0 && it && it->expires > now)
+      cached = *it;
+  }
+  if (cached.num_stats > 0) {
+    if (cached.resolved.empty()) {
+      MutexLock rl(resolution_mutex_);
+      ++resolution_stats_.hits;
+      resolution_stats_.stats_saved += cached.num_stats;
+      resolved->clear();
+      return false;
+    }
+    TemplateSource::FileInfo tmp_statbuf;
+    if (!statbuf || source_->Stat(cached.resolved, &tmp_statbuf)) {
+      MutexLock rl(resolution_mutex_);
+      ++resolution_stats_.hits;
+      resolution_stats_.stats_saved += cached.num_stats - (statbuf ? 1 : 0);
+      *resolved = cached.resolved;
+      if (statbuf)
+        *statbuf = tmp_statbuf;
+      return true;
+    }
+    // The file went away; look for it again.
+  }
+
+  TemplateSource::FileInfo tmp_statbuf;
+  if (!statbuf)
+    statbuf = &tmp_statbuf;
+  Resolution found;
   if (search_path_.empty() || IsAbspath(unresolved)) {
     *resolved = unresolved;
-    if (File::Stat(*resolved, statbuf)) {
+    ++found.num_stats;
+    if (source_->Stat(*resolved, statbuf)) {
       VLOG(1) << "Resolved " << unresolved << " to " << *resolved << endl;
-      return true;
+      found.resolved = *resolved;
     }
   } else {
     for (TemplateSearchPath::const_iterator path = search_path_.begin();
          path != search_path_.end();
          ++path) {
       *resolved = PathJoin(*path, unresolved);
-      if (File::Stat(*resolved, statbuf)) {
+      ++found.num_stats;
+      if (source_->Stat(*resolved, statbuf)) {
         VLOG(1) << "Resolved " << unresolved << " to " << *resolved << endl;
-        return true;
+        found.resolved = *resolved;
+        break;
       }
     }
   }
+  *resolved = found.resolved;
 
-  resolved->clear();
-  return false;
+  MutexLock rl(resolution_mutex_);
+  if (ttl > 0) {
+    ++resolution_stats_.misses;
+    found.expires = now + ttl;
+    (*resolutions_)[unresolved] = found;
+  }
+  return !resolved->empty();
 }
 
 string TemplateCache::FindTemplateFilename(const string& unresolved)
     const {
   string resolved;
-  FileStat statbuf;
-  if (!ResolveTemplateFilename(unresolved, &resolved, &statbuf))
+  if (!ResolveTemplateFilename(unresolved, &resolved, NULL))
     resolved.clear();
   return resolved;
 }
 
+// ----------------------------------------------------------------------
+// TemplateCache::SetTemplateSource()
+// TemplateCache::template_source()
+//    Like a change to the search path, a new source can change what
+//    any filename refers to, so we forget what we resolved and check
+//    every template again when it's next used.
+// ----------------------------------------------------------------------
+
+bool TemplateCache::SetTemplateSource(const TemplateSource* source) {
+  {
+    ReaderMutexLock ml(mutex_);
+    if (is_frozen_) {
+      return false;
+    }
+  }
+  {
+    WriterMutexLock ml(search_path_mutex_);
+    source_ = source ? source : TemplateSource::Filesystem();
+    MutexLock rl(resolution_mutex_);
+    resolutions_->clear();
+  }
+  ReloadAllIfChanged(LAZY_RELOAD);
+  return true;
+}
+
+const TemplateSource* TemplateCache::template_source() const {
+  ReaderMutexLock ml(search_path_mutex_);
+  return source_;
+}
+
+// ----------------------------------------------------------------------
+// TemplateCache::SetResolutionCacheTtl()
+// TemplateCache::InvalidateResolutions()
+// TemplateCache::resolution_stats()
+//    The resolution cache maps each filename ResolveTemplateFilename()
+//    was asked about to what it found, misses included, since a miss
+//    is what costs the most stats.
+// ----------------------------------------------------------------------
+
+void TemplateCache::SetResolutionCacheTtl(int ttl_seconds) {
+  MutexLock rl(resolution_mutex_);
+  resolution_ttl_ = ttl_seconds;
+  if (ttl_seconds <= 0)
+    resolutions_->clear();
+}
+
+void TemplateCache::InvalidateResolutions(const string& directory) {
+  ReaderMutexLock ml(search_path_mutex_);
+  MutexLock rl(resolution_mutex_);
+  if (directory.empty()) {
+    resolutions_->clear();
+    return;
+  }
+  const string normalized = SearchPathDirectory(directory);
+  // A file added to directory shadows any file of the same name that
+  // we found in a directory after it on the search path.
+  TemplateSearchPath::iterator first_affected =
+      std::find(search_path_.begin(), search_path_.end(), normalized);
+  const TemplateSearchPath affected =
+      (first_affected == search_path_.end() ?
+       TemplateSearchPath(1, normalized) :
+       TemplateSearchPath(first_affected, search_path_.end()));
+  for (ResolutionMap::iterator it = resolutions_->begin();
+       it != resolutions_->end(); ) {
+    const string& resolved = it->second.resolved;
+    bool forget = resolved.empty();
+    for (TemplateSearchPath::const_iterator dir = affected.begin();
+         !forget && dir != affected.end(); ++dir) {
+      forget = resolved.compare(0, dir->size(), *dir) == 0;
+    }
+    if (forget) {
+      resolutions_->erase(it++);
+    } else {
+      ++it;
+    }
+  }
+}
+
+TemplateCache::ResolutionStats TemplateCache::resolution_stats() const {
+  MutexLock rl(resolution_mutex_);
+  return resolution_stats_;
+}
+
 
 // ----------------------------------------------------------------------
 // TemplateCache::Delete()
 // TemplateCache::ClearCache()
-//    Delete deletes one entry from the cache.
+//    Delete deletes one entry from the cache: every Strip variant of
+//    the key.  There are only NUM_STRIPS of those, so we look each one
+//    up rather than scanning the cache.
 // ----------------------------------------------------------------------
 
 bool TemplateCache::Delete(const TemplateString& key) {
@@ -582,22 +1550,26 @@ bool TemplateCache::Delete(const TemplateString& key) {
   if (is_frozen_) {  // Cannot delete from a frozen cache.
     return false;
   }
-  vector<TemplateCacheKey> to_erase;
   const TemplateId key_id = key.GetGlobalId();
-  for (TemplateMap::iterator it = parsed_template_cache_->begin();
-       it != parsed_template_cache_->end();  ++it) {
-    if (it->first.first == key_id) {
-      // We'll delete the content pointed to by the entry here, since
-      // it's handy, but we won't delete the entry itself quite yet.
-      it->second.refcounted_tpl->DecRef();
-      to_erase.push_back(it->first);
+  bool deleted = false;
+  for (int strip = 0; strip < static_cast<int>(NUM_STRIPS); ++strip) {
+    const TemplateCacheKey template_cache_key(key_id, strip);
+    const CachedTemplate* it =
+        parsed_template_cache_->find(template_cache_key);
+    if (it) {
+      memory_usage_ -= it->memory_usage;
+      parsed_template_cache_->erase(template_cache_key);
+      deleted = true;
+    }
+    // The template may have been evicted, leaving only its source.
+    const StringSource* source = string_sources_->find(template_cache_key);
+    if (source) {
+      memory_usage_ -= source->memory_usage();
+      string_sources_->erase(template_cache_key);
+      deleted = true;
     }
   }
-  for (vector<TemplateCacheKey>::iterator it = to_erase.begin();
-       it != to_erase.end(); ++it) {
-    parsed_template_cache_->erase(*it);
-  }
-  return !to_erase.empty();
+  return deleted;
 }
 
 void TemplateCache::ClearCache() {
@@ -607,16 +1579,17 @@ void TemplateCache::ClearCache() {
   // us delete the items in the cache at our leisure without needing
   // to hold mutex_.
   TemplateMap tmp_cache;
+  StringSourceMap tmp_sources;
   {
     WriterMutexLock ml(mutex_);
     parsed_template_cache_->swap(tmp_cache);
+    string_sources_->swap(tmp_sources);
+    memory_usage_ = 0;
     is_frozen_ = false;
+    RenewReplicaIdLocked();
   }
-  for (TemplateMap::iterator it = tmp_cache.begin();
-       it != tmp_cache.end();
-       ++it) {
-    it->second.refcounted_tpl->DecRef();
-  }
+  // tmp_cache DecRefs its templates as it goes away.
+  tmp_cache.clear();
 
   // Do a decref for all templates ever returned by GetTemplate().
   DoneWithGetTemplatePtrs();
@@ -662,16 +1635,24 @@ void TemplateCache::ReloadAllIfChanged(ReloadType reload_type) {
   if (is_frozen_) {  // do not reload a frozen cache.
     return;
   }
-  for (TemplateMap::iterator it = parsed_template_cache_->begin();
+  // Changing an entry invalidates the map's iterators, so we collect
+  // the keys first.
+  vector<TemplateCacheKey> keys;
+  for (TemplateMap::const_iterator it = parsed_template_cache_->begin();
        it != parsed_template_cache_->end();
        ++it) {
-    it->second.should_reload = true;
+    keys.push_back(it->first);
+  }
+  for (vector<TemplateCacheKey>::const_iterator key = keys.begin();
+       key != keys.end(); ++key) {
+    CachedTemplate* it = parsed_template_cache_->find_mutable(*key);
+    it->should_reload = true;
     if (reload_type == IMMEDIATE_RELOAD) {
-      const Template* tpl = it->second.refcounted_tpl->tpl();
+      const Template* tpl = it->refcounted_tpl->tpl();
       // Reload should always use the original filename.
       // For instance on reload, we may replace an existing template with a
       // new one that came earlier on the search path.
-      GetTemplateLocked(tpl->original_filename(), tpl->strip(), it->first);
+      GetTemplateLocked(tpl->original_filename(), tpl->strip(), *key);
     }
   }
 }
@@ -695,13 +1676,206 @@ void TemplateCache::Freeze() {
   {
     WriterMutexLock ml(mutex_);
     is_frozen_ = true;
+    RenewReplicaIdLocked();
   }
 }
 
+// ----------------------------------------------------------------------
+// TemplateCache::SetThreadLocalReplicas()
+// TemplateCache::RenewReplicaIdLocked()
+// TemplateCache::ThreadReplica()
+// TemplateCache::ExpandFromReplica()
+//    A frozen cache's index can't change, so a thread may as well
+//    keep its own copy of it.  The copy is made under a reader lock
+//    on mutex_, the first time the thread expands from the cache.
+//    After that, the thread only reads replica_id_ (which doesn't
+//    change while the cache is frozen), and its own memory.
+// ----------------------------------------------------------------------
+
+void TemplateCache::SetThreadLocalReplicas(bool enabled) {
+  WriterMutexLock ml(mutex_);
+  thread_local_replicas_ = enabled;
+  RenewReplicaIdLocked();
+}
+
+void TemplateCache::RenewReplicaIdLocked() {
+  const uint64_t old_id = replica_id_.load();
+  const uint64_t new_id =
+      (is_frozen_ && thread_local_replicas_) ? g_next_replica_id++ : 0;
+  if (old_id == 0 && new_id == 0)
+    return;
+  replica_id_.store(new_id);
+  MutexLock ml(&g_replica_mutex);
+  if (!g_live_replica_ids)
+    g_live_replica_ids = new set<uint64_t>;
+  g_live_replica_ids->erase(old_id);
+  if (new_id)
+    g_live_replica_ids->insert(new_id);
+}
+
+TemplateCache::Replica* TemplateCache::ThreadReplica() const {
+  const uint64_t id = replica_id_.load();
+  if (id == 0)
+    return NULL;
+  static thread_local ThreadReplicas thread_replicas;
+  Replica** found = find_ptr(thread_replicas.replicas, id);
+  if (found)
+    return *found;
+
+  // Making a Replica is a good time to get rid of the old ones.
+  thread_replicas.DeleteRetired();
+  Replica* replica = new Replica;
+  {
+    ReaderMutexLock ml(mutex_);
+    if (replica_id_.load() != id) {   // we were just cleared
+      delete replica;
+      return NULL;
+    }
+    for (TemplateMap::const_iterator it = parsed_template_cache_->begin();
+         it != parsed_template_cache_->end(); ++it) {
+      // Just like GetTemplateLocked(), we leave out broken templates.
+      if (it->second.refcounted_tpl->tpl()->state() != TS_READY)
+        continue;
+      it->second.refcounted_tpl->IncRef();
+      replica->templates[it->first] = it->second.refcounted_tpl;
+    }
+    replica->global_values_final = global_values_final_;
+    replica->global_values_generation = global_values_generation_;
+  }
+  thread_replicas.replicas[id] = replica;
+  return replica;
+}
+
+bool TemplateCache::ExpandFromReplica(
+    Replica* replica,
+    const TemplateCacheKey& template_cache_key,
+    const TemplateDictionaryInterface* dict,
+    PerExpandData* per_expand_data,
+    ExpandEmitter* expand_emitter) const {
+  RefcountedTemplate** refcounted_tpl =
+      find_ptr(replica->templates, template_cache_key);
+  if (!refcounted_tpl)
+    return false;
+  if (replica->global_values_final) {
+    const int generation = TemplateDictionary::GlobalValuesGeneration();
+    if (generation != replica->global_values_generation) {
+      RespecializeTemplates();
+      replica->global_values_generation = generation;
+    }
+  }
+  // The replica's reference keeps the template alive, even if the
+  // cache is cleared while we're expanding.
+  const bool result = (*refcounted_tpl)->tpl()->ExpandWithDataAndCache(
+      expand_emitter, dict, per_expand_data, this);
+  num_aborted_expands_->Count(per_expand_data);
+  return result;
+}
+
+// ----------------------------------------------------------------------
+// TemplateCache::FinalizeGlobalValues()
+// TemplateCache::RespecializeTemplates()
+// TemplateCache::GlobalValuesAreStaleLocked()
+// TemplateCache::global_values_final()
+//    Once global values are final, each template keeps a copy of its
+//    parse tree with the global values folded in (see
+//    Template::SpecializeOnGlobalValues()).  Expands notice when
+//    SetGlobalValue() has been called since we last specialized, and
+//    call RespecializeTemplates() to catch up.  Until that finishes,
+//    templates with an out-of-date specialization just use their
+//    original parse tree, so expansion is always correct.
+// ----------------------------------------------------------------------
+
+void TemplateCache::FinalizeGlobalValues() {
+  {
+    WriterMutexLock ml(mutex_);
+    global_values_final_ = true;
+    RenewReplicaIdLocked();   // so Replicas see global_values_final_
+  }
+  RespecializeTemplates();
+}
+
+void TemplateCache::RespecializeTemplates() const {
+  // Template::SpecializeOnGlobalValues() acquires g_template_mutex,
+  // which must never be acquired while holding mutex_, so we only
+  // hold mutex_ long enough to collect (and IncRef) the templates,
+  // and then to charge the cache for their new sizes.  The snapshot
+  // of the map holds the references.
+  TemplateMap templates;
+  {
+    WriterMutexLock ml(mutex_);
+    if (!GlobalValuesAreStaleLocked())
+      return;     // another thread got here first
+    global_values_generation_ = TemplateDictionary::GlobalValuesGeneration();
+    templates = *parsed_template_cache_;
+  }
+  vector<pair<TemplateCacheKey, size_t> > memory_usage;
+  for (TemplateMap::const_iterator it = templates.begin();
+       it != templates.end(); ++it) {
+    const Template* tpl = it->second.refcounted_tpl->tpl();
+    tpl->SpecializeOnGlobalValues();
+    memory_usage.push_back(make_pair(it->first, tpl->MemoryUsage()));
+  }
+  {
+    WriterMutexLock ml(mutex_);
+    for (vector<pair<TemplateCacheKey, size_t> >::const_iterator it =
+             memory_usage.begin(); it != memory_usage.end(); ++it) {
+      const CachedTemplate* cached = parsed_template_cache_->find(it->first);
+      if (!cached || cached->memory_usage == it->second ||
+          cached->refcounted_tpl !=
+          templates.find(it->first)->refcounted_tpl)
+        continue;   // unchanged, or replaced since we looked
+      CachedTemplate* mutable_cached =
+          parsed_template_cache_->find_mutable(it->first);
+      memory_usage_ -= mutable_cached->memory_usage;
+      mutable_cached->memory_usage = it->second;
+      memory_usage_ += mutable_cached->memory_usage;
+    }
+  }
+  // Specializing usually makes templates bigger.
+  EvictIfOverBudget(NULL);
+}
+
+bool TemplateCache::GlobalValuesAreStaleLocked() const {
+  return (global_values_final_ &&
+          global_values_generation_ !=
+          TemplateDictionary::GlobalValuesGeneration());
+}
+
+bool TemplateCache::global_values_final() const {
+  return global_values_final_.load(std::memory_order_acquire);
+}
+
+// ----------------------------------------------------------------------
+// TemplateCache::NumAbortedExpands()
+//    The counts are kept by ExpandWithData() and ExpandNoLoad(), in
+//    an AbortCounts, since neither holds mutex_ after an expand.
+// ----------------------------------------------------------------------
+
+int TemplateCache::NumAbortedExpands(ExpandAbortReason reason) const {
+  if (reason <= EXPAND_NOT_ABORTED || reason >= NUM_EXPAND_ABORT_REASONS)
+    return 0;
+  return num_aborted_expands_->Sum(reason);
+}
+
+// ----------------------------------------------------------------------
+// TemplateCache::SetPrecompressThreshold()
+//    Templates already in the cache are left as they are: they may
+//    be in use, and precompressing text is slow enough that we'd
+//    rather not do it under a lock.
+// ----------------------------------------------------------------------
+
+void TemplateCache::SetPrecompressThreshold(size_t min_length) {
+  WriterMutexLock ml(mutex_);
+  precompress_threshold_ = min_length;
+}
+
 // ----------------------------------------------------------------------
 // TemplateCache::Clone()
-//    Clone makes a shallow copy of the parsed cache by incrementing
-//    templates' refcount.
+//    Clone makes a shallow copy of the parsed cache.  Copying a
+//    TemplateMap just shares its root with the copy, so this takes
+//    constant time no matter how many templates we have; the entries
+//    (and their references to the templates) get copied only when
+//    one of the caches changes them.
 //    The caller is responsible for deallocating the returned TemplateCache.
 // ----------------------------------------------------------------------
 
@@ -709,10 +1883,24 @@ TemplateCache* TemplateCache::Clone() const {
   ReaderMutexLock ml(mutex_);
   TemplateCache* new_cache = new TemplateCache();
   *(new_cache->parsed_template_cache_) = *parsed_template_cache_;
-  for (TemplateMap::iterator it = parsed_template_cache_->begin();
-       it != parsed_template_cache_->end(); ++it) {
-    it->second.refcounted_tpl->IncRef();
+  new_cache->global_values_final_ = global_values_final_.load();
+  new_cache->global_values_generation_ = global_values_generation_;
+  new_cache->precompress_threshold_ = precompress_threshold_;
+  *(new_cache->string_sources_) = *string_sources_;
+  new_cache->memory_budget_ = memory_budget_;
+  new_cache->keep_string_sources_ = keep_string_sources_;
+  new_cache->thread_local_replicas_ = thread_local_replicas_;
+  new_cache->source_ = template_source();
+  {
+    MutexLock rl(resolution_mutex_);
+    new_cache->resolution_ttl_ = resolution_ttl_;
   }
+  new_cache->memory_usage_ = memory_usage_;
+  new_cache->use_clock_ = use_clock_;
+  // Templates the clone loads share their text with ours.
+  new_cache->text_store_->DecRef();
+  new_cache->text_store_ = text_store_;
+  text_store_->IncRef();
 
   return new_cache;
 }
@@ -720,12 +1908,13 @@ TemplateCache* TemplateCache::Clone() const {
 // ----------------------------------------------------------------------
 // TemplateCache::Refcount()
 //    This routine is DEBUG-only. It returns the refcount of a template,
-//    given the TemplateCacheKey.
+//    given the TemplateCacheKey.  Caches that share an entry through
+//    Clone() share the reference it holds, too.
 // ----------------------------------------------------------------------
 
 int TemplateCache::Refcount(const TemplateCacheKey template_cache_key) const {
   ReaderMutexLock ml(mutex_);
-  CachedTemplate* it = find_ptr(*parsed_template_cache_, template_cache_key);
+  const CachedTemplate* it = parsed_template_cache_->find(template_cache_key);
   return it ? it->refcounted_tpl->refcount() : 0;
 }
 
@@ -738,7 +1927,7 @@ int TemplateCache::Refcount(const TemplateCacheKey template_cache_key) const {
 bool TemplateCache::TemplateIsCached(const TemplateCacheKey template_cache_key)
     const {
   ReaderMutexLock ml(mutex_);
-  return parsed_template_cache_->count(template_cache_key);
+  return parsed_template_cache_->find(template_cache_key) != NULL;
 }
 
 // ----------------------------------------------------------------------
@@ -746,16 +1935,17 @@ bool TemplateCache::TemplateIsCached(const TemplateCacheKey template_cache_key)
 //    Validates the filename before constructing the template.
 // ----------------------------------------------------------------------
 
-bool TemplateCache::IsValidTemplateFilename(const string& filename,
-                                            string* resolved_filename,
-                                            FileStat* statbuf) const {
+bool TemplateCache::IsValidTemplateFilename(
+    const string& filename,
+    string* resolved_filename,
+    TemplateSource::FileInfo* statbuf) const {
   if (!ResolveTemplateFilename(filename,
                                resolved_filename,
                                statbuf)) {
     LOG(WARNING) << "Unable to locate file " << filename << endl;
     return false;
   }
-  if (statbuf->IsDirectory()) {
+  if (statbuf->is_directory) {
     LOG(WARNING) << *resolved_filename
                  << "is a directory and thus not readable" << endl;
     return false;
@@ -0,0 +1,760 @@
+// Copyright (c) 2026, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+//
+// TemplateCapture and TemplateCaptureReader.
+//
+// A capture file is laid out as follows.  All integers are
+// little-endian, and a string is a u32 length followed by its bytes.
+//    header:  "CTPLCAPT", u32 format (1)
+//    then records, each a u8 type, a u32 length and that many bytes:
+//    'G':     the global values: u32 count, then count (name, value)
+//             string pairs.  Written before the first expansion, and
+//             again whenever they change.
+//    'E':     an expansion: string template name, u8 strip, u8 flags
+//             (kAnnotate etc), string annotate path, u64 max output
+//             bytes, u64 max iterations, i64 usecs to the deadline
+//             (or -1), u64 output size, u64 output digest, then the
+//             dictionary.
+// A dictionary is what the template asked it, and the answers:
+//    u32 count, then count (name, value) string pairs: GetValue()
+//    u32 count, then count (name, u8 answer): IsHiddenSection()
+//    the same for IsUnhiddenSection() and for IsHiddenTemplate()
+//    u32 count, then count (name, u32 dictnum, u8 is-NULL, string
+//        filename): GetIncludeTemplateName()
+//    u32 count, then count (name, u32 n, n dictionaries):
+//        CreateSectionIterator()
+//    the same for CreateTemplateIterator().
+
+#include <config.h>
+#include "base/mutex.h"  // This must go first so we get _XOPEN_SOURCE
+#include <ctemplate/template_capture.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>      // for memcmp(), strerror()
+#include <chrono>        // for steady_clock
+#include <iostream>      // for cerr
+#include <map>
+#include <string>
+#include <utility>       // for pair<>
+#include <vector>
+#include <ctemplate/per_expand_data.h>
+#include <ctemplate/template_dictionary.h>
+#include <ctemplate/template_dictionary_interface.h>
+#include <ctemplate/template_emitter.h>
+#include <ctemplate/template_string.h>
+
+using std::make_pair;
+using std::map;
+using std::pair;
+using std::string;
+using std::vector;
+
+#define LOG(level)   std::cerr << #level ": "
+
+namespace ctemplate {
+
+static const char kCaptureMagic[8] = { 'C', 'T', 'P', 'L',
+                                       'C', 'A', 'P', 'T' };
+static const uint32_t kCaptureFormat = 1;
+static const char kGlobalsRecord = 'G';
+static const char kExpandRecord = 'E';
+// The flags byte of an expand record.
+static const int kAnnotate = 1;
+static const int kHadExpansionModifier = 2;
+static const int kExpandSucceeded = 4;
+
+// ----------------------------------------------------------------------
+// Encoding and decoding
+// ----------------------------------------------------------------------
+
+static void Append(string* out, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; ++i) {
+    out->push_back(static_cast<char>(value & 0xff));
+    value >>= 8;
+  }
+}
+
+static void AppendString(string* out, const string& s) {
+  Append(out, s.size(), 4);
+  out->append(s);
+}
+
+// Reads what Append() and AppendString() wrote.  Once a read runs off
+// the end of the input, it and every later one fails.
+class Decoder {
+ public:
+  Decoder(const char* data, size_t size) : p_(data), end_(data + size) { }
+
+  bool Read(int bytes, uint64_t* value) {
+    if (p_ == NULL || end_ - p_ < bytes) {
+      p_ = NULL;
+      return false;
+    }
+    *value = 0;
+    for (int i = bytes - 1; i >= 0; --i)
+      *value = (*value << 8) | static_cast<unsigned char>(p_[i]);
+    p_ += bytes;
+    return true;
+  }
+  bool ReadString(string* s) {
+    uint64_t size;
+    if (!Read(4, &size))
+      return false;
+    if (static_cast<uint64_t>(end_ - p_) < size) {
+      p_ = NULL;
+      return false;
+    }
+    s->assign(p_, size);
+    p_ += size;
+    return true;
+  }
+  bool at_end() const { return p_ == end_; }
+
+ private:
+  const char* p_;     // NULL once a read has failed
+  const char* end_;
+};
+
+// ----------------------------------------------------------------------
+// RecordingDictionary
+//    Passes every question an expansion asks on to the real
+//    dictionary, and remembers the question and its answer.
+// CapturedDictionary
+//    Answers those questions the same way, from a capture file.
+//    What both of them remember is a DictionaryAnswers.
+// ----------------------------------------------------------------------
+
+struct DictionaryAnswers {
+  map<string, string> values;
+  map<string, bool> hidden_sections;
+  map<string, bool> unhidden_sections;
+  map<string, bool> hidden_templates;
+  // The bool is true if GetIncludeTemplateName() returned NULL.
+  map<pair<string, int>, pair<bool, string> > include_names;
+
+  void Encode(string* out) const {
+    Append(out, values.size(), 4);
+    for (map<string, string>::const_iterator it = values.begin();
+         it != values.end(); ++it) {
+      AppendString(out, it->first);
+      AppendString(out, it->second);
+    }
+    EncodeBools(hidden_sections, out);
+    EncodeBools(unhidden_sections, out);
+    EncodeBools(hidden_templates, out);
+    Append(out, include_names.size(), 4);
+    for (map<pair<string, int>, pair<bool, string> >::const_iterator it =
+             include_names.begin(); it != include_names.end(); ++it) {
+      AppendString(out, it->first.first);
+      Append(out, it->first.second, 4);
+      Append(out, it->second.first, 1);
+      AppendString(out, it->second.second);
+    }
+  }
+
+  bool Decode(Decoder* in) {
+    uint64_t count;
+    if (!in->Read(4, &count))
+      return false;
+    for (uint64_t i = 0; i < count; ++i) {
+      string name, value;
+      if (!in->ReadString(&name) || !in->ReadString(&value))
+        return false;
+      values[name] = value;
+    }
+    if (!DecodeBools(in, &hidden_sections) ||
+        !DecodeBools(in, &unhidden_sections) ||
+        !DecodeBools(in, &hidden_templates) ||
+        !in->Read(4, &count))
+      return false;
+    for (uint64_t i = 0; i < count; ++i) {
+      string name, filename;
+      uint64_t dictnum, is_null;
+      if (!in->ReadString(&name) || !in->Read(4, &dictnum) ||
+          !in->Read(1, &is_null) || !in->ReadString(&filename))
+        return false;
+      include_names[make_pair(name, static_cast<int>(dictnum))] =
+          make_pair(is_null != 0, filename);
+    }
+    return true;
+  }
+
+ private:
+  static void EncodeBools(const map<string, bool>& m, string* out) {
+    Append(out, m.size(), 4);
+    for (map<string, bool>::const_iterator it = m.begin();
+         it != m.end(); ++it) {
+      AppendString(out, it->first);
+      Append(out, it->second, 1);
+    }
+  }
+  static bool DecodeBools(Decoder* in, map<string, bool>* m) {
+    uint64_t count, answer;
+    if (!in->Read(4, &count))
+      return false;
+    for (uint64_t i = 0; i < count; ++i) {
+      string name;
+      if (!in->ReadString(&name) || !in->Read(1, &answer))
+        return false;
+      (*m)[name] = answer != 0;
+    }
+    return true;
+  }
+};
+
+static string ToString(const TemplateString& s) {
+  return string(s.data(), s.size());
+}
+
+class RecordingDictionary : public TemplateDictionaryInterface {
+ public:
+  explicit RecordingDictionary(const TemplateDictionaryInterface* real)
+      : real_(real) { }
+  virtual ~RecordingDictionary() {
+    DeleteChildren(&sections_);
+    DeleteChildren(&includes_);
+  }
+
+  void Encode(string* out) const {
+    answers_.Encode(out);
+    EncodeChildren(sections_, out);
+    EncodeChildren(includes_, out);
+  }
+
+ protected:
+  virtual TemplateString GetValue(const TemplateString& variable) const {
+    const TemplateString value = real_->GetValue(variable);
+    answers_.values[ToString(variable)] = ToString(value);
+    return value;
+  }
+  virtual bool IsHiddenSection(const TemplateString& name) const {
+    return answers_.hidden_sections[ToString(name)] =
+        real_->IsHiddenSection(name);
+  }
+  virtual bool IsUnhiddenSection(const TemplateString& name) const {
+    return answers_.unhidden_sections[ToString(name)] =
+        real_->IsUnhiddenSection(name);
+  }
+  virtual bool IsHiddenTemplate(const TemplateString& name) const {
+    return answers_.hidden_templates[ToString(name)] =
+        real_->IsHiddenTemplate(name);
+  }
+  virtual const char* GetIncludeTemplateName(const TemplateString& variable,
+                                             int dictnum) const {
+    const char* filename = real_->GetIncludeTemplateName(variable, dictnum);
+    answers_.include_names[make_pair(ToString(variable), dictnum)] =
+        make_pair(filename == NULL, string(filename ? filename : ""));
+    return filename;
+  }
+  virtual Iterator* CreateSectionIterator(const TemplateString& name) const {
+    return new RecordingIterator(real_->CreateSectionIterator(name),
+                                 &sections_[ToString(name)]);
+  }
+  virtual Iterator* CreateTemplateIterator(const TemplateString& name) const {
+    return new RecordingIterator(real_->CreateTemplateIterator(name),
+                                 &includes_[ToString(name)]);
+  }
+  virtual void DumpToString(string* out, int level) const {
+    real_->DumpToString(out, level);
+  }
+
+ private:
+  typedef map<string, vector<RecordingDictionary*> > Children;
+
+  // Wraps each child dictionary the real iterator returns in a
+  // RecordingDictionary.  If the same section is iterated over again
+  // (it's used twice in the template, say), so are the same wrappers.
+  class RecordingIterator : public Iterator {
+   public:
+    RecordingIterator(Iterator* real, vector<RecordingDictionary*>* children)
+        : real_(real), children_(children), next_(0) { }
+    virtual ~RecordingIterator() { delete real_; }
+
+    virtual bool HasNext() const { return real_->HasNext(); }
+    virtual const TemplateDictionaryInterface& Next() {
+      const TemplateDictionaryInterface& child = real_->Next();
+      if (next_ == children_->size())
+        children_->push_back(new RecordingDictionary(&child));
+      return *(*children_)[next_++];
+    }
+
+   private:
+    Iterator* const real_;
+    vector<RecordingDictionary*>* const children_;
+    size_t next_;
+  };
+
+  static void DeleteChildren(Children* children) {
+    for (Children::iterator it = children->begin();
+         it != children->end(); ++it) {
+      for (size_t i = 0; i < it->second.size(); ++i)
+        delete it->second[i];
+    }
+  }
+  static void EncodeChildren(const Children& children, string* out) {
+    Append(out, children.size(), 4);
+    for (Children::const_iterator it = children.begin();
+         it != children.end(); ++it) {
+      AppendString(out, it->first);
+      Append(out, it->second.size(), 4);
+      for (size_t i = 0; i < it->second.size(); ++i)
+        it->second[i]->Encode(out);
+    }
+  }
+
+  const TemplateDictionaryInterface* const real_;
+  // The interface is const, but recording what it's asked isn't.
+  mutable DictionaryAnswers answers_;
+  mutable Children sections_;
+  mutable Children includes_;
+};
+
+class CapturedDictionary : public TemplateDictionaryInterface {
+ public:
+  CapturedDictionary() { }
+  virtual ~CapturedDictionary() {
+    DeleteChildren(&sections_);
+    DeleteChildren(&includes_);
+  }
+
+  // depth guards against a corrupt file that nests without end.
+  bool Decode(Decoder* in, int depth) {
+    return depth < 1000 &&
+        answers_.Decode(in) &&
+        DecodeChildren(in, depth, &sections_) &&
+        DecodeChildren(in, depth, &includes_);
+  }
+
+ protected:
+  // Questions the original expansion didn't ask get the answer an
+  // empty TemplateDictionary would give.
+  virtual TemplateString GetValue(const TemplateString& variable) const {
+    map<string, string>::const_iterator it =
+        answers_.values.find(ToString(variable));
+    if (it == answers_.values.end())
+      return TemplateString("", 0);
+    return TemplateString(it->second.data(), it->second.size());
+  }
+  virtual bool IsHiddenSection(const TemplateString& name) const {
+    return Find(answers_.hidden_sections, name, true);
+  }
+  virtual bool IsUnhiddenSection(const TemplateString& name) const {
+    return Find(answers_.unhidden_sections, name, false);
+  }
+  virtual bool IsHiddenTemplate(const TemplateString& name) const {
+    return Find(answers_.hidden_templates, name, true);
+  }
+  virtual const char* GetIncludeTemplateName(const TemplateString& variable,
+                                             int dictnum) const {
+    map<pair<string, int>, pair<bool, string> >::const_iterator it =
+        answers_.include_names.find(make_pair(ToString(variable), dictnum));
+    if (it == answers_.include_names.end() || it->second.first)
+      return NULL;
+    return it->second.second.c_str();
+  }
+  virtual Iterator* CreateSectionIterator(const TemplateString& name) const {
+    return new CapturedIterator(FindChildren(sections_, name));
+  }
+  virtual Iterator* CreateTemplateIterator(const TemplateString& name) const {
+    return new CapturedIterator(FindChildren(includes_, name));
+  }
+  virtual void DumpToString(string* out, int level) const {
+    out->append(level * 2, ' ');
+    out->append("captured dictionary\n");
+  }
+
+ private:
+  typedef map<string, vector<CapturedDictionary*> > Children;
+
+  class CapturedIterator : public Iterator {
+   public:
+    explicit CapturedIterator(const vector<CapturedDictionary*>* children)
+        : children_(children), next_(0) { }
+
+    virtual bool HasNext() const {
+      return children_ != NULL && next_ < children_->size();
+    }
+    virtual const TemplateDictionaryInterface& Next() {
+      return *(*children_)[next_++];
+    }
+
+   private:
+    const vector<CapturedDictionary*>* const children_;   // may be NULL
+    size_t next_;
+  };
+
+  static bool Find(const map<string, bool>& m, const TemplateString& name,
+                   bool if_missing) {
+    map<string, bool>::const_iterator it = m.find(ToString(name));
+    return it == m.end() ? if_missing : it->second;
+  }
+  static const vector<CapturedDictionary*>* FindChildren(
+      const Children& children, const TemplateString& name) {
+    Children::const_iterator it = children.find(ToString(name));
+    return it == children.end() ? NULL : &it->second;
+  }
+  static void DeleteChildren(Children* children) {
+    for (Children::iterator it = children->begin();
+         it != children->end(); ++it) {
+      for (size_t i = 0; i < it->second.size(); ++i)
+        delete it->second[i];
+    }
+  }
+  static bool DecodeChildren(Decoder* in, int depth, Children* children) {
+    uint64_t count, num_dicts;
+    if (!in->Read(4, &count))
+      return false;
+    for (uint64_t i = 0; i < count; ++i) {
+      string name;
+      if (!in->ReadString(&name) || !in->Read(4, &num_dicts))
+        return false;
+      vector<CapturedDictionary*>* dicts = &(*children)[name];
+      for (uint64_t j = 0; j < num_dicts; ++j) {
+        dicts->push_back(new CapturedDictionary);
+        if (!dicts->back()->Decode(in, depth + 1))
+          return false;
+      }
+    }
+    return true;
+  }
+
+  DictionaryAnswers answers_;
+  Children sections_;
+  Children includes_;
+};
+
+// ----------------------------------------------------------------------
+// TemplateCapture
+// ----------------------------------------------------------------------
+
+class TemplateCapture::Recording {
+ public:
+  Recording(const TemplateString& filename, Strip strip,
+            const TemplateDictionaryInterface* dict,
+            const PerExpandData* per_expand_data,
+            ExpandEmitter* output)
+      : template_name(ToString(filename)),
+        strip(strip),
+        flags(0),
+        max_output_bytes(0),
+        max_iterations(0),
+        deadline_usec(-1),
+        dictionary(dict),
+        emitter(output) {
+    if (per_expand_data == NULL)
+      return;
+    if (per_expand_data->annotate()) {
+      flags |= kAnnotate;
+      annotate_path = per_expand_data->annotate_path();
+    }
+    if (per_expand_data->template_expansion_modifier())
+      flags |= kHadExpansionModifier;
+    max_output_bytes = per_expand_data->max_output_bytes();
+    max_iterations = per_expand_data->max_iterations();
+    if (per_expand_data->has_expand_deadline()) {
+      deadline_usec = std::chrono::duration_cast<std::chrono::microseconds>(
+          per_expand_data->expand_deadline() -
+          std::chrono::steady_clock::now()).count();
+      if (deadline_usec < 0)
+        deadline_usec = 0;
+    }
+  }
+
+  void Encode(bool expand_succeeded, string* out) const {
+    AppendString(out, template_name);
+    Append(out, strip, 1);
+    Append(out, flags | (expand_succeeded ? kExpandSucceeded : 0), 1);
+    AppendString(out, annotate_path);
+    Append(out, max_output_bytes, 8);
+    Append(out, max_iterations, 8);
+    Append(out, static_cast<uint64_t>(deadline_usec), 8);
+    Append(out, emitter.size(), 8);
+    Append(out, emitter.digest(), 8);
+    dictionary.Encode(out);
+  }
+
+  const string template_name;
+  const Strip strip;
+  int flags;
+  string annotate_path;
+  uint64_t max_output_bytes;
+  uint64_t max_iterations;
+  int64_t deadline_usec;
+  RecordingDictionary dictionary;
+  HashingEmitter emitter;   // passes the output on, and digests it
+};
+
+TemplateCapture::TemplateCapture(FILE* file, const string& filename,
+                                 double sample_rate)
+    : file_(file),
+      filename_(filename),
+      sample_rate_(sample_rate),
+      num_seen_(0),
+      num_captured_(0),
+      mutex_(new Mutex),
+      globals_generation_(-1),
+      write_failed_(false) {
+}
+
+TemplateCapture* TemplateCapture::Create(const string& filename,
+                                         double sample_rate) {
+  FILE* file = fopen(filename.c_str(), "wb");
+  if (file == NULL) {
+    LOG(ERROR) << "Can't create " << filename << ": " << strerror(errno)
+               << std::endl;
+    return NULL;
+  }
+  string header(kCaptureMagic, sizeof(kCaptureMagic));
+  Append(&header, kCaptureFormat, 4);
+  if (fwrite(header.data(), 1, header.size(), file) != header.size() ||
+      fflush(file) != 0) {
+    LOG(ERROR) << "Can't write to " << filename << ": " << strerror(errno)
+               << std::endl;
+    fclose(file);
+    return NULL;
+  }
+  return new TemplateCapture(file, filename, sample_rate);
+}
+
+TemplateCapture::~TemplateCapture() {
+  if (fclose(file_) != 0 && !write_failed_) {
+    LOG(ERROR) << "Can't write to " << filename_ << ": " << strerror(errno)
+               << std::endl;
+  }
+  delete mutex_;
+}
+
+bool TemplateCapture::ok() const {
+  ReaderMutexLock ml(mutex_);
+  return !write_failed_;
+}
+
+TemplateCapture::Recording* TemplateCapture::MaybeStartRecording(
+    const TemplateString& filename, Strip strip,
+    const TemplateDictionaryInterface* dictionary,
+    const PerExpandData* per_expand_data,
+    ExpandEmitter* output) {
+  // We record expansion n if that takes the number recorded, at
+  // sample_rate_, from floor(n * sample_rate_) to one more.
+  const uint64_t n = num_seen_++;
+  if (static_cast<uint64_t>((n + 1) * sample_rate_) ==
+      static_cast<uint64_t>(n * sample_rate_))
+    return NULL;
+  return new Recording(filename, strip, dictionary, per_expand_data, output);
+}
+
+/*static*/ const TemplateDictionaryInterface* TemplateCapture::dictionary(
+    Recording* recording) {
+  return &recording->dictionary;
+}
+
+/*static*/ ExpandEmitter* TemplateCapture::emitter(Recording* recording) {
+  return &recording->emitter;
+}
+
+static bool WriteRecord(FILE* file, char type, const string& contents) {
+  string header(1, type);
+  Append(&header, contents.size(), 4);
+  return (fwrite(header.data(), 1, header.size(), file) == header.size() &&
+          fwrite(contents.data(), 1, contents.size(), file) == contents.size());
+}
+
+void TemplateCapture::FinishRecording(Recording* recording,
+                                      bool expand_succeeded) {
+  string record;
+  recording->Encode(expand_succeeded, &record);
+  delete recording;
+
+  // Cheap enough to do every time, since we're only sampling.
+  vector<pair<string, string> > global_values;
+  const int generation = TemplateDictionary::GetGlobalValues(&global_values);
+
+  WriterMutexLock ml(mutex_);
+  if (write_failed_)
+    return;
+  bool ok = true;
+  if (generation != globals_generation_) {
+    string globals;
+    Append(&globals, global_values.size(), 4);
+    for (size_t i = 0; i < global_values.size(); ++i) {
+      AppendString(&globals, global_values[i].first);
+      AppendString(&globals, global_values[i].second);
+    }
+    ok = WriteRecord(file_, kGlobalsRecord, globals);
+    globals_generation_ = generation;
+  }
+  // We flush each record so the file is usable while we're running.
+  ok = ok && WriteRecord(file_, kExpandRecord, record) && fflush(file_) == 0;
+  if (!ok) {
+    LOG(ERROR) << "Can't write to " << filename_ << ": " << strerror(errno)
+               << "; no more expansions will be captured" << std::endl;
+    write_failed_ = true;
+    return;
+  }
+  ++num_captured_;
+}
+
+// ----------------------------------------------------------------------
+// CapturedExpand
+// ----------------------------------------------------------------------
+
+CapturedExpand::CapturedExpand()
+    : strip(DO_NOT_STRIP),
+      annotate(false),
+      had_expansion_modifier(false),
+      max_output_bytes(0),
+      max_iterations(0),
+      deadline_usec(-1),
+      expand_succeeded(false),
+      output_size(0),
+      output_digest(0),
+      dictionary_(new CapturedDictionary) {
+}
+
+CapturedExpand::~CapturedExpand() {
+  delete dictionary_;
+}
+
+const TemplateDictionaryInterface* CapturedExpand::dictionary() const {
+  return dictionary_;
+}
+
+void CapturedExpand::SetUpPerExpandData(PerExpandData* per_expand_data) const {
+  per_expand_data->SetAnnotateOutput(annotate ? annotate_path.c_str() : NULL);
+  per_expand_data->SetMaxOutputBytes(max_output_bytes);
+  per_expand_data->SetMaxIterations(max_iterations);
+  if (deadline_usec >= 0) {
+    per_expand_data->SetExpandDeadline(
+        std::chrono::steady_clock::now() +
+        std::chrono::microseconds(deadline_usec));
+  } else {
+    per_expand_data->ClearExpandDeadline();
+  }
+}
+
+// ----------------------------------------------------------------------
+// TemplateCaptureReader
+// ----------------------------------------------------------------------
+
+TemplateCaptureReader::TemplateCaptureReader(FILE* file,
+                                             const string& filename)
+    : file_(file), filename_(filename) {
+}
+
+TemplateCaptureReader* TemplateCaptureReader::Open(const string& filename) {
+  FILE* file = fopen(filename.c_str(), "rb");
+  if (file == NULL) {
+    LOG(ERROR) << "Can't open " << filename << ": " << strerror(errno)
+               << std::endl;
+    return NULL;
+  }
+  char header[12];
+  uint64_t format;
+  if (fread(header, 1, sizeof(header), file) != sizeof(header) ||
+      memcmp(header, kCaptureMagic, sizeof(kCaptureMagic)) != 0 ||
+      !Decoder(header + 8, 4).Read(4, &format) ||
+      format != kCaptureFormat) {
+    LOG(ERROR) << filename << " is not a template capture file" << std::endl;
+    fclose(file);
+    return NULL;
+  }
+  return new TemplateCaptureReader(file, filename);
+}
+
+TemplateCaptureReader::~TemplateCaptureReader() {
+  fclose(file_);
+}
+
+bool TemplateCaptureReader::Next(CapturedExpand* expand) {
+  if (!error_.empty())
+    return false;
+  while (true) {
+    char header[5];
+    const size_t header_size = fread(header, 1, sizeof(header), file_);
+    if (header_size == 0 && feof(file_))
+      return false;   // the end
+    uint64_t size;
+    string contents;
+    if (header_size == sizeof(header)) {
+      Decoder(header + 1, 4).Read(4, &size);
+      contents.resize(size);
+    }
+    if (header_size != sizeof(header) ||
+        fread(&contents[0], 1, size, file_) != size) {
+      error_ = filename_ + ": truncated record";
+      return false;
+    }
+
+    Decoder in(contents.data(), contents.size());
+    if (header[0] == kGlobalsRecord) {
+      uint64_t count;
+      vector<pair<string, string> > global_values;
+      bool ok = in.Read(4, &count);
+      for (uint64_t i = 0; ok && i < count; ++i) {
+        string name, value;
+        ok = in.ReadString(&name) && in.ReadString(&value);
+        global_values.push_back(make_pair(name, value));
+      }
+      if (!ok || !in.at_end()) {
+        error_ = filename_ + ": corrupt global values";
+        return false;
+      }
+      global_values_.swap(global_values);
+    } else if (header[0] == kExpandRecord) {
+      uint64_t strip, flags, deadline_usec;
+      delete expand->dictionary_;
+      expand->dictionary_ = new CapturedDictionary;
+      if (!in.ReadString(&expand->template_name) ||
+          !in.Read(1, &strip) || strip >= NUM_STRIPS ||
+          !in.Read(1, &flags) ||
+          !in.ReadString(&expand->annotate_path) ||
+          !in.Read(8, &expand->max_output_bytes) ||
+          !in.Read(8, &expand->max_iterations) ||
+          !in.Read(8, &deadline_usec) ||
+          !in.Read(8, &expand->output_size) ||
+          !in.Read(8, &expand->output_digest) ||
+          !expand->dictionary_->Decode(&in, 0) ||
+          !in.at_end()) {
+        error_ = filename_ + ": corrupt expansion record";
+        return false;
+      }
+      expand->strip = static_cast<Strip>(strip);
+      expand->annotate = (flags & kAnnotate) != 0;
+      expand->had_expansion_modifier = (flags & kHadExpansionModifier) != 0;
+      expand->expand_succeeded = (flags & kExpandSucceeded) != 0;
+      expand->deadline_usec = static_cast<int64_t>(deadline_usec);
+      return true;
+    }
+    // Skip any other kind of record: it's from a newer version.
+  }
+}
+
+}
@@ -39,6 +39,7 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <algorithm>            // for sort()
+#include <atomic>               // for atomic<>
 #include HASH_MAP_H
 #include <map>
 #include <string>
@@ -66,6 +67,14 @@ namespace ctemplate {
 static GoogleOnceType g_once = GOOGLE_ONCE_INIT;
 // Guard access to the global dictionary.
 static Mutex g_static_mutex(base::LINKER_INITIALIZED);
+#ifdef MUTEX_WAIT_STATS
+static base::MutexWaitStats g_static_mutex_stats("g_static_mutex",
+                                                 &g_static_mutex);
+#endif
+// Bumped every time SetGlobalValue() is called.  It's only changed
+// while holding g_static_mutex, but it's atomic so that every expand
+// can read it without taking the lock.
+static std::atomic<int> g_global_values_generation(0);
 
 /*static*/ UnsafeArena* const TemplateDictionary::NO_ARENA = NULL;
 /*static*/ TemplateDictionary::GlobalDict* TemplateDictionary::global_dict_
@@ -538,6 +547,52 @@ void TemplateDictionary::SetTemplateGlobalValueWithoutCopy(
   HashInsert(global_dict_,
              variable,
              TemplateString(value_copy, value.length_));
+  g_global_values_generation.fetch_add(1, std::memory_order_release);
+}
+
+// ----------------------------------------------------------------------
+// TemplateDictionary::GetGlobalValue()
+// TemplateDictionary::GlobalValuesGeneration()
+// TemplateDictionary::GetGlobalValues()
+//    These let a Template fold global values into its parse tree,
+//    and later notice when they may have changed.  The values
+//    GetGlobalValue() returns are never freed (see SetGlobalValue()),
+//    so it's safe to hold on to them.  GetGlobalValues() is for
+//    TemplateCapture, which records them all.
+// ----------------------------------------------------------------------
+
+/*static*/ bool TemplateDictionary::GetGlobalValue(
+    const TemplateString& variable,
+    TemplateString* value) LOCKS_EXCLUDED(g_static_mutex) {
+  GoogleOnceInit(&g_once, &SetupGlobalDict);
+
+  ReaderMutexLock ml(&g_static_mutex);
+  if (const TemplateString* it = find_ptr(*global_dict_,
+                                          variable.GetGlobalId())) {
+    *value = *it;
+    return true;
+  }
+  return false;
+}
+
+/*static*/ int TemplateDictionary::GlobalValuesGeneration() {
+  return g_global_values_generation.load(std::memory_order_acquire);
+}
+
+/*static*/ int TemplateDictionary::GetGlobalValues(
+    vector<pair<string, string> >* values) LOCKS_EXCLUDED(g_static_mutex) {
+  GoogleOnceInit(&g_once, &SetupGlobalDict);
+
+  ReaderMutexLock ml(&g_static_mutex);
+  values->clear();
+  for (GlobalDict::const_iterator it = global_dict_->begin();
+       it != global_dict_->end(); ++it) {
+    const TemplateString key = IdToString(it->first);
+    values->push_back(make_pair(string(key.data(), key.size()),
+                                string(it->second.data(),
+                                       it->second.size())));
+  }
+  return g_global_values_generation;
 }
 
 // ----------------------------------------------------------------------
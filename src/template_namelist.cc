@@ -31,7 +31,6 @@
 
 #include <config.h>
 #include <stdlib.h>
-#include <sys/stat.h>            // for stat()
 #include <time.h>                // for time_t
 #ifdef HAVE_UNISTD_H
 # include <unistd.h>
@@ -43,9 +42,10 @@
 #include <ctemplate/template_namelist.h>
 #include <ctemplate/template_pathops.h>
 #include <ctemplate/template.h>   // for Strip, GetTemplate(), etc.
+#include <ctemplate/template_cache.h>  // for TemplateCache
+#include <ctemplate/template_source.h>  // for TemplateSource
 #include <assert.h>
 #include <iostream>              // for cerr
-#include "base/fileutil.h"
 
 using std::max;
 using std::pair;
@@ -100,11 +100,14 @@ const TemplateNamelist::MissingListType& TemplateNamelist::GetMissingList(
     const NameListType& the_list = TemplateNamelist::GetList();
     missing_list_->clear();
 
+    // Templates may come from an archive rather than the filesystem.
+    const TemplateSource* source = default_template_cache()->template_source();
     for (NameListType::const_iterator iter = the_list.begin();
          iter != the_list.end();
          ++iter) {
       const string path = Template::FindTemplateFilename(*iter);
-      if (path.empty() || !File::Readable(path.c_str())) {
+      TemplateSource::FileInfo info;
+      if (path.empty() || !source->Stat(path, &info) || info.is_directory) {
         missing_list_->push_back(*iter);
         LOG(ERROR) << "Template file missing: " << *iter
                    << " at path: " << (path.empty() ? "(empty path)" : path)
@@ -158,20 +161,22 @@ const TemplateNamelist::SyntaxListType& TemplateNamelist::GetBadSyntaxList(
   return *bad_syntax_list_;
 }
 
-// Look at all the existing template files, and get their lastmod time via stat()
+// Look at all the existing template files, and get their lastmod time
+// from the default cache's TemplateSource.
 time_t TemplateNamelist::GetLastmodTime() {
   time_t retval = -1;
 
+  const TemplateSource* source = default_template_cache()->template_source();
   const NameListType& the_list = TemplateNamelist::GetList();
   for (NameListType::const_iterator iter = the_list.begin();
        iter != the_list.end();
        ++iter) {
     // Only prepend root_dir if *iter isn't an absolute path:
     const string path = Template::FindTemplateFilename(*iter);
-    struct stat statbuf;
-    if (path.empty() || stat(path.c_str(), &statbuf) != 0)
+    TemplateSource::FileInfo info;
+    if (path.empty() || !source->Stat(path, &info))
       continue;  // ignore files we can't find
-    retval = max(retval, statbuf.st_mtime);
+    retval = max(retval, info.mtime);
   }
   return retval;
 }
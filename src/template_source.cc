@@ -0,0 +1,458 @@
+// Copyright (c) 2026, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+//
+// The two TemplateSources that come with the library: the filesystem,
+// and TemplateArchive.
+//
+// An archive is laid out as follows.  All integers are little-endian.
+//    header:  "CTPLARCH", u32 format (1), u32 number of entries,
+//             u64 version
+//    index:   one 40-byte record per entry, sorted by name:
+//             u64 name offset, u32 name length, u32 zero,
+//             u64 contents offset, u64 contents length, i64 mtime
+//    then the names and contents the index points to.
+// Offsets are from the start of the file.
+
+#include <config.h>
+#include "base/mutex.h"  // This must go first so we get _XOPEN_SOURCE
+#include <ctemplate/template_source.h>
+#include <errno.h>
+#include <fcntl.h>       // for open()
+#include <stdio.h>       // for rename()
+#include <string.h>      // for memcmp(), memcpy(), strerror()
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>     // for close(), getcwd()
+#endif
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>   // for mmap(), munmap()
+#endif
+#include <algorithm>     // for min(), sort(), swap()
+#include <iostream>      // for cerr
+#include <string>
+#include <vector>
+#include <ctemplate/str_ref.h>
+#include <ctemplate/template_pathops.h>  // for PathJoin(), IsAbspath(), etc
+#include "base/fileutil.h"
+
+using std::endl;
+using std::string;
+using std::vector;
+
+#ifndef PATH_MAX
+#ifdef MAXPATHLEN
+#define PATH_MAX        MAXPATHLEN
+#else
+#define PATH_MAX        4096         // seems conservative for max filename len!
+#endif
+#endif
+
+#define LOG(level)   std::cerr << #level ": "
+
+namespace ctemplate {
+
+// ----------------------------------------------------------------------
+// TemplateSource::Filesystem()
+//    Templates read straight from disk, which is what TemplateCache
+//    always did before it had sources.
+// ----------------------------------------------------------------------
+
+namespace {
+
+class FilesystemTemplateSource : public TemplateSource {
+ public:
+  virtual bool Stat(const string& filename, FileInfo* info) const {
+    FileStat statbuf;
+    if (!File::Stat(filename, &statbuf))
+      return false;
+    info->mtime = statbuf.mtime;
+    info->length = statbuf.length;
+    info->is_directory = statbuf.IsDirectory();
+    return true;
+  }
+
+  virtual bool Read(const string& filename,
+                    char* buffer, size_t length) const {
+    File* fp = File::Open(filename.c_str(), "r");
+    if (fp == NULL)
+      return false;
+    const bool ok = fp->Read(buffer, length) == length;
+    fp->Close();
+    return ok;
+  }
+};
+
+}  // unnamed namespace
+
+const TemplateSource* TemplateSource::Filesystem() {
+  static const TemplateSource* const filesystem = new FilesystemTemplateSource;
+  return filesystem;
+}
+
+// ----------------------------------------------------------------------
+// TemplateArchive
+// ----------------------------------------------------------------------
+
+static const char kArchiveMagic[8] = { 'C', 'T', 'P', 'L',
+                                       'A', 'R', 'C', 'H' };
+static const uint32_t kArchiveFormat = 1;
+static const size_t kHeaderSize = 24;
+static const size_t kIndexRecordSize = 40;
+
+static uint64_t Load(const char* p, int bytes) {
+  uint64_t value = 0;
+  for (int i = bytes - 1; i >= 0; --i)
+    value = (value << 8) | static_cast<unsigned char>(p[i]);
+  return value;
+}
+
+// Orders names the way std::string's operator< does.
+static int Compare(str_ref a, str_ref b) {
+  const int cmp = memcmp(a.data(), b.data(), std::min(a.size(), b.size()));
+  if (cmp != 0)
+    return cmp;
+  return a.size() < b.size() ? -1 : a.size() > b.size() ? 1 : 0;
+}
+
+static void Append(string* out, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; ++i) {
+    out->push_back(static_cast<char>(value & 0xff));
+    value >>= 8;
+  }
+}
+
+// An open archive: its bytes, and what we need to know to tell
+// whether the file has changed since we read them.
+struct ArchiveMapping {
+  ArchiveMapping() : data(NULL), size(0), mapped(false), file_mtime(0),
+                     file_device(0), file_inode(0),
+                     num_entries(0), version(0) {}
+  ~ArchiveMapping() {
+#ifdef HAVE_SYS_MMAN_H
+    if (mapped) {
+      munmap(const_cast<char*>(data), size);
+      return;
+    }
+#endif
+    delete[] data;
+  }
+
+  // Where entry i's index record is.
+  const char* Record(size_t i) const {
+    return data + kHeaderSize + i * kIndexRecordSize;
+  }
+  str_ref Name(size_t i) const {
+    const char* record = Record(i);
+    return str_ref(data + Load(record, 8), Load(record + 8, 4));
+  }
+
+  const char* data;
+  size_t size;
+  bool mapped;      // data came from mmap() rather than new[]
+  time_t file_mtime;
+  // A replacement written in the same second, at the same size, is
+  // still a different file.
+  dev_t file_device;
+  ino_t file_inode;
+  size_t num_entries;
+  uint64_t version;
+};
+
+// Reads archive_filename into memory, mapping it if we can, and checks
+// that every offset in it is in bounds.  Returns NULL, having logged
+// why, if the file can't be read or isn't a valid archive.
+static ArchiveMapping* ReadArchive(const string& archive_filename) {
+  FileStat statbuf;
+  if (!File::Stat(archive_filename, &statbuf)) {
+    LOG(ERROR) << "Unable to stat archive " << archive_filename << endl;
+    return NULL;
+  }
+  ArchiveMapping* mapping = new ArchiveMapping;
+  mapping->size = statbuf.length;
+  mapping->file_mtime = statbuf.mtime;
+  mapping->file_device = statbuf.device;
+  mapping->file_inode = statbuf.inode;
+  if (mapping->size < kHeaderSize) {
+    LOG(ERROR) << archive_filename << " is too short to be an archive" << endl;
+    delete mapping;
+    return NULL;
+  }
+#ifdef HAVE_SYS_MMAN_H
+  const int fd = open(archive_filename.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    void* data = mmap(NULL, mapping->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data != MAP_FAILED) {
+      mapping->data = static_cast<const char*>(data);
+      mapping->mapped = true;
+    }
+  }
+#endif
+  if (mapping->data == NULL) {
+    char* data = new char[mapping->size];
+    File* fp = File::Open(archive_filename.c_str(), "r");
+    if (fp == NULL || fp->Read(data, mapping->size) != mapping->size) {
+      LOG(ERROR) << "Error reading archive " << archive_filename
+                 << ": " << strerror(errno) << endl;
+      if (fp)
+        fp->Close();
+      delete[] data;
+      delete mapping;
+      return NULL;
+    }
+    fp->Close();
+    mapping->data = data;
+  }
+
+  const char* const data = mapping->data;
+  const char* error = NULL;
+  if (memcmp(data, kArchiveMagic, sizeof(kArchiveMagic)) != 0) {
+    error = "is not a template archive";
+  } else if (Load(data + 8, 4) != kArchiveFormat) {
+    error = "has an unknown format";
+  } else {
+    mapping->num_entries = Load(data + 12, 4);
+    mapping->version = Load(data + 16, 8);
+    if (mapping->num_entries >
+        (mapping->size - kHeaderSize) / kIndexRecordSize)
+      error = "has a truncated index";
+  }
+  for (size_t i = 0; error == NULL && i < mapping->num_entries; ++i) {
+    const char* record = mapping->Record(i);
+    const uint64_t name_offset = Load(record, 8);
+    const uint64_t name_length = Load(record + 8, 4);
+    const uint64_t offset = Load(record + 16, 8);
+    const uint64_t length = Load(record + 24, 8);
+    if (name_offset > mapping->size ||
+        name_length > mapping->size - name_offset ||
+        offset > mapping->size || length > mapping->size - offset) {
+      error = "has an entry out of bounds";
+    } else if (i > 0 && Compare(mapping->Name(i - 1), mapping->Name(i)) >= 0) {
+      error = "has an unsorted index";
+    }
+  }
+  if (error) {
+    LOG(ERROR) << archive_filename << " " << error << endl;
+    delete mapping;
+    return NULL;
+  }
+  return mapping;
+}
+
+// Returns the index of the entry named name, or -1.
+static long FindEntry(const ArchiveMapping& mapping, str_ref name) {
+  size_t lo = 0, hi = mapping.num_entries;
+  while (lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    const int cmp = Compare(mapping.Name(mid), name);
+    if (cmp < 0)
+      lo = mid + 1;
+    else if (cmp > 0)
+      hi = mid;
+    else
+      return static_cast<long>(mid);
+  }
+  return -1;
+}
+
+static bool EntryLessThan(const TemplateArchive::Entry* a,
+                          const TemplateArchive::Entry* b) {
+  return a->name < b->name;
+}
+
+bool TemplateArchive::Write(const string& archive_filename,
+                            const vector<Entry>& entries,
+                            uint64_t version) {
+  vector<const Entry*> sorted;
+  for (vector<Entry>::const_iterator it = entries.begin();
+       it != entries.end(); ++it)
+    sorted.push_back(&*it);
+  std::sort(sorted.begin(), sorted.end(), EntryLessThan);
+
+  string header(kArchiveMagic, sizeof(kArchiveMagic));
+  Append(&header, kArchiveFormat, 4);
+  Append(&header, sorted.size(), 4);
+  Append(&header, version, 8);
+  string names;
+  uint64_t name_offset = kHeaderSize + sorted.size() * kIndexRecordSize;
+  uint64_t offset = name_offset;
+  for (size_t i = 0; i < sorted.size(); ++i)
+    offset += sorted[i]->name.size();
+  for (size_t i = 0; i < sorted.size(); ++i) {
+    if (i > 0 && sorted[i - 1]->name == sorted[i]->name) {
+      LOG(ERROR) << "Template " << sorted[i]->name
+                 << " is in the archive twice" << endl;
+      return false;
+    }
+    Append(&header, name_offset, 8);
+    Append(&header, sorted[i]->name.size(), 4);
+    Append(&header, 0, 4);
+    Append(&header, offset, 8);
+    Append(&header, sorted[i]->contents.size(), 8);
+    Append(&header, static_cast<uint64_t>(sorted[i]->mtime), 8);
+    names.append(sorted[i]->name);
+    name_offset += sorted[i]->name.size();
+    offset += sorted[i]->contents.size();
+  }
+
+  // Write to a temporary file and rename it into place, so that
+  // nobody ever maps a half-written archive.
+  const string tmp_filename = archive_filename + ".tmp";
+  File* fp = File::Open(tmp_filename.c_str(), "w");
+  if (fp == NULL) {
+    LOG(ERROR) << "Can't open " << tmp_filename << ": "
+               << strerror(errno) << endl;
+    return false;
+  }
+  bool ok = (fp->Write(header.data(), header.size()) == header.size() &&
+             fp->Write(names.data(), names.size()) == names.size());
+  for (size_t i = 0; ok && i < sorted.size(); ++i) {
+    const string& contents = sorted[i]->contents;
+    ok = fp->Write(contents.data(), contents.size()) == contents.size();
+  }
+  ok = fp->Close() && ok;
+  if (!ok || rename(tmp_filename.c_str(), archive_filename.c_str()) != 0) {
+    LOG(ERROR) << "Error writing archive " << archive_filename << ": "
+               << strerror(errno) << endl;
+    unlink(tmp_filename.c_str());
+    return false;
+  }
+  return true;
+}
+
+TemplateArchive* TemplateArchive::Open(const string& archive_filename,
+                                       const string& mount_point) {
+  ArchiveMapping* mapping = ReadArchive(archive_filename);
+  if (mapping == NULL)
+    return NULL;
+  // Normalize mount_point the way SetTemplateRootDirectory() does
+  // its directory, so that the names it resolves start with ours.
+  string normalized = mount_point;
+  if (!normalized.empty()) {
+    NormalizeDirectory(&normalized);
+    if (!IsAbspath(normalized)) {
+      char* cwdbuf = new char[PATH_MAX];   // new to avoid stack overflow
+      if (getcwd(cwdbuf, PATH_MAX))
+        normalized = PathJoin(cwdbuf, normalized);
+      delete[] cwdbuf;
+    }
+  }
+  return new TemplateArchive(archive_filename, normalized, mapping);
+}
+
+TemplateArchive::TemplateArchive(const string& archive_filename,
+                                 const string& mount_point,
+                                 ArchiveMapping* mapping)
+    : archive_filename_(archive_filename),
+      mount_point_(mount_point),
+      mutex_(new Mutex),
+      mapping_(mapping) {
+}
+
+TemplateArchive::~TemplateArchive() {
+  delete mapping_;
+  delete mutex_;
+}
+
+// Sets name to the part of filename after mount_point.  Returns false
+// if filename isn't under mount_point.
+static bool StripMountPoint(const string& filename, const string& mount_point,
+                            str_ref* name) {
+  if (filename.compare(0, mount_point.size(), mount_point) != 0)
+    return false;
+  *name = str_ref(filename.data() + mount_point.size(),
+                 filename.size() - mount_point.size());
+  return true;
+}
+
+bool TemplateArchive::Stat(const string& filename, FileInfo* info) const {
+  str_ref name;
+  if (!StripMountPoint(filename, mount_point_, &name))
+    return false;
+  ReaderMutexLock ml(mutex_);
+  const long i = FindEntry(*mapping_, name);
+  if (i < 0)
+    return false;
+  const char* record = mapping_->Record(i);
+  info->length = Load(record + 24, 8);
+  info->mtime = static_cast<time_t>(Load(record + 32, 8));
+  info->is_directory = false;
+  return true;
+}
+
+bool TemplateArchive::Read(const string& filename,
+                           char* buffer, size_t length) const {
+  str_ref name;
+  if (!StripMountPoint(filename, mount_point_, &name))
+    return false;
+  ReaderMutexLock ml(mutex_);
+  const long i = FindEntry(*mapping_, name);
+  if (i < 0)
+    return false;
+  const char* record = mapping_->Record(i);
+  if (Load(record + 24, 8) != length)
+    return false;
+  memcpy(buffer, mapping_->data + Load(record + 16, 8), length);
+  return true;
+}
+
+bool TemplateArchive::ReloadIfChanged() {
+  FileStat statbuf;
+  {
+    ReaderMutexLock ml(mutex_);
+    if (File::Stat(archive_filename_, &statbuf) &&
+        statbuf.mtime == mapping_->file_mtime &&
+        static_cast<size_t>(statbuf.length) == mapping_->size &&
+        statbuf.device == mapping_->file_device &&
+        statbuf.inode == mapping_->file_inode)
+      return false;
+  }
+  ArchiveMapping* mapping = ReadArchive(archive_filename_);
+  if (mapping == NULL)
+    return false;
+  WriterMutexLock ml(mutex_);
+  std::swap(mapping, mapping_);
+  delete mapping;   // the old one
+  return true;
+}
+
+uint64_t TemplateArchive::version() const {
+  ReaderMutexLock ml(mutex_);
+  return mapping_->version;
+}
+
+size_t TemplateArchive::num_entries() const {
+  ReaderMutexLock ml(mutex_);
+  return mapping_->num_entries;
+}
+
+}
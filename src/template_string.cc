@@ -146,6 +146,9 @@ struct TemplateStringHasher {
 
 namespace {
 Mutex mutex(base::LINKER_INITIALIZED);
+#ifdef MUTEX_WAIT_STATS
+base::MutexWaitStats mutex_stats("TemplateString intern mutex", &mutex);
+#endif
 
 typedef unordered_set<TemplateString, TemplateStringHasher> TemplateStringSet;
 
@@ -0,0 +1,178 @@
+#!/bin/sh
+
+# Copyright (c) 2026, Google Inc.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+#     * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#     * Redistributions in binary form must reproduce the above
+# copyright notice, this list of conditions and the following disclaimer
+# in the documentation and/or other materials provided with the
+# distribution.
+#     * Neither the name of Google Inc. nor the names of its
+# contributors may be used to endorse or promote products derived from
+# this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+# "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+# LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+# A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+# OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+# DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+# THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+
+# ---
+# Inspired by make_tpl_archive_unittest.sh
+#
+# How the costs are worked out is tested in template_unittest; here we
+# check what analyze_tpl_cost does with them.
+
+die() {
+    echo "Test failed: $@" 1>&2
+    exit 1
+}
+
+TEST_SRCDIR=${TEST_SRCDIR-"."}
+TEST_TMPDIR=${TMPDIR-"/tmp"}
+
+# Optional first argument is where the executable lives
+ANALYZETPLCOST=${1-"$TEST_SRCDIR/analyze_tpl_cost"}
+
+# Optional second argument is tmpdir to use
+TMPDIR=${2-"$TEST_TMPDIR/analyzetplcost"}
+
+rm -rf $TMPDIR
+mkdir $TMPDIR || die "$LINENO: Can't make $TMPDIR"
+# The templates go in their own directory, apart from the capture file.
+TPLDIR=$TMPDIR/tpl
+mkdir $TPLDIR $TPLDIR/sub $TPLDIR/sub/deeper \
+   || die "$LINENO: Can't make $TPLDIR"
+
+# Let's make some templates, most expensive first.
+echo 'a {{#S}}{{#T}}{{X}}{{Y:h}}{{/T}}{{/S}}' > $TPLDIR/a.tpl
+echo 'b {{A}} {{B}}' > $TPLDIR/sub/b.tpl
+echo 'c plain text' > $TPLDIR/sub/deeper/c.tpl
+
+# Prints the rank of template $1 in the report on stdin.
+rank_of() {
+    awk -F'	' -v name="$1" '$15 == name { print $1 }'
+}
+
+# Prints the unset column for template $1 in the report on stdin.
+unset_of() {
+    awk -F'	' -v name="$1" '$15 == name { print $14 }'
+}
+
+# Writes the little-endian 4-byte integer $1 (which must be < 65536).
+le32() {
+    printf "\\$(printf %03o $(($1 & 255)))\\$(printf %03o $(($1 >> 8 & 255)))\\000\\000"
+}
+
+# Writes the string $1 as a capture file does: its length, then it.
+str() {
+    le32 ${#1}
+    printf '%s' "$1"
+}
+
+# Writes a capture file's record of expanding template $1 with a
+# dictionary holding the variable/value pairs that follow, and no
+# sections or includes.  Everything else in the record is zero.
+expand_record() {
+    name=$1; shift
+    {
+      str "$name"
+      head -c 46 /dev/zero   # strip, flags, annotate path, limits, output
+      le32 $(($# / 2))
+      while [ $# -gt 0 ]; do str "$1"; str "$2"; shift 2; done
+      head -c 24 /dev/zero   # no section or include answers, or children
+    } > $TMPDIR/record
+    printf 'E'
+    le32 `wc -c < $TMPDIR/record | tr -d ' '`
+    cat $TMPDIR/record
+}
+
+# First, test commandline flags
+$ANALYZETPLCOST >/dev/null 2>&1 \
+   && die "$LINENO: $ANALYZETPLCOST with no args didn't give an error"
+$ANALYZETPLCOST -n-1 -t$TPLDIR a.tpl >/dev/null 2>&1 \
+   && die "$LINENO: $ANALYZETPLCOST with a bad -n didn't give an error"
+$ANALYZETPLCOST -sBAD -t$TPLDIR a.tpl >/dev/null 2>&1 \
+   && die "$LINENO: $ANALYZETPLCOST with a bad -s didn't give an error"
+$ANALYZETPLCOST --help >/dev/null 2>&1 \
+   || die "$LINENO: $ANALYZETPLCOST --help gave an error"
+$ANALYZETPLCOST -V >/dev/null 2>&1 \
+   || die "$LINENO: $ANALYZETPLCOST -V gave an error"
+
+# Directories are analyzed recursively, and the templates ranked most
+# expensive first.
+out=`$ANALYZETPLCOST -q -t$TPLDIR .` \
+   || die "$LINENO: $ANALYZETPLCOST gave an error analyzing a directory"
+[ `echo "$out" | wc -l` -eq 4 ] \
+   || die "$LINENO: $ANALYZETPLCOST didn't report a header and 3 templates: $out"
+echo "$out" | head -1 | grep -q '^rank	est_work	' \
+   || die "$LINENO: $ANALYZETPLCOST didn't print a header first: $out"
+[ "`echo "$out" | rank_of a.tpl`" = "1" ] \
+   || die "$LINENO: $ANALYZETPLCOST didn't rank a.tpl first: $out"
+[ "`echo "$out" | rank_of sub/b.tpl`" = "2" ] \
+   || die "$LINENO: $ANALYZETPLCOST didn't rank sub/b.tpl second: $out"
+[ "`echo "$out" | rank_of sub/deeper/c.tpl`" = "3" ] \
+   || die "$LINENO: $ANALYZETPLCOST didn't recurse into sub/deeper: $out"
+echo "$out" | grep -q '	\./' \
+   && die "$LINENO: $ANALYZETPLCOST named a template ./something: $out"
+[ "`echo "$out" | unset_of a.tpl`" = "-" ] \
+   || die "$LINENO: $ANALYZETPLCOST counted unset vars without a sample: $out"
+
+# A subdirectory on its own.
+out=`$ANALYZETPLCOST -q -t$TPLDIR sub` \
+   || die "$LINENO: $ANALYZETPLCOST gave an error analyzing sub"
+[ `echo "$out" | wc -l` -eq 3 ] \
+   || die "$LINENO: $ANALYZETPLCOST didn't report both templates in sub: $out"
+
+# -n only shows the most expensive templates.
+out=`$ANALYZETPLCOST -q -t$TPLDIR -n1 .` \
+   || die "$LINENO: $ANALYZETPLCOST -n1 gave an error"
+[ `echo "$out" | wc -l` -eq 2 ] \
+   || die "$LINENO: $ANALYZETPLCOST -n1 didn't report just one template: $out"
+[ "`echo "$out" | rank_of a.tpl`" = "1" ] \
+   || die "$LINENO: $ANALYZETPLCOST -n1 didn't report a.tpl: $out"
+
+# A missing file is an error, but the others are still reported.
+out=`$ANALYZETPLCOST -t$TPLDIR nonexistent.tpl a.tpl 2>&1` \
+   && die "$LINENO: $ANALYZETPLCOST didn't fail on a missing file: $out"
+echo "$out" | grep -q "Can't stat" \
+   || die "$LINENO: $ANALYZETPLCOST didn't say what was missing: $out"
+[ "`echo "$out" | rank_of a.tpl`" = "1" ] \
+   || die "$LINENO: $ANALYZETPLCOST didn't report a.tpl anyway: $out"
+
+# With a capture file, each template's first expansion in it is its
+# sample.  a.tpl's shows none of its sections, so it's cheap now, and
+# sub/b.tpl's first sample sets A but not B.
+{
+  printf 'CTPLCAPT\001\000\000\000'
+  expand_record a.tpl
+  expand_record sub/b.tpl A x
+  expand_record sub/b.tpl
+} > $TMPDIR/capture.tplcap
+out=`$ANALYZETPLCOST -q -t$TPLDIR -c$TMPDIR/capture.tplcap -v .` \
+   || die "$LINENO: $ANALYZETPLCOST gave an error with a capture file: $out"
+[ "`echo "$out" | rank_of sub/b.tpl`" = "1" ] \
+   || die "$LINENO: $ANALYZETPLCOST didn't use a.tpl's sample: $out"
+[ "`echo "$out" | unset_of sub/b.tpl`" = "1" ] \
+   || die "$LINENO: $ANALYZETPLCOST didn't use sub/b.tpl's first sample: $out"
+echo "$out" | grep -q '^# sub/b.tpl: unset: B$' \
+   || die "$LINENO: $ANALYZETPLCOST -v didn't list the unset variable: $out"
+[ "`echo "$out" | unset_of sub/deeper/c.tpl`" = "-" ] \
+   || die "$LINENO: $ANALYZETPLCOST found a sample for sub/deeper/c.tpl: $out"
+
+# A file that isn't a capture file is an error.
+$ANALYZETPLCOST -q -t$TPLDIR -c$TPLDIR/a.tpl . >/dev/null 2>&1 \
+   && die "$LINENO: $ANALYZETPLCOST read a template as a capture file"
+
+echo "PASSED"
@@ -193,4 +193,69 @@ out=`$DIFFTPL $TMPDIR/ok2.tpl $TMPDIR/ok3.tpl 2>&1`
 [ "$out" != "$expected_test4" ] &&\
   die "$LINENO: $DIFFTPL: bad output for test4: $out\n"
 
+# Batch mode, with a list of pairs.
+cat > $TMPDIR/pairs <<EOF
+# comments and blank lines are skipped
+
+ok1.tpl ok4.tpl
+ok1.tpl	ok2.tpl
+ok3.tpl ok4.tpl
+ok1.tpl bad1.tpl
+EOF
+expected_batch=`cat <<EOF | grep -v '^EOF$'
+same	2	0	1	ok1.tpl	ok4.tpl
+differ	2	1	1	ok1.tpl	ok2.tpl
+differ	2	2	0	ok3.tpl	ok4.tpl
+error	0	0	0	ok1.tpl	bad1.tpl
+# total=4 same=1 differ=2 error=1 cached=0
+EOF`
+out=`$DIFFTPL -b -j2 -t$TMPDIR $TMPDIR/pairs 2>/dev/null`
+[ $? = 1 ] || die "$LINENO: $DIFFTPL -b: wrong error-code on diff. templates: $?"
+[ "$out" != "$expected_batch" ] &&\
+  die "$LINENO: $DIFFTPL: bad output for batch: $out\n"
+out=`$DIFFTPL -b -t$TMPDIR - < $TMPDIR/pairs 2>&1 >/dev/null`
+echo "$out" | grep -q 'Difference for variable USER -- :c vs. :h' \
+   || die "$LINENO: $DIFFTPL -b didn't report a difference: $out\n"
+echo "$out" | grep -q 'ok1.tpl vs. bad1.tpl: Could not load file' \
+   || die "$LINENO: $DIFFTPL -b didn't report an error: $out\n"
+echo 'ok1.tpl' | $DIFFTPL -b - >/dev/null 2>&1 \
+   && die "$LINENO: $DIFFTPL -b gave no error on a bad list"
+
+# Batch mode, with two directories.
+mkdir -p $TMPDIR/old/sub $TMPDIR/new/sub
+cp $TMPDIR/ok1.tpl $TMPDIR/old/a.tpl
+cp $TMPDIR/ok4.tpl $TMPDIR/new/a.tpl
+cp $TMPDIR/ok2.tpl $TMPDIR/old/sub/b.tpl
+cp $TMPDIR/ok2.tpl $TMPDIR/new/sub/b.tpl
+cp $TMPDIR/ok3.tpl $TMPDIR/old/sub/c.tpl
+expected_dirs=`cat <<EOF | grep -v '^EOF$'
+same	2	0	1	old/a.tpl	new/a.tpl
+same	2	0	0	old/sub/b.tpl	new/sub/b.tpl
+error	0	0	0	old/sub/c.tpl	new/sub/c.tpl
+# total=3 same=2 differ=0 error=1 cached=0
+EOF`
+out=`$DIFFTPL -b -t$TMPDIR old new 2>/dev/null`
+[ "$out" != "$expected_dirs" ] &&\
+  die "$LINENO: $DIFFTPL: bad output for batch dirs: $out\n"
+cp $TMPDIR/ok3.tpl $TMPDIR/new/sub/c.tpl
+$DIFFTPL -b -t$TMPDIR old new >/dev/null 2>&1 \
+   || die "$LINENO: $DIFFTPL -b gave error on identical directories"
+
+# With a cache, the second run doesn't diff the pairs that were the same.
+$DIFFTPL -b -t$TMPDIR -c$TMPDIR/cache old new >/dev/null 2>&1 \
+   || die "$LINENO: $DIFFTPL -b -c gave error on identical directories"
+out=`$DIFFTPL -b -t$TMPDIR -c$TMPDIR/cache old new 2>&1`
+echo "$out" | grep -q '^# total=3 same=3 differ=0 error=0 cached=3$' \
+   || die "$LINENO: $DIFFTPL -b -c didn't use the cache: $out\n"
+echo "$out" | grep -q "^same	2	0	1	old/a.tpl	new/a.tpl$" \
+   || die "$LINENO: $DIFFTPL -b -c lost the counts: $out\n"
+cp $TMPDIR/ok2.tpl $TMPDIR/new/a.tpl
+out=`$DIFFTPL -b -t$TMPDIR -c$TMPDIR/cache old new 2>/dev/null`
+[ $? = 1 ] || die "$LINENO: $DIFFTPL -b -c missed a changed template: $?"
+echo "$out" | grep -q '^# total=3 same=2 differ=1 error=0 cached=2$' \
+   || die "$LINENO: $DIFFTPL -b -c used a stale cache entry: $out\n"
+out=`$DIFFTPL -b -t$TMPDIR -sDO_NOT_STRIP -c$TMPDIR/cache old new 2>/dev/null`
+echo "$out" | grep -q 'cached=0$' \
+   || die "$LINENO: $DIFFTPL -b -c ignored the strip mode: $out\n"
+
 echo "PASSED"
@@ -48,6 +48,7 @@ int main()
 {
   (void)stringparser_states_internal_names;
   (void)stringparser_state_transitions;
+  (void)stringparser_compact_table;
   printf("DONE.\n");
   exit(0);
 }
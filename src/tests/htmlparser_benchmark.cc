@@ -0,0 +1,302 @@
+// Copyright (c) 2026, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+//
+// Throughput of the html/javascript parser used by auto-escaping.
+//
+//    htmlparser_benchmark [--filter=<substring>] [--min_time=<seconds>]
+//
+// The inputs are the files in src/tests/htmlparser_testdata (found via
+// $TEMPLATE_ROOTDIR, like htmlparser_test), and a synthetic page of about
+// 1M that mixes text, markup, attributes, a style block and script.
+// Each input is parsed in one go and in 64-byte chunks, the way the
+// template parser feeds it the text between template markers.  The
+// "statemachine/" benchmarks run just the html state machine without
+// any of the parser's callbacks, once with the full int transition
+// tables and once with the compact ones, to isolate the table lookups.
+//
+// Results are written to stdout as JSON, in the same format as
+// template_benchmark.
+
+#include "config_for_unittests.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <chrono>        // for steady_clock
+#include <string>
+#include <vector>
+#include "htmlparser/htmlparser_cpp.h"
+#include "htmlparser/statemachine.h"
+#include <ctemplate/template_pathops.h>  // for PathJoin()
+#include "base/util.h"                   // for CHECK()
+
+namespace ctemplate_htmlparser {
+// Only the tables are used; the parser itself comes from the library.
+#include "htmlparser/htmlparser_fsm.h"
+}
+
+using std::string;
+using std::vector;
+using ctemplate::PathJoin;
+using ctemplate_htmlparser::HtmlParser;
+using ctemplate_htmlparser::statemachine_ctx;
+using ctemplate_htmlparser::statemachine_definition;
+
+static string FLAG_filter;
+static double FLAG_min_time = 0.2;
+
+// ----------------------------------------------------------------------
+// The harness
+// ----------------------------------------------------------------------
+
+// A benchmark does iterations repetitions of something, and returns
+// how many bytes it processed.
+typedef size_t (*BenchmarkFunction)(int iterations, void* arg);
+
+static bool g_first_result = true;
+
+static double Seconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+}
+
+// Runs fn with more and more iterations until a run takes at least
+// FLAG_min_time, and prints that run's result.
+static void Run(const string& name, BenchmarkFunction fn, void* arg) {
+  if (name.find(FLAG_filter) == string::npos)
+    return;
+  fn(1, arg);   // warm up
+  int iterations = 1;
+  double seconds;
+  size_t bytes;
+  while (true) {
+    const std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    bytes = fn(iterations, arg);
+    seconds = Seconds(start);
+    if (seconds >= FLAG_min_time || iterations >= (1 << 30))
+      break;
+    // Aim a little past min_time, but don't grow more than 10x at once.
+    const double scale = seconds > 0 ? 1.4 * FLAG_min_time / seconds : 10;
+    iterations = static_cast<int>(iterations * (scale < 10 ? scale : 10)) + 1;
+  }
+  printf("%s\n    { \"name\": \"%s\", \"iterations\": %d, "
+         "\"ns_per_op\": %.1f, \"bytes_per_second\": %.4g }",
+         g_first_result ? "" : ",", name.c_str(), iterations,
+         seconds * 1e9 / iterations, bytes / seconds);
+  g_first_result = false;
+  fflush(stdout);
+}
+
+// ----------------------------------------------------------------------
+// Test data
+// ----------------------------------------------------------------------
+
+static string ReadFile(const string& filename) {
+  FILE* fp = fopen(filename.c_str(), "rb");
+  if (!fp) {
+    perror(filename.c_str());
+    exit(1);
+  }
+  string contents;
+  char buf[8192];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    contents.append(buf, n);
+  fclose(fp);
+  return contents;
+}
+
+// A page of about size bytes.  Most of it is plain text, as in real
+// templates, with enough tags, attribute values, script and style to
+// go through all the interesting parser states.
+static string LargePage(size_t size) {
+  static const char kHead[] =
+      "<html>\n<head>\n<title>A large page</title>\n"
+      "<style type=\"text/css\">\n"
+      "  body { font-family: sans-serif; color: #333; }\n"
+      "</style>\n</head>\n<body>\n";
+  static const char kChunk[] =
+      "<div class=\"item\" id='item' onclick=\"select(this, 'item');\">\n"
+      "  <a href=\"http://www.example.com/path?a=b&amp;c=d\">A link</a>\n"
+      "  <p>Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do\n"
+      "  eiusmod tempor incididunt ut labore et dolore magna aliqua. Ut enim\n"
+      "  ad minim veniam, quis nostrud exercitation ullamco laboris nisi ut\n"
+      "  aliquip ex ea commodo consequat.</p>\n"
+      "  <!-- a comment, which the parser skips over -->\n"
+      "  <img src=/images/picture.png width=100 height=50 alt=\"\">\n"
+      "</div>\n"
+      "<script type=\"text/javascript\">\n"
+      "  var s = \"a string with </b> in it\"; /* comment */\n"
+      "  if (a / 2 > b) { c = /regexp[/]/.test(s); }  // line comment\n"
+      "</script>\n";
+  string page(kHead);
+  while (page.size() < size)
+    page.append(kChunk);
+  page.append("</body>\n</html>\n");
+  return page;
+}
+
+// ----------------------------------------------------------------------
+// The benchmarks
+// ----------------------------------------------------------------------
+
+struct ParseArgs {
+  string text;
+  int chunk_size;        // 0 to parse the text in one call
+};
+
+static size_t BM_HtmlParser(int iterations, void* arg) {
+  const ParseArgs& args = *static_cast<ParseArgs*>(arg);
+  HtmlParser parser;
+  const int size = static_cast<int>(args.text.size());
+  for (int i = 0; i < iterations; ++i) {
+    parser.Reset();
+    if (args.chunk_size == 0) {
+      parser.Parse(args.text.data(), size);
+    } else {
+      for (int pos = 0; pos < size; pos += args.chunk_size) {
+        const int len = size - pos < args.chunk_size ? size - pos
+                                                     : args.chunk_size;
+        parser.Parse(args.text.data() + pos, len);
+      }
+    }
+  }
+  return args.text.size() * iterations;
+}
+
+struct StatemachineArgs {
+  string text;
+  statemachine_definition* def;
+};
+
+static size_t BM_Statemachine(int iterations, void* arg) {
+  const StatemachineArgs& args = *static_cast<StatemachineArgs*>(arg);
+  statemachine_ctx* ctx = ctemplate_htmlparser::statemachine_new(args.def,
+                                                                 NULL);
+  CHECK(ctx != NULL);
+  for (int i = 0; i < iterations; ++i) {
+    ctemplate_htmlparser::statemachine_reset(ctx);
+    ctemplate_htmlparser::statemachine_parse(
+        ctx, args.text.data(), static_cast<int>(args.text.size()));
+  }
+  ctemplate_htmlparser::statemachine_delete(ctx);
+  return args.text.size() * iterations;
+}
+
+// Runs the html state machine, without the parser's callbacks, with
+// both kinds of transition tables.
+static void StatemachineBenchmarks(const string& name, const string& text) {
+  using namespace ctemplate_htmlparser;
+  statemachine_definition* full =
+      statemachine_definition_new(HTMLPARSER_NUM_STATES);
+  statemachine_definition* compact =
+      statemachine_definition_new(HTMLPARSER_NUM_STATES);
+  CHECK(full != NULL && compact != NULL);
+  statemachine_definition_populate(full, htmlparser_state_transitions,
+                                   htmlparser_states_internal_names);
+  statemachine_definition_populate_compact(compact,
+                                           &htmlparser_compact_table,
+                                           htmlparser_states_internal_names);
+
+  StatemachineArgs args;
+  args.text = text;
+  args.def = full;
+  Run("statemachine/" + name + "/full_table", BM_Statemachine, &args);
+  args.def = compact;
+  Run("statemachine/" + name + "/compact_table", BM_Statemachine, &args);
+
+  statemachine_definition_delete(full);
+  statemachine_definition_delete(compact);
+}
+
+static void ParserBenchmarks(const string& name, const string& text) {
+  ParseArgs args;
+  args.text = text;
+  args.chunk_size = 0;
+  Run("htmlparser/" + name, BM_HtmlParser, &args);
+  args.chunk_size = 64;
+  Run("htmlparser/" + name + "/chunk64", BM_HtmlParser, &args);
+}
+
+int main(int argc, char** argv) {
+  for (int i = 1; i < argc; ++i) {
+    if (strncmp(argv[i], "--filter=", 9) == 0) {
+      FLAG_filter = argv[i] + 9;
+    } else if (strncmp(argv[i], "--min_time=", 11) == 0) {
+      FLAG_min_time = atof(argv[i] + 11);
+    } else {
+      fprintf(stderr, "USAGE: %s [--filter=<substring>] [--min_time=<secs>]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  const char* template_rootdir = getenv("TEMPLATE_ROOTDIR");
+  if (template_rootdir == NULL)
+    template_rootdir = DEFAULT_TEMPLATE_ROOTDIR;   // probably "."
+  const string testdata_dir =
+      PathJoin(PathJoin(PathJoin(template_rootdir, "src"), "tests"),
+               "htmlparser_testdata");
+
+  char date[64];
+  const time_t now = time(NULL);
+  strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+  printf("{\n  \"context\": { \"package\": \"%s\", \"date\": \"%s\", "
+         "\"min_time\": %g },\n  \"benchmarks\": [",
+         PACKAGE_STRING, date, FLAG_min_time);
+
+  // The testdata files are small, so they're parsed back to back as a
+  // single corpus, as well as one at a time.
+  static const char* const kTestdataFiles[] = {
+    "cdata.html", "comments.html", "context.html", "google.html",
+    "javascript_attribute.html", "javascript_block.html",
+    "javascript_regexp.html", "position.html", "reset.html", "simple.html",
+    "tags.html",
+  };
+  string corpus;
+  for (size_t i = 0; i < sizeof(kTestdataFiles) / sizeof(*kTestdataFiles);
+       ++i) {
+    const string text = ReadFile(PathJoin(testdata_dir, kTestdataFiles[i]));
+    corpus.append(text);
+    string name = kTestdataFiles[i];
+    name.resize(name.size() - strlen(".html"));
+    ParserBenchmarks("testdata/" + name, text);
+  }
+  ParserBenchmarks("testdata/all", corpus);
+
+  const string large = LargePage(1 << 20);
+  ParserBenchmarks("large_page", large);
+  StatemachineBenchmarks("large_page", large);
+
+  printf("\n  ]\n}\n");
+  return 0;
+}
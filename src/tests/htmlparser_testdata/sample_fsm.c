@@ -275,7 +275,8 @@ static const int stringparser_transition_row_text[] = {
       /* '\xfb' */ STRINGPARSER_STATE_INT_TEXT,
       /* '\xfc' */ STRINGPARSER_STATE_INT_TEXT,
       /* '\xfd' */ STRINGPARSER_STATE_INT_TEXT,
-      /* '\xfe' */ STRINGPARSER_STATE_INT_TEXT
+      /* '\xfe' */ STRINGPARSER_STATE_INT_TEXT,
+      /* '\xff' */ STRINGPARSER_STATE_INT_TEXT
 };
 
 static const int stringparser_transition_row_string[] = {
@@ -533,7 +534,8 @@ static const int stringparser_transition_row_string[] = {
       /* '\xfb' */ STRINGPARSER_STATE_INT_STRING,
       /* '\xfc' */ STRINGPARSER_STATE_INT_STRING,
       /* '\xfd' */ STRINGPARSER_STATE_INT_STRING,
-      /* '\xfe' */ STRINGPARSER_STATE_INT_STRING
+      /* '\xfe' */ STRINGPARSER_STATE_INT_STRING,
+      /* '\xff' */ STRINGPARSER_STATE_INT_STRING
 };
 
 static const int stringparser_transition_row_string_escape[] = {
@@ -791,12 +793,296 @@ static const int stringparser_transition_row_string_escape[] = {
       /* '\xfb' */ STRINGPARSER_STATE_INT_STRING,
       /* '\xfc' */ STRINGPARSER_STATE_INT_STRING,
       /* '\xfd' */ STRINGPARSER_STATE_INT_STRING,
-      /* '\xfe' */ STRINGPARSER_STATE_INT_STRING
+      /* '\xfe' */ STRINGPARSER_STATE_INT_STRING,
+      /* '\xff' */ STRINGPARSER_STATE_INT_STRING
 };
 
-static const int * stringparser_state_transitions[] = {
+static const int * const stringparser_state_transitions[] = {
   stringparser_transition_row_text,
   stringparser_transition_row_string,
   stringparser_transition_row_string_escape
 };
 
+#define STRINGPARSER_NUM_CLASSES 3
+
+static const unsigned char stringparser_char_classes[] = {
+      /* '\x00' */ 0,
+      /* '\x01' */ 0,
+      /* '\x02' */ 0,
+      /* '\x03' */ 0,
+      /* '\x04' */ 0,
+      /* '\x05' */ 0,
+      /* '\x06' */ 0,
+      /* '\x07' */ 0,
+      /* '\x08' */ 0,
+      /*   '\t' */ 0,
+      /*   '\n' */ 0,
+      /* '\x0b' */ 0,
+      /* '\x0c' */ 0,
+      /*   '\r' */ 0,
+      /* '\x0e' */ 0,
+      /* '\x0f' */ 0,
+      /* '\x10' */ 0,
+      /* '\x11' */ 0,
+      /* '\x12' */ 0,
+      /* '\x13' */ 0,
+      /* '\x14' */ 0,
+      /* '\x15' */ 0,
+      /* '\x16' */ 0,
+      /* '\x17' */ 0,
+      /* '\x18' */ 0,
+      /* '\x19' */ 0,
+      /* '\x1a' */ 0,
+      /* '\x1b' */ 0,
+      /* '\x1c' */ 0,
+      /* '\x1d' */ 0,
+      /* '\x1e' */ 0,
+      /* '\x1f' */ 0,
+      /*    ' ' */ 0,
+      /*    '!' */ 0,
+      /*    '"' */ 1,
+      /*    '#' */ 0,
+      /*    '$' */ 0,
+      /*    '%' */ 0,
+      /*    '&' */ 0,
+      /*    "'" */ 0,
+      /*    '(' */ 0,
+      /*    ')' */ 0,
+      /*    '*' */ 0,
+      /*    '+' */ 0,
+      /*    ',' */ 0,
+      /*    '-' */ 0,
+      /*    '.' */ 0,
+      /*    '/' */ 0,
+      /*    '0' */ 0,
+      /*    '1' */ 0,
+      /*    '2' */ 0,
+      /*    '3' */ 0,
+      /*    '4' */ 0,
+      /*    '5' */ 0,
+      /*    '6' */ 0,
+      /*    '7' */ 0,
+      /*    '8' */ 0,
+      /*    '9' */ 0,
+      /*    ':' */ 0,
+      /*    ';' */ 0,
+      /*    '<' */ 0,
+      /*    '=' */ 0,
+      /*    '>' */ 0,
+      /*    '?' */ 0,
+      /*    '@' */ 0,
+      /*    'A' */ 0,
+      /*    'B' */ 0,
+      /*    'C' */ 0,
+      /*    'D' */ 0,
+      /*    'E' */ 0,
+      /*    'F' */ 0,
+      /*    'G' */ 0,
+      /*    'H' */ 0,
+      /*    'I' */ 0,
+      /*    'J' */ 0,
+      /*    'K' */ 0,
+      /*    'L' */ 0,
+      /*    'M' */ 0,
+      /*    'N' */ 0,
+      /*    'O' */ 0,
+      /*    'P' */ 0,
+      /*    'Q' */ 0,
+      /*    'R' */ 0,
+      /*    'S' */ 0,
+      /*    'T' */ 0,
+      /*    'U' */ 0,
+      /*    'V' */ 0,
+      /*    'W' */ 0,
+      /*    'X' */ 0,
+      /*    'Y' */ 0,
+      /*    'Z' */ 0,
+      /*    '[' */ 0,
+      /*   '\\' */ 2,
+      /*    ']' */ 0,
+      /*    '^' */ 0,
+      /*    '_' */ 0,
+      /*    '`' */ 0,
+      /*    'a' */ 0,
+      /*    'b' */ 0,
+      /*    'c' */ 0,
+      /*    'd' */ 0,
+      /*    'e' */ 0,
+      /*    'f' */ 0,
+      /*    'g' */ 0,
+      /*    'h' */ 0,
+      /*    'i' */ 0,
+      /*    'j' */ 0,
+      /*    'k' */ 0,
+      /*    'l' */ 0,
+      /*    'm' */ 0,
+      /*    'n' */ 0,
+      /*    'o' */ 0,
+      /*    'p' */ 0,
+      /*    'q' */ 0,
+      /*    'r' */ 0,
+      /*    's' */ 0,
+      /*    't' */ 0,
+      /*    'u' */ 0,
+      /*    'v' */ 0,
+      /*    'w' */ 0,
+      /*    'x' */ 0,
+      /*    'y' */ 0,
+      /*    'z' */ 0,
+      /*    '{' */ 0,
+      /*    '|' */ 0,
+      /*    '}' */ 0,
+      /*    '~' */ 0,
+      /* '\x7f' */ 0,
+      /* '\x80' */ 0,
+      /* '\x81' */ 0,
+      /* '\x82' */ 0,
+      /* '\x83' */ 0,
+      /* '\x84' */ 0,
+      /* '\x85' */ 0,
+      /* '\x86' */ 0,
+      /* '\x87' */ 0,
+      /* '\x88' */ 0,
+      /* '\x89' */ 0,
+      /* '\x8a' */ 0,
+      /* '\x8b' */ 0,
+      /* '\x8c' */ 0,
+      /* '\x8d' */ 0,
+      /* '\x8e' */ 0,
+      /* '\x8f' */ 0,
+      /* '\x90' */ 0,
+      /* '\x91' */ 0,
+      /* '\x92' */ 0,
+      /* '\x93' */ 0,
+      /* '\x94' */ 0,
+      /* '\x95' */ 0,
+      /* '\x96' */ 0,
+      /* '\x97' */ 0,
+      /* '\x98' */ 0,
+      /* '\x99' */ 0,
+      /* '\x9a' */ 0,
+      /* '\x9b' */ 0,
+      /* '\x9c' */ 0,
+      /* '\x9d' */ 0,
+      /* '\x9e' */ 0,
+      /* '\x9f' */ 0,
+      /* '\xa0' */ 0,
+      /* '\xa1' */ 0,
+      /* '\xa2' */ 0,
+      /* '\xa3' */ 0,
+      /* '\xa4' */ 0,
+      /* '\xa5' */ 0,
+      /* '\xa6' */ 0,
+      /* '\xa7' */ 0,
+      /* '\xa8' */ 0,
+      /* '\xa9' */ 0,
+      /* '\xaa' */ 0,
+      /* '\xab' */ 0,
+      /* '\xac' */ 0,
+      /* '\xad' */ 0,
+      /* '\xae' */ 0,
+      /* '\xaf' */ 0,
+      /* '\xb0' */ 0,
+      /* '\xb1' */ 0,
+      /* '\xb2' */ 0,
+      /* '\xb3' */ 0,
+      /* '\xb4' */ 0,
+      /* '\xb5' */ 0,
+      /* '\xb6' */ 0,
+      /* '\xb7' */ 0,
+      /* '\xb8' */ 0,
+      /* '\xb9' */ 0,
+      /* '\xba' */ 0,
+      /* '\xbb' */ 0,
+      /* '\xbc' */ 0,
+      /* '\xbd' */ 0,
+      /* '\xbe' */ 0,
+      /* '\xbf' */ 0,
+      /* '\xc0' */ 0,
+      /* '\xc1' */ 0,
+      /* '\xc2' */ 0,
+      /* '\xc3' */ 0,
+      /* '\xc4' */ 0,
+      /* '\xc5' */ 0,
+      /* '\xc6' */ 0,
+      /* '\xc7' */ 0,
+      /* '\xc8' */ 0,
+      /* '\xc9' */ 0,
+      /* '\xca' */ 0,
+      /* '\xcb' */ 0,
+      /* '\xcc' */ 0,
+      /* '\xcd' */ 0,
+      /* '\xce' */ 0,
+      /* '\xcf' */ 0,
+      /* '\xd0' */ 0,
+      /* '\xd1' */ 0,
+      /* '\xd2' */ 0,
+      /* '\xd3' */ 0,
+      /* '\xd4' */ 0,
+      /* '\xd5' */ 0,
+      /* '\xd6' */ 0,
+      /* '\xd7' */ 0,
+      /* '\xd8' */ 0,
+      /* '\xd9' */ 0,
+      /* '\xda' */ 0,
+      /* '\xdb' */ 0,
+      /* '\xdc' */ 0,
+      /* '\xdd' */ 0,
+      /* '\xde' */ 0,
+      /* '\xdf' */ 0,
+      /* '\xe0' */ 0,
+      /* '\xe1' */ 0,
+      /* '\xe2' */ 0,
+      /* '\xe3' */ 0,
+      /* '\xe4' */ 0,
+      /* '\xe5' */ 0,
+      /* '\xe6' */ 0,
+      /* '\xe7' */ 0,
+      /* '\xe8' */ 0,
+      /* '\xe9' */ 0,
+      /* '\xea' */ 0,
+      /* '\xeb' */ 0,
+      /* '\xec' */ 0,
+      /* '\xed' */ 0,
+      /* '\xee' */ 0,
+      /* '\xef' */ 0,
+      /* '\xf0' */ 0,
+      /* '\xf1' */ 0,
+      /* '\xf2' */ 0,
+      /* '\xf3' */ 0,
+      /* '\xf4' */ 0,
+      /* '\xf5' */ 0,
+      /* '\xf6' */ 0,
+      /* '\xf7' */ 0,
+      /* '\xf8' */ 0,
+      /* '\xf9' */ 0,
+      /* '\xfa' */ 0,
+      /* '\xfb' */ 0,
+      /* '\xfc' */ 0,
+      /* '\xfd' */ 0,
+      /* '\xfe' */ 0,
+      /* '\xff' */ 0
+};
+
+static const unsigned char stringparser_compact_transitions[] = {
+  /* text */
+    STRINGPARSER_STATE_INT_TEXT,
+    STRINGPARSER_STATE_INT_STRING,
+    STRINGPARSER_STATE_INT_STRING,
+  /* string */
+    STRINGPARSER_STATE_INT_STRING,
+    STRINGPARSER_STATE_INT_TEXT,
+    STRINGPARSER_STATE_INT_STRING_ESCAPE,
+  /* string_escape */
+    STRINGPARSER_STATE_INT_STRING,
+    STRINGPARSER_STATE_INT_STRING,
+    STRINGPARSER_STATE_INT_STRING
+};
+
+static const statemachine_compact_table stringparser_compact_table = {
+  3,
+  STRINGPARSER_NUM_CLASSES,
+  stringparser_char_classes,
+  stringparser_compact_transitions
+};
+
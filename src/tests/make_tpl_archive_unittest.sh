@@ -0,0 +1,129 @@
+#!/bin/sh
+
+# Copyright (c) 2026, Google Inc.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+#     * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#     * Redistributions in binary form must reproduce the above
+# copyright notice, this list of conditions and the following disclaimer
+# in the documentation and/or other materials provided with the
+# distribution.
+#     * Neither the name of Google Inc. nor the names of its
+# contributors may be used to endorse or promote products derived from
+# this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+# "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+# LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+# A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+# OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+# DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+# THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+# ---
+# Inspired by make_tpl_varnames_h_unittest.sh
+#
+# Reading an archive back is tested in template_cache_test; here we
+# just check what make_tpl_archive puts in one.
+
+die() {
+    echo "Test failed: $@" 1>&2
+    exit 1
+}
+
+TEST_SRCDIR=${TEST_SRCDIR-"."}
+TEST_TMPDIR=${TMPDIR-"/tmp"}
+
+# Optional first argument is where the executable lives
+MAKETPLARCHIVE=${1-"$TEST_SRCDIR/make_tpl_archive"}
+
+# Optional second argument is tmpdir to use
+TMPDIR=${2-"$TEST_TMPDIR/maketplarchive"}
+
+rm -rf $TMPDIR
+mkdir $TMPDIR || die "$LINENO: Can't make $TMPDIR"
+# The templates go in their own directory, apart from the archives.
+TPLDIR=$TMPDIR/tpl
+mkdir $TPLDIR $TPLDIR/sub $TPLDIR/sub/deeper \
+   || die "$LINENO: Can't make $TPLDIR"
+
+# Let's make some templates
+echo 'a {{X}}' > $TPLDIR/a.tpl
+echo 'b {{#S}}{{Y}}{{/S}}' > $TPLDIR/sub/b.tpl
+echo 'c {{>INC}}' > $TPLDIR/sub/deeper/c.tpl
+
+# Prints the number of entries in archive $1, from its header.
+num_entries() {
+    od -An -tu4 -j12 -N4 "$1" | tr -d ' '
+}
+
+# First, test commandline flags
+$MAKETPLARCHIVE >/dev/null 2>&1 \
+   && die "$LINENO: $MAKETPLARCHIVE with no args didn't give an error"
+$MAKETPLARCHIVE -t$TPLDIR a.tpl >/dev/null 2>&1 \
+   && die "$LINENO: $MAKETPLARCHIVE with no -o didn't give an error"
+$MAKETPLARCHIVE -o$TMPDIR/out.arch >/dev/null 2>&1 \
+   && die "$LINENO: $MAKETPLARCHIVE with no template didn't give an error"
+$MAKETPLARCHIVE --help >/dev/null 2>&1 \
+   || die "$LINENO: $MAKETPLARCHIVE --help gave an error"
+$MAKETPLARCHIVE -V >/dev/null 2>&1 \
+   || die "$LINENO: $MAKETPLARCHIVE -V gave an error"
+
+# One file, named relative to -t.
+$MAKETPLARCHIVE -q -t$TPLDIR -o$TMPDIR/one.arch a.tpl \
+   || die "$LINENO: $MAKETPLARCHIVE gave an error packing a.tpl"
+[ "`head -c8 $TMPDIR/one.arch`" = "CTPLARCH" ] \
+   || die "$LINENO: $MAKETPLARCHIVE didn't write an archive header"
+[ "`num_entries $TMPDIR/one.arch`" = "1" ] \
+   || die "$LINENO: $MAKETPLARCHIVE didn't pack exactly one template"
+grep -q 'a {{X}}' $TMPDIR/one.arch \
+   || die "$LINENO: $MAKETPLARCHIVE didn't pack the contents of a.tpl"
+
+# Directories are packed recursively, with names relative to -t.
+out=`$MAKETPLARCHIVE -t$TPLDIR -o$TMPDIR/all.arch . 2>&1` \
+   || die "$LINENO: $MAKETPLARCHIVE gave an error packing a directory: $out"
+echo "$out" | grep -q "Adding sub/deeper/c.tpl" \
+   || die "$LINENO: $MAKETPLARCHIVE didn't recurse into sub/deeper: $out"
+echo "$out" | grep -q "Adding \./" \
+   && die "$LINENO: $MAKETPLARCHIVE named a template ./something: $out"
+echo "$out" | grep -q "Wrote 3 templates" \
+   || die "$LINENO: $MAKETPLARCHIVE packed the wrong number of files: $out"
+[ "`num_entries $TMPDIR/all.arch`" = "3" ] \
+   || die "$LINENO: $MAKETPLARCHIVE's header has the wrong entry count"
+grep -q 'sub/b.tpl' $TMPDIR/all.arch \
+   || die "$LINENO: $MAKETPLARCHIVE didn't name sub/b.tpl"
+grep -q 'c {{>INC}}' $TMPDIR/all.arch \
+   || die "$LINENO: $MAKETPLARCHIVE didn't pack the contents of c.tpl"
+
+# A subdirectory on its own.
+$MAKETPLARCHIVE -q -t$TPLDIR -o$TMPDIR/sub.arch sub \
+   || die "$LINENO: $MAKETPLARCHIVE gave an error packing sub"
+[ "`num_entries $TMPDIR/sub.arch`" = "2" ] \
+   || die "$LINENO: $MAKETPLARCHIVE didn't pack both templates under sub"
+
+# -q keeps quiet unless something goes wrong.
+out=`$MAKETPLARCHIVE -q -t$TPLDIR -o$TMPDIR/quiet.arch a.tpl 2>&1`
+[ -z "$out" ] || die "$LINENO: $MAKETPLARCHIVE -q logged anyway: $out"
+
+# A missing file is an error, and nothing is written.
+out=`$MAKETPLARCHIVE -t$TPLDIR -o$TMPDIR/bad.arch a.tpl nonexistent.tpl 2>&1` \
+   && die "$LINENO: $MAKETPLARCHIVE didn't fail on a missing file: $out"
+echo "$out" | grep -q "Can't stat" \
+   || die "$LINENO: $MAKETPLARCHIVE didn't say what was missing: $out"
+[ -f $TMPDIR/bad.arch ] \
+   && die "$LINENO: $MAKETPLARCHIVE wrote an archive despite an error"
+
+# Packing the same file twice is an error too: names must be unique.
+$MAKETPLARCHIVE -q -t$TPLDIR -o$TMPDIR/dup.arch a.tpl a.tpl >/dev/null 2>&1 \
+   && die "$LINENO: $MAKETPLARCHIVE packed a duplicate name"
+
+echo "PASSED"
@@ -230,6 +230,65 @@ for i in 1 2 3 4 5 6 7 8; do
      || die "$LINENO: $MAKETPL didn't make ok$i output correctly"
 done
 
+# The same, but loading the templates in several threads.
+mkdir $TMPDIR/output_j
+out=`$MAKETPL -q -j3 -t$TMPDIR -o$TMPDIR/output_j -s"#" \
+     ok1.tpl ok2.tpl ok3.tpl ok4.tpl ok5.tpl ok6.tpl ok7.tpl ok8.tpl \
+     2>&1`
+[ -z "$out" ] || die "$LINENO: $MAKETPL -q -j3 wasn't so quiet: '$out'"
+for i in 1 2 3 4 5 6 7 8; do
+  Cleanse "$TMPDIR/output_j/ok$i.tpl#"
+  eval "echo \"\$expected_ok$i\"" | diff - "$TMPDIR/output_j/ok$i.tpl#.cleansed" \
+     || die "$LINENO: $MAKETPL -j3 didn't make ok$i output correctly"
+done
+$MAKETPL -j3 -t$TMPDIR -o$TMPDIR/output_j ok1.tpl bad2.tpl ok3.tpl bad3.tpl \
+   >/dev/null 2>&1
+[ $? = 2 ] || die "$LINENO: $MAKETPL -j3 gave wrong error-code parsing 2 bad templates: $?"
+
+# With a manifest, a second run skips the templates that haven't
+# changed, and leaves alone the output files that would come out the same.
+mkdir $TMPDIR/output_m
+cp $TMPDIR/ok1.tpl $TMPDIR/ok2.tpl $TMPDIR/ok3.tpl $TMPDIR/bad2.tpl \
+   $TMPDIR/output_m
+MAKETPL_M="$MAKETPL -t$TMPDIR/output_m -o$TMPDIR/output_m -m$TMPDIR/manifest"
+$MAKETPL_M ok1.tpl ok2.tpl ok3.tpl bad2.tpl >/dev/null 2>&1
+[ $? = 1 ] || die "$LINENO: $MAKETPL -m gave wrong error-code parsing 1 bad template: $?"
+out=`$MAKETPL_M ok1.tpl ok2.tpl ok3.tpl bad2.tpl 2>&1`
+[ $? = 1 ] || die "$LINENO: $MAKETPL -m skipped a bad template"
+echo "$out" | grep -q 'Skipped 3 unchanged templates out of 4' \
+   || die "$LINENO: $MAKETPL -m didn't skip unchanged templates: '$out'"
+echo '<b>{{TITLE}}</b>' >> $TMPDIR/output_m/ok3.tpl
+out=`$MAKETPL_M ok1.tpl ok2.tpl ok3.tpl 2>&1`
+echo "$out" | grep -q 'Skipped 2 unchanged templates out of 3' \
+   || die "$LINENO: $MAKETPL -m didn't notice a changed template: '$out'"
+echo "$out" | grep -q "Leaving .*ok3.tpl.varnames.h unchanged" \
+   || die "$LINENO: $MAKETPL -m rewrote an unchanged header: '$out'"
+Cleanse "$TMPDIR/output_m/ok3.tpl.varnames.h"
+echo "$expected_ok3" | diff - "$TMPDIR/output_m/ok3.tpl.varnames.h.cleansed" \
+   || die "$LINENO: $MAKETPL -m didn't make ok3 output correctly"
+rm $TMPDIR/output_m/ok1.tpl.varnames.h
+out=`$MAKETPL_M ok1.tpl ok2.tpl ok3.tpl 2>&1`
+echo "$out" | grep -q 'Skipped 2 unchanged templates out of 3' \
+   || die "$LINENO: $MAKETPL -m skipped a template with no output: '$out'"
+Cleanse "$TMPDIR/output_m/ok1.tpl.varnames.h"
+echo "$expected_ok1" | diff - "$TMPDIR/output_m/ok1.tpl.varnames.h.cleansed" \
+   || die "$LINENO: $MAKETPL -m didn't make ok1 output correctly"
+
+# With -f, any changed template means writing the whole file again.
+MAKETPL_F="$MAKETPL -t$TMPDIR/output_m -f$TMPDIR/output_m/ok1and2.h -m$TMPDIR/manifest"
+$MAKETPL_F ok1.tpl ok2.tpl >/dev/null 2>&1 \
+   || die "$LINENO: $MAKETPL -m -f gave error parsing good templates"
+out=`$MAKETPL_F ok1.tpl ok2.tpl 2>&1`
+echo "$out" | grep -q 'Skipped 2 unchanged templates out of 2' \
+   || die "$LINENO: $MAKETPL -m -f didn't skip unchanged templates: '$out'"
+echo '<a href={{HREF}}>' > $TMPDIR/output_m/ok2.tpl
+out=`$MAKETPL_F ok1.tpl ok2.tpl 2>&1`
+echo "$out" | grep -q 'Skipped 0 unchanged templates out of 2' \
+   || die "$LINENO: $MAKETPL -m -f skipped templates after a change: '$out'"
+Cleanse "$TMPDIR/output_m/ok1and2.h"
+echo "$expected_ok1" | diff - "$TMPDIR/output_m/ok1and2.h.cleansed" \
+   || die "$LINENO: $MAKETPL -m -f didn't make ok1and2.h output correctly"
+
 out=`$MAKETPL -q --outputfile_suffix=2 $TMPDIR/bad{1,2,3}.tpl 2>&1`
 [ -z "$out" ] && die "$LINENO: $MAKETPL -q was too quiet"
 for i in 1 2 3; do
@@ -306,6 +306,96 @@ int test_copy()
   return 0;
 }
 
+/* Tests that the compact transition tables, including the run skipping in
+ * statemachine_parse(), behave exactly like the full tables.
+ */
+int test_compact()
+{
+  statemachine_definition *def;
+  statemachine_definition *compact_def;
+  statemachine_ctx *sm;
+  statemachine_ctx *compact_sm;
+  char input[1024];
+  int i;
+
+  def = statemachine_definition_new(NUM_STATES);
+  statemachine_definition_populate(def, simple_state_transitions,
+                                   simple_states_internal_names);
+  compact_def = statemachine_definition_new(NUM_STATES);
+  statemachine_definition_populate_compact(compact_def, &simple_compact_table,
+                                           simple_states_internal_names);
+
+  /* State A can only be left through '1', '\xf1' and 'E'. */
+  ASSERT(compact_def->single_exit_char[SIMPLE_STATE_ERROR_TEST] == -1);
+  ASSERT(compact_def->single_exit_char[SIMPLE_STATE_A] == -1);
+
+  compact_sm = statemachine_new(compact_def, NULL);
+  statemachine_parse(compact_sm, "001", 3);
+  ASSERT(compact_sm->current_state == SIMPLE_STATE_B);
+  statemachine_parse(compact_sm, "\xf0\xf0\xf1", 3);
+  ASSERT(compact_sm->current_state == SIMPLE_STATE_C);
+  statemachine_parse(compact_sm, "2", 1);
+  ASSERT(compact_sm->current_state == SIMPLE_STATE_B);
+  statemachine_parse(compact_sm, "11", 2);
+  ASSERT(compact_sm->current_state == SIMPLE_STATE_D);
+  statemachine_parse(compact_sm, "\xff\xff", 2);
+  ASSERT(compact_sm->current_state == SIMPLE_STATE_D);
+  statemachine_parse(compact_sm, "222E", 4);
+  ASSERT(compact_sm->current_state == SIMPLE_STATE_ERROR_TEST);
+  ASSERT(statemachine_parse(compact_sm, "3", 1) == STATEMACHINE_ERROR);
+  ASSERT_STREQ(statemachine_get_error_msg(compact_sm),
+               "Unexpected character '3' in state 'error_test'");
+  statemachine_delete(compact_sm);
+
+  /* Long runs with newlines, fed in uneven chunks while recording. */
+  for (i = 0; i < (int)sizeof(input); i++) {
+    if (i % 97 == 0)
+      input[i] = '1';
+    else if (i % 89 == 0)
+      input[i] = '2';
+    else if (i % 13 == 0)
+      input[i] = '\n';
+    else
+      input[i] = 'a' + i % 26;
+  }
+
+  sm = statemachine_new(def, NULL);
+  compact_sm = statemachine_new(compact_def, NULL);
+  statemachine_start_record(sm);
+  statemachine_start_record(compact_sm);
+  for (i = 0; i < (int)sizeof(input); i += i % 7 + 1) {
+    int size = i % 7 + 1;
+    if (i + size > (int)sizeof(input))
+      size = sizeof(input) - i;
+    ASSERT(statemachine_parse(sm, input + i, size) ==
+           statemachine_parse(compact_sm, input + i, size));
+    ASSERT(sm->current_state == compact_sm->current_state);
+    ASSERT(sm->current_char == compact_sm->current_char);
+    ASSERT(statemachine_get_line_number(sm) ==
+           statemachine_get_line_number(compact_sm));
+    ASSERT(statemachine_get_column_number(sm) ==
+           statemachine_get_column_number(compact_sm));
+    ASSERT_STREQ(statemachine_record_buffer(sm),
+                 statemachine_record_buffer(compact_sm));
+  }
+  ASSERT_STREQ(statemachine_stop_record(sm),
+               statemachine_stop_record(compact_sm));
+
+  statemachine_parse(sm, input, sizeof(input));
+  statemachine_parse(compact_sm, input, sizeof(input));
+  ASSERT(sm->current_state == compact_sm->current_state);
+  ASSERT(statemachine_get_line_number(sm) ==
+         statemachine_get_line_number(compact_sm));
+  ASSERT(statemachine_get_column_number(sm) ==
+         statemachine_get_column_number(compact_sm));
+
+  statemachine_delete(sm);
+  statemachine_delete(compact_sm);
+  statemachine_definition_delete(def);
+  statemachine_definition_delete(compact_def);
+  return 0;
+}
+
 /* Tests statemachine_encode_char().
  */
 int test_encode_char()
@@ -359,6 +449,7 @@ int main(int argc, char **argv)
   test_record();
   test_no_ascii();
   test_copy();
+  test_compact();
   test_encode_char();
   printf("DONE.\n");
   return 0;
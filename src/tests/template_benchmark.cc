@@ -0,0 +1,527 @@
+// Copyright (c) 2026, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+//
+// Microbenchmarks for the template system: parsing, expanding,
+// filling dictionaries, modifiers and the template cache.
+//
+//    template_benchmark [--filter=<substring>] [--min_time=<seconds>]
+//
+// Each benchmark runs until it has taken at least --min_time (default
+// 0.2) seconds, and the results are written to stdout as JSON:
+//    { "context": { ... },
+//      "benchmarks": [ { "name": "parse/16k/strip_whitespace",
+//                        "iterations": 4096, "ns_per_op": 61234.5,
+//                        "bytes_per_second": 2.7e8 }, ... ] }
+// bytes_per_second counts input bytes for parses and modifiers, and
+// output bytes for expands; it's left out where neither makes sense.
+// Only benchmarks whose name contains --filter are run.
+
+#include "config_for_unittests.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <chrono>        // for steady_clock
+#include <string>
+#include <vector>
+#include <ctemplate/template.h>
+#include <ctemplate/template_cache.h>
+#include <ctemplate/template_dictionary.h>
+#include <ctemplate/template_emitter.h>
+#include <ctemplate/template_enums.h>
+#include <ctemplate/template_modifiers.h>
+#include <ctemplate/template_string.h>
+#include "tests/template_test_util.h"    // for TemplateDictionaryPeer
+#include "base/util.h"                   // for CHECK()
+
+using std::string;
+using std::vector;
+using ctemplate::DO_NOT_STRIP;
+using ctemplate::STRIP_BLANK_LINES;
+using ctemplate::STRIP_WHITESPACE;
+using ctemplate::StringEmitter;
+using ctemplate::Strip;
+using ctemplate::Template;
+using ctemplate::TemplateCache;
+using ctemplate::TemplateDictionary;
+using ctemplate::TemplateDictionaryPeer;
+using ctemplate::TemplateHandle;
+using ctemplate::TemplateModifier;
+using ctemplate::TemplateString;
+
+static string FLAG_filter;
+static double FLAG_min_time = 0.2;
+
+// ----------------------------------------------------------------------
+// The harness
+// ----------------------------------------------------------------------
+
+// A benchmark does iterations repetitions of something, and returns
+// how many bytes it processed (0 if that's not meaningful).
+typedef size_t (*BenchmarkFunction)(int iterations, void* arg);
+
+static bool g_first_result = true;
+
+static double Seconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+}
+
+// Runs fn with more and more iterations until a run takes at least
+// FLAG_min_time, and prints that run's result.
+static void Run(const string& name, BenchmarkFunction fn, void* arg) {
+  if (name.find(FLAG_filter) == string::npos)
+    return;
+  fn(1, arg);   // warm up
+  int iterations = 1;
+  double seconds;
+  size_t bytes;
+  while (true) {
+    const std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    bytes = fn(iterations, arg);
+    seconds = Seconds(start);
+    if (seconds >= FLAG_min_time || iterations >= (1 << 30))
+      break;
+    // Aim a little past min_time, but don't grow more than 10x at once.
+    const double scale = seconds > 0 ? 1.4 * FLAG_min_time / seconds : 10;
+    iterations = static_cast<int>(iterations * (scale < 10 ? scale : 10)) + 1;
+  }
+  printf("%s\n    { \"name\": \"%s\", \"iterations\": %d, "
+         "\"ns_per_op\": %.1f",
+         g_first_result ? "" : ",", name.c_str(), iterations,
+         seconds * 1e9 / iterations);
+  if (bytes > 0)
+    printf(", \"bytes_per_second\": %.4g", bytes / seconds);
+  printf(" }");
+  g_first_result = false;
+  fflush(stdout);
+}
+
+// ----------------------------------------------------------------------
+// Test data
+// ----------------------------------------------------------------------
+
+// Template text of about size bytes: a page of markup with a
+// variable, a section and a comment every few lines, and some blank
+// lines and indentation for the strip modes to remove.
+static string PageText(size_t size) {
+  static const char kChunk[] =
+      "<div class=\"item\">\n"
+      "    <a href=\"{{URL:h}}\">{{NAME:h}}</a>\n"
+      "\n"
+      "    {{#DETAILS}}<span>{{PRICE}} &middot; {{COUNT}} left</span>"
+      "{{/DETAILS}}\n"
+      "    {{! a comment that the parser throws away }}\n"
+      "</div>\n";
+  string text;
+  while (text.size() < size)
+    text.append(kChunk);
+  return text;
+}
+
+// Mostly static text, with one variable per ~4k.
+static string TextHeavyText() {
+  string text;
+  for (int i = 0; i < 16; ++i) {
+    for (int j = 0; j < 64; ++j)
+      text.append("Lorem ipsum dolor sit amet, consectetur adipiscing. ");
+    text.append("{{TITLE}}\n");
+  }
+  return text;
+}
+
+// Hardly any static text: 200 variables, half of them escaped.
+static string VariableHeavyText() {
+  string text;
+  char buf[64];
+  for (int i = 0; i < 200; ++i) {
+    snprintf(buf, sizeof(buf), "{{VAR%d%s}} ", i % 50, i % 2 ? ":h" : "");
+    text.append(buf);
+  }
+  return text;
+}
+
+// Sections nested depth deep, each with a variable.
+static string NestedText(int depth) {
+  string text;
+  char buf[64];
+  for (int i = 0; i < depth; ++i) {
+    snprintf(buf, sizeof(buf), "{{#S%d}}<{{V%d}}>", i, i);
+    text.append(buf);
+  }
+  for (int i = depth - 1; i >= 0; --i) {
+    snprintf(buf, sizeof(buf), "{{/S%d}}", i);
+    text.append(buf);
+  }
+  return text;
+}
+
+// A value of about size bytes for the modifiers to work on: mostly
+// plain text, with characters that html, javascript, url and css
+// escaping all have to deal with.
+static string ModifierValue(size_t size) {
+  static const char kChunk[] =
+      "Some text & <b>markup</b> with \"quotes\", 'apostrophes', "
+      "a url http://www.example.com/a?b=c&d=e\n\ttabs; and 100% more. ";
+  string value;
+  while (value.size() < size)
+    value.append(kChunk);
+  value.resize(size);
+  return value;
+}
+
+static const char* StripName(Strip strip) {
+  switch (strip) {
+    case DO_NOT_STRIP: return "do_not_strip";
+    case STRIP_BLANK_LINES: return "strip_blank_lines";
+    case STRIP_WHITESPACE: return "strip_whitespace";
+    default: return "unknown";
+  }
+}
+
+// ----------------------------------------------------------------------
+// Parsing
+// ----------------------------------------------------------------------
+
+struct ParseArgs {
+  string text;
+  Strip strip;
+};
+
+static size_t BM_Parse(int iterations, void* arg) {
+  const ParseArgs* args = static_cast<ParseArgs*>(arg);
+  for (int i = 0; i < iterations; ++i) {
+    Template* tpl = Template::StringToTemplate(args->text, args->strip);
+    CHECK(tpl);
+    delete tpl;
+  }
+  return args->text.size() * iterations;
+}
+
+// ----------------------------------------------------------------------
+// Expanding
+// ----------------------------------------------------------------------
+
+struct ExpandArgs {
+  TemplateCache* cache;
+  string key;
+  const TemplateDictionary* dict;
+};
+
+static size_t BM_Expand(int iterations, void* arg) {
+  const ExpandArgs* args = static_cast<ExpandArgs*>(arg);
+  string out;
+  size_t bytes = 0;
+  for (int i = 0; i < iterations; ++i) {
+    out.clear();
+    CHECK(args->cache->ExpandWithData(args->key, DO_NOT_STRIP, args->dict,
+                                      NULL, &out));
+    bytes += out.size();
+  }
+  return bytes;
+}
+
+static void ExpandBenchmarks() {
+  TemplateCache cache;
+  ExpandArgs args;
+  args.cache = &cache;
+
+  TemplateDictionary text_dict("text");
+  text_dict.SetValue("TITLE", "A Title");
+  CHECK(cache.StringToTemplateCache("text", TextHeavyText(), DO_NOT_STRIP));
+  args.key = "text";
+  args.dict = &text_dict;
+  Run("expand/text_heavy", BM_Expand, &args);
+
+  TemplateDictionary var_dict("variables");
+  char name[32];
+  for (int i = 0; i < 50; ++i) {
+    snprintf(name, sizeof(name), "VAR%d", i);
+    var_dict.SetValue(name, "a value with <b>markup</b> & such");
+  }
+  CHECK(cache.StringToTemplateCache("variables", VariableHeavyText(),
+                                    DO_NOT_STRIP));
+  args.key = "variables";
+  args.dict = &var_dict;
+  Run("expand/variable_heavy", BM_Expand, &args);
+
+  // A dictionary three sections wide at each of 16 levels.
+  const int kDepth = 16;
+  TemplateDictionary nested_dict("nested");
+  vector<TemplateDictionary*> level(1, &nested_dict);
+  for (int d = 0; d < kDepth; ++d) {
+    vector<TemplateDictionary*> next;
+    for (size_t i = 0; i < level.size() && next.size() < 3; ++i) {
+      for (int j = 0; j < 3 && next.size() < 3; ++j) {
+        snprintf(name, sizeof(name), "S%d", d);
+        TemplateDictionary* sub = level[i]->AddSectionDictionary(name);
+        snprintf(name, sizeof(name), "V%d", d);
+        sub->SetIntValue(name, j);
+        next.push_back(sub);
+      }
+    }
+    level.swap(next);
+  }
+  CHECK(cache.StringToTemplateCache("nested", NestedText(kDepth),
+                                    DO_NOT_STRIP));
+  args.key = "nested";
+  args.dict = &nested_dict;
+  Run("expand/deeply_nested", BM_Expand, &args);
+
+  // 100 includes of ten small templates, each with a variable of its
+  // own and one it inherits.
+  string include_text;
+  TemplateDictionary include_dict("includes");
+  include_dict.SetValue("SHARED", "shared");
+  for (int i = 0; i < 100; ++i) {
+    char key[32];
+    snprintf(key, sizeof(key), "included%d", i % 10);
+    if (i < 10) {
+      CHECK(cache.StringToTemplateCache(
+          key, "<p>{{OWN}} and {{SHARED}}</p>\n", DO_NOT_STRIP));
+    }
+    snprintf(name, sizeof(name), "{{>INC%d}}", i);
+    include_text.append(name);
+    snprintf(name, sizeof(name), "INC%d", i);
+    TemplateDictionary* sub = include_dict.AddIncludeDictionary(name);
+    sub->SetFilename(key);
+    sub->SetIntValue("OWN", i);
+  }
+  CHECK(cache.StringToTemplateCache("includes", include_text, DO_NOT_STRIP));
+  args.key = "includes";
+  args.dict = &include_dict;
+  Run("expand/include_heavy", BM_Expand, &args);
+}
+
+// ----------------------------------------------------------------------
+// Dictionaries
+// ----------------------------------------------------------------------
+
+struct DictionaryArgs {
+  int num_values;
+  vector<string> names;
+  vector<string> values;
+};
+
+static size_t BM_DictionaryFill(int iterations, void* arg) {
+  const DictionaryArgs* args = static_cast<DictionaryArgs*>(arg);
+  for (int i = 0; i < iterations; ++i) {
+    TemplateDictionary dict("fill");
+    for (int j = 0; j < args->num_values; ++j) {
+      dict.SetValue(args->names[j], args->values[j]);
+      if (j % 10 == 0)
+        dict.AddSectionDictionary("ROW")->SetValue("CELL", args->values[j]);
+    }
+  }
+  return 0;
+}
+
+struct LookupArgs {
+  const DictionaryArgs* names;
+  const TemplateDictionary* dict;
+};
+
+static size_t BM_DictionaryLookup(int iterations, void* arg) {
+  const LookupArgs* args = static_cast<LookupArgs*>(arg);
+  const TemplateDictionaryPeer peer(args->dict);
+  const int n = args->names->num_values;
+  size_t found = 0;
+  for (int i = 0; i < iterations; ++i)
+    found += *peer.GetSectionValue(args->names->names[i % n]) != '\0';
+  CHECK(found == static_cast<size_t>(iterations));
+  return 0;
+}
+
+static void DictionaryBenchmarks() {
+  const int kSizes[] = { 10, 100, 1000 };
+  for (size_t s = 0; s < sizeof(kSizes) / sizeof(*kSizes); ++s) {
+    DictionaryArgs args;
+    args.num_values = kSizes[s];
+    char buf[32];
+    for (int i = 0; i < args.num_values; ++i) {
+      snprintf(buf, sizeof(buf), "VARIABLE_%d", i);
+      args.names.push_back(buf);
+      snprintf(buf, sizeof(buf), "value %d", i);
+      args.values.push_back(buf);
+    }
+    snprintf(buf, sizeof(buf), "%d", args.num_values);
+    Run(string("dictionary/fill/") + buf, BM_DictionaryFill, &args);
+
+    // Lookups are done in a child dictionary, so each one misses
+    // there and finds the value in the parent.
+    TemplateDictionary dict("lookup");
+    for (int i = 0; i < args.num_values; ++i)
+      dict.SetValue(args.names[i], args.values[i]);
+    LookupArgs lookup = { &args, dict.AddSectionDictionary("CHILD") };
+    Run(string("dictionary/lookup/") + buf, BM_DictionaryLookup, &lookup);
+  }
+}
+
+// ----------------------------------------------------------------------
+// Modifiers
+// ----------------------------------------------------------------------
+
+struct ModifierArgs {
+  const TemplateModifier* modifier;
+  string arg;
+  string value;
+};
+
+static size_t BM_Modifier(int iterations, void* arg) {
+  const ModifierArgs* args = static_cast<ModifierArgs*>(arg);
+  string out;
+  StringEmitter emitter(&out);
+  for (int i = 0; i < iterations; ++i) {
+    out.clear();
+    args->modifier->Modify(args->value.data(), args->value.size(), NULL,
+                           &emitter, args->arg);
+  }
+  return args->value.size() * iterations;
+}
+
+static void ModifierBenchmarks() {
+  static const struct {
+    const char* name;
+    const TemplateModifier* modifier;
+    const char* arg;
+  } kModifiers[] = {
+    { "none", &ctemplate::null_modifier, "" },
+    { "html_escape", &ctemplate::html_escape, "" },
+    { "pre_escape", &ctemplate::pre_escape, "" },
+    { "snippet_escape", &ctemplate::snippet_escape, "" },
+    { "cleanse_attribute", &ctemplate::cleanse_attribute, "" },
+    { "cleanse_css", &ctemplate::cleanse_css, "" },
+    { "validate_url_and_html_escape",
+      &ctemplate::validate_url_and_html_escape, "" },
+    { "xml_escape", &ctemplate::xml_escape, "" },
+    { "javascript_escape", &ctemplate::javascript_escape, "" },
+    { "javascript_number", &ctemplate::javascript_number, "" },
+    { "url_query_escape", &ctemplate::url_query_escape, "" },
+    { "json_escape", &ctemplate::json_escape, "" },
+    { "prefix_line", &ctemplate::prefix_line, "=    " },
+  };
+  // Values the size of a name, a sentence, and a paragraph or two.
+  const size_t kSizes[] = { 16, 256, 4096 };
+  for (size_t m = 0; m < sizeof(kModifiers) / sizeof(*kModifiers); ++m) {
+    for (size_t s = 0; s < sizeof(kSizes) / sizeof(*kSizes); ++s) {
+      ModifierArgs args;
+      args.modifier = kModifiers[m].modifier;
+      args.arg = kModifiers[m].arg;
+      args.value = ModifierValue(kSizes[s]);
+      char size[32];
+      snprintf(size, sizeof(size), "/%d", static_cast<int>(kSizes[s]));
+      Run(string("modifier/") + kModifiers[m].name + size,
+          BM_Modifier, &args);
+    }
+  }
+}
+
+// ----------------------------------------------------------------------
+// The template cache
+// ----------------------------------------------------------------------
+
+struct CacheArgs {
+  TemplateCache* cache;
+  vector<string> keys;
+};
+
+static size_t BM_CacheLookup(int iterations, void* arg) {
+  const CacheArgs* args = static_cast<CacheArgs*>(arg);
+  const size_t n = args->keys.size();
+  for (int i = 0; i < iterations; ++i) {
+    TemplateHandle handle =
+        args->cache->GetTemplateHandle(args->keys[i % n], DO_NOT_STRIP);
+    CHECK(handle.valid());
+  }
+  return 0;
+}
+
+static void CacheBenchmarks() {
+  const int kSizes[] = { 10, 1000, 100000 };
+  for (size_t s = 0; s < sizeof(kSizes) / sizeof(*kSizes); ++s) {
+    TemplateCache cache;
+    CacheArgs args;
+    args.cache = &cache;
+    char buf[32];
+    for (int i = 0; i < kSizes[s]; ++i) {
+      snprintf(buf, sizeof(buf), "template_%d", i);
+      args.keys.push_back(buf);
+      CHECK(cache.StringToTemplateCache(buf, "{{X}}", DO_NOT_STRIP));
+    }
+    snprintf(buf, sizeof(buf), "%d", kSizes[s]);
+    Run(string("cache/lookup/") + buf, BM_CacheLookup, &args);
+    cache.Freeze();
+    Run(string("cache/lookup_frozen/") + buf, BM_CacheLookup, &args);
+  }
+}
+
+int main(int argc, char** argv) {
+  for (int i = 1; i < argc; ++i) {
+    if (strncmp(argv[i], "--filter=", 9) == 0) {
+      FLAG_filter = argv[i] + 9;
+    } else if (strncmp(argv[i], "--min_time=", 11) == 0) {
+      FLAG_min_time = atof(argv[i] + 11);
+    } else {
+      fprintf(stderr, "USAGE: %s [--filter=<substring>] [--min_time=<secs>]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  char date[64];
+  const time_t now = time(NULL);
+  strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+  printf("{\n  \"context\": { \"package\": \"%s\", \"date\": \"%s\", "
+         "\"min_time\": %g },\n  \"benchmarks\": [",
+         PACKAGE_STRING, date, FLAG_min_time);
+
+  const size_t kParseSizes[] = { 1024, 16 * 1024, 256 * 1024 };
+  const Strip kStrips[] = { DO_NOT_STRIP, STRIP_BLANK_LINES, STRIP_WHITESPACE };
+  for (size_t s = 0; s < sizeof(kParseSizes) / sizeof(*kParseSizes); ++s) {
+    for (size_t m = 0; m < sizeof(kStrips) / sizeof(*kStrips); ++m) {
+      ParseArgs args;
+      args.text = PageText(kParseSizes[s]);
+      args.strip = kStrips[m];
+      char name[64];
+      snprintf(name, sizeof(name), "parse/%dk/%s",
+               static_cast<int>(kParseSizes[s] / 1024), StripName(kStrips[m]));
+      Run(name, BM_Parse, &args);
+    }
+  }
+  ExpandBenchmarks();
+  DictionaryBenchmarks();
+  ModifierBenchmarks();
+  CacheBenchmarks();
+
+  printf("\n  ]\n}\n");
+  return 0;
+}
@@ -34,26 +34,43 @@
 #include "config_for_unittests.h"
 #include <ctemplate/template_cache.h>
 #include <assert.h>      // for assert()
+#include <limits.h>      // for PATH_MAX
 #include <stdio.h>       // for printf()
 #include <stdlib.h>      // for exit()
 #include <string.h>      // for strcmp()
 #include <sys/types.h>   // for mode_t
+#if defined(HAVE_PTHREAD) && !defined(NO_THREADS)
+# include <pthread.h>    // for pthread_create(), pthread_join()
+#endif
 #ifdef HAVE_UNISTD_H
 # include <unistd.h>
-#endif      // for unlink()
+#endif      // for unlink(), chdir(), getcwd()
+#ifdef HAVE_ZLIB
+# include <zlib.h>
+#endif      // for inflate()
+#include <chrono>        // for steady_clock
+#include <vector>        // for vector<>
+#include <ctemplate/per_expand_data.h>  // for PerExpandData
 #include <ctemplate/template.h>  // for Template
+#include <ctemplate/template_capture.h>  // for TemplateCapture, etc
 #include <ctemplate/template_dictionary.h>  // for TemplateDictionary
+#include <ctemplate/template_emitter.h>  // for HashingEmitter, etc
 #include <ctemplate/template_enums.h>  // for DO_NOT_STRIP, etc
 #include <ctemplate/template_pathops.h>  // for PathJoin(), kCWD
+#include <ctemplate/template_source.h>  // for TemplateArchive
 #include <ctemplate/template_string.h>  // for TemplateString
 #include "tests/template_test_util.h"  // for AssertExpandIs(), etc
 using std::string;
+using std::vector;
 using ctemplate::FLAGS_test_tmpdir;
 using ctemplate::AssertExpandIs;
+using ctemplate::CapturedExpand;
 using ctemplate::CreateOrCleanTestDir;
 using ctemplate::CreateOrCleanTestDirAndSetAsTmpdir;
 using ctemplate::DO_NOT_STRIP;
+using ctemplate::HashingEmitter;
 using ctemplate::PathJoin;
+using ctemplate::PerExpandData;
 using ctemplate::STRIP_BLANK_LINES;
 using ctemplate::STRIP_WHITESPACE;
 using ctemplate::StaticTemplateString;
@@ -62,8 +79,12 @@ using ctemplate::StringToTemplateCache;
 using ctemplate::StringToTemplateFile;
 using ctemplate::Template;
 using ctemplate::TemplateCache;
+using ctemplate::TemplateArchive;
 using ctemplate::TemplateCachePeer;
+using ctemplate::TemplateCapture;
+using ctemplate::TemplateCaptureReader;
 using ctemplate::TemplateDictionary;
+using ctemplate::TemplateHandle;
 using ctemplate::kCWD;
 
 #define ASSERT(cond)  do {                                      \
@@ -314,6 +335,288 @@ class TemplateCacheUnittest {
     CreateOrCleanTestDir(pathB);
   }
 
+  static void TestResolutionCache() {
+    TemplateCache cache;
+    // The threaded and nothreads versions of this test may run at the
+    // same time, and share FLAGS_test_tmpdir; we don't want to see
+    // each other's files.
+#ifdef NO_THREADS
+    const string prefix = "resolve_nothreads_";
+#else
+    const string prefix = "resolve_";
+#endif
+    const string pathA = PathJoin(FLAGS_test_tmpdir, prefix + "a/");
+    const string pathB = PathJoin(FLAGS_test_tmpdir, prefix + "b/");
+    CreateOrCleanTestDir(pathA);
+    CreateOrCleanTestDir(pathB);
+    cache.SetTemplateRootDirectory(pathA);
+    cache.AddAlternateTemplateRootDirectory(pathB);
+    cache.SetResolutionCacheTtl(3600);
+
+    // A miss is remembered, so a file added later isn't noticed...
+    ASSERT(cache.FindTemplateFilename("resolved_template").empty());
+    const string path_b = PathJoin(pathB, "resolved_template");
+    StringToFile("b/resolved_template", path_b);
+    ASSERT(cache.FindTemplateFilename("resolved_template").empty());
+    TemplateCache::ResolutionStats stats = cache.resolution_stats();
+    ASSERT(stats.misses == 1);
+    ASSERT(stats.hits == 1);
+    ASSERT(stats.stats_saved == 2);   // one per search-path directory
+    // ... until we're told the directory changed.
+    cache.InvalidateResolutions(pathB);
+    ASSERT_STREQ(path_b.c_str(),
+                 cache.FindTemplateFilename("resolved_template").c_str());
+    ASSERT_STREQ(path_b.c_str(),
+                 cache.FindTemplateFilename("resolved_template").c_str());
+    stats = cache.resolution_stats();
+    ASSERT(stats.misses == 2);
+    ASSERT(stats.hits == 2);
+    ASSERT(stats.stats_saved == 4);
+
+    // Loading the template needs a fresh stat, but only the one.
+    const Template* tpl = cache.GetTemplate("resolved_template", DO_NOT_STRIP);
+    ASSERT(tpl);
+    TemplateDictionary dict("dict");
+    AssertExpandIs(tpl, &dict, "b/resolved_template", true);
+    stats = cache.resolution_stats();
+    ASSERT(stats.hits == 3);
+    ASSERT(stats.stats_saved == 5);
+
+    // Changing the search path forgets everything.
+    const string path_a = PathJoin(pathA, "resolved_template");
+    StringToFile("a/resolved_template", path_a);
+    cache.SetTemplateRootDirectory(pathA);
+    ASSERT_STREQ(path_a.c_str(),
+                 cache.FindTemplateFilename("resolved_template").c_str());
+
+    // Turning the cache off leaves the counts alone.
+    cache.SetResolutionCacheTtl(0);
+    ASSERT_STREQ(path_a.c_str(),
+                 cache.FindTemplateFilename("resolved_template").c_str());
+    ASSERT(cache.resolution_stats().misses == 3);
+    ASSERT(cache.resolution_stats().hits == 3);
+
+    // A file added to a directory shadows the file of the same name
+    // in every directory after it on the search path.
+    cache.AddAlternateTemplateRootDirectory(pathB);
+    cache.SetResolutionCacheTtl(3600);
+    const string shadowed_b = PathJoin(pathB, "shadowed_template");
+    StringToFile("b/shadowed_template", shadowed_b);
+    ASSERT_STREQ(shadowed_b.c_str(),
+                 cache.FindTemplateFilename("shadowed_template").c_str());
+    const string shadowed_a = PathJoin(pathA, "shadowed_template");
+    StringToFile("a/shadowed_template", shadowed_a);
+    ASSERT_STREQ(shadowed_b.c_str(),
+                 cache.FindTemplateFilename("shadowed_template").c_str());
+    cache.InvalidateResolutions(pathA);
+    ASSERT_STREQ(shadowed_a.c_str(),
+                 cache.FindTemplateFilename("shadowed_template").c_str());
+    // But a change to the last directory can't shadow anything.
+    cache.InvalidateResolutions(pathB);
+    ASSERT(cache.resolution_stats().hits == 4);
+    ASSERT_STREQ(shadowed_a.c_str(),
+                 cache.FindTemplateFilename("shadowed_template").c_str());
+    ASSERT(cache.resolution_stats().hits == 5);
+
+    // A relative directory means the same as it does on the search path.
+    unlink(shadowed_a.c_str());
+    char cwd[PATH_MAX];
+    ASSERT(getcwd(cwd, sizeof(cwd)));
+    ASSERT(chdir(FLAGS_test_tmpdir.c_str()) == 0);
+    cache.InvalidateResolutions(prefix + "a");
+    ASSERT(chdir(cwd) == 0);
+    ASSERT_STREQ(shadowed_b.c_str(),
+                 cache.FindTemplateFilename("shadowed_template").c_str());
+
+    CreateOrCleanTestDir(pathA);
+    CreateOrCleanTestDir(pathB);
+  }
+
+  static void TestCapture() {
+#ifdef NO_THREADS
+    const string filename = PathJoin(FLAGS_test_tmpdir,
+                                     "capture_nothreads.template");
+#else
+    const string filename = PathJoin(FLAGS_test_tmpdir, "capture.template");
+#endif
+    TemplateDictionary::SetGlobalValue("CAPTURE_GLOBAL", "g");
+    TemplateCache cache;
+    ASSERT(cache.StringToTemplateCache(
+        "capture_main", "{{X}}{{#S}}[{{Y}}]{{/S}}{{>INC}}{{CAPTURE_GLOBAL}}",
+        DO_NOT_STRIP));
+    ASSERT(cache.StringToTemplateCache("capture_inc", "<{{Z}}>",
+                                       DO_NOT_STRIP));
+
+    TemplateCapture* capture = TemplateCapture::Create(filename, 1);
+    ASSERT(capture);
+    cache.SetCapture(capture);
+    TemplateDictionary dict1("dict1");
+    dict1.SetValue("X", "x");
+    dict1.AddSectionDictionary("S")->SetValue("Y", "a");
+    dict1.AddSectionDictionary("S")->SetValue("Y", "b");
+    TemplateDictionary* inc = dict1.AddIncludeDictionary("INC");
+    inc->SetFilename("capture_inc");
+    inc->SetValue("Z", "z");
+    PerExpandData per_expand_data;
+    per_expand_data.SetMaxIterations(100);
+    string out1, out2, out3;
+    ASSERT(cache.ExpandWithData("capture_main", DO_NOT_STRIP, &dict1,
+                                &per_expand_data, &out1));
+    ASSERT_STREQ("x[a][b]<z>g", out1.c_str());
+    TemplateDictionary dict2("dict2");
+    ASSERT(cache.ExpandWithData("capture_main", DO_NOT_STRIP, &dict2, NULL,
+                                &out2));
+    ASSERT_STREQ("g", out2.c_str());
+    cache.SetCapture(NULL);
+    ASSERT(cache.ExpandWithData("capture_main", DO_NOT_STRIP, &dict2, NULL,
+                                &out3));
+    ASSERT(capture->num_captured() == 2);
+    ASSERT(capture->ok());
+    delete capture;
+
+    // Each captured expansion replays, with its dictionary, to the
+    // same output, even in a cache that's never seen the dictionaries.
+    TemplateCache replay_cache;
+    ASSERT(replay_cache.StringToTemplateCache(
+        "capture_main", "{{X}}{{#S}}[{{Y}}]{{/S}}{{>INC}}{{CAPTURE_GLOBAL}}",
+        DO_NOT_STRIP));
+    ASSERT(replay_cache.StringToTemplateCache("capture_inc", "<{{Z}}>",
+                                              DO_NOT_STRIP));
+    TemplateCaptureReader* reader = TemplateCaptureReader::Open(filename);
+    ASSERT(reader);
+    const string* outs[] = { &out1, &out2 };
+    for (int i = 0; i < 2; ++i) {
+      CapturedExpand expand;
+      ASSERT(reader->Next(&expand));
+      ASSERT(expand.template_name == "capture_main");
+      ASSERT(expand.strip == DO_NOT_STRIP);
+      ASSERT(expand.expand_succeeded);
+      ASSERT(expand.max_iterations == (i == 0 ? 100 : 0));
+      ASSERT(expand.output_size == outs[i]->size());
+      ASSERT(expand.output_digest ==
+             HashingEmitter::Digest(outs[i]->data(), outs[i]->size()));
+      PerExpandData replay_data;
+      expand.SetUpPerExpandData(&replay_data);
+      ASSERT(replay_data.max_iterations() == expand.max_iterations);
+      string out;
+      ASSERT(replay_cache.ExpandWithData(expand.template_name, expand.strip,
+                                         expand.dictionary(), &replay_data,
+                                         &out));
+      ASSERT_STREQ(outs[i]->c_str(), out.c_str());
+    }
+    CapturedExpand expand;
+    ASSERT(!reader->Next(&expand));
+    ASSERT(reader->error().empty());
+    bool found_global = false;
+    for (size_t i = 0; i < reader->global_values().size(); ++i) {
+      if (reader->global_values()[i].first == "CAPTURE_GLOBAL") {
+        ASSERT(reader->global_values()[i].second == "g");
+        found_global = true;
+      }
+    }
+    ASSERT(found_global);
+    delete reader;
+
+    // A truncated file reads up to the truncation.
+    string contents;
+    FILE* fp = fopen(filename.c_str(), "rb");
+    ASSERT(fp);
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+      contents.append(buf, n);
+    fclose(fp);
+    StringToFile(contents.substr(0, contents.size() - 1), filename);
+    reader = TemplateCaptureReader::Open(filename);
+    ASSERT(reader);
+    ASSERT(reader->Next(&expand));
+    ASSERT(!reader->Next(&expand));
+    ASSERT(!reader->error().empty());
+    delete reader;
+    StringToFile("not a capture", filename);
+    ASSERT(TemplateCaptureReader::Open(filename) == NULL);
+
+    // Sampling at 1/4 records every fourth expansion.
+    capture = TemplateCapture::Create(filename, 0.25);
+    ASSERT(capture);
+    cache.SetCapture(capture);
+    for (int i = 0; i < 10; ++i) {
+      out1.clear();
+      ASSERT(cache.ExpandWithData("capture_main", DO_NOT_STRIP, &dict1,
+                                  NULL, &out1));
+    }
+    cache.SetCapture(NULL);
+    ASSERT(capture->num_captured() == 2);
+    delete capture;
+  }
+
+  static void TestTemplateArchive() {
+#ifdef NO_THREADS
+    const string archive = PathJoin(FLAGS_test_tmpdir,
+                                    "archive_nothreads.template");
+#else
+    const string archive = PathJoin(FLAGS_test_tmpdir, "archive.template");
+#endif
+    // The templates are packed as if from here, which needn't exist.
+    const string root = PathJoin(FLAGS_test_tmpdir, "archived/");
+    std::vector<TemplateArchive::Entry> entries;
+    entries.push_back(TemplateArchive::Entry("sub/b.tpl", "b", 1000));
+    entries.push_back(TemplateArchive::Entry("a.tpl", "a {{X}}", 1000));
+    ASSERT(TemplateArchive::Write(archive, entries, 1));
+    TemplateArchive* source = TemplateArchive::Open(archive, root);
+    ASSERT(source);
+    ASSERT(source->version() == 1);
+    ASSERT(source->num_entries() == 2);
+
+    TemplateCache cache;
+    cache.SetTemplateRootDirectory(root);
+    ASSERT(cache.SetTemplateSource(source));
+    TemplateDictionary dict("dict");
+    dict.SetValue("X", "x");
+    string out;
+    ASSERT(cache.ExpandWithData("a.tpl", DO_NOT_STRIP, &dict, NULL, &out));
+    ASSERT_STREQ("a x", out.c_str());
+    out.clear();
+    ASSERT(cache.ExpandWithData(PathJoin(root, "sub/b.tpl"), DO_NOT_STRIP,
+                                &dict, NULL, &out));
+    ASSERT_STREQ("b", out.c_str());
+    ASSERT(!cache.GetTemplateHandle("c.tpl", DO_NOT_STRIP).valid());
+    ASSERT(!cache.GetTemplateHandle("sub", DO_NOT_STRIP).valid());
+
+    // A new archive is picked up when we ask, and only templates
+    // whose mtime changed are reloaded.
+    const Template* b = cache.GetTemplate("sub/b.tpl", DO_NOT_STRIP);
+    entries[1] = TemplateArchive::Entry("a.tpl", "new a {{X}}", 2000);
+    ASSERT(TemplateArchive::Write(archive, entries, 2));
+    ASSERT(source->ReloadIfChanged());
+    ASSERT(!source->ReloadIfChanged());
+    ASSERT(source->version() == 2);
+    cache.ReloadAllIfChanged(TemplateCache::LAZY_RELOAD);
+    out.clear();
+    ASSERT(cache.ExpandWithData("a.tpl", DO_NOT_STRIP, &dict, NULL, &out));
+    ASSERT_STREQ("new a x", out.c_str());
+    ASSERT(cache.GetTemplate("sub/b.tpl", DO_NOT_STRIP) == b);
+    // So is a replacement of the same size, even one written in the
+    // same second as the archive it replaces.
+    entries[1] = TemplateArchive::Entry("a.tpl", "new A {{X}}", 2000);
+    ASSERT(TemplateArchive::Write(archive, entries, 3));
+    ASSERT(source->ReloadIfChanged());
+    ASSERT(source->version() == 3);
+
+    // A bad archive doesn't replace a good one.
+    StringToFile("not an archive", archive);
+    ASSERT(TemplateArchive::Open(archive, root) == NULL);
+    ASSERT(!source->ReloadIfChanged());
+    ASSERT(source->version() == 3);
+
+    // Back to the filesystem, where there's no a.tpl.
+    ASSERT(cache.SetTemplateSource(NULL));
+    ASSERT(!cache.GetTemplateHandle("a.tpl", DO_NOT_STRIP).valid());
+    cache.Freeze();
+    ASSERT(!cache.SetTemplateSource(source));
+    delete source;
+  }
+
   static void TestDelete() {
     Template::ClearCache();   // just for exercise.
     const string cache_key = "TestRemoveStringFromTemplateCache";
@@ -370,6 +673,25 @@ class TemplateCacheUnittest {
     ASSERT(!tpl);
     tpl = Template::GetTemplate(cache_key, STRIP_BLANK_LINES);
     ASSERT(!tpl);
+
+    // Delete gets every strip variant of the key, and nothing else.
+    TemplateCache cache2;
+    TemplateCachePeer cache_peer2(&cache2);
+    const string other_key = "TestRemoveStringFromTemplateCache other";
+    ASSERT(cache2.StringToTemplateCache(cache_key, text, DO_NOT_STRIP));
+    ASSERT(cache2.StringToTemplateCache(cache_key, text, STRIP_WHITESPACE));
+    ASSERT(cache2.StringToTemplateCache(cache_key, text, STRIP_BLANK_LINES));
+    ASSERT(cache2.StringToTemplateCache(other_key, text, DO_NOT_STRIP));
+    ASSERT(cache2.Delete(cache_key));
+    ASSERT(!cache2.Delete(cache_key));
+    TemplateCachePeer::TemplateCacheKey key1(cache_key, DO_NOT_STRIP);
+    ASSERT(!cache_peer2.TemplateIsCached(key1));
+    TemplateCachePeer::TemplateCacheKey key2(cache_key, STRIP_WHITESPACE);
+    ASSERT(!cache_peer2.TemplateIsCached(key2));
+    TemplateCachePeer::TemplateCacheKey key3(cache_key, STRIP_BLANK_LINES);
+    ASSERT(!cache_peer2.TemplateIsCached(key3));
+    TemplateCachePeer::TemplateCacheKey kept_key(other_key, DO_NOT_STRIP);
+    ASSERT(cache_peer2.TemplateIsCached(kept_key));
   }
 
   static void TestTemplateCache() {
@@ -590,6 +912,84 @@ class TemplateCacheUnittest {
                    true);
   }
 
+  // An auto-escaped html page of about 100k, with variables in text,
+  // attribute, url, script and style contexts.  inserts[i], if there
+  // is one, goes before the i-th block.
+  static string AutoEscapePage(const vector<string>& inserts) {
+    string page = "{{%AUTOESCAPE context=\"HTML\"}}\n<html><body>\n";
+    for (int i = 0; i < 400; ++i) {
+      if (i < static_cast<int>(inserts.size()))
+        page.append(inserts[i]);
+      page.append(
+          "<div title=\"{{TITLE}}\"><a href=\"{{URL}}\">{{NAME}}</a></div>\n"
+          "<script>var x = '{{JS}}'; // {{COMMENT}}\n</script>\n"
+          "<p style=\"color: {{COLOR}}\">Lorem ipsum dolor sit amet, "
+          "consectetur adipiscing elit {{TEXT}}.</p>{{BI_NEWLINE}}\n");
+    }
+    page.append("</body></html>\n");
+    return page;
+  }
+
+  static void TestResumeAutoEscapeOnReload() {
+    TemplateDictionary dict("dict");
+    const char* const kVars[] = {
+      "TITLE", "URL", "NAME", "JS", "COMMENT", "COLOR", "TEXT"
+    };
+    for (size_t i = 0; i < sizeof(kVars) / sizeof(*kVars); ++i)
+      dict.SetValue(kVars[i], "x\"y<z>'&: /\\\n");
+
+    vector<string> inserts(400);
+    const string filename = StringToTemplateFile(AutoEscapePage(inserts));
+    TemplateCache cache;
+    ASSERT(cache.GetTemplate(filename, STRIP_WHITESPACE));
+    int num_resumed = TemplateCachePeer::NumResumedBuilds();
+
+    // Each edit is added to the ones before it.  After every reload the
+    // template has to expand just like the same file loaded into a
+    // fresh cache.  Edits past the first checkpoint, 16k in, let the
+    // reload resume from one.
+    const struct {
+      int block;
+      const char* text;
+      bool resumes;
+    } kEdits[] = {
+      { 350, "<b>some more text</b>\n", true },
+      { 200, "<style>", true },              // css from here on
+      { 250, "<a href=\"", true },           // the next '"' closes it
+      { 380, "<textarea>", true },
+      { 0, "<i>", false },
+      { 399, "<script>var y = ", true },     // js until the next </script>
+      { 100, "", true },                     // no change, but reloaded
+    };
+    for (size_t e = 0; e < sizeof(kEdits) / sizeof(*kEdits); ++e) {
+      inserts[kEdits[e].block].append(kEdits[e].text);
+      StringToFile(AutoEscapePage(inserts), filename);
+      cache.ReloadAllIfChanged(TemplateCache::IMMEDIATE_RELOAD);
+      if (kEdits[e].resumes)
+        ++num_resumed;
+      ASSERT(TemplateCachePeer::NumResumedBuilds() == num_resumed);
+
+      string out, expected;
+      ASSERT(cache.ExpandWithData(filename, STRIP_WHITESPACE, &dict, NULL,
+                                  &out));
+      TemplateCache fresh;
+      ASSERT(fresh.ExpandWithData(filename, STRIP_WHITESPACE, &dict, NULL,
+                                  &expected));
+      ASSERT(out == expected);
+      ASSERT(TemplateCachePeer::NumResumedBuilds() == num_resumed);
+    }
+
+    // An edit that breaks the template leaves nothing to resume from.
+    StringToFile(AutoEscapePage(inserts) + "{{#UNCLOSED}}", filename);
+    cache.ReloadAllIfChanged(TemplateCache::IMMEDIATE_RELOAD);
+    ++num_resumed;
+    ASSERT(!cache.GetTemplate(filename, STRIP_WHITESPACE));
+    StringToFile(AutoEscapePage(inserts), filename);
+    cache.ReloadAllIfChanged(TemplateCache::IMMEDIATE_RELOAD);
+    ASSERT(cache.GetTemplate(filename, STRIP_WHITESPACE));
+    ASSERT(TemplateCachePeer::NumResumedBuilds() == num_resumed);
+  }
+
   static void TestRefcounting() {
     TemplateCache cache1;
     TemplateCachePeer cache_peer(&cache1);
@@ -617,11 +1017,13 @@ class TemplateCacheUnittest {
     TemplateCache* cache2 = cache1.Clone();
     TemplateCachePeer cache_peer2(cache2);
 
-    // Check refcount was incremented.  It should be the same for both caches.
-    ASSERT(cache_peer.Refcount(cache_key1) == 3);
-    ASSERT(cache_peer2.Refcount(cache_key1) == 3);
-    ASSERT(cache_peer.Refcount(cache_key2) == 3);
-    ASSERT(cache_peer2.Refcount(cache_key2) == 3);
+    // Check refcount.  It should be the same for both caches, and
+    // unchanged: the two caches share one copy of the entry (and its
+    // reference) until one of them changes it.
+    ASSERT(cache_peer.Refcount(cache_key1) == 2);
+    ASSERT(cache_peer2.Refcount(cache_key1) == 2);
+    ASSERT(cache_peer.Refcount(cache_key2) == 2);
+    ASSERT(cache_peer2.Refcount(cache_key2) == 2);
 
     // Check that the template ptrs in both caches are the same.
     const Template* cache2_tpl1 = cache2->GetTemplate(filename1,
@@ -632,10 +1034,10 @@ class TemplateCacheUnittest {
     ASSERT(cache2_tpl2 == cache1_tpl2);
 
     // GetTemplate should have augmented the refcount.
-    ASSERT(cache_peer.Refcount(cache_key1) == 4);
-    ASSERT(cache_peer2.Refcount(cache_key1) == 4);
-    ASSERT(cache_peer.Refcount(cache_key2) == 4);
-    ASSERT(cache_peer2.Refcount(cache_key2) == 4);
+    ASSERT(cache_peer.Refcount(cache_key1) == 3);
+    ASSERT(cache_peer2.Refcount(cache_key1) == 3);
+    ASSERT(cache_peer.Refcount(cache_key2) == 3);
+    ASSERT(cache_peer2.Refcount(cache_key2) == 3);
 
     // Change tpl1 file contents and reload.
     StringToFile("{file1 contents changed}", filename1);
@@ -656,8 +1058,10 @@ class TemplateCacheUnittest {
     ASSERT(cache2_tpl2_post_reload == cache2_tpl2);
 
     // Now key1 points to different templates in cache1 and cache2.
-    // cache1's version should have a refcount of 3 (was 4, went down
-    // by 1 when cache2 dropped its reference to it).  cache2's
+    // cache1's version should have a refcount of 3 (ReloadAllIfChanged
+    // gave cache2 its own copy of the entries, which took it to 4,
+    // and then it went down by 1 when cache2 dropped its reference
+    // to it).  cache2's
     // version should be 2 (one for the new file, 1 for the call to
     // GetTemplate() that followed it), while key2 should have a
     // refcount of 5 in both caches (due to the new call, above, to
@@ -770,8 +1174,8 @@ class TemplateCacheUnittest {
     {
       TemplateCache* cache2 = cache1.Clone();
       TemplateCachePeer cache_peer2(cache2);
-      ASSERT(cache_peer1.Refcount(cache_key) == 3);
-      ASSERT(cache_peer2.Refcount(cache_key) == 3);
+      ASSERT(cache_peer1.Refcount(cache_key) == 2);
+      ASSERT(cache_peer2.Refcount(cache_key) == 2);
       // Do all sorts of Delete()s.
       StringToFile("{file1 contents changed}", fname);
       cache1.ReloadAllIfChanged(TemplateCache::IMMEDIATE_RELOAD);
@@ -853,10 +1257,10 @@ class TemplateCacheUnittest {
     {
       TemplateCache* cache2 = cache1.Clone();
       TemplateCachePeer cache_peer2(cache2);
-      ASSERT(cache_peer1.Refcount(cache_key) == 2);
+      ASSERT(cache_peer1.Refcount(cache_key) == 1);
       cache2->GetTemplate(fname, STRIP_WHITESPACE);
-      ASSERT(cache_peer1.Refcount(cache_key) == 3);
-      ASSERT(cache_peer2.Refcount(cache_key) == 3);
+      ASSERT(cache_peer1.Refcount(cache_key) == 2);
+      ASSERT(cache_peer2.Refcount(cache_key) == 2);
       ASSERT(cache1.Delete(fname));
       ASSERT(cache_peer1.NumTotalTemplateDeletes() == old_delete_count);
       ASSERT(cache_peer2.Refcount(cache_key) == 2);
@@ -865,6 +1269,145 @@ class TemplateCacheUnittest {
     ASSERT(cache_peer1.NumTotalTemplateDeletes() == ++old_delete_count);
   }
 
+  static void TestTemplateHandle() {
+    TemplateCache cache;
+    TemplateCachePeer cache_peer(&cache);
+    TemplateDictionary dict("dict");
+    dict.SetValue("WHO", "handle");
+    string filename = StringToTemplateFile("hello {{WHO}}");
+    TemplateCachePeer::TemplateCacheKey cache_key(filename, DO_NOT_STRIP);
+
+    ASSERT(!TemplateHandle().valid());
+    ASSERT(!cache.GetTemplateHandle("no such template", DO_NOT_STRIP).valid());
+
+    TemplateHandle handle = cache.GetTemplateHandle(filename, DO_NOT_STRIP);
+    ASSERT(handle.valid());
+    ASSERT(cache_peer.Refcount(cache_key) == 2);
+    string out;
+    ASSERT(handle.Expand(&out, &dict));
+    ASSERT_STREQ("hello handle", out.c_str());
+
+    // Moving the handle moves the reference.
+    TemplateHandle handle2(std::move(handle));
+    ASSERT(!handle.valid());
+    ASSERT(handle2.valid());
+    ASSERT(cache_peer.Refcount(cache_key) == 2);
+    handle = std::move(handle2);
+    ASSERT(handle.valid());
+    ASSERT(!handle2.valid());
+
+    // The handle keeps the template alive after the cache lets go of it,
+    // and DoneWithGetTemplatePtrs() has nothing to do with it.
+    int delete_count = cache_peer.NumTotalTemplateDeletes();
+    ASSERT(cache.Delete(filename));
+    cache.DoneWithGetTemplatePtrs();
+    ASSERT(cache_peer.NumTotalTemplateDeletes() == delete_count);
+    out.clear();
+    ASSERT(handle.Expand(&out, &dict));
+    ASSERT_STREQ("hello handle", out.c_str());
+    handle.reset();
+    ASSERT(!handle.valid());
+    ASSERT(cache_peer.NumTotalTemplateDeletes() == delete_count + 1);
+    out.clear();
+    ASSERT(!handle.Expand(&out, &dict));
+  }
+
+  static void TestThreadLocalReplicas() {
+    TemplateCache cache;
+    TemplateCachePeer cache_peer(&cache);
+    TemplateDictionary dict("dict");
+    dict.SetValue("WHO", "replica");
+    ASSERT(cache.StringToTemplateCache("replicated", "hi {{WHO}}",
+                                       DO_NOT_STRIP));
+    TemplateCachePeer::TemplateCacheKey cache_key("replicated", DO_NOT_STRIP);
+    cache.SetThreadLocalReplicas(true);
+
+    // Nothing is replicated until the cache is frozen.
+    string out;
+    ASSERT(cache.ExpandWithData("replicated", DO_NOT_STRIP, &dict, NULL,
+                                &out));
+    ASSERT(cache_peer.Refcount(cache_key) == 1);
+
+    // Then the first expand makes our replica, which takes a reference.
+    cache.Freeze();
+    out.clear();
+    ASSERT(cache.ExpandWithData("replicated", DO_NOT_STRIP, &dict, NULL,
+                                &out));
+    ASSERT_STREQ("hi replica", out.c_str());
+    ASSERT(cache_peer.Refcount(cache_key) == 2);
+    out.clear();
+    ASSERT(cache.ExpandNoLoad("replicated", DO_NOT_STRIP, &dict, NULL, &out));
+    ASSERT_STREQ("hi replica", out.c_str());
+    ASSERT(cache_peer.Refcount(cache_key) == 2);
+    ASSERT(!cache.ExpandNoLoad("not replicated", DO_NOT_STRIP, &dict, NULL,
+                               &out));
+    PerExpandData per_expand_data;
+    per_expand_data.SetMaxOutputBytes(1);
+    ASSERT(!cache.ExpandNoLoad("replicated", DO_NOT_STRIP, &dict,
+                               &per_expand_data, &out));
+    ASSERT(cache.NumAbortedExpands(ctemplate::EXPAND_OUTPUT_LIMIT_EXCEEDED)
+           == 1);
+
+    // Clearing the cache retires the replica: we see the new contents.
+    const int delete_count = cache_peer.NumTotalTemplateDeletes();
+    cache.ClearCache();
+    ASSERT(cache.StringToTemplateCache("replicated", "bye {{WHO}}",
+                                       DO_NOT_STRIP));
+    cache.Freeze();
+    out.clear();
+    ASSERT(cache.ExpandNoLoad("replicated", DO_NOT_STRIP, &dict, NULL, &out));
+    ASSERT_STREQ("bye replica", out.c_str());
+    // ... and making the new replica let go of the old template.
+    ASSERT(cache_peer.NumTotalTemplateDeletes() == delete_count + 1);
+  }
+
+#if defined(HAVE_PTHREAD) && !defined(NO_THREADS)
+  static const int kNumReplicaExpands = 500;
+
+  // Expands "replicated" over and over, aborting every third expand.
+  static void* ExpandFromReplicaThread(void* vcache) {
+    TemplateCache* cache = static_cast<TemplateCache*>(vcache);
+    TemplateDictionary dict("dict");
+    dict.SetValue("WHO", "thread");
+    for (int i = 0; i < kNumReplicaExpands; ++i) {
+      string out;
+      PerExpandData per_expand_data;
+      if (i % 3 == 0)
+        per_expand_data.SetMaxOutputBytes(1);
+      const bool expanded = cache->ExpandWithData(
+          "replicated", DO_NOT_STRIP, &dict, &per_expand_data, &out);
+      ASSERT(expanded == (i % 3 != 0));
+      if (expanded)
+        ASSERT_STREQ("hi thread", out.c_str());
+    }
+    return NULL;
+  }
+
+  static void TestThreadLocalReplicasThreaded() {
+    TemplateCache cache;
+    TemplateCachePeer cache_peer(&cache);
+    ASSERT(cache.StringToTemplateCache("replicated", "hi {{WHO}}",
+                                       DO_NOT_STRIP));
+    TemplateCachePeer::TemplateCacheKey cache_key("replicated", DO_NOT_STRIP);
+    cache.SetThreadLocalReplicas(true);
+    cache.Freeze();
+
+    const int kNumThreads = 8;
+    pthread_t thread_ids[kNumThreads];
+    for (int i = 0; i < kNumThreads; ++i) {
+      ASSERT(pthread_create(thread_ids + i, NULL, ExpandFromReplicaThread,
+                            &cache) == 0);
+    }
+    for (int i = 0; i < kNumThreads; ++i)
+      ASSERT(pthread_join(thread_ids[i], NULL) == 0);
+    // Every thread's aborts were counted, and every thread's replica
+    // let go of the template when the thread exited.
+    ASSERT(cache.NumAbortedExpands(ctemplate::EXPAND_OUTPUT_LIMIT_EXCEEDED)
+           == kNumThreads * ((kNumReplicaExpands + 2) / 3));
+    ASSERT(cache_peer.Refcount(cache_key) == 1);
+  }
+#endif  // #if defined(HAVE_PTHREAD) && !defined(NO_THREADS)
+
   static void TestCloneStringTemplates() {
     TemplateCache cache1;
 
@@ -887,6 +1430,61 @@ class TemplateCacheUnittest {
     delete cache2;
   }
 
+  // Clone() shares the cache-map with the clone; make sure changes to
+  // either cache don't show through to the other one.
+  static void TestCloneSharesStructure() {
+    TemplateCache cache1;
+    TemplateCachePeer cache_peer1(&cache1);
+    const int kNumTemplates = 1000;   // enough for several trie levels
+    for (int i = 0; i < kNumTemplates; ++i) {
+      char key[64];
+      snprintf(key, sizeof(key), "shared key %d", i);
+      ASSERT(cache1.StringToTemplateCache(key, key, DO_NOT_STRIP));
+    }
+    TemplateCache* cache2 = cache1.Clone();
+    TemplateCachePeer cache_peer2(cache2);
+    // Nothing is copied yet, so each template has just one reference.
+    TemplateCachePeer::TemplateCacheKey key0("shared key 0", DO_NOT_STRIP);
+    ASSERT(cache_peer1.Refcount(key0) == 1);
+
+    // Delete the even templates from the clone, and add new ones to
+    // the original.
+    for (int i = 0; i < kNumTemplates; i += 2) {
+      char key[64];
+      snprintf(key, sizeof(key), "shared key %d", i);
+      ASSERT(cache2->Delete(key));
+      snprintf(key, sizeof(key), "new key %d", i);
+      ASSERT(cache1.StringToTemplateCache(key, key, DO_NOT_STRIP));
+    }
+    TemplateDictionary empty_dict("dict");
+    for (int i = 0; i < kNumTemplates; ++i) {
+      char key[64];
+      snprintf(key, sizeof(key), "shared key %d", i);
+      TemplateCachePeer::TemplateCacheKey cache_key(key, DO_NOT_STRIP);
+      ASSERT(cache_peer1.TemplateIsCached(cache_key));
+      ASSERT(cache_peer2.TemplateIsCached(cache_key) == (i % 2 == 1));
+      string out;
+      ASSERT(cache1.ExpandWithData(key, DO_NOT_STRIP, &empty_dict, NULL,
+                                   &out));
+      ASSERT_STREQ(key, out.c_str());
+      snprintf(key, sizeof(key), "new key %d", i);
+      TemplateCachePeer::TemplateCacheKey new_key(key, DO_NOT_STRIP);
+      ASSERT(cache_peer1.TemplateIsCached(new_key) == (i % 2 == 0));
+      ASSERT(!cache_peer2.TemplateIsCached(new_key));
+    }
+    // The clone's Delete()s copied the entries for key0; now only
+    // cache1 has it.
+    ASSERT(cache_peer1.Refcount(key0) == 1);
+    ASSERT(cache_peer2.Refcount(key0) == 0);
+
+    delete cache2;
+    // Our templates are still around after the clone goes away.
+    string out;
+    ASSERT(cache1.ExpandWithData("shared key 1", DO_NOT_STRIP, &empty_dict,
+                                 NULL, &out));
+    ASSERT_STREQ("shared key 1", out.c_str());
+  }
+
   static void TestInclude() {
     TemplateCache cache;
     string incname = StringToTemplateFile("include & print file\n");
@@ -1031,6 +1629,660 @@ class TemplateCacheUnittest {
     CreateOrCleanTestDir(pathA);
     CreateOrCleanTestDir(pathB);
   }
+
+  static void TestFinalizeGlobalValues() {
+    TemplateDictionary::SetGlobalValue("FINAL_HOST", "cdn&co");
+    TemplateCache cache;
+    const string key = "TestFinalizeGlobalValues";
+    ASSERT(cache.StringToTemplateCache(
+        key, "<{{FINAL_HOST:h}}>{{BI_SPACE}}{{NAME}}"
+        "{{#SEC}}[{{FINAL_HOST}}]{{/SEC}}", DO_NOT_STRIP));
+    TemplateDictionary dict("dict");
+    dict.SetValue("NAME", "name");
+    dict.ShowSection("SEC");
+    AssertExpandWithCacheIs(&cache, key, DO_NOT_STRIP, &dict, NULL,
+                            "<cdn&amp;co> name[cdn&co]", true);
+
+    cache.FinalizeGlobalValues();
+    AssertExpandWithCacheIs(&cache, key, DO_NOT_STRIP, &dict, NULL,
+                            "<cdn&amp;co> name[cdn&co]", true);
+    // Overriding a final global isn't allowed, but doing it anyway
+    // shows that the value was folded into the template.
+    dict.SetValue("FINAL_HOST", "override");
+    AssertExpandWithCacheIs(&cache, key, DO_NOT_STRIP, &dict, NULL,
+                            "<cdn&amp;co> name[cdn&co]", true);
+
+    // Changing the global re-specializes the template.
+    TemplateDictionary::SetGlobalValue("FINAL_HOST", "cdn2");
+    AssertExpandWithCacheIs(&cache, key, DO_NOT_STRIP, &dict, NULL,
+                            "<cdn2> name[cdn2]", true);
+
+    // Templates loaded later, and clones of the cache, are specialized too.
+    string filename = StringToTemplateFile("{{FINAL_HOST:u}}/{{NAME}}");
+    AssertExpandWithCacheIs(&cache, filename, DO_NOT_STRIP, &dict, NULL,
+                            "cdn2/name", true);
+    // So are reloaded ones, though no global changed since the last
+    // specialization.
+    StringToFile("{{FINAL_HOST:u}}|{{NAME}}", filename);
+    cache.ReloadAllIfChanged(TemplateCache::IMMEDIATE_RELOAD);
+    AssertExpandWithCacheIs(&cache, filename, DO_NOT_STRIP, &dict, NULL,
+                            "cdn2|name", true);
+    TemplateCache* cache2 = cache.Clone();
+    TemplateDictionary::SetGlobalValue("FINAL_HOST", "cdn 3");
+    AssertExpandWithCacheIs(cache2, filename, DO_NOT_STRIP, &dict, NULL,
+                            "cdn+3|name", true);
+    delete cache2;
+  }
+
+  static void TestSkeletonAndHoles() {
+    TemplateCache cache;
+    const string key = "TestSkeletonAndHoles";
+    ASSERT(cache.StringToTemplateCache(
+        key, "<html>{{!comment}}<body>{{NAME:h}}<hr>{{#SEC}}{{NAME}}{{/SEC}}"
+        "</body></html>", DO_NOT_STRIP));
+    TemplateDictionary dict("dict");
+    dict.SetValue("NAME", "a&b");
+    dict.ShowSection("SEC");
+
+    string skeleton;
+    ASSERT(cache.ExpandSkeleton(key, DO_NOT_STRIP, &skeleton));
+    ASSERT(skeleton.find("<html><body>") != string::npos);
+    ASSERT(skeleton.find("</body></html>") != string::npos);
+    string holes;
+    ASSERT(cache.ExpandHoles(key, DO_NOT_STRIP, &dict, NULL, &holes));
+    ASSERT(holes.find("<html>") == string::npos);
+    ASSERT(holes.find("a&amp;b") != string::npos);
+
+    string expected;
+    ASSERT(cache.ExpandWithData(key, DO_NOT_STRIP, &dict, NULL, &expected));
+    string spliced;
+    ASSERT(TemplateCache::SpliceSkeleton(skeleton, holes, &spliced));
+    ASSERT_STREQ(expected.c_str(), spliced.c_str());
+
+    // The skeleton doesn't look inside sections, so a page wrapped in
+    // one is a single hole.
+    const string wrapped_key = "TestSkeletonAndHolesWrapped";
+    ASSERT(cache.StringToTemplateCache(
+        wrapped_key, "<html>{{#SEC}}<body>{{NAME}}</body>{{/SEC}}</html>",
+        DO_NOT_STRIP));
+    string wrapped_skeleton, wrapped_holes;
+    ASSERT(cache.ExpandSkeleton(wrapped_key, DO_NOT_STRIP, &wrapped_skeleton));
+    ASSERT(wrapped_skeleton.find("<html>") != string::npos);
+    ASSERT(wrapped_skeleton.find("<body>") == string::npos);
+    ASSERT(cache.ExpandHoles(wrapped_key, DO_NOT_STRIP, &dict, NULL,
+                             &wrapped_holes));
+    ASSERT(wrapped_holes.find("<body>a&b</body>") != string::npos);
+    spliced.clear();
+    ASSERT(TemplateCache::SpliceSkeleton(wrapped_skeleton, wrapped_holes,
+                                         &spliced));
+    ASSERT_STREQ("<html><body>a&b</body></html>", spliced.c_str());
+
+    // Holes from a different template version don't splice.
+    cache.Delete(key);
+    ASSERT(cache.StringToTemplateCache(key, "<p>{{NAME}}</p>", DO_NOT_STRIP));
+    string new_holes;
+    ASSERT(cache.ExpandHoles(key, DO_NOT_STRIP, &dict, NULL, &new_holes));
+    spliced.clear();
+    ASSERT(!TemplateCache::SpliceSkeleton(skeleton, new_holes, &spliced));
+    ASSERT(spliced.empty());
+    ASSERT(!TemplateCache::SpliceSkeleton(skeleton, "garbage", &spliced));
+    ASSERT(!TemplateCache::SpliceSkeleton(skeleton, holes.substr(0, 20),
+                                          &spliced));
+  }
+
+  // Applies edits, as returned by ExpandIncrementally, to output.
+  static void ApplyEdits(const std::vector<ctemplate::ExpandEdit>& edits,
+                         string* output) {
+    for (std::vector<ctemplate::ExpandEdit>::const_reverse_iterator it =
+             edits.rbegin(); it != edits.rend(); ++it) {
+      output->replace(it->offset, it->delete_len, it->insert);
+    }
+  }
+
+  static void TestExpandIncrementally() {
+    TemplateCache cache;
+    const string key = "TestExpandIncrementally";
+    ASSERT(cache.StringToTemplateCache(
+        key, "<table>{{CPU}}<tr>{{MEM}}</tr>{{#ROW}}<td>{{V}}</td>{{/ROW}}"
+        "</table>", DO_NOT_STRIP));
+    TemplateDictionary dict1("dict1");
+    dict1.SetIntValue("CPU", 5);
+    dict1.SetIntValue("MEM", 100);
+    dict1.AddSectionDictionary("ROW")->SetIntValue("V", 1);
+
+    ctemplate::ExpansionRecord record;
+    std::vector<ctemplate::ExpandEdit> edits;
+    ASSERT(cache.ExpandIncrementally(key, DO_NOT_STRIP, &dict1, NULL,
+                                     &record, &edits));
+    ASSERT(edits.size() == 1);   // the first time, everything is new
+    string output;
+    ApplyEdits(edits, &output);
+    ASSERT_STREQ("<table>5<tr>100</tr><td>1</td></table>", output.c_str());
+
+    // Only the holes that changed produce edits.
+    TemplateDictionary dict2("dict2");
+    dict2.SetIntValue("CPU", 75);
+    dict2.SetIntValue("MEM", 100);
+    dict2.AddSectionDictionary("ROW")->SetIntValue("V", 1);
+    dict2.AddSectionDictionary("ROW")->SetIntValue("V", 2);
+    ASSERT(cache.ExpandIncrementally(key, DO_NOT_STRIP, &dict2, NULL,
+                                     &record, &edits));
+    ASSERT(edits.size() == 2);
+    ASSERT(edits[0].offset == 7 && edits[0].delete_len == 1);
+    ASSERT_STREQ("75", edits[0].insert.c_str());
+    ApplyEdits(edits, &output);
+    ASSERT_STREQ("<table>75<tr>100</tr><td>1</td><td>2</td></table>",
+                 output.c_str());
+    string record_output;
+    record.AppendOutput(&record_output);
+    ASSERT_STREQ(output.c_str(), record_output.c_str());
+
+    ASSERT(cache.ExpandIncrementally(key, DO_NOT_STRIP, &dict2, NULL,
+                                     &record, &edits));
+    ASSERT(edits.empty());
+
+    // Inside a section, only the variables that changed are redone,
+    // row by row, and rows that go away are deleted.
+    const string list_key = "TestExpandIncrementally_list";
+    ASSERT(cache.StringToTemplateCache(
+        list_key, "<ul>{{#ITEM}}<li>{{NAME:h}}</li>"
+        "{{#ITEM_separator}},{{/ITEM_separator}}{{/ITEM}}</ul>",
+        DO_NOT_STRIP));
+    TemplateDictionary list1("list1");
+    for (int i = 0; i < 100; ++i)
+      list1.AddSectionDictionary("ITEM")->SetIntValue("NAME", i);
+    ctemplate::ExpansionRecord list_record;
+    ASSERT(cache.ExpandIncrementally(list_key, DO_NOT_STRIP, &list1, NULL,
+                                     &list_record, &edits));
+    string list_output;
+    ApplyEdits(edits, &list_output);
+
+    TemplateDictionary list2("list2");
+    for (int i = 0; i < 98; ++i) {
+      TemplateDictionary* item = list2.AddSectionDictionary("ITEM");
+      if (i == 50)
+        item->SetValue("NAME", "a&b");
+      else
+        item->SetIntValue("NAME", i);
+    }
+    ASSERT(cache.ExpandIncrementally(list_key, DO_NOT_STRIP, &list2, NULL,
+                                     &list_record, &edits));
+    ASSERT(edits.size() == 2);
+    ASSERT(edits[0].delete_len == 2);           // "50"
+    ASSERT_STREQ("a&amp;b", edits[0].insert.c_str());
+    // The last row's separator, and the two rows after it.
+    ASSERT(edits[1].delete_len == strlen(",<li>98</li>,<li>99</li>"));
+    ASSERT(edits[1].insert.empty());
+    ApplyEdits(edits, &list_output);
+    string expected;
+    ASSERT(cache.ExpandWithData(list_key, DO_NOT_STRIP, &list2, NULL,
+                                &expected));
+    ASSERT_STREQ(expected.c_str(), list_output.c_str());
+    string list_record_output;
+    list_record.AppendOutput(&list_record_output);
+    ASSERT_STREQ(expected.c_str(), list_record_output.c_str());
+
+    // A hidden section deletes all its rows.
+    TemplateDictionary empty("empty");
+    ASSERT(cache.ExpandIncrementally(list_key, DO_NOT_STRIP, &empty, NULL,
+                                     &list_record, &edits));
+    ASSERT(edits.size() == 1);
+    ApplyEdits(edits, &list_output);
+    ASSERT_STREQ("<ul></ul>", list_output.c_str());
+  }
+
+  // Counts the static text it's asked to emit that has a digest.
+  class DigestCountingEmitter : public ctemplate::StringEmitter {
+   public:
+    DigestCountingEmitter(string* outbuf)
+        : StringEmitter(outbuf), count(0) {}
+    virtual void EmitStaticText(const ctemplate::StaticTextSegment& text) {
+      if (text.digest_shift != 0)
+        ++count;
+      Emit(text.text, text.textlen);
+    }
+    int count;
+  };
+
+  static void TestHashingEmitter() {
+    // The standard CRC-64/XZ check value.
+    ASSERT(HashingEmitter::Digest("123456789", 9) == 0x995dc9bbdf1939faULL);
+    ASSERT(HashingEmitter::Digest("", 0) == 0);
+
+    const string a = "first part, ", b = "and the second part";
+    const string ab = a + b;
+    ASSERT(HashingEmitter::Combine(HashingEmitter::Digest(a.data(), a.size()),
+                                   HashingEmitter::Digest(b.data(), b.size()),
+                                   b.size()) ==
+           HashingEmitter::Digest(ab.data(), ab.size()));
+
+    TemplateCache cache;
+    const string key = "TestHashingEmitter";
+    ASSERT(cache.StringToTemplateCache(
+        key, "<html>{{#ROW}}<tr>{{VALUE}}</tr>{{/ROW}}</html>\n",
+        DO_NOT_STRIP));
+    TemplateDictionary dict("dict");
+    for (int i = 0; i < 10; ++i)
+      dict.AddSectionDictionary("ROW")->SetIntValue("VALUE", i);
+
+    // Loading the template doesn't compute digests; the first
+    // HashingEmitter to see the text does.
+    string unhashed;
+    DigestCountingEmitter before(&unhashed);
+    ASSERT(cache.ExpandWithData(key, DO_NOT_STRIP, &dict, NULL, &before));
+    ASSERT(before.count == 0);
+    HashingEmitter first(NULL);
+    ASSERT(cache.ExpandWithData(key, DO_NOT_STRIP, &dict, NULL, &first));
+    DigestCountingEmitter after(&unhashed);
+    ASSERT(cache.ExpandWithData(key, DO_NOT_STRIP, &dict, NULL, &after));
+    ASSERT(after.count > 0);
+
+    // Passing the output through doesn't change it.
+    string output;
+    ctemplate::StringEmitter string_emitter(&output);
+    HashingEmitter hasher(&string_emitter);
+    ASSERT(cache.ExpandWithData(key, DO_NOT_STRIP, &dict, NULL, &hasher));
+    string expected;
+    ASSERT(cache.ExpandWithData(key, DO_NOT_STRIP, &dict, NULL, &expected));
+    ASSERT(output == expected);
+    ASSERT(hasher.size() == expected.size());
+    ASSERT(hasher.digest() ==
+           HashingEmitter::Digest(expected.data(), expected.size()));
+
+    // Nor does not having any output.
+    HashingEmitter hash_only(NULL);
+    ASSERT(cache.ExpandWithData(key, DO_NOT_STRIP, &dict, NULL, &hash_only));
+    ASSERT(hash_only.digest() == hasher.digest());
+
+    dict.SetValue("VALUE", "changed");
+    HashingEmitter changed(NULL);
+    ASSERT(cache.ExpandWithData(key, DO_NOT_STRIP, &dict, NULL, &changed));
+    ASSERT(changed.digest() == hasher.digest());   // the rows override it
+    dict.AddSectionDictionary("ROW");
+    HashingEmitter more_rows(NULL);
+    ASSERT(cache.ExpandWithData(key, DO_NOT_STRIP, &dict, NULL, &more_rows));
+    ASSERT(more_rows.digest() != hasher.digest());
+  }
+
+  static void TestExpansionLimits() {
+    TemplateCache cache;
+    const string key = "TestExpansionLimits";
+    ASSERT(cache.StringToTemplateCache(
+        key, "<ul>{{#ROW}}<li>{{VALUE}}</li>{{/ROW}}</ul>", DO_NOT_STRIP));
+    TemplateDictionary dict("dict");
+    for (int i = 0; i < 1000; ++i)
+      dict.AddSectionDictionary("ROW")->SetIntValue("VALUE", i);
+
+    PerExpandData per_expand_data;
+    per_expand_data.SetMaxIterations(100);
+    string output;
+    ASSERT(!cache.ExpandWithData(key, DO_NOT_STRIP, &dict, &per_expand_data,
+                                 &output));
+    ASSERT(per_expand_data.expand_aborted() ==
+           ctemplate::EXPAND_ITERATION_LIMIT_EXCEEDED);
+    // The main section counts as an iteration too.
+    ASSERT(output.find("<li>98</li>") != string::npos);
+    ASSERT(output.find("<li>99</li>") == string::npos);
+
+    per_expand_data.SetMaxIterations(0);
+    per_expand_data.SetMaxOutputBytes(29);
+    output.clear();
+    ASSERT(!cache.ExpandWithData(key, DO_NOT_STRIP, &dict, &per_expand_data,
+                                 &output));
+    ASSERT(per_expand_data.expand_aborted() ==
+           ctemplate::EXPAND_OUTPUT_LIMIT_EXCEEDED);
+    ASSERT_STREQ("<ul><li>0</li><li>1</li><li>2", output.c_str());
+
+    per_expand_data.SetMaxOutputBytes(0);
+    per_expand_data.SetExpandDeadline(std::chrono::steady_clock::now());
+    output.clear();
+    ASSERT(!cache.ExpandWithData(key, DO_NOT_STRIP, &dict, &per_expand_data,
+                                 &output));
+    ASSERT(per_expand_data.expand_aborted() ==
+           ctemplate::EXPAND_DEADLINE_EXCEEDED);
+    ASSERT(output.empty());
+
+    // Generous limits don't get in the way.
+    per_expand_data.SetExpandDeadline(std::chrono::steady_clock::now() +
+                                      std::chrono::hours(1));
+    per_expand_data.SetMaxIterations(1001);
+    per_expand_data.SetMaxOutputBytes(100000);
+    output.clear();
+    ASSERT(cache.ExpandWithData(key, DO_NOT_STRIP, &dict, &per_expand_data,
+                                &output));
+    ASSERT(per_expand_data.expand_aborted() == ctemplate::EXPAND_NOT_ABORTED);
+    ASSERT(output.find("<li>999</li></ul>") != string::npos);
+
+    // Included templates count against the iteration budget.
+    const string outer_key = "TestExpansionLimitsOuter";
+    ASSERT(cache.StringToTemplateCache(outer_key, "{{>INC}}", DO_NOT_STRIP));
+    TemplateDictionary outer_dict("outer");
+    for (int i = 0; i < 5; ++i)
+      outer_dict.AddIncludeDictionary("INC")->SetFilename(key);
+    per_expand_data.ClearExpandDeadline();
+    per_expand_data.SetMaxIterations(3);
+    output.clear();
+    ASSERT(!cache.ExpandWithData(outer_key, DO_NOT_STRIP, &outer_dict,
+                                 &per_expand_data, &output));
+    ASSERT(per_expand_data.expand_aborted() ==
+           ctemplate::EXPAND_ITERATION_LIMIT_EXCEEDED);
+
+    // The limits, and the count of aborts, cover holes and incremental
+    // expands too.
+    string holes;
+    ASSERT(!cache.ExpandHoles(key, DO_NOT_STRIP, &dict, &per_expand_data,
+                              &holes));
+    ASSERT(per_expand_data.expand_aborted() ==
+           ctemplate::EXPAND_ITERATION_LIMIT_EXCEEDED);
+    ctemplate::ExpansionRecord record;
+    std::vector<ctemplate::ExpandEdit> edits;
+    ASSERT(!cache.ExpandIncrementally(key, DO_NOT_STRIP, &dict,
+                                      &per_expand_data, &record, &edits));
+    ASSERT(per_expand_data.expand_aborted() ==
+           ctemplate::EXPAND_ITERATION_LIMIT_EXCEEDED);
+
+    ASSERT(cache.NumAbortedExpands(ctemplate::EXPAND_ITERATION_LIMIT_EXCEEDED)
+           == 4);
+    ASSERT(cache.NumAbortedExpands(ctemplate::EXPAND_OUTPUT_LIMIT_EXCEEDED)
+           == 1);
+    ASSERT(cache.NumAbortedExpands(ctemplate::EXPAND_DEADLINE_EXCEEDED) == 1);
+    ASSERT(cache.NumAbortedExpands(ctemplate::EXPAND_NOT_ABORTED) == 0);
+  }
+
+  static void TestExpandBatch() {
+    TemplateCache cache;
+    const string key = "TestExpandBatch";
+    ASSERT(cache.StringToTemplateCache(
+        key, "Dear {{NAME}},{{#ITEM}} {{ITEM:h}}{{/ITEM}}.", DO_NOT_STRIP));
+    std::vector<TemplateDictionary*> dicts;
+    std::vector<const ctemplate::TemplateDictionaryInterface*> dict_ptrs;
+    for (int i = 0; i < 500; ++i) {
+      TemplateDictionary* dict = new TemplateDictionary("batch");
+      dict->SetIntValue("NAME", i);
+      for (int j = 0; j < i % 7; ++j)
+        dict->SetValueAndShowSection("ITEM", "<b>", "ITEM");
+      dicts.push_back(dict);
+      dict_ptrs.push_back(dict);
+    }
+
+    std::vector<string> expected(dicts.size());
+    for (size_t i = 0; i < dicts.size(); ++i) {
+      ASSERT(cache.ExpandWithData(key, DO_NOT_STRIP, dicts[i], NULL,
+                                  &expected[i]));
+    }
+    std::vector<string> outputs;
+    ASSERT(cache.ExpandBatch(key, DO_NOT_STRIP, dict_ptrs, &outputs));
+    ASSERT(outputs == expected);
+    // Leftover output from the last batch is replaced, not appended to.
+    ASSERT(cache.ExpandBatch(key, DO_NOT_STRIP, dict_ptrs, &outputs, 4));
+    ASSERT(outputs == expected);
+    // The cache keeps its threads from batch to batch, adding more
+    // when a batch wants them.
+    for (int threads = 2; threads <= 8; threads *= 2) {
+      for (int i = 0; i < 3; ++i) {
+        outputs.clear();
+        ASSERT(cache.ExpandBatch(key, DO_NOT_STRIP, dict_ptrs, &outputs,
+                                 threads));
+        ASSERT(outputs == expected);
+      }
+    }
+
+    std::vector<const ctemplate::TemplateDictionaryInterface*> no_dicts;
+    ASSERT(cache.ExpandBatch(key, DO_NOT_STRIP, no_dicts, &outputs, 4));
+    ASSERT(outputs.empty());
+    ASSERT(!cache.ExpandBatch("no such template", DO_NOT_STRIP, dict_ptrs,
+                              &outputs, 4));
+
+    for (size_t i = 0; i < dicts.size(); ++i)
+      delete dicts[i];
+  }
+
+  static void TestMemoryBudget() {
+    TemplateDictionary dict("dict");
+    dict.SetValue("X", "x");
+    const string file_a = StringToTemplateFile("file a {{X}}");
+    const string file_b = StringToTemplateFile("file b {{X}}");
+    TemplateCache cache;
+    TemplateCachePeer cache_peer(&cache);
+    TemplateCachePeer::TemplateCacheKey key_a(file_a, DO_NOT_STRIP);
+    TemplateCachePeer::TemplateCacheKey key_b(file_b, DO_NOT_STRIP);
+    TemplateCachePeer::TemplateCacheKey key_pinned("pinned", DO_NOT_STRIP);
+    ASSERT(cache.memory_usage() == 0);
+    ASSERT(cache.LoadTemplate(file_a, DO_NOT_STRIP));
+    ASSERT(cache.memory_usage() > strlen("file a {{X}}"));
+    ASSERT(cache.LoadTemplate(file_b, DO_NOT_STRIP));
+    // Without keep_string_sources, this can never be evicted.
+    ASSERT(cache.StringToTemplateCache("pinned", "pinned {{X}}",
+                                       DO_NOT_STRIP));
+    ASSERT(cache.LoadTemplate(file_a, DO_NOT_STRIP));   // b is now oldest
+
+    // Going just under budget evicts the least recently used template.
+    const size_t budget = cache.memory_usage() - 1;
+    cache.SetMemoryBudget(budget);
+    ASSERT(cache.memory_usage() <= budget);
+    ASSERT(cache_peer.TemplateIsCached(key_a));
+    ASSERT(!cache_peer.TemplateIsCached(key_b));
+    ASSERT(cache_peer.TemplateIsCached(key_pinned));
+
+    // b comes back when it's used, and a, now the oldest, makes room.
+    string out;
+    ASSERT(cache.ExpandWithData(file_b, DO_NOT_STRIP, &dict, NULL, &out));
+    ASSERT_STREQ("file b x", out.c_str());
+    ASSERT(cache.memory_usage() <= budget);
+    ASSERT(!cache_peer.TemplateIsCached(key_a));
+    ASSERT(cache_peer.TemplateIsCached(key_b));
+    ASSERT(cache_peer.TemplateIsCached(key_pinned));
+
+    // A frozen cache doesn't evict.
+    cache.Freeze();
+    cache.SetMemoryBudget(1);
+    ASSERT(cache_peer.TemplateIsCached(key_b));
+    ASSERT(cache.memory_usage() > 1);
+    cache.ClearCache();
+    ASSERT(cache.memory_usage() == 0);
+
+    // With keep_string_sources, string templates are evicted and
+    // parsed again from their kept text.
+    TemplateCache string_cache;
+    TemplateCachePeer string_cache_peer(&string_cache);
+    TemplateCachePeer::TemplateCacheKey key_s1("s1", DO_NOT_STRIP);
+    string_cache.SetMemoryBudget(1, true);
+    ASSERT(string_cache.StringToTemplateCache("s1", "one {{X}}",
+                                              DO_NOT_STRIP));
+    ASSERT(string_cache.StringToTemplateCache("s2", "two {{X}}",
+                                              DO_NOT_STRIP));
+    ASSERT(!string_cache_peer.TemplateIsCached(key_s1));
+    // s1 is still in the cache, as far as StringToTemplateCache goes.
+    ASSERT(!string_cache.StringToTemplateCache("s1", "uno {{X}}",
+                                               DO_NOT_STRIP));
+    out.clear();
+    ASSERT(string_cache.ExpandWithData("s1", DO_NOT_STRIP, &dict, NULL, &out));
+    ASSERT_STREQ("one x", out.c_str());
+    ASSERT(string_cache_peer.TemplateIsCached(key_s1));
+    // Deleting an evicted template deletes its text.
+    ASSERT(string_cache.Delete("s2"));
+    ASSERT(string_cache.StringToTemplateCache("s2", "dos {{X}}",
+                                              DO_NOT_STRIP));
+    out.clear();
+    ASSERT(string_cache.ExpandWithData("s2", DO_NOT_STRIP, &dict, NULL, &out));
+    ASSERT_STREQ("dos x", out.c_str());
+
+    // Specializing templates on global values makes them bigger, and
+    // the cache is charged for that.
+    TemplateDictionary::SetGlobalValue("BUDGET_GLOBAL", "global");
+    TemplateCache global_cache;
+    ASSERT(global_cache.StringToTemplateCache("g", "g {{BUDGET_GLOBAL}}",
+                                              DO_NOT_STRIP));
+    const size_t unspecialized_usage = global_cache.memory_usage();
+    global_cache.FinalizeGlobalValues();
+    const size_t specialized_usage = global_cache.memory_usage();
+    ASSERT(specialized_usage > unspecialized_usage);
+    global_cache.Delete("g");
+    ASSERT(global_cache.memory_usage() == 0);
+  }
+
+  static void TestShareText() {
+    const string head(200, 'h');
+    const string tail(300, 't');
+    TemplateDictionary dict("dict");
+    dict.SetValue("X", "x");
+    TemplateCache cache;
+    ASSERT(cache.StringToTemplateCache(
+        "arm a", head + "{{X}} a {{X}}" + tail, DO_NOT_STRIP));
+    const size_t usage_a = cache.memory_usage();
+    ASSERT(cache.StringToTemplateCache(
+        "arm b", head + "{{X}} b {{X}}" + tail, DO_NOT_STRIP));
+    // b counts only its share of the text it has in common with a.
+    const size_t usage_b = cache.memory_usage() - usage_a;
+    ASSERT(usage_b + (head.size() + tail.size()) / 3 < usage_a);
+
+    string out;
+    ASSERT(cache.ExpandWithData("arm b", DO_NOT_STRIP, &dict, NULL, &out));
+    ASSERT(out == head + "x b x" + tail);
+    // b's text outlives a.
+    ASSERT(cache.Delete("arm a"));
+    out.clear();
+    ASSERT(cache.ExpandWithData("arm b", DO_NOT_STRIP, &dict, NULL, &out));
+    ASSERT(out == head + "x b x" + tail);
+    // So does the specialized copy of b's tree.
+    cache.FinalizeGlobalValues();
+    out.clear();
+    ASSERT(cache.ExpandWithData("arm b", DO_NOT_STRIP, &dict, NULL, &out));
+    ASSERT(out == head + "x b x" + tail);
+
+    // The same file loaded with different Strip modes.
+    const string filename = StringToTemplateFile(
+        head + "\n\n   {{X}}   \n" + tail + "\n");
+    out.clear();
+    ASSERT(cache.ExpandWithData(filename, DO_NOT_STRIP, &dict, NULL, &out));
+    ASSERT(out == head + "\n\n   x   \n" + tail + "\n");
+    out.clear();
+    ASSERT(cache.ExpandWithData(filename, STRIP_BLANK_LINES, &dict, NULL,
+                                &out));
+    ASSERT(out == head + "\n   x   \n" + tail + "\n");
+    out.clear();
+    ASSERT(cache.ExpandWithData(filename, STRIP_WHITESPACE, &dict, NULL,
+                                &out));
+    ASSERT(out == head + "x" + tail);
+  }
+
+#ifdef HAVE_ZLIB
+  // Decompresses a gzip stream.
+  static string Gunzip(const string& compressed) {
+    z_stream zstream;
+    memset(&zstream, 0, sizeof(zstream));
+    ASSERT(inflateInit2(&zstream, 16 + MAX_WBITS) == Z_OK);
+    zstream.next_in = (Bytef*)compressed.data();
+    zstream.avail_in = compressed.size();
+    string output;
+    int err;
+    do {
+      char buf[4096];
+      zstream.next_out = (Bytef*)buf;
+      zstream.avail_out = sizeof(buf);
+      err = inflate(&zstream, Z_NO_FLUSH);
+      ASSERT(err == Z_OK || err == Z_STREAM_END);
+      output.append(buf, sizeof(buf) - zstream.avail_out);
+    } while (err != Z_STREAM_END);
+    ASSERT(zstream.avail_in == 0);
+    inflateEnd(&zstream);
+    return output;
+  }
+
+  // Counts the precompressed text it's asked to emit.
+  class PrecompressedCountingEmitter : public ctemplate::StringEmitter {
+   public:
+    PrecompressedCountingEmitter(string* outbuf)
+        : StringEmitter(outbuf), count(0) {}
+    virtual void EmitStaticText(const ctemplate::StaticTextSegment& text) {
+      if (!text.precompressed.empty())
+        ++count;
+      Emit(text.text, text.textlen);
+    }
+    int count;
+  };
+
+  static void TestDeflateEmitter() {
+    string text;
+    for (int i = 0; i < 5000; ++i)
+      text += "line " + string(1, 'a' + i % 26) + "\n";
+
+    string compressed;
+    ctemplate::DeflateEmitter emitter(&compressed);
+    emitter.Emit('x');
+    emitter.Emit(text);
+    emitter.Emit("y");
+    emitter.Finish();
+    ASSERT(compressed.size() < text.size() / 4);
+    ASSERT(Gunzip(compressed) == "x" + text + "y");
+
+    // Precompressed text can go anywhere in the stream, even next to
+    // more precompressed text.
+    ctemplate::StaticTextSegment segment;
+    segment.text = text.data();
+    segment.textlen = text.size();
+    ASSERT(ctemplate::DeflateEmitter::Precompress(text.data(), text.size(),
+                                                  &segment.precompressed));
+    compressed.clear();
+    ctemplate::DeflateEmitter splicer(&compressed);
+    splicer.EmitStaticText(segment);
+    splicer.Emit("middle");
+    splicer.EmitStaticText(segment);
+    splicer.EmitStaticText(segment);
+    splicer.Finish();
+    ASSERT(Gunzip(compressed) == text + "middle" + text + text);
+
+    // Text that doesn't compress isn't precompressed.
+    string precompressed;
+    ASSERT(!ctemplate::DeflateEmitter::Precompress("abc", 3, &precompressed));
+
+    // An empty stream is still a valid gzip file.
+    compressed.clear();
+    ctemplate::DeflateEmitter empty(&compressed);
+    empty.Finish();
+    ASSERT(Gunzip(compressed).empty());
+  }
+
+  static void TestPrecompressStaticText() {
+    string text;
+    for (int i = 0; i < 50; ++i)
+      text += "<li>static list item</li>\n";
+    const string tpl_text = (text + "{{NAME}}" + text +
+                             "{{#SEC}}" + text + "{{/SEC}}<b>short</b>");
+
+    TemplateCache cache;
+    cache.SetPrecompressThreshold(256);
+    const string key = "TestPrecompressStaticText";
+    ASSERT(cache.StringToTemplateCache(key, tpl_text, DO_NOT_STRIP));
+    TemplateDictionary dict("dict");
+    dict.SetValue("NAME", "world");
+    dict.ShowSection("SEC");
+    const string expected = (text + "world" + text + text + "<b>short</b>");
+
+    // Only the three long runs were precompressed.
+    string output;
+    PrecompressedCountingEmitter counter(&output);
+    ASSERT(cache.ExpandWithData(key, DO_NOT_STRIP, &dict, NULL, &counter));
+    ASSERT(counter.count == 3);
+    ASSERT(output == expected);
+
+    string compressed;
+    ctemplate::DeflateEmitter emitter(&compressed);
+    ASSERT(cache.ExpandWithData(key, DO_NOT_STRIP, &dict, NULL, &emitter));
+    emitter.Finish();
+    ASSERT(Gunzip(compressed) == expected);
+
+    // Templates loaded without a threshold aren't precompressed.
+    TemplateCache plain_cache;
+    ASSERT(plain_cache.StringToTemplateCache(key, tpl_text, DO_NOT_STRIP));
+    output.clear();
+    PrecompressedCountingEmitter plain_counter(&output);
+    ASSERT(plain_cache.ExpandWithData(key, DO_NOT_STRIP, &dict, NULL,
+                                      &plain_counter));
+    ASSERT(plain_counter.count == 0);
+    ASSERT(output == expected);
+  }
+#endif  // HAVE_ZLIB
 };
 
 
@@ -1044,20 +2296,42 @@ int main(int argc, char** argv) {
   TemplateCacheUnittest::TestStringToTemplateCacheWithStrip();
   TemplateCacheUnittest::TestExpandNoLoad();
   TemplateCacheUnittest::TestTemplateSearchPath();
+  TemplateCacheUnittest::TestResolutionCache();
+  TemplateCacheUnittest::TestTemplateArchive();
+  TemplateCacheUnittest::TestCapture();
   TemplateCacheUnittest::TestDelete();
   TemplateCacheUnittest::TestTemplateCache();
   TemplateCacheUnittest::TestReloadAllIfChangedLazyLoad();
   TemplateCacheUnittest::TestReloadAllIfChangedImmediateLoad();
   TemplateCacheUnittest::TestReloadImmediateWithDifferentSearchPaths();
   TemplateCacheUnittest::TestReloadLazyWithDifferentSearchPaths();
+  TemplateCacheUnittest::TestResumeAutoEscapeOnReload();
   TemplateCacheUnittest::TestRefcounting();
   TemplateCacheUnittest::TestDoneWithGetTemplatePtrs();
+  TemplateCacheUnittest::TestTemplateHandle();
+  TemplateCacheUnittest::TestThreadLocalReplicas();
+#if defined(HAVE_PTHREAD) && !defined(NO_THREADS)
+  TemplateCacheUnittest::TestThreadLocalReplicasThreaded();
+#endif
   TemplateCacheUnittest::TestCloneStringTemplates();
+  TemplateCacheUnittest::TestCloneSharesStructure();
   TemplateCacheUnittest::TestInclude();
   TemplateCacheUnittest::TestRecursiveInclude();
   TemplateCacheUnittest::TestStringTemplateInclude();
   TemplateCacheUnittest::TestTemplateString();
   TemplateCacheUnittest::TestFreeze();
+  TemplateCacheUnittest::TestFinalizeGlobalValues();
+  TemplateCacheUnittest::TestSkeletonAndHoles();
+  TemplateCacheUnittest::TestExpandIncrementally();
+  TemplateCacheUnittest::TestHashingEmitter();
+  TemplateCacheUnittest::TestExpansionLimits();
+  TemplateCacheUnittest::TestExpandBatch();
+  TemplateCacheUnittest::TestMemoryBudget();
+  TemplateCacheUnittest::TestShareText();
+#ifdef HAVE_ZLIB
+  TemplateCacheUnittest::TestDeflateEmitter();
+  TemplateCacheUnittest::TestPrecompressStaticText();
+#endif
 
   printf("DONE\n");
   return 0;
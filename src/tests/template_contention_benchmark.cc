@@ -0,0 +1,346 @@
+// Copyright (c) 2026, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+//
+// Measures how rendering scales with threads: N threads expand
+// templates from one shared TemplateCache while, optionally,
+// background threads do the things that take the cache's and the
+// dictionary's locks for writing.
+//
+//    template_contention_benchmark [--threads=1,2,4,...] [--seconds=<s>]
+//        [--background=none,reload,globals,strings,all]
+//        [--background_interval_us=<us>]
+//
+// Every combination of thread count, background load and frozen or
+// unfrozen cache is run for --seconds (default 1).  By default the
+// thread counts double from 1 up to the number of cores, and the
+// background loads are "none" and "all".  Each background thread
+// sleeps --background_interval_us (default 1000) between operations:
+//    reload   TemplateCache::ReloadAllIfChanged(LAZY_RELOAD)
+//    globals  TemplateDictionary::SetGlobalValue()
+//    strings  TemplateCache::Delete() and StringToTemplateCache()
+// Results go to stdout as JSON: throughput, expand latency
+// percentiles, and how long threads waited for each of the library's
+// main mutexes.  The library is built with MUTEX_WAIT_STATS for this
+// (see base/mutex.h), so the absolute numbers are a little worse than
+// a normal build's.
+
+#include "config_for_unittests.h"
+#include "base/mutex.h"  // This must go first so we get _XOPEN_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>      // for sysconf(), usleep()
+#include <algorithm>     // for sort()
+#include <atomic>
+#include <chrono>        // for steady_clock
+#include <string>
+#include <vector>
+#include <ctemplate/template_cache.h>
+#include <ctemplate/template_dictionary.h>
+#include <ctemplate/template_enums.h>    // for DO_NOT_STRIP
+#include "base/util.h"                   // for CHECK()
+
+using std::string;
+using std::vector;
+using ctemplate::DO_NOT_STRIP;
+using ctemplate::TemplateCache;
+using ctemplate::TemplateDictionary;
+using ctemplate::base::MutexWaitStats;
+
+static const int kNumTemplates = 50;
+
+static uint64_t NowNanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Fills cache with kNumTemplates pages, each including a header and a
+// footer, plus those two.
+static void LoadTemplates(TemplateCache* cache) {
+  CHECK(cache->StringToTemplateCache(
+      "header", "<head><title>{{TITLE:h}}</title></head>\n", DO_NOT_STRIP));
+  CHECK(cache->StringToTemplateCache(
+      "footer", "<p>{{GLOBAL}} &copy; {{YEAR}}</p>\n", DO_NOT_STRIP));
+  for (int i = 0; i < kNumTemplates; ++i) {
+    char key[32], text[512];
+    snprintf(key, sizeof(key), "page%d", i);
+    snprintf(text, sizeof(text),
+             "<html>{{>HEADER}}<body>\n<h1>Page %d: {{TITLE:h}}</h1>\n"
+             "<ul>{{#ROW}}<li><a href=\"{{URL:h}}\">{{NAME:h}}</a>"
+             "</li>{{/ROW}}</ul>\n{{>FOOTER}}</body></html>\n", i);
+    CHECK(cache->StringToTemplateCache(key, text, DO_NOT_STRIP));
+  }
+}
+
+static void FillDictionary(TemplateDictionary* dict) {
+  dict->SetValue("TITLE", "Contention & scaling");
+  dict->SetIntValue("YEAR", 2026);
+  dict->AddIncludeDictionary("HEADER")->SetFilename("header");
+  dict->AddIncludeDictionary("FOOTER")->SetFilename("footer");
+  for (int i = 0; i < 10; ++i) {
+    TemplateDictionary* row = dict->AddSectionDictionary("ROW");
+    row->SetValue("URL", "http://www.example.com/?a=b&c=d");
+    row->SetFormattedValue("NAME", "item <%d>", i);
+  }
+}
+
+// ----------------------------------------------------------------------
+// Threads
+// ----------------------------------------------------------------------
+
+struct Shared {
+  TemplateCache* cache;
+  std::atomic<bool> start;
+  std::atomic<bool> stop;
+  int background_interval_us;
+};
+
+struct RenderThread {
+  Shared* shared;
+  pthread_t thread;
+  vector<uint32_t> latencies_ns;
+  uint64_t ops;
+};
+
+static void* RenderLoop(void* arg) {
+  RenderThread* me = static_cast<RenderThread*>(arg);
+  TemplateDictionary dict("render");
+  FillDictionary(&dict);
+  vector<string> keys;
+  for (int i = 0; i < kNumTemplates; ++i) {
+    char key[32];
+    snprintf(key, sizeof(key), "page%d", i);
+    keys.push_back(key);
+  }
+  string out;
+  while (!me->shared->start)
+    ;   // spin, so all the threads start together
+  for (uint64_t i = 0; !me->shared->stop; ++i) {
+    out.clear();
+    const uint64_t start = NowNanos();
+    CHECK(me->shared->cache->ExpandWithData(keys[i % kNumTemplates],
+                                            DO_NOT_STRIP, &dict, NULL, &out));
+    const uint64_t elapsed = NowNanos() - start;
+    me->latencies_ns.push_back(elapsed > 0xffffffff ? 0xffffffff
+                               : static_cast<uint32_t>(elapsed));
+  }
+  me->ops = me->latencies_ns.size();
+  return NULL;
+}
+
+static void* ReloadLoop(void* arg) {
+  Shared* shared = static_cast<Shared*>(arg);
+  while (!shared->stop) {
+    shared->cache->ReloadAllIfChanged(TemplateCache::LAZY_RELOAD);
+    usleep(shared->background_interval_us);
+  }
+  return NULL;
+}
+
+static void* GlobalsLoop(void* arg) {
+  Shared* shared = static_cast<Shared*>(arg);
+  for (int i = 0; !shared->stop; ++i) {
+    TemplateDictionary::SetGlobalValue("GLOBAL", i % 2 ? "odd" : "even");
+    usleep(shared->background_interval_us);
+  }
+  return NULL;
+}
+
+static void* StringsLoop(void* arg) {
+  Shared* shared = static_cast<Shared*>(arg);
+  for (int i = 0; !shared->stop; ++i) {
+    char key[32];
+    snprintf(key, sizeof(key), "background%d", i % 10);
+    // Both fail, harmlessly, on a frozen cache.
+    shared->cache->Delete(key);
+    shared->cache->StringToTemplateCache(key, "{{X}}", DO_NOT_STRIP);
+    usleep(shared->background_interval_us);
+  }
+  return NULL;
+}
+
+// ----------------------------------------------------------------------
+// Running and reporting
+// ----------------------------------------------------------------------
+
+static bool g_first_result = true;
+
+static double Percentile(const vector<uint32_t>& sorted, double p) {
+  if (sorted.empty())
+    return 0;
+  size_t i = static_cast<size_t>(p * sorted.size());
+  if (i >= sorted.size())
+    i = sorted.size() - 1;
+  return sorted[i] / 1e3;   // in microseconds
+}
+
+static void RunOne(TemplateCache* cache, bool frozen, int num_threads,
+                   const string& background, double seconds,
+                   int background_interval_us) {
+  Shared shared;
+  shared.cache = cache;
+  shared.start = false;
+  shared.stop = false;
+  shared.background_interval_us = background_interval_us;
+
+  vector<RenderThread> renderers(num_threads);
+  for (int i = 0; i < num_threads; ++i) {
+    renderers[i].shared = &shared;
+    renderers[i].latencies_ns.reserve(1 << 20);
+    CHECK(pthread_create(&renderers[i].thread, NULL, RenderLoop,
+                         &renderers[i]) == 0);
+  }
+  vector<pthread_t> background_threads;
+  void* (*const kLoops[])(void*) = { ReloadLoop, GlobalsLoop, StringsLoop };
+  const char* const kLoopNames[] = { "reload", "globals", "strings" };
+  for (int i = 0; i < 3; ++i) {
+    if (background == "all" || background == kLoopNames[i]) {
+      pthread_t thread;
+      CHECK(pthread_create(&thread, NULL, kLoops[i], &shared) == 0);
+      background_threads.push_back(thread);
+    }
+  }
+
+  for (MutexWaitStats* s = *MutexWaitStats::list(); s; s = s->next)
+    s->Reset();
+  const uint64_t start = NowNanos();
+  shared.start = true;
+  usleep(static_cast<useconds_t>(seconds * 1e6));
+  shared.stop = true;
+  for (int i = 0; i < num_threads; ++i)
+    CHECK(pthread_join(renderers[i].thread, NULL) == 0);
+  const double elapsed = (NowNanos() - start) / 1e9;
+  for (size_t i = 0; i < background_threads.size(); ++i)
+    CHECK(pthread_join(background_threads[i], NULL) == 0);
+
+  vector<uint32_t> latencies;
+  uint64_t ops = 0;
+  for (int i = 0; i < num_threads; ++i) {
+    ops += renderers[i].ops;
+    latencies.insert(latencies.end(), renderers[i].latencies_ns.begin(),
+                     renderers[i].latencies_ns.end());
+  }
+  std::sort(latencies.begin(), latencies.end());
+
+  printf("%s\n    { \"threads\": %d, \"frozen\": %s, \"background\": \"%s\",\n"
+         "      \"seconds\": %.3f, \"expands\": %llu, "
+         "\"expands_per_second\": %.1f,\n"
+         "      \"latency_us\": { \"p50\": %.2f, \"p90\": %.2f, "
+         "\"p99\": %.2f, \"p999\": %.2f, \"max\": %.2f },\n"
+         "      \"mutex_waits\": [",
+         g_first_result ? "" : ",", num_threads, frozen ? "true" : "false",
+         background.c_str(), elapsed, static_cast<unsigned long long>(ops),
+         ops / elapsed, Percentile(latencies, 0.5),
+         Percentile(latencies, 0.9), Percentile(latencies, 0.99),
+         Percentile(latencies, 0.999), Percentile(latencies, 1.0));
+  g_first_result = false;
+  // Waiting time is also given as a share of the render threads' time.
+  bool first = true;
+  for (MutexWaitStats* s = *MutexWaitStats::list(); s; s = s->next) {
+    printf("%s\n        { \"mutex\": \"%s\", \"acquisitions\": %llu, "
+           "\"contended\": %llu, \"wait_ms\": %.3f, "
+           "\"wait_fraction\": %.4f }",
+           first ? "" : ",", s->name,
+           static_cast<unsigned long long>(s->acquisitions.load()),
+           static_cast<unsigned long long>(s->contended.load()),
+           s->wait_ns / 1e6, s->wait_ns / (elapsed * 1e9 * num_threads));
+    first = false;
+  }
+  printf(" ] }");
+  fflush(stdout);
+}
+
+// Splits a comma-separated list.
+static vector<string> Split(const string& s) {
+  vector<string> parts;
+  string::size_type begin = 0;
+  while (begin <= s.size()) {
+    string::size_type end = s.find(',', begin);
+    if (end == string::npos)
+      end = s.size();
+    if (end > begin)
+      parts.push_back(s.substr(begin, end - begin));
+    begin = end + 1;
+  }
+  return parts;
+}
+
+int main(int argc, char** argv) {
+  vector<int> thread_counts;
+  vector<string> backgrounds;
+  backgrounds.push_back("none");
+  backgrounds.push_back("all");
+  double seconds = 1.0;
+  int background_interval_us = 1000;
+  for (int i = 1; i < argc; ++i) {
+    if (strncmp(argv[i], "--threads=", 10) == 0) {
+      const vector<string> counts = Split(argv[i] + 10);
+      for (size_t j = 0; j < counts.size(); ++j)
+        thread_counts.push_back(atoi(counts[j].c_str()));
+    } else if (strncmp(argv[i], "--seconds=", 10) == 0) {
+      seconds = atof(argv[i] + 10);
+    } else if (strncmp(argv[i], "--background=", 13) == 0) {
+      backgrounds = Split(argv[i] + 13);
+    } else if (strncmp(argv[i], "--background_interval_us=", 25) == 0) {
+      background_interval_us = atoi(argv[i] + 25);
+    } else {
+      fprintf(stderr, "USAGE: %s [--threads=1,2,4,...] [--seconds=<s>]\n"
+              "    [--background=none,reload,globals,strings,all]\n"
+              "    [--background_interval_us=<us>]\n", argv[0]);
+      return 1;
+    }
+  }
+  const int num_cores = static_cast<int>(sysconf(_SC_NPROCESSORS_ONLN));
+  if (thread_counts.empty()) {
+    for (int n = 1; n < num_cores; n *= 2)
+      thread_counts.push_back(n);
+    thread_counts.push_back(num_cores > 0 ? num_cores : 1);
+  }
+
+  printf("{\n  \"context\": { \"package\": \"%s\", \"cores\": %d },\n"
+         "  \"results\": [", PACKAGE_STRING, num_cores);
+  TemplateCache cache;
+  LoadTemplates(&cache);
+  TemplateCache* frozen = cache.Clone();
+  frozen->Freeze();
+  for (size_t b = 0; b < backgrounds.size(); ++b) {
+    for (size_t t = 0; t < thread_counts.size(); ++t) {
+      RunOne(&cache, false, thread_counts[t], backgrounds[b], seconds,
+             background_interval_us);
+      RunOne(frozen, true, thread_counts[t], backgrounds[b], seconds,
+             background_interval_us);
+    }
+  }
+  printf("\n  ]\n}\n");
+  delete frozen;
+  return 0;
+}
@@ -40,6 +40,29 @@
 //    template_unittest_testXX.in
 //    template_unittest_testXX_dictYY.out
 // YY should start with 01 (not 00).  XX can be an arbitrary string.
+//
+// The same corpus doubles as a performance regression gate:
+//    template_regtest --perf_record=<file> [perf options]
+//    template_regtest --perf_compare=<file> [perf options]
+// records, or compares against, the per-template parse and expand
+// times, allocation counts and output sizes.  The perf options are
+//    --single_core            pin to one cpu and use fixed iteration
+//                             counts, for numbers that are stable
+//                             from run to run
+//    --iterations=<n>         ops per sample (default: calibrated to
+//                             about 5ms per sample, or 1000 with
+//                             --single_core)
+//    --repetitions=<n>        passes over the corpus; for each op we
+//                             keep the fastest, since noise only adds
+//                             time (default 5)
+//    --time_threshold=<f>     fail if an op got more than this
+//                             fraction slower (default 0.25) ...
+//    --min_time_delta_ns=<n>  ... and more than this many ns slower
+//                             (default 500), to ignore noise on tiny ops
+//    --alloc_threshold=<f>    fail if an op does more than this
+//                             fraction more allocations (default 0)
+// An op whose output size changed always fails.  'make check-perf'
+// runs this against $(PERF_BASELINE), recording it on the first run.
 
 #include "config_for_unittests.h"
 #include <stdio.h>
@@ -61,7 +84,12 @@
 #  include <ndir.h>
 # endif
 #endif       // for opendir() etc
+#ifdef HAVE_SCHED_SETAFFINITY
+# include <sched.h>       // for sched_setaffinity()
+#endif
 #include <algorithm>      // for sort() and stable_partition
+#include <chrono>         // for steady_clock
+#include <map>
 #include <string>
 #include <vector>
 #include <ctemplate/template.h>
@@ -69,12 +97,15 @@
 #include <ctemplate/template_modifiers.h>
 #include <ctemplate/template_pathops.h>
 #include "base/util.h"
+#include "tests/allocation_counter.h"
 
+using std::map;
 using std::vector;
 using std::string;
 using std::sort;
 
 using ctemplate::DO_NOT_STRIP;
+using ctemplate::NumAllocations;
 using ctemplate::PerExpandData;
 using ctemplate::STRIP_BLANK_LINES;
 using ctemplate::STRIP_WHITESPACE;
@@ -473,7 +504,298 @@ static void TestExpand(const vector<Testdata>::const_iterator& begin,
 }
 
 
+// ----------------------------------------------------------------------
+// Performance mode
+// ----------------------------------------------------------------------
+
+// allocation_counter.cc counts every allocation made by this binary,
+// so we can tell how many a parse or expand does.
+
+static bool FLAG_single_core = false;
+static int FLAG_iterations = 0;          // 0 means 'calibrate'
+static int FLAG_repetitions = 5;
+static double FLAG_time_threshold = 0.25;
+static double FLAG_min_time_delta_ns = 500;
+static double FLAG_alloc_threshold = 0;
+
+// One row of the baseline file.  kind is "parse" or "expand"; bytes is
+// the input size for parses and the output size for expands.
+struct PerfResult {
+  string kind;
+  string key;
+  double ns_per_op;
+  size_t allocs_per_op;
+  size_t bytes;
+};
+
+// An operation to measure: a parse of 'text', or an expand of 'tpl'.
+struct PerfOp {
+  const string* text;
+  const Template* tpl;
+  const TemplateDictionary* dict;
+  int iterations;   // ops per sample
+
+  size_t Run() const {
+    if (tpl == NULL) {
+      Template* t = Template::StringToTemplate(*text, STRIP_WHITESPACE);
+      ASSERT(t);
+      delete t;
+      return text->size();
+    }
+    string output;
+    tpl->Expand(&output, dict);
+    return output.size();
+  }
+};
+
+static bool PinToOneCpu() {
+#ifdef HAVE_SCHED_SETAFFINITY
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  if (sched_getaffinity(0, sizeof(cpus), &cpus) != 0)
+    return false;
+  // Pick the first cpu we're allowed to run on.
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &cpus)) {
+      CPU_ZERO(&cpus);
+      CPU_SET(cpu, &cpus);
+      return sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
+    }
+  }
+#endif
+  return false;
+}
+
+static double SampleNs(const PerfOp& op) {
+  const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  for (int i = 0; i < op.iterations; ++i)
+    op.Run();
+  return std::chrono::duration<double, std::nano>(
+      std::chrono::steady_clock::now() - start).count() / op.iterations;
+}
+
+// Fills in everything but ns_per_op, and picks op->iterations.
+static PerfResult PreparePerfOp(const char* kind, const string& key,
+                                PerfOp* op) {
+  PerfResult result;
+  result.kind = kind;
+  result.key = key;
+  result.ns_per_op = 0;
+
+  // The first run warms up the template cache (for includes) and the
+  // modifiers; the allocation count comes from the second.
+  op->Run();
+  const size_t allocs_before = NumAllocations();
+  result.bytes = op->Run();
+  result.allocs_per_op = NumAllocations() - allocs_before;
+
+  op->iterations = FLAG_iterations;
+  if (op->iterations <= 0 && FLAG_single_core) {
+    op->iterations = 1000;
+  } else if (op->iterations <= 0) {
+    op->iterations = 1;
+    while (op->iterations < (1 << 20) &&
+           SampleNs(*op) * op->iterations < 5e6)
+      op->iterations *= 2;
+  }
+  return result;
+}
+
+static vector<PerfResult> MeasurePerf(const vector<Testdata>& testdata) {
+  vector<PerfResult> results;
+  vector<PerfOp> ops;
+  vector<Template*> templates;
+  vector<TemplateDictionary*> dicts;
+  for (vector<Testdata>::const_iterator one_test = testdata.begin();
+       one_test != testdata.end(); ++one_test) {
+    Template* tpl = Template::StringToTemplate(one_test->input_template,
+                                               STRIP_WHITESPACE);
+    if (tpl == NULL)      // the tests for invalid templates
+      continue;
+    templates.push_back(tpl);
+    PerfOp parse = { &one_test->input_template, NULL, NULL, 0 };
+    results.push_back(PreparePerfOp("parse", one_test->input_template_name,
+                                    &parse));
+    ops.push_back(parse);
+    for (vector<string>::const_iterator out = one_test->output.begin();
+         out != one_test->output.end(); ++out) {
+      if (out->empty())
+        continue;
+      const int dictnum = out - one_test->output.begin() + 1;
+      dicts.push_back(MakeDictionary(dictnum));
+      char key[1024];
+      snprintf(key, sizeof(key), "%s/dict%02d",
+               one_test->input_template_name.c_str(), dictnum);
+      PerfOp expand = { NULL, tpl, dicts.back(), 0 };
+      results.push_back(PreparePerfOp("expand", key, &expand));
+      ops.push_back(expand);
+    }
+  }
+
+  // Each repetition is a separate pass over all the ops, so a burst of
+  // noise (another process, a frequency change) spoils one sample of a
+  // few ops rather than every sample of one op.
+  for (int rep = 0; rep < FLAG_repetitions; ++rep) {
+    for (size_t i = 0; i < ops.size(); ++i) {
+      const double ns = SampleNs(ops[i]);
+      if (rep == 0 || ns < results[i].ns_per_op)
+        results[i].ns_per_op = ns;
+    }
+  }
+
+  for (size_t i = 0; i < dicts.size(); ++i)
+    delete dicts[i];
+  for (size_t i = 0; i < templates.size(); ++i)
+    delete templates[i];
+  return results;
+}
+
+static bool WriteBaseline(const string& filename,
+                          const vector<PerfResult>& results) {
+  FILE* fp = fopen(filename.c_str(), "w");
+  if (!fp) {
+    perror(filename.c_str());
+    return false;
+  }
+  fprintf(fp, "# %s perf baseline: kind key ns_per_op allocs_per_op bytes\n",
+          PACKAGE_STRING);
+  for (vector<PerfResult>::const_iterator it = results.begin();
+       it != results.end(); ++it) {
+    fprintf(fp, "%s\t%s\t%.1f\t%lu\t%lu\n", it->kind.c_str(),
+            it->key.c_str(), it->ns_per_op,
+            static_cast<unsigned long>(it->allocs_per_op),
+            static_cast<unsigned long>(it->bytes));
+  }
+  return fclose(fp) == 0;
+}
+
+static bool ReadBaseline(const string& filename,
+                         map<string, PerfResult>* baseline) {
+  FILE* fp = fopen(filename.c_str(), "r");
+  if (!fp) {
+    perror(filename.c_str());
+    return false;
+  }
+  char line[2048];
+  while (fgets(line, sizeof(line), fp)) {
+    if (line[0] == '#' || line[0] == '\n')
+      continue;
+    char kind[16], key[1024];
+    double ns;
+    unsigned long allocs, bytes;
+    if (sscanf(line, "%15s %1023s %lf %lu %lu",
+               kind, key, &ns, &allocs, &bytes) != 5) {
+      fprintf(stderr, "%s: malformed line: %s", filename.c_str(), line);
+      fclose(fp);
+      return false;
+    }
+    PerfResult result = { kind, key, ns, allocs, bytes };
+    (*baseline)[result.kind + " " + result.key] = result;
+  }
+  fclose(fp);
+  return true;
+}
+
+// Returns the number of ops that regressed against the baseline.
+static int CompareToBaseline(const map<string, PerfResult>& baseline,
+                             const vector<PerfResult>& results) {
+  int num_regressions = 0;
+  printf("%-6s %-50s %12s %12s %7s %8s %8s\n", "kind", "key",
+         "base ns/op", "ns/op", "change", "allocs", "bytes");
+  for (vector<PerfResult>::const_iterator it = results.begin();
+       it != results.end(); ++it) {
+    map<string, PerfResult>::const_iterator base =
+        baseline.find(it->kind + " " + it->key);
+    if (base == baseline.end()) {
+      printf("%-6s %-50s %12s %12.1f %7s %8lu %8lu  (new)\n",
+             it->kind.c_str(), it->key.c_str(), "-", it->ns_per_op, "-",
+             static_cast<unsigned long>(it->allocs_per_op),
+             static_cast<unsigned long>(it->bytes));
+      continue;
+    }
+    const PerfResult& b = base->second;
+    string why;
+    if (it->bytes != b.bytes)
+      why += " output size changed;";
+    if (it->allocs_per_op > b.allocs_per_op * (1 + FLAG_alloc_threshold))
+      why += " more allocations;";
+    if (it->ns_per_op > b.ns_per_op * (1 + FLAG_time_threshold) &&
+        it->ns_per_op - b.ns_per_op > FLAG_min_time_delta_ns)
+      why += " slower;";
+    printf("%-6s %-50s %12.1f %12.1f %+6.1f%% %8lu %8lu%s%s\n",
+           it->kind.c_str(), it->key.c_str(), b.ns_per_op, it->ns_per_op,
+           b.ns_per_op > 0 ? 100 * (it->ns_per_op / b.ns_per_op - 1) : 0.0,
+           static_cast<unsigned long>(it->allocs_per_op),
+           static_cast<unsigned long>(it->bytes),
+           why.empty() ? "" : "  REGRESSION:", why.c_str());
+    if (!why.empty())
+      ++num_regressions;
+  }
+  return num_regressions;
+}
+
+static int PerfMain(const vector<Testdata>& testdata,
+                    const string& record_file, const string& compare_file) {
+  if (FLAG_single_core && !PinToOneCpu())
+    printf("WARNING: unable to pin to a single cpu; numbers may be noisy\n");
+
+  const vector<PerfResult> results = MeasurePerf(testdata);
+
+  if (!record_file.empty()) {
+    if (!WriteBaseline(record_file, results))
+      return 1;
+    printf("Recorded %d measurements to %s\n",
+           static_cast<int>(results.size()), record_file.c_str());
+    return 0;
+  }
+
+  map<string, PerfResult> baseline;
+  if (!ReadBaseline(compare_file, &baseline))
+    return 1;
+  const int num_regressions = CompareToBaseline(baseline, results);
+  if (num_regressions > 0) {
+    printf("FAILED: %d of %d measurements regressed against %s\n",
+           num_regressions, static_cast<int>(results.size()),
+           compare_file.c_str());
+    return 1;
+  }
+  printf("PASS: no regressions against %s\n", compare_file.c_str());
+  return 0;
+}
+
+
 int main(int argc, char** argv) {
+  string perf_record, perf_compare;
+  for (int i = 1; i < argc; ++i) {
+    if (strncmp(argv[i], "--perf_record=", 14) == 0) {
+      perf_record = argv[i] + 14;
+    } else if (strncmp(argv[i], "--perf_compare=", 15) == 0) {
+      perf_compare = argv[i] + 15;
+    } else if (strcmp(argv[i], "--single_core") == 0) {
+      FLAG_single_core = true;
+    } else if (strncmp(argv[i], "--iterations=", 13) == 0) {
+      FLAG_iterations = atoi(argv[i] + 13);
+    } else if (strncmp(argv[i], "--repetitions=", 14) == 0) {
+      FLAG_repetitions = std::max(1, atoi(argv[i] + 14));
+    } else if (strncmp(argv[i], "--time_threshold=", 17) == 0) {
+      FLAG_time_threshold = atof(argv[i] + 17);
+    } else if (strncmp(argv[i], "--min_time_delta_ns=", 20) == 0) {
+      FLAG_min_time_delta_ns = atof(argv[i] + 20);
+    } else if (strncmp(argv[i], "--alloc_threshold=", 18) == 0) {
+      FLAG_alloc_threshold = atof(argv[i] + 18);
+    } else {
+      fprintf(stderr, "USAGE: %s [--perf_record=<file> | --perf_compare=<file>]"
+              " [perf options]\n(see the top of template_regtest.cc)\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  if (!perf_record.empty() && !perf_compare.empty()) {
+    fprintf(stderr, "Only one of --perf_record and --perf_compare is allowed\n");
+    return 1;
+  }
+
   // If TEMPLATE_ROOTDIR is set in the environment, it overrides the
   // default of ".".  We use an env-var rather than argv because
   // that's what automake supports most easily.
@@ -491,6 +813,9 @@ int main(int argc, char** argv) {
     return 1;
   }
 
+  if (!perf_record.empty() || !perf_compare.empty())
+    return PerfMain(testdata, perf_record, perf_compare);
+
   TestExpand(testdata.begin(), testdata.end());
 
   printf("DONE\n");
@@ -0,0 +1,167 @@
+// Copyright (c) 2026, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+//
+// Compares how long a TemplateCache takes to load a large tree of
+// templates from scratch -- the first request after a server starts,
+// say -- when it reads them from the filesystem and when it reads them
+// from a TemplateArchive.
+//
+//    template_source_benchmark [num_templates [num_runs]]
+//
+// The default is 10000 templates, spread over 100 directories, and the
+// best of 3 runs.  The templates are written to $TMPDIR (or /tmp).
+// Both sources run against a warm OS page cache, so what's measured
+// is the system calls and parsing, not the disk.
+
+#include "config_for_unittests.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>        // for steady_clock
+#include <string>
+#include <vector>
+#include <ctemplate/template_cache.h>
+#include <ctemplate/template_enums.h>    // for DO_NOT_STRIP
+#include <ctemplate/template_pathops.h>  // for PathJoin()
+#include <ctemplate/template_source.h>
+#include "tests/template_test_util.h"    // for StringToFile(), etc
+#include "base/util.h"                   // for CHECK()
+
+using std::string;
+using std::vector;
+using ctemplate::CreateOrCleanTestDir;
+using ctemplate::DO_NOT_STRIP;
+using ctemplate::PathJoin;
+using ctemplate::StringToFile;
+using ctemplate::TemplateArchive;
+using ctemplate::TemplateCache;
+
+static const int kNumDirs = 100;
+
+// The name of the i-th template, relative to the root.  The names
+// have "template" in them so CreateOrCleanTestDir() can remove them.
+static string TemplateName(int i) {
+  char name[64];
+  snprintf(name, sizeof(name), "dir%02d/template_%05d.tpl", i % kNumDirs, i);
+  return name;
+}
+
+// A page of a few hundred bytes, with the usual mix of variables,
+// sections and includes.
+static string TemplateText(int i) {
+  char text[1024];
+  snprintf(text, sizeof(text),
+           "<html><head><title>{{TITLE:h}} (page %d)</title></head>\n"
+           "<body>\n"
+           "{{>HEADER}}\n"
+           "<h1>{{TITLE:h}}</h1>\n"
+           "{{#ITEMS}}\n"
+           "  <li><a href=\"{{URL:U=html}}\">{{NAME:h}}</a>"
+           " {{#NEW}}<b>new</b>{{/NEW}}</li>\n"
+           "{{/ITEMS}}\n"
+           "<p>Generated for {{USER:h}} in {{MS}} ms.</p>\n"
+           "</body></html>\n", i);
+  return text;
+}
+
+// Loads every template through a fresh cache, and returns how long
+// that took in seconds.  With archive non-empty, the cache reads
+// through a TemplateArchive opened on it, and opening the archive is
+// part of what we time.
+static double LoadAll(const string& root, const string& archive,
+                      int num_templates) {
+  const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  TemplateCache cache;
+  cache.SetTemplateRootDirectory(root);
+  TemplateArchive* source = NULL;
+  if (!archive.empty()) {
+    source = TemplateArchive::Open(archive, root);
+    CHECK(source);
+    cache.SetTemplateSource(source);
+  }
+  for (int i = 0; i < num_templates; ++i)
+    CHECK(cache.GetTemplateHandle(TemplateName(i), DO_NOT_STRIP).valid());
+  const double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+  cache.ClearCache();
+  delete source;
+  return seconds;
+}
+
+static void Report(const char* what, double seconds, int num_templates) {
+  printf("%-12s %8.1f ms  %6.2f us/template\n",
+         what, seconds * 1e3, seconds * 1e6 / num_templates);
+}
+
+int main(int argc, char** argv) {
+  const int num_templates = argc > 1 ? atoi(argv[1]) : 10000;
+  const int num_runs = argc > 2 ? atoi(argv[2]) : 3;
+  const char* tmpdir = getenv("TMPDIR");
+  const string dir = PathJoin(tmpdir ? tmpdir : "/tmp",
+                              "template_source_benchmark/");
+  const string root = PathJoin(dir, "tree/");
+  const string archive = PathJoin(dir, "templates.tplar");
+
+  CreateOrCleanTestDir(dir);
+  CreateOrCleanTestDir(root);
+  for (int d = 0; d < kNumDirs; ++d) {
+    char subdir[16];
+    snprintf(subdir, sizeof(subdir), "dir%02d", d);
+    CreateOrCleanTestDir(PathJoin(root, subdir));
+  }
+  vector<TemplateArchive::Entry> entries;
+  for (int i = 0; i < num_templates; ++i) {
+    const string text = TemplateText(i);
+    StringToFile(text, PathJoin(root, TemplateName(i)));
+    entries.push_back(TemplateArchive::Entry(TemplateName(i), text, 0));
+  }
+  CHECK(TemplateArchive::Write(archive, entries, 1));
+
+  double filesystem = 1e9, archived = 1e9;
+  for (int run = 0; run < num_runs; ++run) {
+    const double f = LoadAll(root, "", num_templates);
+    const double a = LoadAll(root, archive, num_templates);
+    if (f < filesystem) filesystem = f;
+    if (a < archived) archived = a;
+  }
+  printf("Loading %d templates, best of %d runs:\n", num_templates, num_runs);
+  Report("filesystem", filesystem, num_templates);
+  Report("archive", archived, num_templates);
+  printf("%-12s %8.2fx\n", "speedup", filesystem / archived);
+
+  for (int d = 0; d < kNumDirs; ++d) {
+    char subdir[16];
+    snprintf(subdir, sizeof(subdir), "dir%02d", d);
+    CreateOrCleanTestDir(PathJoin(root, subdir));
+  }
+  remove(archive.c_str());
+  return 0;
+}
@@ -270,6 +270,10 @@ class TemplateCachePeer {
     return Template::num_deletes();
   }
 
+  static int NumResumedBuilds() {
+    return Template::num_resumed_builds();
+  }
+
  private:
   TemplateCache* cache_;  // Not owned.
 
@@ -90,6 +90,7 @@ using ctemplate::TC_UNUSED;
 using ctemplate::TC_XML;
 using ctemplate::Template;
 using ctemplate::TemplateContext;
+using ctemplate::TemplateCost;
 using ctemplate::TemplateDictionary;
 using ctemplate::TemplateNamelist;
 using ctemplate::TemplateString;
@@ -560,6 +561,28 @@ TEST(Template, Comment) {
   AssertExpandIs(tpl3, &dict, "hi  lo", true);
 }
 
+TEST(Template, CoalesceText) {
+  TemplateDictionary dict("dict");
+  Template* tpl = StringToTemplate("a{{!comment}}b{{=<% %>=}}c"
+                                   "<%#SEC%>d<%!comment%>e<%/SEC%>"
+                                   "<%#SEC2%>f<%VAR%>g<%/SEC2%>",
+                                   DO_NOT_STRIP);
+  ASSERT(tpl);
+  string dump;
+  tpl->DumpToString("bogus_filename", &dump);
+  // The text around the comments and delimiter-change is one node.
+  ASSERT(dump.find("Text Node: -->|abc|<--") != string::npos);
+  ASSERT(dump.find("Text Node: -->|de|<--") != string::npos);
+  ASSERT(dump.find("Text Node: -->|f|<--") != string::npos);
+
+  AssertExpandIs(tpl, &dict, "abc", true);
+  dict.AddSectionDictionary("SEC");
+  dict.AddSectionDictionary("SEC");
+  dict.SetValue("VAR", "-");
+  dict.ShowSection("SEC2");
+  AssertExpandIs(tpl, &dict, "abcdedef-g", true);
+}
+
 TEST(Template, SetMarkerDelimiters) {
   TemplateDictionary dict("dict");
   dict.SetValue("VAR", "yo");
@@ -2111,6 +2134,51 @@ TEST(Template, RegisterString) {
   AssertExpandIs(tpl, &dict, expected, true);
 }
 
+TEST(Template, AnalyzeCost) {
+  Template* tpl = StringToTemplate(
+      "a {{X:h:j}} {{#S}}{{Y}}{{#T}}{{>INC}}{{/T}}{{/S}} b", DO_NOT_STRIP);
+  ASSERT(tpl);
+
+  // Work: 1 per text node, plus 1/64 per byte; 2 per variable, section
+  // iteration and modifier; 8 per include.
+  TemplateCost cost;
+  ASSERT(tpl->AnalyzeCost(NULL, 3, &cost));
+  ASSERT_INTEQ(cost.num_nodes, 8);
+  ASSERT_INTEQ(cost.num_text_nodes, 3);
+  ASSERT_INTEQ(cost.num_variable_nodes, 2);
+  ASSERT_INTEQ(cost.num_section_nodes, 2);
+  ASSERT_INTEQ(cost.num_include_nodes, 1);
+  ASSERT_INTEQ(cost.max_section_depth, 2);
+  ASSERT_INTEQ(cost.num_includes_in_sections, 1);
+  ASSERT_INTEQ(cost.max_modifiers, 2);
+  ASSERT_INTEQ(cost.num_modifiers, 2);
+  ASSERT_INTEQ(cost.text_bytes, 5);
+  ASSERT(cost.work_per_pass == 23 + 5 / 64.0);
+  ASSERT(cost.max_iteration_work == 12);
+  ASSERT_STREQ(cost.costliest_section.c_str(), "S");
+  // T: (2 + 8) * 3; S: (2 + 2 + 30) * 3.
+  ASSERT(cost.estimated_work == 3 + 5 / 64.0 + 6 + 102);
+  ASSERT(cost.unset_variables.empty());
+
+  // With a sample, sections repeat as often as it says, and hidden
+  // ones cost nothing.
+  TemplateDictionary dict("dict");
+  dict.SetValue("X", "x");
+  dict.AddSectionDictionary("S")->SetValue("Y", "y");
+  TemplateDictionary* t_dict =
+      dict.AddSectionDictionary("S")->AddSectionDictionary("T");
+  t_dict->AddIncludeDictionary("INC");
+  t_dict->AddIncludeDictionary("INC");
+  ASSERT(tpl->AnalyzeCost(&dict, 3, &cost));
+  ASSERT_INTEQ(cost.num_nodes, 8);
+  // S: 2 + 2, then 2 + 2 + (2 + 8 * 2).
+  ASSERT(cost.estimated_work == 3 + 5 / 64.0 + 6 + 26);
+  ASSERT_INTEQ(cost.unset_variables.size(), 1);
+  ASSERT_STREQ(cost.unset_variables[0].c_str(), "Y");
+
+  ASSERT(!Template::StringToTemplate("{{#S}}", DO_NOT_STRIP));
+}
+
 // This tests that StaticTemplateString is sufficiently initialized at
 // static-initialization time (as opposed to dynamic-initialization
 // time, which comes later), that we can safely expand templates
@@ -0,0 +1,228 @@
+// Copyright (c) 2026, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+//
+// Chunks are found by the CRC-64 of their text (see
+// HashingEmitter::Digest()), which Intern() computes before taking the
+// lock; chunks with the same digest are chained together.  The chunk
+// refcounts are guarded by the store's mutex rather than one of their
+// own, since the last Release() has to take the chunk out of the
+// store's map regardless.
+
+#include <config.h>
+#include "base/mutex.h"   // This must go first so we get _XOPEN_SOURCE
+#include "text_store.h"
+#include <assert.h>
+#include <string.h>       // for memcmp(), memcpy()
+#include <ctemplate/template_emitter.h>   // for HashingEmitter::Digest()
+
+using std::list;
+using std::string;
+
+namespace ctemplate {
+
+// We keep at most this many recently read files, using at most this
+// much memory.
+static const size_t kMaxRecentFiles = 16;
+static const size_t kMaxRecentFileBytes = 256 << 10;
+
+// ----------------------------------------------------------------------
+// TextChunk::TextChunk()
+// TextChunk::IncRef()
+// TextChunk::Release()
+// TextChunk::refcount()
+// ----------------------------------------------------------------------
+
+TextChunk::TextChunk(TextStore* store, uint64_t digest,
+                     const char* text, size_t len)
+    : store_(store), digest_(digest), text_(text, len),
+      refcount_(1), next_(NULL) {
+}
+
+void TextChunk::IncRef() const {
+  MutexLock ml(&store_->mutex_);
+  assert(refcount_ > 0);
+  ++refcount_;
+}
+
+void TextChunk::Release() const {
+  MutexLock ml(&store_->mutex_);
+  assert(refcount_ > 0);
+  if (--refcount_ == 0)
+    store_->ReleaseChunkLocked(this);
+}
+
+int TextChunk::refcount() const {
+  MutexLock ml(&store_->mutex_);
+  return refcount_;
+}
+
+// ----------------------------------------------------------------------
+// TextStore::TextStore()
+// TextStore::~TextStore()
+// TextStore::IncRef()
+// TextStore::DecRef()
+// ----------------------------------------------------------------------
+
+TextStore::TextStore()
+    : num_bytes_(0), recent_file_bytes_(0), refcount_(1) {
+}
+
+TextStore::~TextStore() {
+  // Every chunk holder holds a reference to the store too.
+  assert(chunks_.empty());
+}
+
+void TextStore::IncRef() {
+  MutexLock ml(&mutex_);
+  assert(refcount_ > 0);
+  ++refcount_;
+}
+
+void TextStore::DecRef() {
+  bool refcount_is_zero;
+  {
+    MutexLock ml(&mutex_);
+    assert(refcount_ > 0);
+    refcount_is_zero = (--refcount_ == 0);
+  }
+  // As with TemplateCache::RefcountedTemplate, we can't delete
+  // ourselves while holding our own mutex.
+  if (refcount_is_zero)
+    delete this;
+}
+
+// ----------------------------------------------------------------------
+// TextStore::Intern()
+// TextStore::ReleaseChunkLocked()
+// ----------------------------------------------------------------------
+
+const TextChunk* TextStore::Intern(const char* text, size_t len) {
+  const uint64_t digest = HashingEmitter::Digest(text, len);
+  MutexLock ml(&mutex_);
+  const TextChunk*& head = chunks_[digest];
+  for (const TextChunk* chunk = head; chunk; chunk = chunk->next_) {
+    if (chunk->size() == len && memcmp(chunk->data(), text, len) == 0) {
+      ++chunk->refcount_;
+      return chunk;
+    }
+  }
+  TextChunk* chunk = new TextChunk(this, digest, text, len);
+  chunk->next_ = head;
+  head = chunk;
+  num_bytes_ += len;
+  return chunk;
+}
+
+void TextStore::ReleaseChunkLocked(const TextChunk* chunk) {
+  ChunkMap::iterator it = chunks_.find(chunk->digest_);
+  assert(it != chunks_.end());
+  const TextChunk** link = &it->second;
+  while (*link != chunk)
+    link = &(*link)->next_;
+  *link = chunk->next_;
+  if (it->second == NULL)
+    chunks_.erase(it);
+  num_bytes_ -= chunk->size();
+  delete chunk;
+}
+
+// ----------------------------------------------------------------------
+// TextStore::GetRecentFile()
+// TextStore::AddRecentFile()
+// ----------------------------------------------------------------------
+
+bool TextStore::GetRecentFile(const string& filename, time_t mtime,
+                              size_t length, char* buffer) {
+  MutexLock ml(&mutex_);
+  for (list<RecentFile>::iterator it = recent_files_.begin();
+       it != recent_files_.end(); ++it) {
+    if (it->filename == filename && it->mtime == mtime &&
+        it->contents.size() == length) {
+      memcpy(buffer, it->contents.data(), length);
+      recent_files_.splice(recent_files_.begin(), recent_files_, it);
+      return true;
+    }
+  }
+  return false;
+}
+
+void TextStore::AddRecentFile(const string& filename, time_t mtime,
+                              const char* contents, size_t length) {
+  if (length > kMaxRecentFileBytes)
+    return;
+  MutexLock ml(&mutex_);
+  // Drop any older contents of the file, as well as the least
+  // recently used files if we need the room.
+  for (list<RecentFile>::iterator it = recent_files_.begin();
+       it != recent_files_.end(); ) {
+    if (it->filename == filename) {
+      recent_file_bytes_ -= it->contents.size();
+      it = recent_files_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  while (!recent_files_.empty() &&
+         (recent_files_.size() >= kMaxRecentFiles ||
+          recent_file_bytes_ + length > kMaxRecentFileBytes)) {
+    recent_file_bytes_ -= recent_files_.back().contents.size();
+    recent_files_.pop_back();
+  }
+  recent_files_.push_front(RecentFile());
+  RecentFile* file = &recent_files_.front();
+  file->filename = filename;
+  file->mtime = mtime;
+  file->contents.assign(contents, length);
+  recent_file_bytes_ += length;
+}
+
+// ----------------------------------------------------------------------
+// TextStore::num_chunks()
+// TextStore::num_bytes()
+// ----------------------------------------------------------------------
+
+size_t TextStore::num_chunks() const {
+  MutexLock ml(&mutex_);
+  size_t num_chunks = 0;
+  for (ChunkMap::const_iterator it = chunks_.begin(); it != chunks_.end();
+       ++it) {
+    for (const TextChunk* chunk = it->second; chunk; chunk = chunk->next_)
+      ++num_chunks;
+  }
+  return num_chunks;
+}
+
+size_t TextStore::num_bytes() const {
+  MutexLock ml(&mutex_);
+  return num_bytes_;
+}
+
+}  // namespace ctemplate
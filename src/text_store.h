@@ -0,0 +1,134 @@
+// Copyright (c) 2026, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+//
+// A TextStore holds the static text of the templates in a
+// TemplateCache and its clones, keyed by content, so that text that
+// turns up in many templates -- the same file loaded with different
+// Strip modes, or StringToTemplateCache() variants that differ in
+// only a few places -- is kept once.  It is internal to ctemplate.
+
+#ifndef TEMPLATE_TEXT_STORE_H_
+#define TEMPLATE_TEXT_STORE_H_
+
+#include <config.h>
+#include <stddef.h>             // for size_t
+#include <time.h>               // for time_t
+#include <cstdint>              // for uint64_t
+#include <list>
+#include <string>
+#include HASH_MAP_H
+#include "base/mutex.h"
+
+namespace ctemplate {
+
+class TextStore;
+
+// An immutable run of text owned by a TextStore.  Get one from
+// TextStore::Intern(), and give it back with Release().
+class TextChunk {
+ public:
+  const char* data() const { return text_.data(); }
+  size_t size() const { return text_.size(); }
+
+  void IncRef() const;
+  // The last Release() removes the chunk from its store.
+  void Release() const;
+  // How many holders share the chunk.
+  int refcount() const;
+
+ private:
+  friend class TextStore;
+  TextChunk(TextStore* store, uint64_t digest, const char* text, size_t len);
+
+  TextStore* const store_;
+  const uint64_t digest_;
+  const std::string text_;
+  mutable int refcount_;   // guarded by store_->mutex_
+  // The next chunk whose text has the same digest (guarded, likewise).
+  mutable const TextChunk* next_;
+};
+
+class TextStore {
+ public:
+  // The new store has one reference, which belongs to the caller.
+  TextStore();
+
+  void IncRef();
+  void DecRef();
+
+  // Returns a chunk holding text[0, len).  If the store already has
+  // one with that text, that chunk is returned; otherwise the text is
+  // copied into a new one.  Either way, the caller owns a reference.
+  const TextChunk* Intern(const char* text, size_t len);
+
+  // The store also remembers the contents of the last few files read
+  // by templates (see Template::ReloadIfChangedLocked()), so that a
+  // file loaded with several Strip modes is read from disk only once.
+  // GetRecentFile() copies the contents of filename into buffer and
+  // returns true if the store has them for that mtime and length.
+  bool GetRecentFile(const std::string& filename, time_t mtime,
+                     size_t length, char* buffer);
+  void AddRecentFile(const std::string& filename, time_t mtime,
+                     const char* contents, size_t length);
+
+  // For tests: how many chunks the store holds, and their total size.
+  size_t num_chunks() const;
+  size_t num_bytes() const;
+
+ private:
+  friend class TextChunk;   // for mutex_ and ReleaseChunk()
+
+  struct RecentFile {
+    std::string filename;
+    time_t mtime;
+    std::string contents;
+  };
+
+  ~TextStore();
+  void ReleaseChunkLocked(const TextChunk* chunk);
+
+  // Chunks by the HashingEmitter::Digest() of their text.  Chunks
+  // with the same digest are chained through TextChunk::next_.
+  typedef HASH_NAMESPACE::unordered_map<uint64_t, const TextChunk*> ChunkMap;
+  ChunkMap chunks_;
+  size_t num_bytes_;
+  std::list<RecentFile> recent_files_;   // most recently used first
+  size_t recent_file_bytes_;
+  int refcount_;
+  mutable Mutex mutex_;
+
+  TextStore(const TextStore&);   // disallow copying
+  void operator=(const TextStore&);
+};
+
+}  // namespace ctemplate
+
+#endif  // TEMPLATE_TEXT_STORE_H_
@@ -45,7 +45,9 @@
 #include <stdlib.h>   // for NULL
 #include <string.h>   // for strcmp
 #include <sys/types.h>
+#include <chrono>     // for steady_clock
 #include <unordered_map>
+#include <ctemplate/template_enums.h>    // for ExpandAbortReason
 #include <ctemplate/template_string.h>   // for StringHash
 
 // NOTE: if you are statically linking the template library into your binary
@@ -59,6 +61,10 @@ namespace ctemplate {
 
 class TemplateModifier;
 class TemplateAnnotator;
+class OutputLimitEmitter;
+class SectionTemplateNode;
+class Template;
+class TemplateTemplateNode;
 
 class CTEMPLATE_DLL_DECL PerExpandData {
  public:
@@ -66,7 +72,12 @@ class CTEMPLATE_DLL_DECL PerExpandData {
       : annotate_path_(NULL),
         annotator_(NULL),
         expand_modifier_(NULL),
-        map_(NULL) { }
+        map_(NULL),
+        has_deadline_(false),
+        max_output_bytes_(0),
+        max_iterations_(0),
+        num_iterations_(0),
+        abort_reason_(EXPAND_NOT_ABORTED) { }
 
   ~PerExpandData();
 
@@ -129,7 +140,75 @@ class CTEMPLATE_DLL_DECL PerExpandData {
     return static_cast<const char*>(LookupForModifiers(key));
   }
 
+  // ---- EXPANSION LIMITS -------
+  // These bound the work done by a call to Expand() using this
+  // PerExpandData, so a runaway dictionary -- a section with millions
+  // of rows, say -- can't tie up the expanding thread.  When a limit
+  // is hit, the expand stops where it is and returns false, and
+  // expand_aborted() says which limit it was.  The output and
+  // iteration budgets apply to each Expand() call separately.
+  //
+  // The deadline is checked every kDeadlineCheckInterval iterations,
+  // so an expand may overrun it by that many.  An iteration is one
+  // expansion of a section or of an included template.  The output
+  // is cut off at exactly max_output_bytes bytes.
+
+  void SetExpandDeadline(std::chrono::steady_clock::time_point deadline) {
+    deadline_ = deadline;
+    has_deadline_ = true;
+  }
+  void ClearExpandDeadline() { has_deadline_ = false; }
+
+  // 0 means no limit.  That's the default.
+  void SetMaxOutputBytes(size_t max_output_bytes) {
+    max_output_bytes_ = max_output_bytes;
+  }
+  void SetMaxIterations(size_t max_iterations) {
+    max_iterations_ = max_iterations;
+  }
+
+  size_t max_output_bytes() const { return max_output_bytes_; }
+  size_t max_iterations() const { return max_iterations_; }
+  bool has_expand_deadline() const { return has_deadline_; }
+  // Undefined if has_expand_deadline() != true
+  std::chrono::steady_clock::time_point expand_deadline() const {
+    return deadline_;
+  }
+
+  // Why the last Expand() using this PerExpandData stopped early, or
+  // EXPAND_NOT_ABORTED if it didn't.
+  ExpandAbortReason expand_aborted() const { return abort_reason_; }
+
+  static const size_t kDeadlineCheckInterval = 64;
+
  private:
+  friend class OutputLimitEmitter;
+  friend class SectionTemplateNode;
+  friend class Template;
+  friend class TemplateTemplateNode;
+
+  // Called at the start of each Expand(), to reset the budgets.
+  void StartExpand() {
+    num_iterations_ = 0;
+    abort_reason_ = EXPAND_NOT_ABORTED;
+  }
+
+  // Called once per iteration.  Returns false if the expand should
+  // stop, because it's been aborted or is out of time or iterations.
+  bool CountIteration() {
+    if (abort_reason_ != EXPAND_NOT_ABORTED)
+      return false;
+    if (!has_deadline_ && max_iterations_ == 0)
+      return true;
+    return CountLimitedIteration();
+  }
+  bool CountLimitedIteration();
+
+  void Abort(ExpandAbortReason reason) {
+    if (abort_reason_ == EXPAND_NOT_ABORTED)
+      abort_reason_ = reason;
+  }
+
   struct DataEq {
     bool operator()(const char* s1, const char* s2) const;
   };
@@ -140,6 +219,13 @@ class CTEMPLATE_DLL_DECL PerExpandData {
   const TemplateModifier* expand_modifier_;
   DataMap* map_;
 
+  std::chrono::steady_clock::time_point deadline_;
+  bool has_deadline_;
+  size_t max_output_bytes_;
+  size_t max_iterations_;
+  size_t num_iterations_;             // so far in this Expand()
+  ExpandAbortReason abort_reason_;
+
   PerExpandData(const PerExpandData&);    // disallow evil copy constructor
   void operator=(const PerExpandData&);   // disallow evil operator=
 };
@@ -37,7 +37,9 @@
 #define CTEMPLATE_TEMPLATE_H_
 
 #include <time.h>             // for time_t
+#include <atomic>
 #include <string>
+#include <vector>
 #include <ctemplate/template_cache.h>
 #include <ctemplate/template_enums.h>
 #include <ctemplate/template_string.h>
@@ -54,6 +56,7 @@
 namespace ctemplate {
 class TemplateDictionaryInterface;
 class PerExpandData;
+class TextStore;
 }
 #endif
 
@@ -204,6 +207,32 @@ enum TemplateState { TS_UNUSED, TS_EMPTY, TS_ERROR, TS_READY };
 enum TemplateContext { TC_UNUSED, TC_HTML, TC_JS, TC_CSS, TC_JSON,
                        TC_XML, TC_MANUAL };
 
+// What Template::AnalyzeCost() finds out about a template's parse
+// tree: the things that make it expensive to expand.  Work is counted
+// in rough units, about what it takes to emit a short run of text;
+// each variable lookup, modifier, section iteration and include costs
+// a few units.  Included templates aren't followed.
+struct CTEMPLATE_DLL_DECL TemplateCost {
+  TemplateCost();
+
+  int num_nodes;                 // in the parse tree
+  int num_text_nodes;
+  int num_variable_nodes;
+  int num_section_nodes;
+  int num_include_nodes;
+  int max_section_depth;         // how deeply the sections nest
+  int num_includes_in_sections;  // which may be expanded many times
+  int max_modifiers;             // on any one variable or include
+  int num_modifiers;             // on all of them
+  size_t text_bytes;             // of static text
+  double work_per_pass;          // with every section expanded once
+  double max_iteration_work;     // of one pass through the costliest section
+  std::string costliest_section;
+  double estimated_work;         // with sections repeated; see AnalyzeCost()
+  // Variables used where the sample dictionary leaves them empty.
+  std::vector<std::string> unset_variables;
+};
+
 
 // This class is deprecated.  Old code uses this class heavily (via
 // GetTemplate() to obtain a Template*, and then methods on that
@@ -217,6 +246,14 @@ class CTEMPLATE_DLL_DECL Template {
   // Used by make_tpl_varnames_h.cc.
   void WriteHeaderEntries(std::string *outstring) const;
 
+  // Used by analyze_tpl_cost.cc.  Fills in cost from the parse tree.
+  // For estimated_work, each section is repeated as many times as the
+  // sample dictionary would repeat it, or, if sample is NULL,
+  // assumed_iterations times.  Returns false if the template didn't
+  // parse.
+  bool AnalyzeCost(const TemplateDictionaryInterface* sample,
+                   int assumed_iterations, TemplateCost* cost) const;
+
   // ---- DEPRECATED METHODS ----
   //   These methods used to be the primary way of using the Template
   //   object, but have been deprecated in favor of the (static)
@@ -343,7 +380,13 @@ class CTEMPLATE_DLL_DECL Template {
   //   a comment marker as the last element on the line.
   //   These two options allow the template to include whitespace for
   //   readability without adding to the expanded output.
-  Template(const TemplateString& filename, Strip strip, TemplateCache* owner);
+  //
+  //   If previous is not NULL, it's the template for the same file
+  //   that this one replaces.  We take over its auto-escape checkpoints
+  //   so the parts of the file that haven't changed aren't parsed
+  //   again (see BuildTree()).
+  Template(const TemplateString& filename, Strip strip, TemplateCache* owner,
+           const Template* previous = NULL);
 
   // MaybeInitHtmlParser
   //   In TemplateContexts where the HTML parser is needed, we
@@ -371,6 +414,11 @@ class CTEMPLATE_DLL_DECL Template {
   //   Sets the state of the template.  Used during BuildTree().
   void set_state(TemplateState new_state);
 
+  // Like the public StringToTemplate(), but the template keeps its
+  // long runs of text in text_store (which may be NULL).
+  static Template* StringToTemplate(const TemplateString& content,
+                                    Strip strip, TextStore* text_store);
+
   // StripBuffer
   //   Modifies buffer in-place based on the strip_ mode, to remove
   //   extra whitespace.  May delete[] the input buffer and replace
@@ -418,14 +466,20 @@ class CTEMPLATE_DLL_DECL Template {
     }
   };
 
+  struct AutoEscapeCheckpoints;                   // defined in template.cc
+
   // The current parsing state.  Used in BuildTree() and subroutines
   struct CTEMPLATE_DLL_DECL ParseState {
     const char* bufstart;
     const char* bufend;
     enum { PS_UNUSED, GETTING_TEXT, GETTING_NAME } phase;
     MarkerDelimiters current_delimiters;
+    // The checkpoints this build uses and adds to, taken out of
+    // autoescape_checkpoints_ for the duration.  May be NULL.
+    AutoEscapeCheckpoints* checkpoints;
     ParseState()
-        : bufstart(NULL), bufend(NULL), phase(PS_UNUSED), current_delimiters()
+        : bufstart(NULL), bufend(NULL), phase(PS_UNUSED), current_delimiters(),
+          checkpoints(NULL)
     {}
   };
   ParseState parse_state_;
@@ -438,6 +492,12 @@ class CTEMPLATE_DLL_DECL Template {
   // requires a parser (currently TC_HTML, TC_CSS and TC_JS).
   ctemplate_htmlparser::HtmlParser *htmlparser_;
 
+  // Snapshots of htmlparser_ taken by BuildTree(), so that reloading an
+  // edited file can resume auto-escape parsing where the edit starts
+  // rather than at the top.  NULL unless the template is file-based,
+  // uses a parsing Auto-Escape context and is big enough to have any.
+  mutable AutoEscapeCheckpoints* autoescape_checkpoints_;
+
   // A sorted list of trusted variable names, declared here because a unittest
   // needs to verify that it is appropriately sorted (an unsorted array would
   // lead to the binary search of this array failing).
@@ -446,6 +506,7 @@ class CTEMPLATE_DLL_DECL Template {
 
  private:
   friend class TemplateCache;
+  friend class TemplateHandle;     // for ExpandWithDataAndCache()
   friend class TemplateCachePeer;  // to access num_deletes_
 
   // Internal implementation of Expand
@@ -460,10 +521,63 @@ class CTEMPLATE_DLL_DECL Template {
                     PerExpandData* per_expand_data,
                     const TemplateCache* cache) const;
 
+  // Returns the parse tree ExpandLocked() should use: tree_, or the
+  // specialized tree if it's usable.
+  const class SectionTemplateNode* TreeToExpandLocked(
+      const PerExpandData* per_expand_data,
+      const TemplateCache* cache) const;
+
+  // These implement TemplateCache::ExpandSkeleton(), ExpandHoles()
+  // and SpliceSkeleton().
+  bool ExpandSkeleton(ExpandEmitter* skeleton,
+                      const TemplateCache* cache) const;
+  bool ExpandHoles(ExpandEmitter* holes,
+                   const TemplateDictionaryInterface *dictionary,
+                   PerExpandData* per_expand_data,
+                   const TemplateCache* cache) const;
+  static bool SpliceSkeleton(const std::string& skeleton,
+                             const std::string& holes,
+                             ExpandEmitter* output);
+  bool ExpandIncrementally(const TemplateDictionaryInterface *dictionary,
+                           PerExpandData* per_expand_data,
+                           const TemplateCache* cache,
+                           ExpansionRecord* record,
+                           std::vector<ExpandEdit>* edits) const;
+
+  // Used by TemplateCache::ExpandBatch(): expands dictionaries[i] into
+  // (*outputs)[i], for each i in [begin, end), all under one lock.
+  bool ExpandBatch(const std::vector<const TemplateDictionaryInterface*>&
+                       dictionaries,
+                   size_t begin, size_t end,
+                   std::vector<std::string>* outputs,
+                   const TemplateCache* cache) const;
+
   // Returns the lastmod time in mtime_
   // For string-based templates, not backed by a file, this returns 0
   time_t mtime() const;
 
+  // Builds (or rebuilds, if a folded value has changed) a copy of
+  // tree_ in which variables with a value in the global dictionary
+  // are replaced by that value.  See TemplateCache::FinalizeGlobalValues().
+  // You should hold the g_template_mutex write-lock when calling the
+  // Locked version (unless no other thread can see this template yet).
+  void SpecializeOnGlobalValues() const;
+  void SpecializeOnGlobalValuesLocked() const;
+
+  // Compresses runs of static text at least min_length bytes long,
+  // now and whenever the tree is rebuilt.  0 turns this off.  See
+  // TemplateCache::SetPrecompressThreshold().  The locking rules are
+  // those of SpecializeOnGlobalValuesLocked().
+  void PrecompressTextLocked(size_t min_length) const;
+
+  // Returns roughly how many bytes this template uses, for
+  // TemplateCache::SetMemoryBudget().  You should hold the
+  // g_template_mutex read-lock when calling this (unless no other
+  // thread can see this template yet).
+  size_t MemoryUsageLocked() const;
+  // The same, acquiring the read-lock itself.
+  size_t MemoryUsage() const;
+
   // These are helper routines to StripFile.  I would make them static
   // inside template.cc, but they use the MarerDelimiters struct.
   static bool ParseDelimiters(const char* text, size_t textlen,
@@ -473,10 +587,29 @@ class CTEMPLATE_DLL_DECL Template {
   static size_t InsertLine(const char *line, size_t len, Strip strip,
                            const MarkerDelimiters& delim, char* buffer);
 
-  // This is only used by template_cache_test, via TemplateCachePeer.
-  static int num_deletes() { return num_deletes_; }
-
-  static int num_deletes_;  // how many times the destructor has been called
+  // These are only used by template_cache_test, via TemplateCachePeer.
+  static int num_deletes() { return num_deletes_.load(); }
+  static int num_resumed_builds() { return num_resumed_builds_; }
+
+  // How many times the destructor has been called.  Atomic, since the
+  // last reference to a template can be dropped without any lock.
+  static std::atomic<int> num_deletes_;
+  // How many times BuildTree() resumed from an auto-escape checkpoint.
+  static int num_resumed_builds_;
+
+  // The parse tree specialized on global values, or NULL if
+  // SpecializeOnGlobalValues() has never been called.
+  struct Specialization;                    // defined in template.cc
+  mutable Specialization* specialization_;  // guarded by g_template_mutex
+
+  // Set by PrecompressTextLocked().
+  mutable size_t precompress_threshold_;    // guarded by g_template_mutex
+
+  // Where BuildTree() puts the long runs of text, so templates with
+  // the same runs share them; template_text_ then holds only the
+  // rest.  NULL if the template isn't in a TemplateCache.  We hold a
+  // reference to it.
+  TextStore* text_store_;
 
   // Can't invoke copy constructor or assignment operator
   Template(const Template&);
@@ -35,16 +35,15 @@
 #define TEMPLATE_TEMPLATE_CACHE_H_
 
 #include <unordered_map>
+#include <atomic>        // for atomic<>
 #include <string>        // for string
 #include <utility>       // for pair
 #include <vector>        // for vector<>
 #include <ctemplate/template_emitter.h>  // for ExpandEmitter, etc
 #include <ctemplate/template_enums.h>  // for Strip
+#include <ctemplate/template_source.h>  // for TemplateSource
 #include <ctemplate/template_string.h>
 #include <ctemplate/per_expand_data.h>
-namespace ctemplate {
-class FileStat;
-}
 class Mutex;
 class TemplateCacheUnittest;
 
@@ -65,7 +64,46 @@ namespace ctemplate {
 class PerExpandData;
 class Template;
 class TemplateCachePeer;
+class TemplateCapture;
 class TemplateDictionaryInterface;
+class TemplateHandle;
+class TextStore;
+struct ExpansionRecordNode;
+template <typename Key, typename Value, typename Hash> class PersistentMap;
+
+// One change made by TemplateCache::ExpandIncrementally(): replace
+// delete_len bytes at offset, in the previous output, with insert.
+struct CTEMPLATE_DLL_DECL ExpandEdit {
+  size_t offset;
+  size_t delete_len;
+  std::string insert;
+};
+
+// What TemplateCache::ExpandIncrementally() remembers about the
+// previous expansion of a template: its output, and which bytes of
+// the output each node of the parse tree produced -- for sections,
+// row by row -- along with the dictionary value each variable had.
+// Start with an empty record.
+class CTEMPLATE_DLL_DECL ExpansionRecord {
+ public:
+  ExpansionRecord() : tree_id_(0), root_(NULL) { }
+  ~ExpansionRecord();
+
+  // Appends the output the record describes to output.
+  void AppendOutput(std::string* output) const { output->append(output_); }
+  // Returns the size of that output.
+  size_t output_size() const { return output_.size(); }
+
+ private:
+  friend class SectionTemplateNode;   // to fill in the record
+
+  uint64_t tree_id_;                  // of the parse tree we were made with
+  std::string output_;
+  ExpansionRecordNode* root_;         // for the main section
+
+  ExpansionRecord(const ExpansionRecord&);   // disallow copying
+  void operator=(const ExpansionRecord&);
+};
 
 // A cache to store parsed templates.
 class CTEMPLATE_DLL_DECL TemplateCache {
@@ -75,6 +113,7 @@ class CTEMPLATE_DLL_DECL TemplateCache {
 
   // ---- CREATING A TEMPLATE OBJECT -------
   //    LoadTemplate
+  //    GetTemplateHandle
   //    StringToTemplateCache
 
   // Attempts to load the template object stored under its filename,
@@ -112,6 +151,14 @@ class CTEMPLATE_DLL_DECL TemplateCache {
   // for more details.
   bool LoadTemplate(const TemplateString& filename, Strip strip);
 
+  // Like LoadTemplate, but returns a handle on the template, which
+  // keeps it alive (even if the cache drops or reloads it) until the
+  // handle goes away.  Unlike GetTemplate, this leaves nothing for
+  // DoneWithGetTemplatePtrs() to clean up.  Returns an empty handle
+  // if the template can't be loaded.
+  TemplateHandle GetTemplateHandle(const TemplateString& filename,
+                                   Strip strip);
+
   // Parses the string as a template file (e.g. "Hello {{WORLD}}"),
   // and inserts it into the parsed template cache, so it can later be
   // used by the user. The user specifies a key and a strip, which are
@@ -138,6 +185,9 @@ class CTEMPLATE_DLL_DECL TemplateCache {
   // ---- EXPANDING A TEMPLATE -------
   //    ExpandWithData
   //    ExpandFrozen
+  //    ExpandSkeleton, ExpandHoles, SpliceSkeleton
+  //    ExpandIncrementally
+  //    ExpandBatch
 
   // This returns false if the expand failed for some reason: filename
   // could not be found on disk (and isn't already in the cache), or
@@ -184,6 +234,90 @@ class CTEMPLATE_DLL_DECL TemplateCache {
     return ExpandNoLoad(filename, strip, dictionary, per_expand_data, &e);
   }
 
+  // These split an expansion in two, so the part that doesn't depend
+  // on the dictionary can be cached (say, by a reverse proxy) and
+  // only the rest has to be computed and sent for each request.
+  // ExpandSkeleton writes the template's top-level text, with a gap
+  // for each top-level variable, section or include (a "hole").  The
+  // skeleton only changes when the template does, and it starts with
+  // a fingerprint of its contents.  ExpandHoles writes the expansion
+  // of just the holes, tagged with the same fingerprint; it returns
+  // false if per_expand_data asks for annotations or an expansion
+  // modifier, since those apply to the whole output.  SpliceSkeleton
+  // puts the two together, producing exactly what ExpandWithData()
+  // would have.  It returns false, and writes nothing, if the holes
+  // weren't expanded for this version of the skeleton.  Only text at
+  // the top level goes in the skeleton, since whether a section is
+  // shown, and how often, is up to the dictionary.  So for a template
+  // whose content is all inside a section (a {{#PAGE}}...{{/PAGE}}
+  // wrapper, say), the skeleton is just the text around the section,
+  // and the section, text and all, is one hole.
+  bool ExpandSkeleton(const TemplateString& filename, Strip strip,
+                      ExpandEmitter* skeleton);
+  bool ExpandSkeleton(const TemplateString& filename, Strip strip,
+                      std::string* skeleton) {
+    if (skeleton == NULL)  return false;
+    StringEmitter e(skeleton);
+    return ExpandSkeleton(filename, strip, &e);
+  }
+  bool ExpandHoles(const TemplateString& filename, Strip strip,
+                   const TemplateDictionaryInterface *dictionary,
+                   PerExpandData* per_expand_data,
+                   ExpandEmitter* holes);
+  bool ExpandHoles(const TemplateString& filename, Strip strip,
+                   const TemplateDictionaryInterface *dictionary,
+                   PerExpandData* per_expand_data,
+                   std::string* holes) {
+    if (holes == NULL)  return false;
+    StringEmitter e(holes);
+    return ExpandHoles(filename, strip, dictionary, per_expand_data, &e);
+  }
+  static bool SpliceSkeleton(const std::string& skeleton,
+                             const std::string& holes,
+                             ExpandEmitter* output);
+  static bool SpliceSkeleton(const std::string& skeleton,
+                             const std::string& holes,
+                             std::string* output_buffer) {
+    if (output_buffer == NULL)  return false;
+    StringEmitter e(output_buffer);
+    return SpliceSkeleton(skeleton, holes, &e);
+  }
+
+  // For expanding a template over and over with dictionaries that
+  // differ only a little, as a live-updating page does.  record holds
+  // the previous expansion, and is updated to hold the new one.
+  // edits gets the changes that turn the old output into the new;
+  // they're in order and don't overlap, and their offsets are all in
+  // terms of the old output (so it's easiest to apply them last to
+  // first).  Only nodes whose inputs changed are expanded again: a
+  // variable whose value changed, a section row that was added, or a
+  // node we can't see into, such as an include.  Section rows are
+  // compared one by one, so changing one variable in a large section
+  // produces one small edit.  Static text is never re-emitted.  If
+  // record is empty, or is for another version of the template, there
+  // is one edit, which replaces everything.  per_expand_data has the
+  // same restrictions as for ExpandHoles().
+  bool ExpandIncrementally(const TemplateString& filename, Strip strip,
+                           const TemplateDictionaryInterface *dictionary,
+                           PerExpandData* per_expand_data,
+                           ExpansionRecord* record,
+                           std::vector<ExpandEdit>* edits);
+
+  // Expands one template once per dictionary, putting the expansion
+  // of dictionaries[i] in (*outputs)[i], exactly as ExpandWithData()
+  // would.  The template is looked up, and the locks acquired, once
+  // per batch rather than once per dictionary, and the output
+  // strings are reused (so keep outputs around from batch to batch).
+  // With num_threads > 1, the dictionaries are spread over that many
+  // threads, the calling thread being one of them; the dictionaries
+  // must then be safe to read from several threads at once, as
+  // TemplateDictionary is.  Returns false if any expansion failed.
+  bool ExpandBatch(const TemplateString& filename, Strip strip,
+                   const std::vector<const TemplateDictionaryInterface*>&
+                       dictionaries,
+                   std::vector<std::string>* outputs,
+                   int num_threads = 1);
+
   // ---- FINDING A TEMPLATE FILE -------
 
   // Sets the root directory for all templates used by the program.
@@ -207,8 +341,50 @@ class CTEMPLATE_DLL_DECL TemplateCache {
   std::string FindTemplateFilename(const std::string& unresolved)
       const;
 
+  // Reads template files through source rather than straight from
+  // disk (see template_source.h); NULL goes back to the filesystem.
+  // Filenames are still resolved against the search path, so source
+  // is asked about the same names the filesystem would be.  The
+  // caller keeps ownership of source, which must outlive this cache
+  // and its clones.  Templates already in the cache are reloaded from
+  // source, when next used, if source has them with another mtime.
+  // Returns false, and does nothing, if the cache is frozen.
+  bool SetTemplateSource(const TemplateSource* source);
+
+  // Remembers, for ttl_seconds, where each filename was found on the
+  // search path -- or that it wasn't found -- so looking for it again
+  // doesn't stat every search-path directory.  Changing the search
+  // path forgets everything.  So a file added after we failed to find
+  // it (or removed after we found it) may go unnoticed until the TTL
+  // runs out, unless you call InvalidateResolutions().  0, the
+  // default, turns this off.
+  void SetResolutionCacheTtl(int ttl_seconds);
+
+  // Forgets what we remembered about files that a change to directory
+  // (a file added to it or removed from it, say, as reported by
+  // inotify) could affect: the files we found there or in a directory
+  // after it on the search path (which a new file could shadow), and
+  // every file we didn't find.  A relative directory is taken to be
+  // relative to the current directory, as for SetTemplateRootDirectory().
+  // With an empty directory, forgets everything.
+  void InvalidateResolutions(const std::string& directory);
+
+  struct ResolutionStats {
+    ResolutionStats() : hits(0), misses(0), stats_saved(0) { }
+    uint64_t hits;          // lookups answered from the cache
+    uint64_t misses;        // lookups that searched the path
+    uint64_t stats_saved;   // TemplateSource::Stat() calls the hits
+                            // didn't make
+  };
+  ResolutionStats resolution_stats() const;
+
   // ---- MANAGING THE CACHE -------
   //   Freeze
+  //   SetThreadLocalReplicas
+  //   FinalizeGlobalValues
+  //   SetPrecompressThreshold
+  //   SetMemoryBudget
+  //   SetCapture
   //   Delete
   //   ClearCache
   //   ReloadAllIfChanged
@@ -220,6 +396,64 @@ class CTEMPLATE_DLL_DECL TemplateCache {
   // included templates will be used, they won't be loaded on-demand.
   void Freeze();
 
+  // SetThreadLocalReplicas
+  //   While the cache is frozen, gives each thread that expands from
+  //   it (via ExpandWithData() or ExpandNoLoad()) its own copy of the
+  //   cache's index, made the first time the thread needs it.  The
+  //   copy holds a reference to every template, so those expands
+  //   neither lock the cache nor touch the templates' refcounts.
+  //   (Templates included by the expanded template are still looked
+  //   up in the cache itself.)  ClearCache() and FinalizeGlobalValues()
+  //   retire the copies; a thread lets go of a retired copy the next
+  //   time it makes a new one, or when it exits.  Off by default.
+  void SetThreadLocalReplicas(bool enabled);
+
+  // FinalizeGlobalValues
+  //   Says that values set via TemplateDictionary::SetGlobalValue()
+  //   (including built-ins like BI_SPACE) won't change often from now
+  //   on, and that no dictionary passed to Expand will override them.
+  //   Every template in the cache, and every template loaded later,
+  //   is then specialized: each variable with a global value has its
+  //   modifiers applied once, and the result is merged into the text
+  //   around it, so expanding it costs nothing.  If SetGlobalValue()
+  //   is called again, the templates that used the changed value are
+  //   re-specialized by the next ExpandWithData() or ExpandNoLoad().
+  //   Variables with extension ("x-") modifiers are never folded, and
+  //   annotated expansions always use the unspecialized templates.
+  void FinalizeGlobalValues();
+
+  // SetPrecompressThreshold
+  //   Templates loaded after this call have each run of static text
+  //   at least min_length bytes long compressed once, at load time.
+  //   When such a template is expanded into a DeflateEmitter, those
+  //   runs are spliced into the output instead of being compressed
+  //   again.  Other emitters are unaffected.  0 (the default) turns
+  //   precompression off.  A no-op if ctemplate was built without zlib.
+  void SetPrecompressThreshold(size_t min_length);
+
+  // SetMemoryBudget
+  //   Caps how much memory the cache may use (see memory_usage()).
+  //   Whenever loading a template takes the cache over max_bytes, the
+  //   least recently used templates are evicted until it's back under
+  //   7/8 of max_bytes.  An evicted file-based template is loaded
+  //   again the next time it's used.  A string-based template can't
+  //   be, so it's only evicted if keep_string_sources was true when
+  //   it was passed to StringToTemplateCache(): the cache then keeps
+  //   a copy of its text -- compressed, if ctemplate was built with
+  //   zlib -- and parses that again when needed.  Nothing is evicted
+  //   from a frozen cache, and Freeze() doesn't bring back what has
+  //   been evicted.  0 (the default) means no budget.
+  void SetMemoryBudget(size_t max_bytes, bool keep_string_sources = false);
+
+  // SetCapture
+  //   Records a sample of this cache's ExpandWithData() calls to
+  //   capture (see template_capture.h), until called again with NULL.
+  //   The caller keeps ownership of capture.  An ExpandWithData()
+  //   that started before capture was detached may still be writing
+  //   to it, so don't delete it until those are done.  Clones don't
+  //   inherit the capture.
+  void SetCapture(TemplateCapture* capture);
+
   // Delete
   //   Deletes one template object from the cache, if it exists.
   //   This can be used for either file- or string-based templates.
@@ -259,7 +493,9 @@ class CTEMPLATE_DLL_DECL TemplateCache {
 
   // Clone
   //   Returns a copy of the cache. It makes a shallow copy of the
-  //   parsed_template_cache_, incrementing refcount of templates.
+  //   parsed_template_cache_, which takes constant time: the two
+  //   caches share the map's structure (and the templates) until one
+  //   of them changes it.
   //   The caller is responsible for deallocating the returned TemplateCache.
   //   NOTE(user): Annotalysis expects this method to have a lock for
   //                 a TemplateCache instance local to the method, but we
@@ -268,19 +504,42 @@ class CTEMPLATE_DLL_DECL TemplateCache {
   TemplateCache* Clone() const;
 
   // ---- INSPECTING THE CACHE -------
+  //   memory_usage
+  //   NumAbortedExpands
   //   Dump
   //   DumpToString
   // TODO(csilvers): implement these?
 
+  // Returns how many calls to ExpandWithData() and ExpandNoLoad() on
+  // this cache were cut short for the given reason (see
+  // PerExpandData::SetExpandDeadline() and friends).
+  int NumAbortedExpands(ExpandAbortReason reason) const;
+
+  // Returns roughly how many bytes the templates in the cache use:
+  // their text, their parse trees, and any text kept for
+  // SetMemoryBudget().  Templates that have been evicted or deleted
+  // but are still being expanded aren't counted.
+  size_t memory_usage() const;
+
  private:
   // TODO(csilvers): nix Template friend once Template::ReloadIfChanged is gone
   friend class Template;   // for ResolveTemplateFilename
   friend class TemplateTemplateNode;   // for ExpandLocked
   friend class TemplateCachePeer;   // for unittests
   friend class ::TemplateCacheUnittest;  // for unittests
+  friend class TemplateHandle;   // for RefcountedTemplate
+  friend class TemplateNamelist;   // for template_source()
 
   class RefcountedTemplate;
   struct CachedTemplate;
+  struct Replica;
+  struct ThreadReplicas;
+  struct AbortCounts;
+  struct StringSource;
+  struct ExpandBatchWork;
+  class ExpandBatchPool;
+  // The body of each ExpandBatch() thread.
+  static void* ExpandBatchWorker(void* work);
   class TemplateCacheHash;
   class RefTplPtrHash;
   // due to a bug(?) in MSVC, TemplateCachePeer won't compile unless this
@@ -288,23 +547,41 @@ class CTEMPLATE_DLL_DECL TemplateCache {
  public:
   typedef std::pair<TemplateId, int> TemplateCacheKey;
  private:
-  typedef std::unordered_map<TemplateCacheKey, CachedTemplate, TemplateCacheHash> TemplateMap;
+  // These share their structure with their copies, so Clone() is cheap.
+  typedef PersistentMap<TemplateCacheKey, CachedTemplate, TemplateCacheHash> TemplateMap;
   typedef std::unordered_map<RefcountedTemplate*, int, RefTplPtrHash> TemplateCallMap;
+  struct Resolution;
+  typedef std::unordered_map<std::string, Resolution> ResolutionMap;
+  typedef PersistentMap<TemplateCacheKey, StringSource, TemplateCacheHash> StringSourceMap;
   // Where to search for files.
   typedef std::vector<std::string> TemplateSearchPath;
 
   // GetTemplate
-  //   This method is deprecated. It exists here because it is called by
-  //   Template::GetTemplate. Also this is used in tests.
+  //   This method is deprecated (use GetTemplateHandle). It exists here
+  //   because it is called by Template::GetTemplate. Also this is used
+  //   in tests.
   const Template* GetTemplate(const TemplateString& key, Strip strip);
 
+  // statbuf may be NULL, if the caller only needs the filename.
   bool ResolveTemplateFilename(const std::string& unresolved,
                                std::string* resolved,
-                               FileStat* statbuf) const;
+                               TemplateSource::FileInfo* statbuf) const;
+
+  // Where our template files come from (see SetTemplateSource()).
+  const TemplateSource* template_source() const;
+
+  // ExpandWithData(), minus the capturing.
+  bool ExpandWithDataUncaptured(const TemplateString& filename, Strip strip,
+                                const TemplateDictionaryInterface *dictionary,
+                                PerExpandData* per_expand_data,
+                                ExpandEmitter* output);
 
   // This is used only for internal (recursive) calls to Expand due
   // to internal template-includes.  It doesn't try to acquire the
-  // global template_lock again, in template.cc.
+  // global template_lock again, in template.cc.  Nor does it
+  // respecialize templates or count aborted expands: the outermost
+  // expand already did the one, and does the other when it's done.
+  // (RespecializeTemplates() needs the lock we're expanding under.)
   // TODO(csilvers): remove this when template.cc's g_template_lock goes away.
   bool ExpandLocked(const TemplateString& filename, Strip strip,
                     ExpandEmitter* output,
@@ -332,18 +609,63 @@ class CTEMPLATE_DLL_DECL TemplateCache {
   //   Validates the user provided filename before constructing the template
   bool IsValidTemplateFilename(const std::string& filename,
                                std::string* resolved_filename,
-                               FileStat* statbuf) const;
+                               TemplateSource::FileInfo* statbuf) const;
+
+  // AcquireTemplate
+  //   Returns the template for key, IncRef()ed, loading it if need
+  //   be, or NULL if it's not found.  Sets *respecialize to whether
+  //   the caller should call RespecializeTemplates() before expanding.
+  //   A template that's already loaded, and needn't be reloaded, only
+  //   takes a read-lock on mutex_.  Must be called without holding
+  //   mutex_.
+  RefcountedTemplate* AcquireTemplate(const TemplateString& filename,
+                                      Strip strip,
+                                      const TemplateCacheKey& key,
+                                      bool* respecialize);
 
   // GetTemplateLocked
   //   Internal version of GetTemplate. It's used when the function already
   //   has a write-lock on mutex_.  It returns a pointer to a refcounted
   //   template (in the cache), or NULL if the template is not found.
-  //   Its used by GetTemplate & ForceReloadAllIfChanged.
+  //   Its used by AcquireTemplate & ForceReloadAllIfChanged.
   RefcountedTemplate* GetTemplateLocked(
       const TemplateString& filename,
       Strip strip,
       const TemplateCacheKey& key);
 
+  // RespecializeTemplates
+  //   Brings the specialization of every template in the cache up to
+  //   date with the current global values.  Must be called without
+  //   holding mutex_ (or g_template_mutex, in template.cc).
+  void RespecializeTemplates() const;
+
+  // Returns true if global values are final, but have changed since
+  // RespecializeTemplates() last ran.  Requires a lock on mutex_.
+  bool GlobalValuesAreStaleLocked() const;
+
+  // Gives replica_id_ a new value (or 0, if threads shouldn't make
+  // Replicas now), retiring the Replicas made with the old one.
+  void RenewReplicaIdLocked();
+  // Returns this thread's Replica of the cache, making it if need be,
+  // or NULL if threads shouldn't use Replicas now.
+  Replica* ThreadReplica() const;
+  // The ExpandWithData() and ExpandNoLoad() of a thread with a Replica.
+  bool ExpandFromReplica(Replica* replica,
+                         const TemplateCacheKey& template_cache_key,
+                         const TemplateDictionaryInterface* dict,
+                         PerExpandData* per_expand_data,
+                         ExpandEmitter* expand_emitter) const;
+
+  // Returns global_values_final_.  Takes no lock, so it's cheap
+  // enough to call on every expand.
+  bool global_values_final() const;
+
+  // EvictIfOverBudget
+  //   Evicts least recently used templates, other than *keep (which
+  //   may be NULL), if the cache is over its memory budget.  Must be
+  //   called without holding mutex_.
+  void EvictIfOverBudget(const TemplateCacheKey* keep) const;
+
   // Refcount
   //  Testing only. Returns the refcount of a template, given its cache key.
   int Refcount(const TemplateCacheKey template_cache_key) const;
@@ -353,7 +675,23 @@ class CTEMPLATE_DLL_DECL TemplateCache {
   bool TemplateIsCached(const TemplateCacheKey template_cache_key) const;
 
   TemplateMap* parsed_template_cache_;
+  // Text kept by StringToTemplateCache() for SetMemoryBudget().
+  StringSourceMap* string_sources_;
   bool is_frozen_;
+  // Set by FinalizeGlobalValues().  Only changed while holding mutex_,
+  // but atomic so global_values_final() needn't take it.
+  std::atomic<bool> global_values_final_;
+  // The TemplateDictionary::GlobalValuesGeneration() we last
+  // specialized our templates for.
+  mutable int global_values_generation_;
+  size_t precompress_threshold_;   // set by SetPrecompressThreshold()
+  // Counted without taking mutex_, in per-thread shards.
+  AbortCounts* const num_aborted_expands_;
+  size_t memory_budget_;        // set by SetMemoryBudget()
+  bool keep_string_sources_;    // set by SetMemoryBudget()
+  // See memory_usage().  RespecializeTemplates() changes it too.
+  mutable size_t memory_usage_;
+  uint64_t use_clock_;          // ticks once per template load
   TemplateSearchPath search_path_;
 
   // Since GetTemplate() returns a raw pointer, it's impossible for
@@ -367,11 +705,90 @@ class CTEMPLATE_DLL_DECL TemplateCache {
   Mutex* const mutex_;
   Mutex* const search_path_mutex_;
 
+  // Set by SetTemplateSource().  Guarded by search_path_mutex_, since
+  // it goes with the search path in deciding what a filename means.
+  const TemplateSource* source_;
+
+  // Set by SetCapture().  Atomic, so ExpandWithData() can check it
+  // without taking mutex_.
+  std::atomic<TemplateCapture*> capture_;
+
+  // Set by SetThreadLocalReplicas().
+  bool thread_local_replicas_;
+  // Names the Replicas threads may make of this cache as it is now, or
+  // is 0 if they may not make any.  Changes whenever what they'd copy
+  // does.
+  std::atomic<uint64_t> replica_id_;
+
+  // What ResolveTemplateFilename() remembers (see
+  // SetResolutionCacheTtl()).  Acquire after search_path_mutex_.
+  ResolutionMap* const resolutions_;
+  int resolution_ttl_;
+  mutable ResolutionStats resolution_stats_;
+  Mutex* const resolution_mutex_;
+
+  // Holds the text of our templates, sharing what's the same between
+  // them (see Template::text_store_).  Shared with our clones.
+  TextStore* text_store_;
+
+  // The threads ExpandBatch() spreads work over, or NULL if it hasn't
+  // needed any yet.  Set while holding mutex_.
+  ExpandBatchPool* expand_batch_pool_;
+
   // Can't invoke copy constructor or assignment operator
   TemplateCache(const TemplateCache&);
   void operator=(const TemplateCache &);
 };
 
+// A reference to a template in a TemplateCache, from
+// TemplateCache::GetTemplateHandle().  The template stays alive as
+// long as the handle does.  Handles can be moved but not copied, and
+// releasing one just drops a refcount: it doesn't touch the cache.
+// Expanding through the handle doesn't touch the cache either,
+// except to load any templates it includes, so the cache must outlive
+// the handle's last Expand() (though not the handle itself).  These
+// expands aren't counted by TemplateCache::NumAbortedExpands().
+class CTEMPLATE_DLL_DECL TemplateHandle {
+ public:
+  TemplateHandle() : refcounted_tpl_(NULL), cache_(NULL) { }
+  TemplateHandle(TemplateHandle&& other);
+  TemplateHandle& operator=(TemplateHandle&& other);
+  ~TemplateHandle() { reset(); }
+
+  // Returns true if the handle refers to a template.
+  bool valid() const { return refcounted_tpl_ != NULL; }
+  // Returns the template, or NULL if the handle is empty.
+  const Template* get() const;
+  // Lets go of the template, leaving the handle empty.
+  void reset();
+
+  // Returns false if the handle is empty, or the expand failed.
+  bool Expand(ExpandEmitter* output,
+              const TemplateDictionaryInterface* dictionary,
+              PerExpandData* per_expand_data = NULL) const;
+  bool Expand(std::string* output_buffer,
+              const TemplateDictionaryInterface* dictionary,
+              PerExpandData* per_expand_data = NULL) const {
+    if (output_buffer == NULL)  return false;
+    StringEmitter e(output_buffer);
+    return Expand(&e, dictionary, per_expand_data);
+  }
+
+ private:
+  friend class TemplateCache;   // to make us
+  // Takes over a reference the cache got for us.
+  TemplateHandle(TemplateCache::RefcountedTemplate* refcounted_tpl,
+                 const TemplateCache* cache)
+      : refcounted_tpl_(refcounted_tpl), cache_(cache) { }
+
+  TemplateCache::RefcountedTemplate* refcounted_tpl_;
+  const TemplateCache* cache_;
+
+  // Can't invoke copy constructor or assignment operator
+  TemplateHandle(const TemplateHandle&);
+  void operator=(const TemplateHandle&);
+};
+
 }
 
 #endif  // TEMPLATE_TEMPLATE_CACHE_H_
@@ -0,0 +1,198 @@
+// Copyright (c) 2026, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+//
+// Capture and replay of template expansions.  A TemplateCapture,
+// attached to a TemplateCache with TemplateCache::SetCapture(),
+// records a sample of the cache's ExpandWithData() calls to a file:
+// the template and strip mode, everything the template asked the
+// dictionary and what it answered, the PerExpandData limits, and the
+// size and digest of the output.  A TemplateCaptureReader reads the
+// file back, and each CapturedExpand it yields can be expanded again
+// -- against the same templates, or new versions of them -- with a
+// dictionary that answers exactly as the original did.  So benchmarks
+// and regression tests can run on real-world dictionaries, whatever
+// TemplateDictionaryInterface produced them.  replay_tpl_capture does
+// that from the command line.
+
+#ifndef TEMPLATE_TEMPLATE_CAPTURE_H_
+#define TEMPLATE_TEMPLATE_CAPTURE_H_
+
+#include <stdio.h>         // for FILE
+#include <atomic>          // for atomic<>
+#include <cstdint>         // for uint64_t, int64_t
+#include <string>
+#include <utility>         // for pair<>
+#include <vector>
+#include <ctemplate/template_enums.h>   // for Strip
+
+class Mutex;
+
+// NOTE: if you are statically linking the template library into your binary
+// (rather than using the template .dll), set '/D CTEMPLATE_DLL_DECL='
+// as a compiler flag in your project file to turn off the dllimports.
+#ifndef CTEMPLATE_DLL_DECL
+# define CTEMPLATE_DLL_DECL  __declspec(dllimport)
+#endif
+
+namespace ctemplate {
+
+class CapturedDictionary;
+class ExpandEmitter;
+class PerExpandData;
+class TemplateDictionaryInterface;
+class TemplateString;
+
+class CTEMPLATE_DLL_DECL TemplateCapture {
+ public:
+  // Creates (or truncates) filename, and records one in every
+  // 1/sample_rate expansions to it; 1 records them all.  Which ones
+  // are recorded depends only on how many came before, so a capture
+  // of a deterministic program is deterministic.  Returns NULL, after
+  // logging why, if the file can't be created.  Detach the capture
+  // from every cache before deleting it; deleting it closes the file.
+  static TemplateCapture* Create(const std::string& filename,
+                                 double sample_rate);
+  ~TemplateCapture();
+
+  // How many expansions have been recorded so far.
+  uint64_t num_captured() const { return num_captured_; }
+
+  // Returns false if writing to the file has failed.
+  bool ok() const;
+
+ private:
+  friend class TemplateCache;   // for the methods below
+
+  class Recording;
+
+  // If this expansion is to be sampled, returns a Recording of it,
+  // which the expansion must use in place of dictionary and output.
+  // Otherwise returns NULL.
+  Recording* MaybeStartRecording(const TemplateString& filename, Strip strip,
+                                 const TemplateDictionaryInterface* dictionary,
+                                 const PerExpandData* per_expand_data,
+                                 ExpandEmitter* output);
+  static const TemplateDictionaryInterface* dictionary(Recording* recording);
+  static ExpandEmitter* emitter(Recording* recording);
+  // Writes the recording to the file, and deletes it.
+  void FinishRecording(Recording* recording, bool expand_succeeded);
+
+  TemplateCapture(FILE* file, const std::string& filename, double sample_rate);
+
+  FILE* const file_;
+  const std::string filename_;
+  const double sample_rate_;
+  std::atomic<uint64_t> num_seen_;
+  std::atomic<uint64_t> num_captured_;
+  Mutex* const mutex_;      // guards the rest
+  int globals_generation_;  // of the global values last written
+  bool write_failed_;
+
+  // Can't invoke copy constructor or assignment operator
+  TemplateCapture(const TemplateCapture&);
+  void operator=(const TemplateCapture&);
+};
+
+// One expansion read back by a TemplateCaptureReader.
+class CTEMPLATE_DLL_DECL CapturedExpand {
+ public:
+  CapturedExpand();
+  ~CapturedExpand();
+
+  std::string template_name;
+  Strip strip;
+  bool annotate;
+  std::string annotate_path;
+  // The expansion had a template-expansion modifier, which can't be
+  // captured; replaying it won't produce the same output.
+  bool had_expansion_modifier;
+  uint64_t max_output_bytes;
+  uint64_t max_iterations;
+  int64_t deadline_usec;    // time left until the deadline, or -1
+  bool expand_succeeded;
+  uint64_t output_size;
+  uint64_t output_digest;   // HashingEmitter::digest() of the output
+
+  // Answers every question the original expansion asked exactly as
+  // the original dictionary did.  Any other question gets the answer
+  // an empty dictionary would give.  Owned by this CapturedExpand.
+  const TemplateDictionaryInterface* dictionary() const;
+
+  // Sets up per_expand_data the way the original expansion's was,
+  // except for the expansion modifier.
+  void SetUpPerExpandData(PerExpandData* per_expand_data) const;
+
+ private:
+  friend class TemplateCaptureReader;   // to fill us in
+  CapturedDictionary* dictionary_;
+
+  // Can't invoke copy constructor or assignment operator
+  CapturedExpand(const CapturedExpand&);
+  void operator=(const CapturedExpand&);
+};
+
+class CTEMPLATE_DLL_DECL TemplateCaptureReader {
+ public:
+  // Returns NULL, after logging why, if filename can't be opened or
+  // isn't a capture file.
+  static TemplateCaptureReader* Open(const std::string& filename);
+  ~TemplateCaptureReader();
+
+  // Reads the next expansion into *expand.  Returns false at the end
+  // of the file, or if the rest of the file is corrupt (see error()).
+  bool Next(CapturedExpand* expand);
+
+  // Empty unless Next() stopped because the file was corrupt.
+  const std::string& error() const { return error_; }
+
+  // The values set with TemplateDictionary::SetGlobalValue(), as of
+  // the last expansion Next() returned.  Replay with these set, since
+  // a template whose cache had FinalizeGlobalValues() called doesn't
+  // ask the dictionary for them.
+  const std::vector<std::pair<std::string, std::string> >&
+      global_values() const { return global_values_; }
+
+ private:
+  TemplateCaptureReader(FILE* file, const std::string& filename);
+
+  FILE* const file_;
+  const std::string filename_;
+  std::string error_;
+  std::vector<std::pair<std::string, std::string> > global_values_;
+
+  // Can't invoke copy constructor or assignment operator
+  TemplateCaptureReader(const TemplateCaptureReader&);
+  void operator=(const TemplateCaptureReader&);
+};
+
+}
+
+#endif  // TEMPLATE_TEMPLATE_CAPTURE_H_
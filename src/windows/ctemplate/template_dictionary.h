@@ -53,6 +53,7 @@
 #include <functional>    // for less<>
 #include <map>
 #include <string>
+#include <utility>       // for pair<>
 #include <vector>
 
 #include <ctemplate/str_ref.h>
@@ -240,6 +241,9 @@ class CTEMPLATE_DLL_DECL TemplateDictionary : public TemplateDictionaryInterface
   friend class SectionTemplateNode;   // for access to GetSectionValue(), etc.
   friend class TemplateTemplateNode;  // for access to GetSectionValue(), etc.
   friend class VariableTemplateNode;  // for access to GetSectionValue(), etc.
+  friend class Template;       // for access to GlobalValuesGeneration()
+  friend class TemplateCache;  // for access to GlobalValuesGeneration()
+  friend class TemplateCapture;  // for access to GetGlobalValues()
   // For unittesting code using a TemplateDictionary.
   friend class TemplateDictionaryPeer;
 
@@ -313,6 +317,22 @@ class CTEMPLATE_DLL_DECL TemplateDictionary : public TemplateDictionaryInterface
   // initialization in a thread-safe way.
   static void SetupGlobalDict();
 
+  // Looks up variable in the global dict only; returns false if it's
+  // not there.  Used to fold global values into a template's parse
+  // tree (see TemplateCache::FinalizeGlobalValues()).
+  static bool GetGlobalValue(const TemplateString& variable,
+                             TemplateString* value);
+
+  // Returns a number that changes every time SetGlobalValue() is
+  // called, so callers can tell when a folded global value may be stale.
+  // Takes no lock, so it's cheap enough to call on every expand.
+  static int GlobalValuesGeneration();
+
+  // Copies every global value, built-ins included, into *values, and
+  // returns GlobalValuesGeneration() as of the copy.
+  static int GetGlobalValues(
+      std::vector<std::pair<std::string, std::string> >* values);
+
   // Utility functions for copying a string into the arena.
   // Memdup also copies in a trailing NUL, which is why we have the
   // trailing-NUL check in the TemplateString version of Memdup.
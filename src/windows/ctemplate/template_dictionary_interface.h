@@ -76,6 +76,8 @@ class CTEMPLATE_DLL_DECL TemplateDictionaryInterface {
   // This class reaches into our internals for testing.
   friend class TemplateDictionaryPeer;
   friend class TemplateDictionaryPeerIterator;
+  // This class records what an expansion asks, for TemplateCapture.
+  friend class RecordingDictionary;
 
   // GetSectionValue
   //   Returns the value of a variable.
@@ -38,6 +38,8 @@
 #define TEMPLATE_TEMPLATE_EMITTER_H_
 
 #include <sys/types.h>     // for size_t
+#include <atomic>          // for atomic<>
+#include <cstdint>         // for uint64_t
 #include <string>
 
 // NOTE: if you are statically linking the template library into your binary
@@ -49,6 +51,30 @@
 
 namespace ctemplate {
 
+// A run of static template text, along with forms of it that were
+// computed ahead of time, for emitters that can use them instead of
+// the text itself.
+struct StaticTextSegment {
+  StaticTextSegment() : text(NULL), textlen(0), digest(0), digest_shift(0) {}
+
+  const char* text;
+  size_t textlen;
+  // The text as compressed by DeflateEmitter::Precompress(), or empty
+  // (see TemplateCache::SetPrecompressThreshold()).
+  std::string precompressed;
+  // HashingEmitter::Digest() of the text, and
+  // HashingEmitter::DigestShift() of its length.  Few users want
+  // digests, so they aren't computed when the template is loaded, but
+  // by the first HashingEmitter to see the segment.  digest_shift is
+  // 0 until then (it's never 0 afterwards), and is stored last.
+  mutable std::atomic<uint64_t> digest;
+  mutable std::atomic<uint64_t> digest_shift;
+
+ private:
+  StaticTextSegment(const StaticTextSegment&);   // disallow copying
+  void operator=(const StaticTextSegment&);
+};
+
 class CTEMPLATE_DLL_DECL ExpandEmitter {
  public:
   ExpandEmitter() {}
@@ -57,6 +83,13 @@ class CTEMPLATE_DLL_DECL ExpandEmitter {
   virtual void Emit(const std::string& s) = 0;
   virtual void Emit(const char* s) = 0;
   virtual void Emit(const char* s, size_t slen) = 0;
+
+  // Emits a run of static template text.  Emitters that can make
+  // use of the segment's precomputed fields override this; by
+  // default it just emits the text.
+  virtual void EmitStaticText(const StaticTextSegment& text) {
+    Emit(text.text, text.textlen);
+  }
 };
 
 
@@ -70,6 +103,85 @@ class CTEMPLATE_DLL_DECL StringEmitter : public ExpandEmitter {
   virtual void Emit(const char* s, size_t slen) { outbuf_->append(s, slen); }
 };
 
+// HashingEmitter computes a 64-bit digest of its input, suitable for
+// an ETag, as the input streams by.  It passes the input on to
+// 'output', or, if 'output' is NULL, just hashes it: expanding into
+// a HashingEmitter(NULL) computes a page's digest without building
+// the page.  Static template text is only hashed the first time a
+// HashingEmitter sees it; after that, its digest is folded in
+// directly.
+//
+// The digest is the CRC-64 (ECMA-182 polynomial, as used by xz) of
+// the input.  It's not cryptographic: don't use it where an attacker
+// benefits from a collision.
+class CTEMPLATE_DLL_DECL HashingEmitter : public ExpandEmitter {
+ public:
+  explicit HashingEmitter(ExpandEmitter* output)
+      : output_(output), digest_(0), size_(0) {}
+
+  virtual void Emit(char c);
+  virtual void Emit(const std::string& s);
+  virtual void Emit(const char* s);
+  virtual void Emit(const char* s, size_t slen);
+  virtual void EmitStaticText(const StaticTextSegment& text);
+
+  // The digest of everything emitted so far, and its length.
+  uint64_t digest() const { return digest_; }
+  size_t size() const { return size_; }
+
+  // Returns the digest of s; the same as emitting s into a fresh
+  // HashingEmitter.
+  static uint64_t Digest(const char* s, size_t slen);
+
+  // Given the digests of two strings, returns the digest of their
+  // concatenation.  Combine(d1, d2, len2) is the same as
+  // CombineWithShift(d1, d2, DigestShift(len2)); if len2 is used
+  // more than once, the shift is worth computing ahead of time.
+  static uint64_t Combine(uint64_t digest1, uint64_t digest2, size_t len2);
+  static uint64_t DigestShift(size_t len);
+  static uint64_t CombineWithShift(uint64_t digest1, uint64_t digest2,
+                                   uint64_t shift2);
+
+ private:
+  ExpandEmitter* const output_;
+  uint64_t digest_;
+  size_t size_;
+};
+
+#if 0
+// DeflateEmitter compresses its input as it arrives, appending a
+// gzip (RFC 1952) stream to outbuf.  Call Finish() when the expand
+// is done, to flush the compressor and write the gzip trailer;
+// nothing may be emitted after that.  Precompressed static text is
+// spliced into the stream without being compressed a second time.
+class CTEMPLATE_DLL_DECL DeflateEmitter : public ExpandEmitter {
+ public:
+  // level is a zlib compression level: 1 (fastest) through 9 (best).
+  explicit DeflateEmitter(std::string* outbuf, int level = 6);
+  virtual ~DeflateEmitter();
+
+  virtual void Emit(char c);
+  virtual void Emit(const std::string& s);
+  virtual void Emit(const char* s);
+  virtual void Emit(const char* s, size_t slen);
+  virtual void EmitStaticText(const StaticTextSegment& text);
+
+  void Finish();
+
+  // Compresses s into a form (StaticTextSegment::precompressed) that
+  // can be spliced into any DeflateEmitter's output.  Returns false, and leaves
+  // out alone, if compressing s doesn't make it smaller.
+  static bool Precompress(const char* s, size_t slen, std::string* out);
+
+ private:
+  class Stream;                 // defined in deflate_emitter.cc
+  Stream* const stream_;
+
+  DeflateEmitter(const DeflateEmitter&);
+  void operator=(const DeflateEmitter&);
+};
+#endif
+
 }
 
 #endif  // TEMPLATE_TEMPLATE_EMITTER_H_
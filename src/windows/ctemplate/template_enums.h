@@ -41,6 +41,12 @@ namespace ctemplate {
 enum Strip { DO_NOT_STRIP, STRIP_BLANK_LINES, STRIP_WHITESPACE,
              NUM_STRIPS };   // sentinel value
 
+// Why an expand was cut short (see PerExpandData::SetExpandDeadline())
+enum ExpandAbortReason { EXPAND_NOT_ABORTED, EXPAND_DEADLINE_EXCEEDED,
+                         EXPAND_OUTPUT_LIMIT_EXCEEDED,
+                         EXPAND_ITERATION_LIMIT_EXCEEDED,
+                         NUM_EXPAND_ABORT_REASONS };   // sentinel value
+
 }
 
 #endif  // TEMPLATE_TEMPLATE_ENUMS_H_
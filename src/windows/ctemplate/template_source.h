@@ -0,0 +1,156 @@
+// Copyright (c) 2026, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+//
+// Where a TemplateCache gets the text of file-based templates.  By
+// default that's the filesystem, but a cache can be pointed at any
+// TemplateSource (see TemplateCache::SetTemplateSource()).  The
+// library comes with one other: TemplateArchive, which serves a whole
+// tree of templates out of a single file, so loading a template
+// costs no system calls at all once the archive is open.
+
+#ifndef TEMPLATE_TEMPLATE_SOURCE_H_
+#define TEMPLATE_TEMPLATE_SOURCE_H_
+
+#include <sys/types.h>     // for size_t
+#include <time.h>          // for time_t
+#include <cstdint>         // for uint64_t
+#include <string>
+#include <vector>
+
+class Mutex;
+
+// NOTE: if you are statically linking the template library into your binary
+// (rather than using the template .dll), set '/D CTEMPLATE_DLL_DECL='
+// as a compiler flag in your project file to turn off the dllimports.
+#ifndef CTEMPLATE_DLL_DECL
+# define CTEMPLATE_DLL_DECL  __declspec(dllimport)
+#endif
+
+namespace ctemplate {
+
+struct ArchiveMapping;
+
+class CTEMPLATE_DLL_DECL TemplateSource {
+ public:
+  struct FileInfo {
+    FileInfo() : mtime(0), length(0), is_directory(false) {}
+    time_t mtime;
+    size_t length;
+    bool is_directory;
+  };
+
+  TemplateSource() {}
+  virtual ~TemplateSource() {}
+
+  // Looks up filename, which is a template name joined to one of the
+  // cache's search-path directories (or the name itself, if it's
+  // absolute or the search path is empty).  Returns false if there's
+  // no such file.  Must be safe to call from several threads at once.
+  virtual bool Stat(const std::string& filename, FileInfo* info) const = 0;
+
+  // Copies the contents of filename, which are length bytes long
+  // according to a Stat() the caller just did, into buffer.  Returns
+  // false if the file can't be read, or is no longer length bytes.
+  virtual bool Read(const std::string& filename,
+                    char* buffer, size_t length) const = 0;
+
+  // The source TemplateCaches use unless told otherwise.
+  static const TemplateSource* Filesystem();
+
+ private:
+  // Disallow copy and assign.
+  TemplateSource(const TemplateSource&);
+  void operator=(const TemplateSource&);
+};
+
+// A TemplateArchive is a file holding many templates: a header, an
+// index sorted by name, and then the templates' contents, one after
+// the other.  Open() maps it into memory in one go; after that, Stat()
+// is a binary search of the index and Read() is a memcpy.
+//    Each entry keeps the mtime of the file it was packed from, so
+// when a new archive replaces the old one, ReloadIfChanged() followed
+// by TemplateCache::ReloadAllIfChanged() reloads just the templates
+// that changed.  make_tpl_archive builds archives from the command line.
+class CTEMPLATE_DLL_DECL TemplateArchive : public TemplateSource {
+ public:
+  struct Entry {
+    Entry() : mtime(0) {}
+    Entry(const std::string& n, const std::string& c, time_t m)
+        : name(n), contents(c), mtime(m) {}
+    std::string name;
+    std::string contents;
+    time_t mtime;
+  };
+
+  // Writes entries to archive_filename, replacing it atomically if it
+  // exists.  version is stored in the header for the caller's own use
+  // (make_tpl_archive puts the time it ran there).  Names must be
+  // unique.  Returns false, having logged why, on failure.
+  static bool Write(const std::string& archive_filename,
+                    const std::vector<Entry>& entries,
+                    uint64_t version);
+
+  // Opens archive_filename, or returns NULL, having logged why.  Names
+  // in the archive are taken to be relative to mount_point: with
+  // "/srv/templates", an entry "a/b.tpl" is what Stat() finds for
+  // "/srv/templates/a/b.tpl".  That's normally the directory passed to
+  // TemplateCache::SetTemplateRootDirectory().  With an empty
+  // mount_point, names have to match exactly.
+  static TemplateArchive* Open(const std::string& archive_filename,
+                               const std::string& mount_point);
+  ~TemplateArchive();
+
+  virtual bool Stat(const std::string& filename, FileInfo* info) const;
+  virtual bool Read(const std::string& filename,
+                    char* buffer, size_t length) const;
+
+  // If archive_filename has been replaced or modified since we opened
+  // it, opens it again.  Returns true if it did, false if it didn't
+  // need to or the new archive is no good (in which case we keep
+  // serving the old one).
+  bool ReloadIfChanged();
+
+  uint64_t version() const;
+  size_t num_entries() const;
+
+ private:
+  TemplateArchive(const std::string& archive_filename,
+                  const std::string& mount_point, ArchiveMapping* mapping);
+
+  const std::string archive_filename_;
+  const std::string mount_point_;
+  Mutex* const mutex_;
+  ArchiveMapping* mapping_;  // GUARDED_BY(mutex_)
+};
+
+}
+
+#endif  // TEMPLATE_TEMPLATE_SOURCE_H_
@@ -109,6 +109,7 @@ template class __declspec(dllexport) std::vector<std::string>;\n\
          -e "s!@ac_cv_have_stdint_h@!0!g" \
          -e "s!@ac_cv_have_inttypes_h@!0!g" \
          -e "s!@ac_have_attribute_weak@!0!g" \
+         -e "s!@ac_have_zlib@!0!g" \
          -e "s!\\bhash\\b!hash_compare!g" \
          "$file" > "$outfile"
   done